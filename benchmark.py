@@ -11,11 +11,15 @@
 import termios
 import time
 from pty import CHILD, fork
+from typing import TYPE_CHECKING
 
-from kitty.constants import kitten_exe
-from kitty.fast_data_types import Screen, safe_pipe
+from kitty.constants import kitten_exe, kitty_exe
+from kitty.fast_data_types import Screen, has_avx2, has_sse4_2, safe_pipe, test_glyph_compositing
 from kitty.utils import read_screen_size
 
+if TYPE_CHECKING:
+    from kitty.render_benchmark import RenderBenchmark
+
 
 def run_parsing_benchmark(cell_width: int = 10, cell_height: int = 20, scrollback: int = 20000) -> None:
     isatty = sys.stdout.isatty()
@@ -82,8 +86,74 @@ def parse_bytes(data: bytes) -> None:
         sys.stdout.write(str(screen.linebuf))
 
 
+def run_compositing_benchmark(width: int = 512, height: int = 64, repeat: int = 200) -> None:
+    # Compare the scalar and SIMD compositing kernels used when rendering sprites and composing image frames
+    variants = {'scalar': 1}
+    if has_sse4_2:
+        variants['128'] = 2
+    if has_avx2:
+        variants['256'] = 3
+    n = width * height
+    factor = 4
+    dest_sz = 4 * ((width + factor - 1) // factor) * ((height + factor - 1) // factor)
+    kernels = {
+        'blend_alpha_mask': (os.urandom(n), bytes(4 * n), 0xffffff00, 0, 0, 1),
+        'unpremultiply_bgra': (os.urandom(4 * n), bytes(4 * n), 0, 0, 0, 1),
+        'downsample_bgra': (os.urandom(4 * n), bytes(dest_sz), 0, width, height, factor),
+        'alpha_blend_rgba': (os.urandom(4 * n), os.urandom(4 * n), 0, 0, 0, 1),
+        'blend_rgba_on_rgb': (os.urandom(4 * n), os.urandom(3 * n), 0, 0, 0, 1),
+    }
+    for kernel, args in kernels.items():
+        expected = b''
+        for name, which in variants.items():
+            start = time.monotonic()
+            result = test_glyph_compositing(kernel, which, *args, repeat)
+            elapsed = time.monotonic() - start
+            if not expected:
+                expected = result
+            elif result != expected:
+                raise SystemExit(f'The {name} variant of {kernel} does not match the scalar result')
+            print(f'{kernel:20s} {name:6s} {elapsed * 1000 / repeat:8.3f} ms per {width}x{height} image')
+
+
+def render_benchmark(bench: 'RenderBenchmark') -> None:
+    # The workload run inside kitty by run_render_benchmark()
+    dump_dir = os.environ.get('KITTY_RENDER_BENCHMARK_DUMP_DIR', '')
+    screen = bench.window.screen
+    colored_line = ''.join(f'\x1b[38;5;{i % 256}m{chr(0x41 + i % 26)}' for i in range(screen.columns)) + '\x1b[m\r\n'
+    text_line = 'The quick brown fox jumps over the lazy dog, fi ffl => != ' * (screen.columns // 50 + 1)
+    bench.feed('\x1b[H\x1b[2J')
+    for i in range(3):
+        bench.render_frame('warmup')
+    for i in range(screen.lines):
+        bench.feed(f'{text_line[i % 10:][:screen.columns]}\r\n')
+        bench.render_frame('scroll text', force_redraw=False)
+    for i in range(screen.lines):
+        bench.feed(colored_line)
+        bench.render_frame('scroll colors', force_redraw=False)
+    bench.feed('\x1b[1;41m' + ''.join(chr(0x4e00 + i) for i in range(screen.columns * screen.lines // 4)) + '\x1b[m')
+    bench.render_frame('wide chars', force_redraw=False, dump_to=os.path.join(dump_dir, 'wide-chars.png') if dump_dir else '')
+    for i in range(10):
+        bench.render_frame('unchanged')
+    if dump_dir:
+        bench.render_frame('final', dump_to=os.path.join(dump_dir, 'final.png'))
+
+
+def run_render_benchmark(dump_dir: str = '') -> None:
+    # Renders frames using a headless OS window, no display or GPU is needed
+    if dump_dir:
+        os.environ['KITTY_RENDER_BENCHMARK_DUMP_DIR'] = os.path.abspath(dump_dir)
+    argv = [kitty_exe(), '--headless', '--config=NONE', '--benchmark-rendering', os.path.abspath(__file__), 'cat']
+    os.execvp(argv[0], argv)
+
+
 def main() -> None:
-    run_parsing_benchmark()
+    if sys.argv[-1] == 'compositing':
+        run_compositing_benchmark()
+    elif len(sys.argv) > 1 and sys.argv[1] == 'render':
+        run_render_benchmark(*sys.argv[2:3])
+    else:
+        run_parsing_benchmark()
 
 
 if __name__ == '__main__':
@@ -10,7 +10,7 @@
 
 cmdline = (
     'glad --out-path {dest} --api gl:core=3.1 '
-    ' --extensions GL_ARB_texture_storage,GL_ARB_copy_image,GL_ARB_multisample,GL_ARB_robustness,GL_ARB_instanced_arrays,GL_KHR_debug '
+    ' --extensions GL_ARB_texture_storage,GL_ARB_copy_image,GL_ARB_multisample,GL_ARB_robustness,GL_ARB_instanced_arrays,GL_ARB_buffer_storage,GL_ARB_sync,GL_KHR_debug '
     'c --header-only --debug'
 )
 
@@ -168,6 +168,13 @@ def init_env(
         if major < 1:
             ans.cflags.append('-DXKB_HAS_NO_UTF32')
 
+    elif module == 'osmesa':
+        # headless backend, OSMesa is loaded at runtime via dlopen()
+        ans.cflags.append('-pthread')
+        ans.ldpaths.extend('-pthread -lm'.split())
+        if not is_openbsd:
+            ans.ldpaths.extend('-lrt -ldl'.split())
+
     if module == 'x11':
         for dep in 'x11 xrandr xinerama xcursor xkbcommon xkbcommon-x11 x11-xcb dbus-1'.split():
             ans.cflags.extend(pkg_config(dep, '--cflags-only-I'))
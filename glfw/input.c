@@ -1046,7 +1046,7 @@ GLFWAPI void glfwUpdateIMEState(GLFWwindow* handle, const GLFWIMEUpdateEvent *ev
 #if defined(_GLFW_X11) || defined(_GLFW_WAYLAND) || defined(_GLFW_COCOA)
     _glfwPlatformUpdateIMEState(window, ev);
 #else
-    (void)window; (void)which; (void)a; (void)b; (void)c; (void)d;
+    (void)window; (void)ev;
 #endif
 }
 
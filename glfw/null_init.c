@@ -30,14 +30,22 @@
 #include "internal.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 
 //////////////////////////////////////////////////////////////////////////
 //////                       GLFW platform API                      //////
 //////////////////////////////////////////////////////////////////////////
 
-int _glfwPlatformInit(void)
+int _glfwPlatformInit(bool *supports_window_occlusion)
 {
+    *supports_window_occlusion = false;
+    // There is no display connection, the event loop only has the wakeup fd
+    // and timers. poll() ignores the negative display fd.
+    if (!initPollData(&_glfw.null.eventLoopData, -1)) {
+        _glfwInputError(GLFW_PLATFORM_ERROR, "Null: Failed to initialize event loop data");
+        return false;
+    }
     _glfwPollMonitorsNull();
 
     return true;
@@ -45,11 +53,23 @@ int _glfwPlatformInit(void)
 
 void _glfwPlatformTerminate(void)
 {
+    removeAllTimers(&_glfw.null.eventLoopData);
     free(_glfw.null.clipboardString);
+    _glfw.null.clipboardString = NULL;
     _glfwTerminateOSMesa();
+    finalizePollData(&_glfw.null.eventLoopData);
 }
 
 const char* _glfwPlatformGetVersionString(void)
 {
     return _GLFW_VERSION_NUMBER " null OSMesa";
 }
+
+GLFWAPI GLFWColorScheme glfwGetCurrentSystemColorTheme(bool query_if_unintialized UNUSED) {
+    return GLFW_COLOR_SCHEME_NO_PREFERENCE;
+}
+
+void _glfwPlatformInputColorScheme(GLFWColorScheme appearance UNUSED) { }
+
+#define GLFW_LOOP_BACKEND null
+#include "main_loop.h"
@@ -160,6 +160,22 @@ void _glfwPlatformSetWindowIcon(_GLFWwindow* window UNUSED, int count UNUSED,
 {
 }
 
+bool _glfwPlatformIsFullscreen(_GLFWwindow* window, unsigned int flags UNUSED)
+{
+    return window->null.fullscreen;
+}
+
+bool _glfwPlatformToggleFullscreen(_GLFWwindow* window, unsigned int flags UNUSED)
+{
+    window->null.fullscreen = !window->null.fullscreen;
+    return window->null.fullscreen;
+}
+
+int _glfwPlatformSetWindowBlur(_GLFWwindow* window UNUSED, int value UNUSED)
+{
+    return 0;
+}
+
 void _glfwPlatformSetWindowMonitor(_GLFWwindow* window,
                                    _GLFWmonitor* monitor,
                                    int xpos, int ypos,
@@ -476,20 +492,31 @@ int _glfwPlatformWindowVisible(_GLFWwindow* window)
     return window->null.visible;
 }
 
+static void
+handleEvents(monotonic_t timeout) {
+    // There are no display events, only timers and wakeups
+    pollForEvents(&_glfw.null.eventLoopData, timeout, NULL);
+    if (_glfw.null.eventLoopData.wakeup_fd_ready) check_for_wakeup_events(&_glfw.null.eventLoopData);
+}
+
 void _glfwPlatformPollEvents(void)
 {
+    handleEvents(0);
 }
 
 void _glfwPlatformWaitEvents(void)
 {
+    handleEvents(-1);
 }
 
-void _glfwPlatformWaitEventsTimeout(monotonic_t timeout UNUSED)
+void _glfwPlatformWaitEventsTimeout(monotonic_t timeout)
 {
+    handleEvents(timeout);
 }
 
 void _glfwPlatformPostEmptyEvent(void)
 {
+    wakeupEventLoop(&_glfw.null.eventLoopData);
 }
 
 void _glfwPlatformGetCursorPos(_GLFWwindow* window, double* xpos, double* ypos)
@@ -517,7 +544,7 @@ int _glfwPlatformCreateCursor(_GLFWcursor* cursor UNUSED,
     return true;
 }
 
-int _glfwPlatformCreateStandardCursor(_GLFWcursor* cursor UNUSED, int shape UNUSED)
+int _glfwPlatformCreateStandardCursor(_GLFWcursor* cursor UNUSED, GLFWCursorShape shape UNUSED)
 {
     return true;
 }
@@ -530,140 +557,45 @@ void _glfwPlatformSetCursor(_GLFWwindow* window UNUSED, _GLFWcursor* cursor UNUS
 {
 }
 
-void _glfwPlatformSetClipboardString(const char* string)
+void _glfwPlatformSetClipboard(GLFWClipboardType t UNUSED)
 {
-    char* copy = _glfw_strdup(string);
-    free(_glfw.null.clipboardString);
-    _glfw.null.clipboardString = copy;
+    // The clipboard data is kept in _glfw.clipboard and _glfw.primary,
+    // there is no system clipboard to announce it to
 }
 
-const char* _glfwPlatformGetClipboardString(void)
+void _glfwPlatformGetClipboard(GLFWClipboardType clipboard_type, const char* mime_type, GLFWclipboardwritedatafun write_data, void *object)
 {
-    return _glfw.null.clipboardString;
+    // We are always the owner of the clipboard
+    if (mime_type == NULL) {
+        write_data(object, NULL, 1);
+        return;
+    }
+    const _GLFWClipboardData *cd = clipboard_type == GLFW_PRIMARY_SELECTION ? &_glfw.primary : &_glfw.clipboard;
+    if (cd->get_data == NULL) return;
+    GLFWDataChunk chunk = cd->get_data(mime_type, NULL, cd->ctype);
+    void *iter = chunk.iter;
+    if (!iter) return;
+    bool ok = true;
+    while (ok) {
+        chunk = cd->get_data(mime_type, iter, cd->ctype);
+        if (!chunk.sz) break;
+        ok = write_data(object, chunk.data, chunk.sz);
+        if (chunk.free) chunk.free((void*)chunk.free_data);
+    }
+    cd->get_data(NULL, iter, cd->ctype);
 }
 
 const char* _glfwPlatformGetNativeKeyName(int native_key)
 {
-    switch (scancode)
-    {
-        case GLFW_KEY_APOSTROPHE:
-            return "'";
-        case GLFW_KEY_COMMA:
-            return ",";
-        case GLFW_KEY_MINUS:
-        case GLFW_KEY_KP_SUBTRACT:
-            return "-";
-        case GLFW_KEY_PERIOD:
-        case GLFW_KEY_KP_DECIMAL:
-            return ".";
-        case GLFW_KEY_SLASH:
-        case GLFW_KEY_KP_DIVIDE:
-            return "/";
-        case GLFW_KEY_SEMICOLON:
-            return ";";
-        case GLFW_KEY_EQUAL:
-        case GLFW_KEY_KP_EQUAL:
-            return "=";
-        case GLFW_KEY_LEFT_BRACKET:
-            return "[";
-        case GLFW_KEY_RIGHT_BRACKET:
-            return "]";
-        case GLFW_KEY_KP_MULTIPLY:
-            return "*";
-        case GLFW_KEY_KP_ADD:
-            return "+";
-        case GLFW_KEY_BACKSLASH:
-        case GLFW_KEY_WORLD_1:
-        case GLFW_KEY_WORLD_2:
-            return "\\";
-        case GLFW_KEY_0:
-        case GLFW_KEY_KP_0:
-            return "0";
-        case GLFW_KEY_1:
-        case GLFW_KEY_KP_1:
-            return "1";
-        case GLFW_KEY_2:
-        case GLFW_KEY_KP_2:
-            return "2";
-        case GLFW_KEY_3:
-        case GLFW_KEY_KP_3:
-            return "3";
-        case GLFW_KEY_4:
-        case GLFW_KEY_KP_4:
-            return "4";
-        case GLFW_KEY_5:
-        case GLFW_KEY_KP_5:
-            return "5";
-        case GLFW_KEY_6:
-        case GLFW_KEY_KP_6:
-            return "6";
-        case GLFW_KEY_7:
-        case GLFW_KEY_KP_7:
-            return "7";
-        case GLFW_KEY_8:
-        case GLFW_KEY_KP_8:
-            return "8";
-        case GLFW_KEY_9:
-        case GLFW_KEY_KP_9:
-            return "9";
-        case GLFW_KEY_A:
-            return "a";
-        case GLFW_KEY_B:
-            return "b";
-        case GLFW_KEY_C:
-            return "c";
-        case GLFW_KEY_D:
-            return "d";
-        case GLFW_KEY_E:
-            return "e";
-        case GLFW_KEY_F:
-            return "f";
-        case GLFW_KEY_G:
-            return "g";
-        case GLFW_KEY_H:
-            return "h";
-        case GLFW_KEY_I:
-            return "i";
-        case GLFW_KEY_J:
-            return "j";
-        case GLFW_KEY_K:
-            return "k";
-        case GLFW_KEY_L:
-            return "l";
-        case GLFW_KEY_M:
-            return "m";
-        case GLFW_KEY_N:
-            return "n";
-        case GLFW_KEY_O:
-            return "o";
-        case GLFW_KEY_P:
-            return "p";
-        case GLFW_KEY_Q:
-            return "q";
-        case GLFW_KEY_R:
-            return "r";
-        case GLFW_KEY_S:
-            return "s";
-        case GLFW_KEY_T:
-            return "t";
-        case GLFW_KEY_U:
-            return "u";
-        case GLFW_KEY_V:
-            return "v";
-        case GLFW_KEY_W:
-            return "w";
-        case GLFW_KEY_X:
-            return "x";
-        case GLFW_KEY_Y:
-            return "y";
-        case GLFW_KEY_Z:
-            return "z";
-    }
-
-    return NULL;
+    // Native keys are the GLFW keys themselves, which for printable keys
+    // are their unicode codepoints
+    static char name[2];
+    if (native_key < 0x20 || native_key > 0x7e) return NULL;
+    name[0] = (char)native_key; name[1] = 0;
+    return name;
 }
 
-int _glfwPlatformGetNativeKeyForKey(int key)
+int _glfwPlatformGetNativeKeyForKey(uint32_t key)
 {
     return key;
 }
@@ -51,6 +51,7 @@
     kitty_exe,
     logo_png_file,
     supports_primary_selection,
+    version,
     website_url,
 )
 from .fast_data_types import (
@@ -148,6 +149,7 @@
 if TYPE_CHECKING:
 
     from .rc.base import ResponseType
+    from .remote_control import SessionSecrets
 # }}}
 
 RCResponse = Union[dict[str, Any], None, AsyncResponse]
@@ -365,12 +367,14 @@ def __init__(
         self.background_process_death_notify_map: dict[int, Callable[[int, Exception | None], None]] = {}
         self.encryption_key = EllipticCurveKey()
         self.encryption_public_key = f'{RC_ENCRYPTION_PROTOCOL_VERSION}:{base64.b85encode(self.encryption_key.public).decode("ascii")}'
+        self.rc_session_secrets: Optional['SessionSecrets'] = None
         self.clipboard_buffers: dict[str, str] = {}
         self.update_check_process: Optional['PopenType[bytes]'] = None
         self.window_id_map: WeakValueDictionary[int, Window] = WeakValueDictionary()
         self.color_settings_at_startup: dict[str, Color | None] = {
                 k: opts[k] for k in opts if isinstance(opts[k], Color) or k in nullable_colors}
         self.current_visual_select: VisualSelect | None = None
+        self.tracing_active = False
         # A list of events received so far that are potentially part of a sequence keybinding.
         self.cached_values = cached_values
         self.os_window_map: dict[int, TabManager] = {}
@@ -398,6 +402,11 @@ def __init__(
             DumpCommands(args) if args.dump_commands or args.dump_bytes else None,
             talk_fd, listen_fd, self.listening_on.startswith('unix:')
         )
+        if self.allow_remote_control in ('y', 'socket', 'socket-only'):
+            # commands from listen_on sockets need no authorization, so simple
+            # ones can be executed without involving the main thread, see
+            # _handle_remote_command() for the rules
+            self.child_monitor.allow_native_rc_commands(version.major, version.minor)
         self.args: CLIOptions = args
         self.mouse_handler: Callable[[WindowSystemMouseEvent], None] | None = None
         set_boss(self)
@@ -617,7 +626,7 @@ def add_child(self, window: Window) -> None:
         self.window_id_map[window.id] = window
 
     def _handle_remote_command(self, cmd: memoryview, window: Window | None = None, peer_id: int = 0) -> RCResponse:
-        from .remote_control import is_cmd_allowed, parse_cmd, remote_control_allowed
+        from .remote_control import SessionSecrets, is_cmd_allowed, parse_cmd, remote_control_allowed
         response = None
         window = window or None
         from_socket = peer_id > 0
@@ -628,8 +637,11 @@ def _handle_remote_command(self, cmd: memoryview, window: Window | None = None,
                 return {'ok': False, 'error': 'Remote control is disabled'}
             if self.allow_remote_control == 'socket-only' and not from_socket:
                 return {'ok': False, 'error': 'Remote control is allowed over a socket only'}
+        if self.rc_session_secrets is None:
+            self.rc_session_secrets = SessionSecrets()
+        session = ('peer', peer_id) if from_socket else (('window', window.id) if window else None)
         try:
-            pcmd = parse_cmd(cmd, self.encryption_key)
+            pcmd = parse_cmd(cmd, self.encryption_key, self.rc_session_secrets, session)
         except Exception as e:
             log_error(f'Failed to parse remote command with error: {e}')
             return response
@@ -805,6 +817,8 @@ def call_remote_control(self, self_window: Window | None, args: tuple[str, ...])
     def peer_message_received(self, msg_bytes: bytes, peer_id: int, is_remote_control: bool) -> bytes | bool | None:
         if peer_id > 0 and msg_bytes == b'peer_death':
             self.peer_data_map.pop(peer_id, None)
+            if self.rc_session_secrets is not None:
+                self.rc_session_secrets.end_session(('peer', peer_id))
             return False
         if is_remote_control:
             cmd_prefix = b'\x1bP@kitty-cmd'
@@ -912,6 +926,8 @@ def on_child_death(self, window_id: int) -> None:
         window = self.window_id_map.pop(window_id, None)
         if window is None:
             return
+        if self.rc_session_secrets is not None:
+            self.rc_session_secrets.end_session(('window', window_id))
         with self.suppress_focus_change_events():
             for close_action in window.actions_on_close:
                 try:
@@ -2217,11 +2233,9 @@ def paste_to_active_window(self, text: str) -> None:
 
     @ac('cp', 'Paste from the clipboard to the active window')
     def paste_from_clipboard(self) -> None:
-        text = get_clipboard_string()
-        if text:
-            w = self.window_for_dispatch or self.active_window
-            if w is not None:
-                w.paste_with_actions(text)
+        w = self.window_for_dispatch or self.active_window
+        if w is not None:
+            w.paste_from_clipboard(self.clipboard)
 
     def current_primary_selection(self) -> str:
         return get_primary_selection() if supports_primary_selection else ''
@@ -2231,11 +2245,9 @@ def current_primary_selection_or_clipboard(self) -> str:
 
     @ac('cp', 'Paste from the primary selection, if present, otherwise the clipboard to the active window')
     def paste_from_selection(self) -> None:
-        text = self.current_primary_selection_or_clipboard()
-        if text:
-            w = self.window_for_dispatch or self.active_window
-            if w is not None:
-                w.paste_with_actions(text)
+        w = self.window_for_dispatch or self.active_window
+        if w is not None:
+            w.paste_from_clipboard(self.primary_selection if supports_primary_selection else self.clipboard)
 
     def set_primary_selection(self) -> None:
         w = self.active_window
@@ -2747,6 +2759,13 @@ def set_update_check_process(self, process: Optional['PopenType[bytes]'] = None)
                     self.update_check_process.kill()
         self.update_check_process = process
 
+    def on_rejected_paste(self, window_id: int, fd: int) -> None:
+        w = self.window_id_map.get(window_id)
+        if w is None:
+            os.close(fd)
+        else:
+            w.on_rejected_paste(fd)
+
     def on_monitored_pid_death(self, pid: int, exit_status: int) -> None:
         callback = self.background_process_death_notify_map.pop(pid, None)
         if callback is not None:
@@ -3009,6 +3028,36 @@ def show_kitty_env_vars(self) -> None:
             output = '\n'.join(f'{k}={v}' for k, v in env.items())
             self.display_scrollback(w, output, title=_('Current kitty env vars'), report_cursor=False)
 
+    @ac('debug', '''
+        Toggle recording a trace of what kitty is doing
+
+        The first invocation starts recording the time spent in the phases of the main loop,
+        such as parsing program output, preparing cell data and drawing, and in reading and
+        writing to child programs. The next invocation stops recording and saves the trace
+        as JSON that can be viewed in `Perfetto <https://ui.perfetto.dev>`__ or
+        :code:`chrome://tracing`. The trace is saved to the specified file or to
+        :file:`kitty-trace-{pid}.json` in the kitty cache directory. For example::
+
+            map f1 toggle_tracing ~/kitty-trace.json
+        ''')
+    def toggle_tracing(self, path: str = '') -> None:
+        from .fast_data_types import start_tracing, stop_tracing, trace_as_json
+        if not self.tracing_active:
+            self.tracing_active = True
+            start_tracing()
+            log_error('Started recording a trace')
+            return
+        stop_tracing()
+        self.tracing_active = False
+        path = os.path.abspath(os.path.expanduser(path or os.path.join(cache_dir(), f'kitty-trace-{os.getpid()}.json')))
+        try:
+            with open(path, 'wb') as f:
+                f.write(trace_as_json(True))
+        except OSError as e:
+            self.show_error(_('Failed to save trace'), _('Could not write the trace to {0} with error: {1}').format(path, e))
+            return
+        log_error(f'Trace saved to: {path}')
+
     @ac('debug', '''
         Close all shared SSH connections
 
@@ -8,7 +8,7 @@ layout(std140) uniform CellRenderData {
 
     uint default_fg, highlight_fg, highlight_bg, cursor_fg, cursor_bg, url_color, url_style, inverted;
 
-    uint xnum, ynum, sprites_xnum, sprites_ynum, cursor_fg_sprite_idx, cell_height;
+    uint xnum, ynum, first_row, sprites_xnum, sprites_ynum, cursor_fg_sprite_idx, cell_height;
     uint cursor_x1, cursor_x2, cursor_y1, cursor_y2;
     float cursor_opacity;
 
@@ -169,9 +169,10 @@ struct CellData {
 
 CellData set_vertex_position() {
     uint instance_id = uint(gl_InstanceID);
-    /* The current cell being rendered */
+    /* The current cell being rendered, the cell data is a ring of lines starting at first_row */
     uint r = instance_id / xnum;
     uint c = instance_id - r * xnum;
+    r = (r + ynum - first_row) % ynum;
 
     /* The position of this vertex, at a corner of the cell  */
     float left = xstart + c * dx;
@@ -11,15 +11,24 @@
 #include "threading.h"
 #include "screen.h"
 #include "fonts.h"
+#include "modes.h"
+#include "base64.h"
+#include "charsets.h"
 #include "monotonic.h"
+#include "trace.h"
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <signal.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 extern PyTypeObject Screen_Type;
 
 #if defined(__APPLE__) || defined(__OpenBSD__)
@@ -64,7 +73,9 @@ typedef struct {
 
 typedef struct {
     Screen *screen;
-    bool needs_removal;
+    // needs_io_update is set when the events the I/O thread waits for on
+    // this child may have changed, see mark_child_for_io_update()
+    bool needs_removal, needs_io_update;
     int fd;
     unsigned long id;
     pid_t pid;
@@ -83,9 +94,13 @@ static Child children[MAX_CHILDREN] = {{0}};
 static Child scratch[MAX_CHILDREN] = {{0}};
 static Child add_queue[MAX_CHILDREN] = {{0}}, remove_queue[MAX_CHILDREN] = {{0}}, remove_notify[MAX_CHILDREN] = {{0}};
 static size_t add_queue_count = 0, remove_queue_count = 0;
+// The events member is the set of events the I/O thread is currently waiting for
 static struct pollfd children_fds[MAX_CHILDREN + EXTRA_FDS] = {{0}};
 static pthread_mutex_t children_lock, talk_lock;
-static bool kill_signal_received = false, reload_config_signal_received = false;
+static bool kill_signal_received = false, reload_config_signal_received = false, children_need_io_update = false;
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+#endif
 static ChildMonitor *the_monitor = NULL;
 
 typedef struct {
@@ -184,6 +199,13 @@ new_childmonitor_object(PyTypeObject *type, PyObject *args, PyObject UNUSED *kwd
     self->count = 0;
     children_fds[0].fd = self->io_loop_data.wakeup_read_fd; children_fds[1].fd = self->io_loop_data.signal_read_fd;
     children_fds[0].events = POLLIN; children_fds[1].events = POLLIN; children_fds[2].events = POLLIN;
+#ifdef USE_EPOLL
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) return PyErr_SetFromErrno(PyExc_OSError);
+    for (size_t i = 0; i < EXTRA_FDS; i++) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u64 = i};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, children_fds[i].fd, &ev) != 0) return PyErr_SetFromErrno(PyExc_OSError);
+    }
+#endif
     the_monitor = self;
 
     return (PyObject*) self;
@@ -209,6 +231,9 @@ dealloc(ChildMonitor* self) {
         FREE_CHILD(add_queue[add_queue_count]);
     }
     free_loop_data(&self->io_loop_data);
+#ifdef USE_EPOLL
+    if (epoll_fd > -1) { safe_close(epoll_fd, __FILE__, __LINE__); epoll_fd = -1; }
+#endif
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -322,7 +347,70 @@ add_child(ChildMonitor *self, PyObject *args) {
     Py_RETURN_NONE;
 }
 
-#define schedule_write_to_child_generic(id, num, va_start, get_next_arg, va_end) \
+static void
+mark_child_for_io_update(size_t i) {
+    // Tell the I/O thread to re-examine the events it waits for on this
+    // child. Must be called with children_lock held.
+    children[i].needs_io_update = true;
+    children_need_io_update = true;
+}
+
+static void
+mark_screen_for_io_update(ChildMonitor *self, Screen *screen) {
+    children_mutex(lock);
+    for (size_t i = 0; i < self->count; i++) {
+        if (children[i].screen == screen) { mark_child_for_io_update(i); break; }
+    }
+    children_mutex(unlock);
+}
+
+// Large writes are split into chunks of this size
+#define WRITE_CHUNK_SIZE (64u * 1024u)
+
+static void
+append_to_write_chunks(WriteChunk **head, WriteChunk **tail, const char *data, size_t sz) {
+    while (sz) {
+        WriteChunk *t = *tail;
+        if (!t || t->end == t->capacity) {
+            const size_t capacity = MAX((size_t)BUFSIZ, MIN((size_t)WRITE_CHUNK_SIZE, sz));
+            WriteChunk *c = malloc(sizeof(WriteChunk) + capacity);
+            if (!c) fatal("Out of memory.");
+            c->next = NULL; c->start = 0; c->end = 0; c->capacity = capacity;
+            if (t) t->next = c; else *head = c;
+            *tail = t = c;
+        }
+        const size_t n = MIN(sz, t->capacity - t->end);
+        memcpy(t->data + t->end, data, n);
+        t->end += n; data += n; sz -= n;
+    }
+}
+
+static void
+link_write_chunks(WriteChunk **head, WriteChunk **tail, WriteChunk *chunks, WriteChunk *chunks_tail) {
+    if (*tail) (*tail)->next = chunks; else *head = chunks;
+    *tail = chunks_tail;
+}
+
+static void
+free_write_chunks(WriteChunk *c) {
+    while (c) {
+        WriteChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+}
+
+static void
+queued_timed_key(Screen *screen, monotonic_t received_at) {
+    // Must be called with the write lock held, by the code that queues the
+    // key, so that the I/O thread cannot see the stamp before the key
+    screen->latency.queued_at = received_at;
+    screen->latency.echoed.key = 0;
+}
+
+// timed_key is the time the key being written was received, when it is timed
+// for input latency, see latency_key_sent_to_child(), zero otherwise
+#define schedule_write_to_child_generic(id, num, va_start, get_next_arg, va_end, timed_key) \
     ChildMonitor *self = the_monitor; \
     bool found = false; \
     const char *data; \
@@ -333,48 +421,70 @@ add_child(ChildMonitor *self, PyObject *args) {
         sz += szval; \
     } \
     va_end(ap); \
+    /* large writes are copied before the locks are taken, so as not to block the I/O thread */ \
+    WriteChunk *chunks = NULL, *chunks_tail = NULL; \
+    if (sz > BUFSIZ) { \
+        va_start(ap, num); \
+        for (unsigned int i = 0; i < num; i++) { \
+            get_next_arg(ap); \
+            append_to_write_chunks(&chunks, &chunks_tail, data, szval); \
+        } \
+        va_end(ap); \
+    } \
     children_mutex(lock); \
     for (size_t i = 0; i < self->count; i++) { \
         if (children[i].id == id) { \
             Screen *screen = children[i].screen; \
             screen_mutex(lock, write); \
-            size_t space_left = screen->write_buf_sz - screen->write_buf_used; \
-            if (space_left < sz) { \
-                if (screen->write_buf_used + sz > 100 * 1024 * 1024) { \
-                    log_error("Too much data being sent to child with id: %lu, ignoring it", id); \
-                    screen_mutex(unlock, write); \
-                    break; \
-                } \
-                screen->write_buf_sz = screen->write_buf_used + sz; \
-                screen->write_buf = PyMem_RawRealloc(screen->write_buf, screen->write_buf_sz); \
-                if (screen->write_buf == NULL) { fatal("Out of memory."); } \
+            /* data written while a paste is streaming is held back so it cannot end up in the middle of the paste */ \
+            const bool held = screen->streaming_paste; \
+            WriteChunk **qhead = held ? &screen->held_writes.head : &screen->write_queue.head; \
+            WriteChunk **qtail = held ? &screen->held_writes.tail : &screen->write_queue.tail; \
+            size_t *qused = held ? &screen->held_writes.used : &screen->write_buf_used; \
+            if (*qused + sz > 100 * 1024 * 1024) { \
+                log_error("Too much data being sent to child with id: %lu, ignoring it", id); \
+                screen_mutex(unlock, write); \
+                break; \
             } \
             found = true; \
-            va_start(ap, num); \
-            for (unsigned int i = 0; i < num; i++) { \
-                get_next_arg(ap); \
-                memcpy(screen->write_buf + screen->write_buf_used, data, szval); \
-                screen->write_buf_used += szval; \
-            } \
-            va_end(ap); \
-            if (screen->write_buf_sz > BUFSIZ && screen->write_buf_used < BUFSIZ) { \
-                screen->write_buf_sz = BUFSIZ; \
-                screen->write_buf = PyMem_RawRealloc(screen->write_buf, screen->write_buf_sz); \
-                if (screen->write_buf == NULL) { fatal("Out of memory."); } \
+            if (chunks) { \
+                link_write_chunks(qhead, qtail, chunks, chunks_tail); \
+                chunks = NULL; \
+            } else { \
+                va_start(ap, num); \
+                for (unsigned int i = 0; i < num; i++) { \
+                    get_next_arg(ap); \
+                    append_to_write_chunks(qhead, qtail, data, szval); \
+                } \
+                va_end(ap); \
             } \
-            if (screen->write_buf_used) wakeup_io_loop(self, false); \
+            *qused += sz; \
+            if (timed_key && !held) queued_timed_key(screen, timed_key); \
+            if (!held && screen->write_buf_used) { mark_child_for_io_update(i); wakeup_io_loop(self, false); } \
             screen_mutex(unlock, write); \
             break; \
         } \
     } \
     children_mutex(unlock); \
+    free_write_chunks(chunks); \
     return found;
 
 bool
 schedule_write_to_child(unsigned long id, unsigned int num, ...) {
     va_list ap;
 #define get_next_arg(ap) data = va_arg(ap, const char*); szval = va_arg(ap, size_t);
-    schedule_write_to_child_generic(id, num, va_start, get_next_arg, va_end);
+    schedule_write_to_child_generic(id, num, va_start, get_next_arg, va_end, 0);
+#undef get_next_arg
+}
+
+bool
+schedule_timed_key_write_to_child(unsigned long id, const char *key, size_t key_sz, monotonic_t received_at) {
+#define key_start(ap, num)
+#define key_end(ap)
+#define get_next_arg(ap) data = key; szval = key_sz;
+    schedule_write_to_child_generic(id, 1, key_start, get_next_arg, key_end, received_at);
+#undef key_start
+#undef key_end
 #undef get_next_arg
 }
 
@@ -404,7 +514,7 @@ schedule_write_to_child_python(unsigned long id, const char *prefix, PyObject *a
         } \
     } \
 }
-    schedule_write_to_child_generic(id, num, py_start, get_next_arg, py_end);
+    schedule_write_to_child_generic(id, num, py_start, get_next_arg, py_end, 0);
 #undef py_start
 #undef py_end
 #undef get_next_arg
@@ -436,12 +546,60 @@ shutdown_monitor(ChildMonitor *self, PyObject *a UNUSED) {
     Py_RETURN_NONE;
 }
 
+// Input latency {{{
+// A key press is stamped by the main thread when it is sent to the child and
+// by the I/O thread when it is written and when the first bytes of the
+// response are read, then by the main thread when that response is parsed
+// and when the frame showing it is swapped in. Only one key press per screen
+// is tracked at a time, one that gets no response is abandoned after
+// LATENCY_TIMEOUT. Any output from the child counts as the response.
+
+#define LATENCY_TIMEOUT s_to_monotonic_t(1ll)
+
+bool
+latency_key_sent_to_child(Screen *screen, monotonic_t received_at) {
+    // Returns true if the key should be timed, in which case it must be
+    // written with schedule_timed_key_write_to_child()
+    if (screen->latency.sent_at && received_at - screen->latency.sent_at < LATENCY_TIMEOUT) return false;
+    screen->latency.sent_at = received_at;
+    screen->latency.parsed.key = 0;
+    return true;
+}
+
+static void
+latency_response_parsed(Screen *screen) {
+    screen_mutex(lock, write);
+    LatencySample s = screen->latency.echoed;
+    screen->latency.echoed.key = 0;
+    screen_mutex(unlock, write);
+    if (s.key && s.key == screen->latency.sent_at) {
+        s.parsed = monotonic();
+        screen->latency.parsed = s;
+        screen->latency.sent_at = 0;
+    }
+}
+
+static void
+latency_response_presented(Screen *screen, monotonic_t now) {
+    LatencyHistory *h = screen->latency.history;
+    if (!h && !(h = screen->latency.history = calloc(1, sizeof(LatencyHistory)))) return;
+    LatencySample *s = h->samples + h->next;
+    *s = screen->latency.parsed; s->presented = now;
+    h->next = (h->next + 1) % LATENCY_HISTORY_SIZE;
+    h->count = MIN(h->count + 1, LATENCY_HISTORY_SIZE);
+    screen->latency.parsed.key = 0;
+}
+// }}}
+
 static bool
 do_parse(ChildMonitor *self, Screen *screen, monotonic_t now, bool flush) {
     ParseData pd = {.dump_callback = self->dump_callback, .now = now};
+    TRACE_BEGIN_FOR_WINDOW("parse", screen->window_id);
     self->parse_func(screen, &pd, flush);
+    TRACE_END_FOR_WINDOW("parse", screen->window_id);
     if (pd.input_read) {
-        if (pd.write_space_created) wakeup_io_loop(self, false);
+        if (screen->latency.sent_at) latency_response_parsed(screen);
+        if (pd.write_space_created) { mark_screen_for_io_update(self, screen); wakeup_io_loop(self, false); }
         if (screen->paused_rendering.expires_at) {
             set_maximum_wait(MAX(0, screen->paused_rendering.expires_at - now));
         } else set_maximum_wait(OPT(input_delay) - pd.time_since_new_input);
@@ -527,9 +685,11 @@ parse_input(ChildMonitor *self) {
         FREE_CHILD(remove_notify[remove_count]);
     }
 
+    const bool decodes_finished = grman_has_finished_decodes();
     for (size_t i = 0; i < count; i++) {
         if (!scratch[i].needs_removal) {
             if (do_parse(self, scratch[i].screen, now, false)) input_read = true;
+            if (decodes_finished) screen_process_decoded_images(scratch[i].screen, false);
         }
         DECREF_CHILD(scratch[i]);
     }
@@ -788,6 +948,43 @@ prepare_to_render_os_window(OSWindow *os_window, monotonic_t now, unsigned int *
     return needs_render;
 }
 
+// Render benchmarking {{{
+// Per phase CPU time of the main thread, only collected while a benchmark
+// frame is being rendered, see benchmark_render_frame()
+
+typedef struct {
+    monotonic_t prepare, borders, cells, overlays, swap;
+} RenderPhaseTimes;
+
+static struct {
+    bool enabled, capture;
+    unsigned num_rendered;
+    RenderPhaseTimes cpu;
+    PyObject *captured;
+} render_benchmark = {0};
+
+static monotonic_t
+thread_cpu_time(void) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((monotonic_t)ts.tv_sec * MONOTONIC_T_1e9) + (monotonic_t)ts.tv_nsec;
+}
+
+#define START_RENDER_PHASE(phase) TRACE_BEGIN(#phase); const monotonic_t phase##_started_at = render_benchmark.enabled ? thread_cpu_time() : 0
+#define END_RENDER_PHASE(phase) if (render_benchmark.enabled) render_benchmark.cpu.phase += thread_cpu_time() - phase##_started_at; \
+    TRACE_END(#phase)
+
+static void
+capture_os_window_pixels(OSWindow *w) {
+    const uint32_t width = w->viewport_width, height = w->viewport_height;
+    RAII_PyObject(pixels, PyBytes_FromStringAndSize(NULL, (Py_ssize_t)width * height * 4));
+    if (!pixels) { PyErr_Print(); return; }
+    read_framebuffer_pixels(width, height, (uint8_t*)PyBytes_AS_STRING(pixels));
+    RAII_PyObject(entry, Py_BuildValue("KIIO", w->id, width, height, pixels));
+    if (!entry || PyList_Append(render_benchmark.captured, entry) != 0) PyErr_Print();
+}
+// }}}
+
 static void
 draw_resizing_text(OSWindow *w) {
     if (monotonic() - w->created_at > ms_to_monotonic_t(1000) && w->live_resize.num_of_resize_events > 1) {
@@ -808,11 +1005,15 @@ render_prepared_os_window(OSWindow *os_window, unsigned int active_window_id, co
     if (os_window->clear_count++ < 3) blank_os_window(os_window);
     Tab *tab = os_window->tabs + os_window->active_tab;
     BorderRects *br = &tab->border_rects;
+    START_RENDER_PHASE(borders);
     draw_borders(br->vao_idx, br->num_border_rects, br->rect_buf, br->is_dirty, os_window->viewport_width, os_window->viewport_height, active_window_bg, num_visible_windows, all_windows_have_same_bg, os_window);
+    END_RENDER_PHASE(borders);
     br->is_dirty = false;
+    START_RENDER_PHASE(cells);
     if (TD.screen && os_window->num_tabs >= OPT(tab_bar_min_tabs)) draw_cells(TD.vao_idx, &TD, os_window, true, true, false, NULL);
     unsigned int num_of_visible_windows = 0;
     Window *active_window = NULL;
+    bool has_latency_samples = false;
     for (unsigned int i = 0; i < tab->num_windows; i++) { if (tab->windows[i].visible) num_of_visible_windows++; }
     for (unsigned int i = 0; i < tab->num_windows; i++) {
         Window *w = tab->windows + i;
@@ -822,11 +1023,29 @@ render_prepared_os_window(OSWindow *os_window, unsigned int active_window_id, co
             draw_cells(WD.vao_idx, &WD, os_window, is_active_window, false, num_of_visible_windows == 1, w);
             if (WD.screen->start_visual_bell_at != 0) set_maximum_wait(ANIMATION_SAMPLE_WAIT);
             w->cursor_opacity_at_last_render = WD.screen->cursor_render_info.opacity; w->last_cursor_shape = WD.screen->cursor_render_info.shape;
+            if (WD.screen->latency.parsed.key) has_latency_samples = true;
         }
     }
+    END_RENDER_PHASE(cells);
+    START_RENDER_PHASE(overlays);
     if (OPT(cursor_trail) && tab->cursor_trail.needs_render) draw_cursor_trail(&tab->cursor_trail, active_window);
     if (os_window->live_resize.in_progress) draw_resizing_text(os_window);
+    END_RENDER_PHASE(overlays);
+    if (render_benchmark.enabled) {
+        render_benchmark.num_rendered++;
+        if (render_benchmark.capture) capture_os_window_pixels(os_window);
+    }
+    START_RENDER_PHASE(swap);
     swap_window_buffers(os_window);
+    if (render_benchmark.enabled) finish_rendering();
+    END_RENDER_PHASE(swap);
+    if (has_latency_samples) {
+        const monotonic_t presented_at = monotonic();
+        for (unsigned int i = 0; i < tab->num_windows; i++) {
+            Window *w = tab->windows + i;
+            if (w->visible && WD.screen && WD.screen->latency.parsed.key) latency_response_presented(WD.screen, presented_at);
+        }
+    }
     os_window->last_active_tab = os_window->active_tab; os_window->last_num_tabs = os_window->num_tabs; os_window->last_active_window_id = active_window_id;
     os_window->focused_at_last_render = os_window->is_focused;
     if (os_window->redraw_count) os_window->redraw_count--;
@@ -878,7 +1097,9 @@ render_os_window(OSWindow *w, monotonic_t now, bool ignore_render_frames, bool s
     bool all_windows_have_same_bg;
     color_type active_window_bg = 0;
     if (!w->fonts_data) { log_error("No fonts data found for window id: %llu", w->id); return false; }
+    START_RENDER_PHASE(prepare);
     if (prepare_to_render_os_window(w, now, &active_window_id, &active_window_bg, &num_visible_windows, &all_windows_have_same_bg, scan_for_animated_images)) needs_render = true;
+    END_RENDER_PHASE(prepare);
     if (w->last_active_window_id != active_window_id || w->last_active_tab != w->active_tab || w->focused_at_last_render != w->is_focused) needs_render = true;
     if (w->render_calls < 3 && w->bgimage && w->bgimage->texture_id) needs_render = true;
     if (needs_render) render_prepared_os_window(w, active_window_id, active_window_bg, num_visible_windows, all_windows_have_same_bg);
@@ -898,6 +1119,7 @@ render(monotonic_t now, bool input_read) {
 
     const bool scan_for_animated_images = global_state.check_for_active_animated_images;
     global_state.check_for_active_animated_images = false;
+    sprite_tracker_next_frame();
 
     for (size_t i = 0; i < global_state.num_os_windows; i++) {
         OSWindow *w = global_state.os_windows + i;
@@ -915,6 +1137,35 @@ render(monotonic_t now, bool input_read) {
 }
 
 
+static PyObject*
+benchmark_render_frame(PyObject *self UNUSED, PyObject *args) {
+    int force_redraw = 1, capture = 0;
+    if (!PyArg_ParseTuple(args, "|pp", &force_redraw, &capture)) return NULL;
+    RAII_PyObject(captured, PyList_New(0));
+    if (!captured) return NULL;
+    if (force_redraw) {
+        for (size_t i = 0; i < global_state.num_os_windows; i++) {
+            OSWindow *w = global_state.os_windows + i;
+            if (!w->redraw_count) w->redraw_count = 1;
+        }
+    }
+    zero_at_ptr(&render_benchmark.cpu);
+    render_benchmark.num_rendered = 0;
+    render_benchmark.captured = captured;
+    render_benchmark.capture = capture != 0;
+    render_benchmark.enabled = true;
+    const monotonic_t wall_start = monotonic(), cpu_start = thread_cpu_time();
+    render(wall_start, true);
+    const monotonic_t cpu = thread_cpu_time() - cpu_start, wall = monotonic() - wall_start;
+    render_benchmark.enabled = false; render_benchmark.capture = false; render_benchmark.captured = NULL;
+#define S(x) monotonic_t_to_s_double(x)
+    return Py_BuildValue("{sI sd sd sd sd sd sd sd sO}",
+        "rendered", render_benchmark.num_rendered, "wall", S(wall), "cpu", S(cpu),
+        "prepare", S(render_benchmark.cpu.prepare), "borders", S(render_benchmark.cpu.borders), "cells", S(render_benchmark.cpu.cells),
+        "overlays", S(render_benchmark.cpu.overlays), "swap", S(render_benchmark.cpu.swap), "captured", captured);
+#undef S
+}
+
 typedef struct { int fd; uint8_t *buf; size_t sz; } ThreadWriteData;
 
 static ThreadWriteData*
@@ -1024,6 +1275,339 @@ cm_thread_write(PyObject UNUSED *self, PyObject *args) {
     Py_RETURN_NONE;
 }
 
+// Streaming pastes {{{
+
+// Pasted data is read and queued in chunks of this size
+#define PASTE_CHUNK_SIZE (64u * 1024u)
+// Reading of pasted data pauses while the child has at least this much data waiting to be written to it
+#define PASTE_MAX_QUEUED (1024u * 1024u)
+// The maximum number of bytes held back by the bracketed paste filter, see filter_paste()
+#define PASTE_FILTER_MAX_PENDING 4096u
+// Signalled, with children_lock held, when a child that is being pasted into can accept more data
+static pthread_cond_t paste_space_available = PTHREAD_COND_INITIALIZER;
+
+typedef struct PasteFilter {
+    bool bracketed, last_was_cr;
+    size_t pending_sz;
+    uint8_t pending[PASTE_FILTER_MAX_PENDING];
+} PasteFilter;
+
+// Checks that pasted data can be sent unchanged, without confirmation, see Window.can_stream_paste()
+typedef struct PasteCheck {
+    bool c0, newlines;
+    UTF8State state;
+    uint32_t codep;
+} PasteCheck;
+
+typedef struct PasteThreadData {
+    int fd;
+    unsigned long window_id;
+    PasteFilter filter;
+    PasteCheck check;
+} PasteThreadData;
+
+// Pastes that failed their PasteCheck, to be handled by Python in the main thread, protected by children_lock
+static struct { struct { unsigned long window_id; int fd; } *items; size_t count, capacity; } rejected_pastes = {0};
+
+static bool
+paste_check(PasteCheck *c, const uint8_t *src, size_t sz) {
+    for (size_t i = 0; i < sz; i++) {
+        if (decode_utf8(&c->state, &c->codep, src[i]) == UTF8_REJECT) return false;
+        if (c->c0) switch (src[i]) {
+            START_ALLOW_CASE_RANGE
+            case C0_EXCEPT_NL_SPACE_TAB: return false;
+            END_ALLOW_CASE_RANGE
+            case '\n': if (c->newlines) return false; break;
+        }
+    }
+    return true;
+}
+
+static bool
+paste_check_finished(const PasteCheck *c) { return c->state == UTF8_ACCEPT; }
+
+static bool
+is_partial_end_of_paste(const uint8_t *p, size_t sz) {
+    switch (p[0]) {
+        case 0x1b: return sz < 6 && memcmp(p + 1, "[" BRACKETED_PASTE_END, sz - 1) == 0;
+        case 0x9b: return sz < 5 && memcmp(p + 1, BRACKETED_PASTE_END, sz - 1) == 0;
+    }
+    return false;
+}
+
+static size_t
+start_of_partial_end_of_paste_markers(const uint8_t *buf, size_t sz) {
+    // The start of the longest suffix of buf made up of incomplete end of
+    // paste markers. Removing a marker completed by later data can expose
+    // the one before it, so the whole chain must be held back.
+    size_t start = sz;
+    while (start) {
+        size_t i = start, limit = start > 5 ? start - 5 : 0;
+        do { i--; } while (i > limit && buf[i] != 0x1b && buf[i] != 0x9b);
+        if (!is_partial_end_of_paste(buf + i, start - i)) break;
+        start = i;
+    }
+    return start;
+}
+
+static size_t
+filter_paste(PasteFilter *f, const uint8_t *src, size_t sz, uint8_t *dest, bool finished) {
+    // Does the same transformations as Window.paste_text() on a stream of
+    // data. dest must have space for at least sz + PASTE_FILTER_MAX_PENDING
+    // bytes. Returns the number of bytes placed in dest.
+    size_t n = 0;
+    if (!f->bracketed) {
+        // \r\n -> \r and \n -> \r
+        for (size_t i = 0; i < sz; i++) {
+            const uint8_t ch = src[i];
+            if (ch == '\n') { if (!f->last_was_cr) dest[n++] = '\r'; }
+            else dest[n++] = ch;
+            f->last_was_cr = ch == '\r';
+        }
+        return n;
+    }
+    // Remove end of paste markers, including ones that are formed by removing
+    // other markers, using dest as a stack
+    memcpy(dest, f->pending, f->pending_sz); n = f->pending_sz; f->pending_sz = 0;
+    for (size_t i = 0; i < sz; i++) {
+        dest[n++] = src[i];
+        if (src[i] == '~') {
+            if (n >= 6 && memcmp(dest + n - 6, "\x1b[" BRACKETED_PASTE_END, 6) == 0) n -= 6;
+            else if (n >= 5 && memcmp(dest + n - 5, "\x9b" BRACKETED_PASTE_END, 5) == 0) n -= 5;
+        }
+    }
+    if (finished) return n;
+    const size_t start = start_of_partial_end_of_paste_markers(dest, n);
+    if (n - start > PASTE_FILTER_MAX_PENDING) {
+        // pathological input, drop the introducers so no marker can ever be formed from it
+        size_t w = start;
+        for (size_t i = start; i < n; i++) if (dest[i] != 0x1b && dest[i] != 0x9b) dest[w++] = dest[i];
+        return w;
+    }
+    f->pending_sz = n - start;
+    memcpy(f->pending, dest + start, f->pending_sz);
+    return start;
+}
+
+static ssize_t
+child_index_for_window_id(unsigned long id) {
+    // Must be called with children_lock held
+    for (size_t i = 0; i < the_monitor->count; i++) if (children[i].id == id) return i;
+    return -1;
+}
+
+static bool
+queue_pasted_data(PasteThreadData *p, const uint8_t *data, size_t sz, bool finished) {
+    // Waits for the child to have space for more data, unless the paste is
+    // finished. Returns false if the child has gone away.
+    WriteChunk *chunks = NULL, *chunks_tail = NULL;
+    append_to_write_chunks(&chunks, &chunks_tail, (const char*)data, sz);
+    if (finished && p->filter.bracketed) {
+        static const char end_marker[] = "\x1b[" BRACKETED_PASTE_END;
+        append_to_write_chunks(&chunks, &chunks_tail, end_marker, sizeof(end_marker) - 1);
+        sz += sizeof(end_marker) - 1;
+    }
+    bool found = false;
+    children_mutex(lock);
+    ssize_t i;
+    while (the_monitor && (i = child_index_for_window_id(p->window_id)) > -1) {
+        Screen *screen = children[i].screen;
+        screen_mutex(lock, write);
+        if (!finished && screen->write_buf_used >= PASTE_MAX_QUEUED) {
+            screen_mutex(unlock, write);
+            pthread_cond_wait(&paste_space_available, &children_lock);
+            continue;
+        }
+        found = true;
+        if (chunks) {
+            link_write_chunks(&screen->write_queue.head, &screen->write_queue.tail, chunks, chunks_tail);
+            screen->write_buf_used += sz;
+            chunks = NULL;
+        }
+        if (finished) {
+            // data written to the child during the paste is sent after it
+            if (screen->held_writes.head) {
+                link_write_chunks(&screen->write_queue.head, &screen->write_queue.tail, screen->held_writes.head, screen->held_writes.tail);
+                screen->write_buf_used += screen->held_writes.used;
+                screen->held_writes.head = NULL; screen->held_writes.tail = NULL; screen->held_writes.used = 0;
+            }
+            screen->streaming_paste = false;
+        }
+        if (screen->write_buf_used) { mark_child_for_io_update(i); wakeup_io_loop(the_monitor, false); }
+        screen_mutex(unlock, write);
+        break;
+    }
+    children_mutex(unlock);
+    free_write_chunks(chunks);
+    return found;
+}
+
+static bool
+check_pasted_data(PasteThreadData *p, uint8_t *buf) {
+    // Reads all the data to be pasted, so that nothing is sent if any of it
+    // fails the check, then rewinds to its start
+    while (true) {
+        ssize_t n = read(p->fd, buf, PASTE_CHUNK_SIZE);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            break;
+        }
+        if (n == 0) return paste_check_finished(&p->check) && lseek(p->fd, 0, SEEK_SET) == 0;
+        if (!paste_check(&p->check, buf, n)) break;
+    }
+    lseek(p->fd, 0, SEEK_SET);
+    return false;
+}
+
+static void
+reject_paste(PasteThreadData *p) {
+    // Ends the paste without sending anything and hands the data to Python
+    p->filter.bracketed = false;
+    if (!queue_pasted_data(p, NULL, 0, true)) { safe_close(p->fd, __FILE__, __LINE__); return; }
+    children_mutex(lock);
+    ensure_space_for(&rejected_pastes, items, __typeof__(rejected_pastes.items[0]), rejected_pastes.count + 1, capacity, 4, false);
+    rejected_pastes.items[rejected_pastes.count].window_id = p->window_id;
+    rejected_pastes.items[rejected_pastes.count++].fd = p->fd;
+    children_mutex(unlock);
+    wakeup_main_loop();
+}
+
+static void
+report_rejected_pastes(void) {
+    children_mutex(lock);
+    const size_t count = rejected_pastes.count;
+    RAII_ALLOC(__typeof__(rejected_pastes.items[0]), items, count ? malloc(count * sizeof(items[0])) : NULL);
+    if (items) memcpy(items, rejected_pastes.items, count * sizeof(items[0]));
+    rejected_pastes.count = 0;
+    children_mutex(unlock);
+    if (!items) return;
+    for (size_t i = 0; i < count; i++) {
+        // takes ownership of the fd
+        if (global_state.boss) { call_boss(on_rejected_paste, "ki", items[i].window_id, items[i].fd); }
+        else safe_close(items[i].fd, __FILE__, __LINE__);
+    }
+}
+
+static void*
+paste_thread(void *x) {
+    PasteThreadData *p = x;
+    set_thread_name("KittyPaste");
+    int flags = fcntl(p->fd, F_GETFL, 0);
+    if (flags != -1 && flags & O_NONBLOCK) fcntl(p->fd, F_SETFL, flags & ~O_NONBLOCK);
+    uint8_t *buf = malloc(PASTE_CHUNK_SIZE), *filtered = malloc(PASTE_CHUNK_SIZE + PASTE_FILTER_MAX_PENDING);
+    bool child_alive = true;
+    if (buf && filtered && !check_pasted_data(p, buf)) {
+        free(buf); free(filtered);
+        reject_paste(p);
+        free(p);
+        return 0;
+    }
+    if (buf && filtered && p->filter.bracketed) {
+        static const char start_marker[] = "\x1b[" BRACKETED_PASTE_START;
+        child_alive = queue_pasted_data(p, (const uint8_t*)start_marker, sizeof(start_marker) - 1, false);
+    }
+    if (buf && filtered) {
+        while (child_alive) {
+            ssize_t n = read(p->fd, buf, PASTE_CHUNK_SIZE);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                log_error("Failed to read data being pasted with error: %s", strerror(errno));
+                break;
+            }
+            if (n == 0) break;
+            const size_t sz = filter_paste(&p->filter, buf, n, filtered, false);
+            child_alive = queue_pasted_data(p, filtered, sz, false);
+        }
+    } else log_error("Out of memory allocating buffers for pasted data");
+    if (child_alive) {
+        const size_t sz = filtered ? filter_paste(&p->filter, NULL, 0, filtered, true) : 0;
+        queue_pasted_data(p, filtered, sz, true);
+    }
+    free(buf); free(filtered);
+    safe_close(p->fd, __FILE__, __LINE__);
+    free(p);
+    return 0;
+}
+
+static PyObject*
+stream_paste(PyObject *self UNUSED, PyObject *args) {
+    // Takes ownership of fd. If the data contains invalid UTF-8, or control
+    // codes when check_c0 is true, nothing is pasted and Boss.on_rejected_paste()
+    // is called with the fd instead.
+    unsigned long window_id;
+    int fd, check_c0 = 0;
+    if (!PyArg_ParseTuple(args, "ki|p", &window_id, &fd, &check_c0)) return NULL;
+    PasteThreadData *p = calloc(1, sizeof(PasteThreadData));
+    if (!p) { safe_close(fd, __FILE__, __LINE__); return PyErr_NoMemory(); }
+    p->fd = fd; p->window_id = window_id; p->check.c0 = check_c0;
+    bool started = false;
+    children_mutex(lock);
+    ssize_t i = the_monitor ? child_index_for_window_id(window_id) : -1;
+    if (i > -1) {
+        Screen *screen = children[i].screen;
+        screen_mutex(lock, write);
+        if (!screen->streaming_paste) {
+            started = true;
+            screen->streaming_paste = true;
+            p->filter.bracketed = screen->modes.mBRACKETED_PASTE;
+            // newlines are pasted as the Enter key when not bracketed
+            p->check.newlines = check_c0 && !p->filter.bracketed;
+        }
+        screen_mutex(unlock, write);
+    }
+    children_mutex(unlock);
+    if (!started) { safe_close(fd, __FILE__, __LINE__); free(p); Py_RETURN_FALSE; }
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, paste_thread, p);
+    if (ret != 0) {
+        p->filter.bracketed = false;  // the start marker is sent by the thread
+        queue_pasted_data(p, NULL, 0, true);
+        safe_close(fd, __FILE__, __LINE__); free(p);
+        return PyErr_Format(PyExc_OSError, "Failed to start paste thread with error: %s", strerror(ret));
+    }
+    pthread_detach(thread);
+    Py_RETURN_TRUE;
+}
+
+static PyObject*
+test_paste_filter(PyObject *self UNUSED, PyObject *args) {
+    PyObject *chunks; int bracketed;
+    if (!PyArg_ParseTuple(args, "O!p", &PyTuple_Type, &chunks, &bracketed)) return NULL;
+    size_t total = 0;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(chunks); i++) {
+        if (!PyBytes_Check(PyTuple_GET_ITEM(chunks, i))) { PyErr_SetString(PyExc_TypeError, "chunks must be bytes"); return NULL; }
+        total += PyBytes_GET_SIZE(PyTuple_GET_ITEM(chunks, i));
+    }
+    RAII_ALLOC(PasteFilter, f, calloc(1, sizeof(PasteFilter)));
+    // the output, including held back bytes, is never larger than the input consumed so far
+    RAII_ALLOC(uint8_t, buf, malloc(total + 1));
+    if (!f || !buf) return PyErr_NoMemory();
+    f->bracketed = bracketed;
+    size_t n = 0;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(chunks); i++) {
+        PyObject *b = PyTuple_GET_ITEM(chunks, i);
+        n += filter_paste(f, (const uint8_t*)PyBytes_AS_STRING(b), PyBytes_GET_SIZE(b), buf + n, false);
+    }
+    n += filter_paste(f, NULL, 0, buf + n, true);
+    return PyBytes_FromStringAndSize((const char*)buf, n);
+}
+
+static PyObject*
+test_paste_check(PyObject *self UNUSED, PyObject *args) {
+    PyObject *chunks; int check_c0, bracketed;
+    if (!PyArg_ParseTuple(args, "O!pp", &PyTuple_Type, &chunks, &check_c0, &bracketed)) return NULL;
+    PasteCheck c = {.c0=check_c0, .newlines=check_c0 && !bracketed};
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(chunks); i++) {
+        PyObject *b = PyTuple_GET_ITEM(chunks, i);
+        if (!PyBytes_Check(b)) { PyErr_SetString(PyExc_TypeError, "chunks must be bytes"); return NULL; }
+        if (!paste_check(&c, (const uint8_t*)PyBytes_AS_STRING(b), PyBytes_GET_SIZE(b))) Py_RETURN_FALSE;
+    }
+    if (paste_check_finished(&c)) { Py_RETURN_TRUE; }
+    Py_RETURN_FALSE;
+}
+
+// }}}
+
 static void
 python_timer_callback(id_type timer_id, void *data) {
     PyObject *callback = (PyObject*)data;
@@ -1281,14 +1865,19 @@ process_global_state(void *data) {
     maximum_wait = -1;
     bool state_check_timer_enabled = false;
     bool input_read = false;
+    TRACE_BEGIN("main_loop_tick");
 
     monotonic_t now = monotonic();
     if (global_state.has_pending_resizes) {
         process_pending_resizes(now);
         input_read = true;
     }
+    TRACE_BEGIN("parse_input");
     if (parse_input(self)) input_read = true;
+    TRACE_END("parse_input");
+    TRACE_BEGIN("render");
     render(now, input_read);
+    TRACE_END("render");
 #ifdef __APPLE__
     if (has_cocoa_pending_actions) {
         process_cocoa_pending_actions();
@@ -1296,6 +1885,7 @@ process_global_state(void *data) {
     }
 #endif
     report_reaped_pids();
+    report_rejected_pastes();
     bool should_quit = false;
     if (global_state.has_pending_closes) should_quit = process_pending_closes(self);
     if (should_quit) {
@@ -1307,6 +1897,7 @@ process_global_state(void *data) {
         }
     }
     update_main_loop_timer(state_check_timer, MAX(0, maximum_wait), state_check_timer_enabled);
+    TRACE_END("main_loop_tick");
 }
 
 static PyObject*
@@ -1325,6 +1916,52 @@ main_loop(ChildMonitor *self, PyObject *a UNUSED) {
 
 // I/O thread functions {{{
 
+// The events the I/O thread waits for on a child are changed only when the
+// state of the child changes: when its parser buffer fills up or is drained
+// or its write buffer becomes empty or non-empty. This keeps the cost of a
+// wakeup independent of the number of children. On Linux, epoll is used so
+// that waiting does not cost O(number of children) either.
+
+#ifdef USE_EPOLL
+static void
+epoll_update_child(size_t i, int op) {
+    const struct pollfd *pfd = children_fds + EXTRA_FDS + i;
+    struct epoll_event ev = {
+        .events = (pfd->events & POLLIN ? EPOLLIN : 0) | (pfd->events & POLLOUT ? EPOLLOUT : 0), .data.u64 = EXTRA_FDS + i};
+    if (epoll_ctl(epoll_fd, op, pfd->fd, &ev) != 0) perror("Failed to change the events waited for on a child fd");
+}
+#endif
+
+static short
+child_events(Screen *screen) {
+    short ans = vt_parser_has_space_for_input(screen->vt_parser) ? POLLIN : 0;
+    screen_mutex(lock, write);
+    if (screen->write_buf_used) ans |= POLLOUT;
+    screen_mutex(unlock, write);
+    return ans;
+}
+
+static void
+set_child_events(size_t i, short events) {
+    if (children_fds[EXTRA_FDS + i].events == events) return;
+    children_fds[EXTRA_FDS + i].events = events;
+#ifdef USE_EPOLL
+    epoll_update_child(i, EPOLL_CTL_MOD);
+#endif
+}
+
+static void
+update_child_events(ChildMonitor *self) {
+    if (!children_need_io_update) return;
+    children_need_io_update = false;
+    for (size_t i = 0; i < self->count; i++) {
+        if (children[i].needs_io_update) {
+            children[i].needs_io_update = false;
+            set_child_events(i, child_events(children[i].screen));
+        }
+    }
+}
+
 static void
 add_children(ChildMonitor *self) {
     for (; add_queue_count > 0 && self->count < MAX_CHILDREN;) {
@@ -1332,7 +1969,10 @@ add_children(ChildMonitor *self) {
         children[self->count] = add_queue[add_queue_count];
         add_queue[add_queue_count] = EMPTY_CHILD;
         children_fds[EXTRA_FDS + self->count].fd = children[self->count].fd;
-        children_fds[EXTRA_FDS + self->count].events = POLLIN;
+        children_fds[EXTRA_FDS + self->count].events = child_events(children[self->count].screen);
+#ifdef USE_EPOLL
+        epoll_update_child(self->count, EPOLL_CTL_ADD);
+#endif
         self->count++;
     }
 }
@@ -1360,10 +2000,14 @@ cleanup_child(ssize_t i) {
 static void
 remove_children(ChildMonitor *self) {
     if (self->count > 0) {
-        size_t count = 0;
+        size_t count = 0, first_moved = self->count;
         for (ssize_t i = self->count - 1; i >= 0; i--) {
             if (children[i].needs_removal) {
                 count++;
+                first_moved = i;
+#ifdef USE_EPOLL
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, children[i].fd, NULL);
+#endif
                 cleanup_child(i);
                 remove_queue[remove_queue_count] = children[i];
                 remove_queue_count++;
@@ -1377,6 +2021,14 @@ remove_children(ChildMonitor *self) {
             }
         }
         self->count -= count;
+        // let any paste threads for the removed children finish
+        if (count) pthread_cond_broadcast(&paste_space_available);
+#ifdef USE_EPOLL
+        // events are reported with the position of the child in the children array
+        for (size_t i = first_moved; i < self->count; i++) epoll_update_child(i, EPOLL_CTL_MOD);
+#else
+        (void)first_moved;
+#endif
     }
 }
 
@@ -1400,6 +2052,13 @@ read_bytes(int fd, Screen *screen) {
         break;
     }
     vt_parser_commit_write(screen->vt_parser, len);
+    if (len > 0 && screen->latency.in_flight.written) {
+        screen->latency.in_flight.echoed = monotonic();
+        screen_mutex(lock, write);
+        screen->latency.echoed = screen->latency.in_flight;
+        screen_mutex(unlock, write);
+        zero_at_ptr(&screen->latency.in_flight);
+    }
     return len != 0;
 }
 
@@ -1488,20 +2147,59 @@ print_text(const unsigned char *text, ssize_t sz) {
 
 
 static void
+consume_write_queue(Screen *screen, size_t amt) {
+    // Must be called with the screen write lock held
+    screen->write_buf_used -= MIN(amt, screen->write_buf_used);
+    while (screen->write_queue.head) {
+        WriteChunk *c = screen->write_queue.head;
+        const size_t n = MIN(amt, c->end - c->start);
+        c->start += n; amt -= n;
+        if (c->start < c->end) break;
+        if (c == screen->write_queue.tail) {
+            // the last chunk is re-used for subsequent writes, unless it is a large one
+            if (c->capacity > BUFSIZ) { free(c); screen->write_queue.head = NULL; screen->write_queue.tail = NULL; }
+            else { c->start = 0; c->end = 0; }
+            break;
+        }
+        screen->write_queue.head = c->next;
+        free(c);
+    }
+}
+
+static bool
 write_to_child(int fd, Screen *screen) {
-    size_t written = 0;
-    ssize_t ret = 0;
+    // Returns true if there is data left to write. The data is written
+    // without holding the lock, since only this thread removes data from the
+    // queue and other threads only append to it.
+    struct iovec iov[16];
+    int num = 0;
+    size_t total = 0, written = 0;
     screen_mutex(lock, write);
-    while (written < screen->write_buf_used) {
-        ret = write(fd, screen->write_buf + written, screen->write_buf_used - written);
+    for (WriteChunk *c = screen->write_queue.head; c && num < (int)arraysz(iov); c = c->next) {
+        if (c->end > c->start) {
+            iov[num++] = (struct iovec){.iov_base = c->data + c->start, .iov_len = c->end - c->start};
+            total += c->end - c->start;
+        }
+    }
+    // the key being timed is written once everything queued before it is
+    const monotonic_t key_queued_at = total && total == screen->write_buf_used ? screen->latency.queued_at : 0;
+    screen_mutex(unlock, write);
+    struct iovec *pending = iov;
+    while (written < total) {
+        ssize_t ret = writev(fd, pending, num);
 #ifdef KITTY_PRINT_BYTES_SENT_TO_CHILD
         fprintf(stderr, "Wrote: %zd bytes: ", ret);
 #endif
         if (ret > 0) {
+            written += ret;
+            for (size_t left = ret; left; ) {
+                const size_t n = MIN(left, pending->iov_len);
 #ifdef KITTY_PRINT_BYTES_SENT_TO_CHILD
-            print_text(screen->write_buf + written, ret);
+                print_text(pending->iov_base, n);
 #endif
-            written += ret;
+                pending->iov_base = (uint8_t*)pending->iov_base + n; pending->iov_len -= n; left -= n;
+                if (!pending->iov_len) { pending++; num--; }
+            }
         }
         else if (ret == 0) {
             // could mean anything, ignore
@@ -1510,29 +2208,86 @@ write_to_child(int fd, Screen *screen) {
             if (errno == EINTR) continue;
             if (errno == EWOULDBLOCK || errno == EAGAIN) break;
             perror("Call to write() to child fd failed, discarding data.");
-            written = screen->write_buf_used;
+            written = total;
         }
 #ifdef KITTY_PRINT_BYTES_SENT_TO_CHILD
         fprintf(stderr, "\n");
 #endif
     }
-    if (written) {
-        screen->write_buf_used -= written;
-        if (screen->write_buf_used) {
-            memmove(screen->write_buf, screen->write_buf + written, screen->write_buf_used);
-        }
+    const monotonic_t written_at = key_queued_at && written == total ? monotonic() : 0;
+    screen_mutex(lock, write);
+    if (written) consume_write_queue(screen, written);
+    if (written_at && screen->latency.queued_at == key_queued_at) {
+        screen->latency.queued_at = 0;
+        screen->latency.in_flight = (LatencySample){.key=key_queued_at, .written=written_at};
     }
+    const bool has_more = screen->write_buf_used > 0;
+    const bool paste_can_continue = screen->streaming_paste && screen->write_buf_used < PASTE_MAX_QUEUED;
     screen_mutex(unlock, write);
+    if (paste_can_continue) {
+        children_mutex(lock);
+        pthread_cond_broadcast(&paste_space_available);
+        children_mutex(unlock);
+    }
+    return has_more;
+}
+
+static PyObject*
+test_timed_key(PyObject *self UNUSED, PyObject *args) {
+    // Sends a key timed for input latency to the child on fd and waits for
+    // its response, doing the work of the main and I/O threads in turn
+    Screen *screen; int fd; const char *key; Py_ssize_t key_sz; double timeout;
+    if (!PyArg_ParseTuple(args, "O!iy#d", &Screen_Type, &screen, &fd, &key, &key_sz, &timeout)) return NULL;
+    const monotonic_t received_at = monotonic();
+    if (!latency_key_sent_to_child(screen, received_at)) Py_RETURN_FALSE;
+    screen_mutex(lock, write);
+    append_to_write_chunks(&screen->write_queue.head, &screen->write_queue.tail, key, key_sz);
+    screen->write_buf_used += key_sz;
+    queued_timed_key(screen, received_at);
+    screen_mutex(unlock, write);
+    while (write_to_child(fd, screen));
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, (int)(timeout * 1000)) != 1 || !read_bytes(fd, screen)) Py_RETURN_FALSE;
+    latency_response_parsed(screen);
+    if (!screen->latency.parsed.key) Py_RETURN_FALSE;
+    latency_response_presented(screen, monotonic());
+    Py_RETURN_TRUE;
+}
+
+static size_t
+wait_for_io(ChildMonitor *self, int timeout_ms, size_t *ready) {
+    // Fills ready with the indices into children_fds of the fds that have
+    // events, which are stored in their revents
+    size_t num_ready = 0;
+#ifdef USE_EPOLL
+    (void)self;
+    struct epoll_event events[64];
+    int ret = epoll_wait(epoll_fd, events, arraysz(events), timeout_ms);
+    for (int i = 0; i < ret; i++) {
+        const uint32_t e = events[i].events;
+        const size_t idx = events[i].data.u64;
+        children_fds[idx].revents = (e & EPOLLIN ? POLLIN : 0) | (e & EPOLLOUT ? POLLOUT : 0) | (e & EPOLLHUP ? POLLHUP : 0) | (e & EPOLLERR ? POLLERR : 0);
+        ready[num_ready++] = idx;
+    }
+    if (ret < 0 && errno != EAGAIN && errno != EINTR) perror("Call to epoll_wait() failed");
+#else
+    for (size_t i = 0; i < self->count + EXTRA_FDS; i++) children_fds[i].revents = 0;
+    int ret = poll(children_fds, self->count + EXTRA_FDS, timeout_ms);
+    for (size_t i = 0; ret > 0 && i < self->count + EXTRA_FDS; i++) {
+        if (children_fds[i].revents) ready[num_ready++] = i;
+    }
+    if (ret < 0 && errno != EAGAIN && errno != EINTR) perror("Call to poll() failed");
+#endif
+    return num_ready;
 }
 
 static void*
 io_loop(void *data) {
     // The I/O thread loop
-    size_t i;
-    int ret;
+    size_t i, num_ready;
+    static size_t ready[MAX_CHILDREN + EXTRA_FDS];
     bool has_more, data_received, has_pending_wakeups = false;
     monotonic_t last_main_loop_wakeup_at = -1, now = -1;
-    Screen *screen;
     ChildMonitor *self = (ChildMonitor*)data;
     set_thread_name("KittyChildMon");
 
@@ -1540,26 +2295,18 @@ io_loop(void *data) {
         children_mutex(lock);
         remove_children(self);
         add_children(self);
+        update_child_events(self);
         children_mutex(unlock);
         data_received = false;
-        for (i = 0; i < self->count + EXTRA_FDS; i++) children_fds[i].revents = 0;
-        for (i = 0; i < self->count; i++) {
-            screen = children[i].screen;
-            /* printf("i:%lu id:%lu fd: %d read_buf_sz: %lu write_buf_used: %lu\n", i, children[i].id, children[i].fd, screen->read_buf_sz, screen->write_buf_used); */
-            children_fds[EXTRA_FDS + i].events = vt_parser_has_space_for_input(screen->vt_parser) ? POLLIN : 0;
-            screen_mutex(lock, write);
-            children_fds[EXTRA_FDS + i].events |= (screen->write_buf_used ? POLLOUT  : 0);
-            screen_mutex(unlock, write);
-        }
         if (has_pending_wakeups) {
             now = monotonic();
             monotonic_t time_delta = OPT(input_delay) - (now - last_main_loop_wakeup_at);
-            if (time_delta >= 0) ret = poll(children_fds, self->count + EXTRA_FDS, monotonic_t_to_ms(time_delta));
-            else ret = 0;
+            if (time_delta >= 0) num_ready = wait_for_io(self, monotonic_t_to_ms(time_delta), ready);
+            else num_ready = 0;
         } else {
-            ret = poll(children_fds, self->count + EXTRA_FDS, -1);
+            num_ready = wait_for_io(self, -1, ready);
         }
-        if (ret > 0) {
+        if (num_ready) {
             if (children_fds[0].revents && POLLIN) drain_fd(children_fds[0].fd); // wakeup
             if (children_fds[1].revents && POLLIN) {
                 SignalSet ss = {0};
@@ -1573,19 +2320,28 @@ io_loop(void *data) {
                 }
                 if (ss.child_died) reap_children(self, OPT(close_on_child_death));
             }
-            for (i = 0; i < self->count; i++) {
+            for (size_t r = 0; r < num_ready; r++) {
+                if (ready[r] < EXTRA_FDS) continue;
+                i = ready[r] - EXTRA_FDS;
                 if (children_fds[EXTRA_FDS + i].revents & (POLLIN | POLLHUP)) {
                     data_received = true;
+                    TRACE_BEGIN_FOR_WINDOW("read", children[i].screen->window_id);
                     has_more = read_bytes(children_fds[EXTRA_FDS + i].fd, children[i].screen);
+                    TRACE_END_FOR_WINDOW("read", children[i].screen->window_id);
                     if (!has_more) {
                         // child is dead
                         children_mutex(lock);
                         children[i].needs_removal = true;
                         children_mutex(unlock);
+                    } else if (!vt_parser_has_space_for_input(children[i].screen->vt_parser)) {
+                        // waiting for input resumes when the parser drains its buffer, see do_parse()
+                        set_child_events(i, children_fds[EXTRA_FDS + i].events & ~POLLIN);
                     }
                 }
                 if (children_fds[EXTRA_FDS + i].revents & POLLOUT) {
-                    write_to_child(children[i].fd, children[i].screen);
+                    TRACE_BEGIN_FOR_WINDOW("write", children[i].screen->window_id);
+                    if (!write_to_child(children[i].fd, children[i].screen)) set_child_events(i, children_fds[EXTRA_FDS + i].events & ~POLLOUT);
+                    TRACE_END_FOR_WINDOW("write", children[i].screen->window_id);
                 }
                 if (children_fds[EXTRA_FDS + i].revents & POLLNVAL) {
                     // fd was closed
@@ -1596,18 +2352,16 @@ io_loop(void *data) {
                 }
             }
 #ifdef DEBUG_POLL_EVENTS
-            for (i = 0; i < self->count + EXTRA_FDS; i++) {
+            for (size_t r = 0; r < num_ready; r++) {
+                i = ready[r];
 #define P(w) if (children_fds[i].revents & w) printf("i:%lu %s\n", i, #w);
                 P(POLLIN); P(POLLPRI); P(POLLOUT); P(POLLERR); P(POLLHUP); P(POLLNVAL);
 #undef P
             }
 #endif
-        } else if (ret < 0) {
-            if (errno != EAGAIN && errno != EINTR) {
-                perror("Call to poll() failed");
-            }
+            for (size_t r = 0; r < num_ready; r++) children_fds[ready[r]].revents = 0;
         }
-#define WAKEUP { wakeup_main_loop(); last_main_loop_wakeup_at = now; has_pending_wakeups = false; }
+#define WAKEUP { TRACE_INSTANT("wakeup_main_loop"); wakeup_main_loop(); last_main_loop_wakeup_at = now; has_pending_wakeups = false; }
         // we only wakeup the main loop after input_delay as wakeup is an expensive operation
         // on some platforms, such as cocoa
         if (data_received) {
@@ -1635,7 +2389,10 @@ typedef struct {
     int fd;
     struct {
         char *data;
-        size_t capacity, used, command_end;
+        // start is the offset of the first byte not yet dispatched and
+        // scanned the offset, relative to start, up to which the data has
+        // been searched for the end of a command, so each byte is examined once
+        size_t capacity, used, start, scanned, command_end;
         bool finished;
     } read;
     struct {
@@ -1643,7 +2400,8 @@ typedef struct {
         size_t capacity, used;
         bool failed;
     } write;
-    bool is_remote_control_peer;
+    // from_listen_socket is set for peers that connected to listen_on, as opposed to ones injected with a file descriptor
+    bool is_remote_control_peer, from_listen_socket;
 } Peer;
 static id_type peer_id_counter = 0;
 
@@ -1659,7 +2417,7 @@ typedef struct pollfd PollFD;
 #define nuke_socket(s) { shutdown(s, SHUT_RDWR); safe_close(s, __FILE__, __LINE__); }
 
 static id_type
-add_peer(int peer, bool is_remote_control_peer) {
+add_peer(int peer, bool is_remote_control_peer, bool from_listen_socket) {
     id_type ans = 0;
     if (talk_data.num_peers < PEER_LIMIT) {
         ensure_space_for(&talk_data, peers, Peer, talk_data.num_peers + 8, peers_capacity, 8, false);
@@ -1669,6 +2427,7 @@ add_peer(int peer, bool is_remote_control_peer) {
         if (!p->id) p->id = ++peer_id_counter;
         ans = p->id;
         p->is_remote_control_peer = is_remote_control_peer;
+        p->from_listen_socket = from_listen_socket;
     } else {
         log_error("Too many peers want to talk, ignoring one.");
         nuke_socket(peer);
@@ -1713,7 +2472,7 @@ accept_peer(int listen_fd, bool shutting_down, bool is_remote_control_peer) {
             return true;
         }
     }
-    add_peer(peer, is_remote_control_peer);
+    add_peer(peer, is_remote_control_peer, is_remote_control_peer);
     return true;
 }
 
@@ -1726,17 +2485,21 @@ free_peer(Peer *peer) {
 
 #define KITTY_CMD_PREFIX "\x1bP@kitty-cmd{"
 
+// Messages from peers larger than this are rejected, bulk data is sent as a
+// stream of smaller commands, see StreamInFlight in rc/base.py
+#define PEER_MAX_MESSAGE_SIZE (16u * 1024u * 1024u)
+
 static void
-queue_peer_message(ChildMonitor *self, Peer *peer) {
+queue_peer_message(ChildMonitor *self, Peer *peer, const char *data, size_t sz) {
     talk_mutex(lock);
     ensure_space_for(self, messages, Message, self->messages_count + 16, messages_capacity, 16, true);
     Message *m = self->messages + self->messages_count++;
     memset(m, 0, sizeof(Message));
-    if (peer->read.used) {
-        m->data = malloc(peer->read.used);
+    if (sz) {
+        m->data = malloc(sz);
         if (m->data) {
-            memcpy(m->data, peer->read.data, peer->read.used);
-            m->sz = peer->read.used;
+            memcpy(m->data, data, sz);
+            m->sz = sz;
         }
     }
     m->peer_id = peer->id;
@@ -1757,32 +2520,367 @@ notify_on_peer_removal(ChildMonitor *self, const Peer *p) {
     m->is_remote_control_peer = p->id;
 }
 
+// Native remote control commands {{{
+// Remote control commands that need no state from the main thread are
+// executed directly in the talk thread, without a round trip through the
+// main loop and the interpreter. Currently this is send-text to a single
+// window, identified by id, which scripts tend to issue in bulk. Anything
+// that does not exactly match what rc/send_text.py would do without further
+// checks is left to the main thread.
+
+// Enabled by Boss when remote control over sockets needs no authorization
+static struct { bool enabled; unsigned long version[2]; } native_rc = {0};
+
+typedef struct { const char *p, *end; char *buf; size_t buf_used; } JSONReader;
+
+static void
+json_skip_whitespace(JSONReader *r) {
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')) r->p++;
+}
+
+static bool
+json_expect(JSONReader *r, char ch) {
+    json_skip_whitespace(r);
+    if (r->p < r->end && *r->p == ch) { r->p++; return true; }
+    return false;
+}
+
+static bool
+json_literal(JSONReader *r, const char *literal) {
+    json_skip_whitespace(r);
+    const size_t n = strlen(literal);
+    if ((size_t)(r->end - r->p) < n || memcmp(r->p, literal, n) != 0) return false;
+    r->p += n;
+    return true;
+}
+
+static bool
+json_bool(JSONReader *r, bool *ans) {
+    if (json_literal(r, "true")) { *ans = true; return true; }
+    if (json_literal(r, "false")) { *ans = false; return true; }
+    return false;
+}
+
+static bool
+json_uint(JSONReader *r, unsigned long *ans) {
+    // Only small non-negative integers are accepted
+    json_skip_whitespace(r);
+    const char *start = r->p;
+    unsigned long val = 0;
+    while (r->p < r->end && '0' <= *r->p && *r->p <= '9' && r->p - start < 9) val = val * 10 + (*r->p++ - '0');
+    if (r->p == start || (r->p - start > 1 && *start == '0')) return false;
+    if (r->p < r->end && ((*r->p >= '0' && *r->p <= '9') || *r->p == '.' || *r->p == 'e' || *r->p == 'E')) return false;
+    *ans = val;
+    return true;
+}
+
+static bool
+json_key(JSONReader *r, const char **key, size_t *key_sz) {
+    // Keys with escapes are not accepted
+    if (!json_expect(r, '"')) return false;
+    *key = r->p;
+    while (r->p < r->end && *r->p != '"') {
+        if (*r->p == '\\' || (unsigned char)*r->p < 0x20) return false;
+        r->p++;
+    }
+    if (r->p >= r->end) return false;
+    *key_sz = r->p++ - *key;
+    return json_expect(r, ':');
+}
+
+static bool
+json_hex4(JSONReader *r, uint32_t *ans) {
+    if (r->end - r->p < 4) return false;
+    *ans = 0;
+    for (int i = 0; i < 4; i++) {
+        const char ch = *r->p++;
+        uint32_t d;
+        if ('0' <= ch && ch <= '9') d = ch - '0';
+        else if ('a' <= ch && ch <= 'f') d = ch - 'a' + 10;
+        else if ('A' <= ch && ch <= 'F') d = ch - 'A' + 10;
+        else return false;
+        *ans = (*ans << 4) | d;
+    }
+    return true;
+}
+
+static bool
+json_string(JSONReader *r, const char **ans, size_t *ans_sz) {
+    // Decodes the string into r->buf, which is as large as the input, since
+    // decoding never makes a string larger. Only ASCII is accepted unescaped,
+    // to avoid having to validate UTF-8.
+    if (!json_expect(r, '"')) return false;
+    char *dest = r->buf + r->buf_used;
+    size_t n = 0;
+    while (r->p < r->end) {
+        const unsigned char ch = *r->p++;
+        if (ch == '"') { *ans = dest; *ans_sz = n; r->buf_used += n; return true; }
+        if (ch < 0x20 || ch > 0x7f) return false;
+        if (ch != '\\') { dest[n++] = ch; continue; }
+        if (r->p >= r->end) return false;
+        switch (*r->p++) {
+            case '"': dest[n++] = '"'; break;
+            case '\\': dest[n++] = '\\'; break;
+            case '/': dest[n++] = '/'; break;
+            case 'b': dest[n++] = '\b'; break;
+            case 'f': dest[n++] = '\f'; break;
+            case 'n': dest[n++] = '\n'; break;
+            case 'r': dest[n++] = '\r'; break;
+            case 't': dest[n++] = '\t'; break;
+            case 'u': {
+                uint32_t cp, low;
+                if (!json_hex4(r, &cp)) return false;
+                if (0xdc00 <= cp && cp <= 0xdfff) return false;
+                if (0xd800 <= cp && cp <= 0xdbff) {
+                    // lone surrogates cannot be encoded as UTF-8
+                    if (r->end - r->p < 2 || r->p[0] != '\\' || r->p[1] != 'u') return false;
+                    r->p += 2;
+                    if (!json_hex4(r, &low) || low < 0xdc00 || low > 0xdfff) return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                n += encode_utf8(cp, dest + n);
+            } break;
+            default: return false;
+        }
+    }
+    return false;
+}
+
+static bool
+json_optional_string(JSONReader *r, const char **ans, size_t *ans_sz) {
+    if (json_literal(r, "null")) { *ans = ""; *ans_sz = 0; return true; }
+    return json_string(r, ans, ans_sz);
+}
+
+#define key_is(name) (key_sz == sizeof(name) - 1 && memcmp(key, name, key_sz) == 0)
+#define str_is(s, s_sz, val) (s_sz == sizeof(val) - 1 && memcmp(s, val, s_sz) == 0)
+
+typedef struct {
+    unsigned long window_id;
+    bool no_response;
+    // The value of the data field, pointing into the buffer used for parsing
+    const char *data;
+    size_t data_sz;
+} NativeSendText;
+
+static bool
+parse_send_text_payload(JSONReader *r, NativeSendText *ans) {
+    const char *key, *s; size_t key_sz, s_sz;
+    bool flag, has_data = false;
+    if (!json_expect(r, '{')) return false;
+    if (json_expect(r, '}')) return false;
+    do {
+        if (!json_key(r, &key, &key_sz)) return false;
+        if (key_is("data")) {
+            if (!json_string(r, &ans->data, &ans->data_sz)) return false;
+            has_data = true;
+        } else if (key_is("match")) {
+            if (!json_optional_string(r, &s, &s_sz)) return false;
+            if (s_sz) {
+                // only id:N, other match expressions need the window list
+                if (s_sz < 4 || memcmp(s, "id:", 3) != 0) return false;
+                JSONReader num = {.p = s + 3, .end = s + s_sz};
+                unsigned long id;
+                if (!json_uint(&num, &id) || num.p != num.end || !id) return false;
+                ans->window_id = id;
+            }
+        } else if (key_is("match_tab") || key_is("session_id")) {
+            if (!json_optional_string(r, &s, &s_sz) || s_sz) return false;
+        } else if (key_is("bracketed_paste")) {
+            if (!json_optional_string(r, &s, &s_sz) || (s_sz && !str_is(s, s_sz, "disable"))) return false;
+        } else if (key_is("all") || key_is("exclude_active")) {
+            if (!json_bool(r, &flag) || flag) return false;
+        } else return false;
+    } while (json_expect(r, ','));
+    return json_expect(r, '}') && has_data;
+}
+
+static bool
+parse_native_send_text(const char *json, size_t sz, const unsigned long version[2], char *buf, NativeSendText *ans) {
+    // buf must be at least sz bytes. version is the version of this kitty.
+    // Returns false unless json is a send-text command that can be executed natively.
+    JSONReader r = {.p = json, .end = json + sz, .buf = buf};
+    const char *key, *s; size_t key_sz, s_sz;
+    unsigned long kitty_window_id = 0, match_window_id = 0, num;
+    bool is_send_text = false, has_version = false, has_payload = false;
+    memset(ans, 0, sizeof(NativeSendText));
+    if (!json_expect(&r, '{')) return false;
+    if (json_expect(&r, '}')) return false;
+    do {
+        if (!json_key(&r, &key, &key_sz)) return false;
+        if (key_is("cmd")) {
+            if (!json_string(&r, &s, &s_sz)) return false;
+            is_send_text = str_is(s, s_sz, "send-text");
+        } else if (key_is("version")) {
+            unsigned long v[2] = {0};
+            size_t count = 0;
+            if (!json_expect(&r, '[')) return false;
+            do {
+                if (!json_uint(&r, &num)) return false;
+                if (count < 2) v[count] = num;
+                count++;
+            } while (json_expect(&r, ','));
+            if (!json_expect(&r, ']') || count < 2) return false;
+            // clients newer than us get an error from the main thread
+            if (v[0] > version[0] || (v[0] == version[0] && v[1] > version[1])) return false;
+            has_version = true;
+        } else if (key_is("no_response")) {
+            if (!json_bool(&r, &ans->no_response)) return false;
+        } else if (key_is("kitty_window_id")) {
+            if (!json_uint(&r, &kitty_window_id)) return false;
+        } else if (key_is("password")) {
+            // commands from sockets are allowed without authorization
+            if (!json_string(&r, &s, &s_sz)) return false;
+        } else if (key_is("payload")) {
+            if (!parse_send_text_payload(&r, ans)) return false;
+            match_window_id = ans->window_id;
+            has_payload = true;
+        } else return false;  // streams, async requests, encrypted commands, etc.
+    } while (json_expect(&r, ','));
+    if (!json_expect(&r, '}')) return false;
+    json_skip_whitespace(&r);
+    if (r.p != r.end || !is_send_text || !has_version || !has_payload) return false;
+    // without a match the text goes to the window the command was run in, if known, otherwise the active window
+    ans->window_id = match_window_id ? match_window_id : kitty_window_id;
+    if (!ans->window_id) return false;
+    return str_is(ans->data, MIN(ans->data_sz, 5u), "text:") || str_is(ans->data, MIN(ans->data_sz, 7u), "base64:");
+}
+#undef key_is
+#undef str_is
+
+static bool
+decode_strict_base64(const char *src, size_t src_sz, uint8_t **dest, size_t *dest_sz) {
+    // Invalid data is left to the main thread, as Python's decoder ignores
+    // some kinds of invalidity and not others
+    if (src_sz % 4) return false;
+    size_t padding = 0;
+    for (size_t i = 0; i < src_sz; i++) {
+        const char ch = src[i];
+        if (ch == '=') { if (i + 2 < src_sz) return false; padding++; continue; }
+        if (padding) return false;
+        if (!(('A' <= ch && ch <= 'Z') || ('a' <= ch && ch <= 'z') || ('0' <= ch && ch <= '9') || ch == '+' || ch == '/')) return false;
+    }
+    *dest_sz = required_buffer_size_for_base64_decode(src_sz);
+    if (!(*dest = malloc(*dest_sz))) return false;
+    if (!base64_decode8((const uint8_t*)src, src_sz, *dest, dest_sz)) { free(*dest); *dest = NULL; return false; }
+    return true;
+}
+
+static void
+append_to_peer_write_buffer(Peer *peer, const char *msg, size_t msg_sz) {
+    // Must be called with talk_lock held
+    if (peer->write.failed || !msg_sz) return;
+    if (peer->write.capacity - peer->write.used < msg_sz) {
+        void *data = realloc(peer->write.data, peer->write.capacity + msg_sz);
+        if (data) {
+            peer->write.data = data;
+            peer->write.capacity += msg_sz;
+        } else fatal("Out of memory");
+    }
+    memcpy(peer->write.data + peer->write.used, msg, msg_sz);
+    peer->write.used += msg_sz;
+}
+
+static bool
+execute_native_rc_command(Peer *peer, const char *cmd, size_t sz) {
+    // cmd is a complete command escape code. Returns false if the command
+    // must be handled by the main thread.
+    if (!peer->from_listen_socket) return false;
+    talk_mutex(lock);
+    // commands from a peer must be executed in order
+    const bool allowed = native_rc.enabled && !peer->num_of_unresponded_messages_sent_to_main_thread;
+    const unsigned long version[2] = {native_rc.version[0], native_rc.version[1]};
+    talk_mutex(unlock);
+    if (!allowed || sz < sizeof(KITTY_CMD_PREFIX) + 2 || cmd[sz-2] != 0x1b || cmd[sz-1] != '\\') return false;
+    const char *json = cmd + sizeof(KITTY_CMD_PREFIX) - 2;
+    const size_t json_sz = sz - (sizeof(KITTY_CMD_PREFIX) - 2) - 2;
+    RAII_ALLOC(char, buf, malloc(json_sz));
+    if (!buf) return false;
+    NativeSendText st;
+    if (!parse_native_send_text(json, json_sz, version, buf, &st)) return false;
+    // empty data is left to the main thread, as it reports non-existent windows in that case
+    bool ok;
+    if (st.data[0] == 't') {
+        ok = st.data_sz > 5 && schedule_write_to_child(st.window_id, 1, st.data + 5, st.data_sz - 5);
+    } else {
+        RAII_ALLOC(uint8_t, data, NULL);
+        size_t data_sz;
+        if (!decode_strict_base64(st.data + 7, st.data_sz - 7, &data, &data_sz)) return false;
+        ok = data_sz && schedule_write_to_child(st.window_id, 1, (const char*)data, data_sz);
+    }
+    // if there is no child with that id the main thread produces the same result as it normally would
+    if (!ok) return false;
+    if (!st.no_response) {
+        static const char response[] = "\x1bP@kitty-cmd{\"ok\": true}\x1b\\";
+        talk_mutex(lock);
+        append_to_peer_write_buffer(peer, response, sizeof(response) - 1);
+        talk_mutex(unlock);
+    }
+    return true;
+}
+
+static PyObject*
+test_native_rc_command(PyObject *self UNUSED, PyObject *args) {
+    const char *json; Py_ssize_t sz;
+    unsigned long major, minor;
+    if (!PyArg_ParseTuple(args, "y#kk", &json, &sz, &major, &minor)) return NULL;
+    const unsigned long version[2] = {major, minor};
+    RAII_ALLOC(char, buf, malloc(MAX(1, sz)));
+    if (!buf) return PyErr_NoMemory();
+    NativeSendText st;
+    if (!parse_native_send_text(json, sz, version, buf, &st)) Py_RETURN_NONE;
+    if (st.data[0] == 't') return Py_BuildValue("ky#O", st.window_id, st.data + 5, (Py_ssize_t)(st.data_sz - 5), st.no_response ? Py_True : Py_False);
+    RAII_ALLOC(uint8_t, data, NULL);
+    size_t data_sz;
+    if (!decode_strict_base64(st.data + 7, st.data_sz - 7, &data, &data_sz)) Py_RETURN_NONE;
+    return Py_BuildValue("ky#O", st.window_id, data, (Py_ssize_t)data_sz, st.no_response ? Py_True : Py_False);
+}
+
+static PyObject*
+allow_native_rc_commands(ChildMonitor *self UNUSED, PyObject *args) {
+#define allow_native_rc_commands_doc "allow_native_rc_commands(major, minor) -> Execute simple remote control commands from sockets in the talk thread. The version is that of this kitty."
+    unsigned long major, minor;
+    if (!PyArg_ParseTuple(args, "kk", &major, &minor)) return NULL;
+    talk_mutex(lock);
+    native_rc.version[0] = major; native_rc.version[1] = minor;
+    native_rc.enabled = true;
+    talk_mutex(unlock);
+    Py_RETURN_NONE;
+}
+// }}}
+
 static bool
 has_complete_peer_command(Peer *peer) {
     peer->read.command_end = 0;
-    if (peer->read.used > sizeof(KITTY_CMD_PREFIX) && memcmp(peer->read.data, KITTY_CMD_PREFIX, sizeof(KITTY_CMD_PREFIX)-1) == 0) {
-        for (size_t i = sizeof(KITTY_CMD_PREFIX)-1; i < peer->read.used - 1; i++) {
-            if (peer->read.data[i] == 0x1b && peer->read.data[i+1] == '\\') {
-                peer->read.command_end = i + 2;
-                break;
+    const char *cmd = peer->read.data + peer->read.start;
+    const size_t sz = peer->read.used - peer->read.start;
+    if (sz > sizeof(KITTY_CMD_PREFIX) && memcmp(cmd, KITTY_CMD_PREFIX, sizeof(KITTY_CMD_PREFIX)-1) == 0) {
+        size_t i = MAX(peer->read.scanned, sizeof(KITTY_CMD_PREFIX)-1);
+        for (const char *p; i < sz - 1 && (p = memchr(cmd + i, 0x1b, sz - 1 - i)); ) {
+            i = p - cmd;
+            if (cmd[i+1] == '\\') {
+                peer->read.command_end = peer->read.start + i + 2;
+                return true;
             }
+            i++;
         }
+        // the last byte is examined again once more data arrives, as it could be the start of the terminator
+        peer->read.scanned = sz - 1;
     }
-    return peer->read.command_end ? true : false;
+    return false;
 }
 
 
 static void
 dispatch_peer_command(ChildMonitor *self, Peer *peer) {
     if (peer->read.command_end) {
-        size_t used = peer->read.used;
-        peer->read.used = peer->read.command_end;
-        queue_peer_message(self, peer);
-        peer->read.used = used;
-        if (peer->read.used > peer->read.command_end) {
-            peer->read.used -= peer->read.command_end;
-            memmove(peer->read.data, peer->read.data + peer->read.command_end, peer->read.used);
-        } else peer->read.used = 0;
+        const char *cmd = peer->read.data + peer->read.start;
+        const size_t sz = peer->read.command_end - peer->read.start;
+        if (!execute_native_rc_command(peer, cmd, sz)) queue_peer_message(self, peer, cmd, sz);
+        // the buffer is compacted only when it is full, see read_from_peer()
+        if (peer->read.used > peer->read.command_end) peer->read.start = peer->read.command_end;
+        else peer->read.start = peer->read.used = 0;
+        peer->read.scanned = 0;
         peer->read.command_end = 0;
     }
 }
@@ -1791,19 +2889,26 @@ static void
 read_from_peer(ChildMonitor *self, Peer *peer) {
 #define failed(msg) { log_error("Reading from peer failed: %s", msg); shutdown(peer->fd, SHUT_RD); peer->read.finished = true; return; }
     if (peer->read.used >= peer->read.capacity) {
-        if (peer->read.capacity >= 64 * 1024) failed("Ignoring too large message from peer");
-        peer->read.capacity = MAX(8192u, peer->read.capacity * 2);
-        peer->read.data = realloc(peer->read.data, peer->read.capacity);
-        if (!peer->read.data) failed("Out of memory");
+        if (peer->read.start) {
+            peer->read.used -= peer->read.start;
+            memmove(peer->read.data, peer->read.data + peer->read.start, peer->read.used);
+            peer->read.start = 0;
+        }
+        if (peer->read.used >= peer->read.capacity) {
+            if (peer->read.capacity >= PEER_MAX_MESSAGE_SIZE) failed("Ignoring too large message from peer");
+            peer->read.capacity = MAX(8192u, peer->read.capacity * 2);
+            peer->read.data = realloc(peer->read.data, peer->read.capacity);
+            if (!peer->read.data) failed("Out of memory");
+        }
     }
     ssize_t n = recv(peer->fd, peer->read.data + peer->read.used, peer->read.capacity - peer->read.used, 0);
     if (n == 0) {
         peer->read.finished = true;
         shutdown(peer->fd, SHUT_RD);
         while (has_complete_peer_command(peer)) dispatch_peer_command(self, peer);
-        queue_peer_message(self, peer);
+        queue_peer_message(self, peer, peer->read.data + peer->read.start, peer->read.used - peer->read.start);
         free(peer->read.data); peer->read.data = NULL;
-        peer->read.used = 0; peer->read.capacity = 0;
+        peer->read.used = 0; peer->read.capacity = 0; peer->read.start = 0; peer->read.scanned = 0;
     } else if (n < 0) {
         if (errno != EINTR) failed(strerror(errno));
     } else {
@@ -1900,7 +3005,7 @@ talk_loop(void *data) {
         talk_mutex(lock);
         if (peers_to_inject.num) {
             for (size_t i = 0; i < peers_to_inject.num; i++) {
-                id_type added_peer_id = add_peer(peers_to_inject.fds[i].peer_fd, true);
+                id_type added_peer_id = add_peer(peers_to_inject.fds[i].peer_fd, true, false);
                 simple_write_to_pipe(peers_to_inject.fds[i].pipe_fd, &added_peer_id, sizeof(id_type));
                 safe_close(peers_to_inject.fds[i].pipe_fd, __FILE__, __LINE__);
             }
@@ -1937,7 +3042,11 @@ talk_loop(void *data) {
             for (size_t k = 0; k < talk_data.num_peers; k++) {
                 Peer *p = talk_data.peers + k;
                 if (p->fd_array_idx) {
-                    if (fds[p->fd_array_idx].revents & (POLLIN | POLLHUP)) read_from_peer(self, p);
+                    if (fds[p->fd_array_idx].revents & (POLLIN | POLLHUP)) {
+                        TRACE_BEGIN("read_from_peer");
+                        read_from_peer(self, p);
+                        TRACE_END("read_from_peer");
+                    }
                     if (fds[p->fd_array_idx].revents & POLLOUT) write_to_peer(p);
                     if (fds[p->fd_array_idx].revents & POLLNVAL) {
                         p->read.finished = true;
@@ -1963,19 +3072,7 @@ send_response_to_peer(id_type peer_id, const char *msg, size_t msg_sz) {
         Peer *peer = talk_data.peers + i;
         if (peer->id == peer_id) {
             if (peer->num_of_unresponded_messages_sent_to_main_thread) peer->num_of_unresponded_messages_sent_to_main_thread--;
-            if (!peer->write.failed) {
-                if (peer->write.capacity - peer->write.used < msg_sz) {
-                    void *data = realloc(peer->write.data, peer->write.capacity + msg_sz);
-                    if (data) {
-                        peer->write.data = data;
-                        peer->write.capacity += msg_sz;
-                    } else fatal("Out of memory");
-                }
-                if (msg_sz && msg) {
-                    memcpy(peer->write.data + peer->write.used, msg, msg_sz);
-                    peer->write.used += msg_sz;
-                }
-            }
+            if (msg) append_to_peer_write_buffer(peer, msg, msg_sz);
             wakeup = true;
             break;
         }
@@ -1990,6 +3087,7 @@ send_response_to_peer(id_type peer_id, const char *msg, size_t msg_sz) {
 static PyMethodDef methods[] = {
     METHOD(add_child, METH_VARARGS)
     METHOD(inject_peer, METH_O)
+    METHOD(allow_native_rc_commands, METH_VARARGS)
     METHOD(needs_write, METH_VARARGS)
     METHOD(start, METH_NOARGS)
     METHOD(wakeup, METH_NOARGS)
@@ -2052,7 +3150,13 @@ static PyMethodDef module_methods[] = {
     METHODB(send_data_to_peer, METH_VARARGS),
     METHODB(cocoa_set_menubar_title, METH_VARARGS),
     METHODB(mask_kitty_signals_process_wide, METH_NOARGS),
+    METHODB(benchmark_render_frame, METH_VARARGS),
     {"sigqueue", (PyCFunction)sig_queue, METH_VARARGS, ""},
+    METHODB(stream_paste, METH_VARARGS),
+    METHODB(test_paste_filter, METH_VARARGS),
+    METHODB(test_paste_check, METH_VARARGS),
+    METHODB(test_timed_key, METH_VARARGS),
+    METHODB(test_native_rc_command, METH_VARARGS),
     {NULL}  /* Sentinel */
 };
 
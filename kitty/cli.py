@@ -1007,6 +1007,24 @@ def options_spec() -> str:
 present in the main font.
 
 
+--headless
+type=bool-set
+Do not connect to a display server, instead create OS windows that are never
+shown, rendering into an offscreen OSMesa (software OpenGL) context. Requires
+the OSMesa library to be installed. Useful for testing and benchmarking
+rendering on machines without a display or GPU. Only supported on Linux.
+
+
+--benchmark-rendering
+completion=type:file ext:py
+Path to a Python file that drives rendering for benchmarking. It must define a
+function :code:`render_benchmark(bench)`, that is called once the first window
+is created. It can feed data to windows and render frames, the CPU time spent
+in each phase of every rendered frame is printed out once it returns, after
+which {appname} quits. See :file:`kitty/render_benchmark.py` for details. Most
+useful together with :option:`{appname} --headless`.
+
+
 --watcher
 completion=type:file ext:py relative:conf group:"Watcher files"
 This option is deprecated in favor of the :opt:`watcher` option in
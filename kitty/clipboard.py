@@ -25,6 +25,8 @@
 from .utils import log_error
 
 READ_RESPONSE_CHUNK_SIZE = 4096
+# Pastes larger than this are streamed to the child from a temporary file, see Window.paste_file_with_actions()
+STREAMED_PASTE_THRESHOLD = 1024 * 1024
 
 
 class Tempfile:
@@ -109,6 +111,15 @@ def get_text(self) -> str:
         self.get_mime("text/plain", parts.append)
         return b''.join(parts).decode('utf-8', 'replace')
 
+    def get_text_for_paste(self) -> str | IO[bytes]:
+        # Large amounts of text are returned as a file positioned at the start of the text
+        tf = Tempfile(STREAMED_PASTE_THRESHOLD)
+        self.get_mime("text/plain", tf.write)
+        if isinstance(tf.file, io.BytesIO):
+            return tf.file.getvalue().decode('utf-8', 'replace')
+        tf.seek(0)
+        return tf.file
+
     def get_mime(self, mime: str, output: Callable[[bytes], None]) -> None:
         if self.enabled:
             try:
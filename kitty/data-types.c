@@ -133,6 +133,57 @@ base64_decode_into(PyObject UNUSED *self, PyObject *args) {
     return PyLong_FromSize_t(sz);
 }
 
+static bool
+base85_decode8(const uint8_t *src, size_t src_sz, uint8_t *dest, size_t *dest_sz) {
+    // Decodes the RFC 1924 alphabet used by base64.b85decode(), a trailing partial group is padded with the highest digit
+    static const uint8_t digits[128] = {
+        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+        255,  62, 255,  63,  64,  65,  66, 255,  67,  68,  69,  70, 255,  71, 255, 255,
+          0,   1,   2,   3,   4,   5,   6,   7,   8,   9, 255,  72,  73,  74,  75,  76,
+         77,  10,  11,  12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,
+         25,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35, 255, 255, 255,  78,  79,
+         80,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  49,  50,
+         51,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  81,  82,  83,  84, 255
+    };
+    size_t out = 0;
+    for (size_t i = 0; i < src_sz; i += 5) {
+        const size_t n = MIN(5u, src_sz - i);
+        uint64_t acc = 0;
+        for (size_t k = 0; k < 5; k++) {
+            uint8_t d = 84;
+            if (k < n) {
+                if (src[i + k] > 127 || (d = digits[src[i + k]]) == 255) return false;
+            }
+            acc = acc * 85 + d;
+        }
+        if (acc > UINT32_MAX) return false;
+        uint8_t group[4] = {acc >> 24, (acc >> 16) & 0xff, (acc >> 8) & 0xff, acc & 0xff};
+        memcpy(dest + out, group, n - 1);
+        out += n - 1;
+    }
+    *dest_sz = out;
+    return true;
+}
+
+static PyObject*
+base85_decode(PyObject UNUSED *self, PyObject *input_data) {
+    RAII_PY_BUFFER(view);
+    if (PyUnicode_Check(input_data)) view.buf = (void*)PyUnicode_AsUTF8AndSize(input_data, &view.len);
+    else if (PyObject_GetBuffer(input_data, &view, PyBUF_SIMPLE) != 0) return NULL;
+    if (!view.buf) return NULL;
+    size_t sz = (view.len / 5 + 1) * 4;
+    PyObject *ans = PyBytes_FromStringAndSize(NULL, sz);
+    if (!ans) return NULL;
+    if (!base85_decode8(view.buf, view.len, (uint8_t*)PyBytes_AS_STRING(ans), &sz)) {
+        Py_DECREF(ans);
+        PyErr_SetString(PyExc_ValueError, "Invalid base85 input data");
+        return NULL;
+    }
+    if (_PyBytes_Resize(&ans, sz) != 0) return NULL;
+    return ans;
+}
+
 static PyObject*
 split_into_graphemes(PyObject UNUSED *self, PyObject *src) {
     if (!PyUnicode_Check(src)) { PyErr_SetString(PyExc_TypeError, "must provide a unicode string"); return NULL; }
@@ -660,6 +711,7 @@ static PyMethodDef module_methods[] = {
     {"base64_encode_into", (PyCFunction)base64_encode_into, METH_VARARGS, ""},
     {"base64_decode", (PyCFunction)(void (*) (void))(pybase64_decode), METH_O, ""},
     {"base64_decode_into", (PyCFunction)base64_decode_into, METH_VARARGS, ""},
+    {"base85_decode", (PyCFunction)base85_decode, METH_O, ""},
     {"char_props_for", py_char_props_for, METH_O, ""},
     {"split_into_graphemes", (PyCFunction)split_into_graphemes, METH_O, ""},
     {"thread_write", (PyCFunction)cm_thread_write, METH_VARARGS, ""},
@@ -727,6 +779,7 @@ extern bool init_png_reader(PyObject *module);
 extern bool init_utmp(PyObject *module);
 extern bool init_loop_utils(PyObject *module);
 extern bool init_systemd_module(PyObject *module);
+extern bool init_trace(PyObject *module);
 #ifdef __APPLE__
 extern int init_CoreText(PyObject *);
 extern bool init_cocoa(PyObject *module);
@@ -790,6 +843,7 @@ PyInit_fast_data_types(void) {
     if (!init_loop_utils(m)) return NULL;
     if (!init_crypto_library(m)) return NULL;
     if (!init_systemd_module(m)) return NULL;
+    if (!init_trace(m)) return NULL;
     if (!init_animations(m)) return NULL;
 
     CellAttrs a;
@@ -5,6 +5,9 @@
  * Distributed under terms of the GPL3 license.
  */
 
+#if __linux__
+#define _GNU_SOURCE 1
+#endif
 #define MAX_KEY_SIZE 16u
 
 #include "disk-cache.h"
@@ -19,6 +22,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <zlib.h>
 
 typedef struct CacheKey {
     void *hash_key;
@@ -28,7 +32,9 @@ typedef struct CacheKey {
 typedef struct {
     uint8_t *data;
     size_t data_sz;
-    bool written_to_disk;
+    // The number of bytes the entry uses in the cache file, less than data_sz if it is compressed
+    size_t stored_sz;
+    bool written_to_disk, compressed;
     off_t pos_in_cache_file;
     uint8_t encryption_key[64];
 } CacheValue;
@@ -67,26 +73,55 @@ static void free_pos_list(PosList p) { free(p.positions); }
 #include "kitty-verstable.h"
 #define hole_size_map_for_loop(i) vt_create_for_loop(hole_size_map_itr, i, &holes->size_map)
 
+// The distinct sizes of the holes whose size is in [2^n, 2^(n+1))
+typedef struct SizeClass { size_t count, capacity; off_t *sizes; } SizeClass;
+
 typedef struct Holes {
     hole_pos_map pos_map, end_pos_map;
     hole_size_map size_map;
-    off_t largest_hole_size;
+    SizeClass classes[64];
+    uint64_t nonempty_classes;
 } Holes;
 
+// An entry in the cache file, for ordering entries by position during compaction
+typedef struct PositionedEntry {
+    off_t pos;
+    unsigned short keylen;
+    uint8_t key[MAX_KEY_SIZE];
+} PositionedEntry;
+
+// Freed ranges of at least this size have their disk space released
+#define PUNCH_HOLE_THRESHOLD (64 * 1024)
+#define PUNCH_HOLE_ALIGNMENT 4096
+
 typedef struct {
     PyObject_HEAD
     char *cache_dir;
     int cache_file_fd;
-    Py_ssize_t small_hole_threshold;
+    Py_ssize_t small_hole_threshold, compression_threshold;
     unsigned int defrag_factor;
     pthread_mutex_t lock;
     pthread_t write_thread;
     bool thread_started, lock_inited, loop_data_inited, shutting_down, fully_initialized;
     LoopData loop_data;
-    struct { CacheValue val; CacheKey key; } currently_writing;
+    // compressed is the compressed data of val, if it is stored compressed
+    struct { CacheValue val; CacheKey key; uint8_t *compressed; } currently_writing;
     cache_map map;
     Holes holes;
-    unsigned long long total_size;
+    // Freed ranges whose disk space has to be released before they are reused
+    struct { Hole *items; size_t count, capacity; } punch_queue;
+    bool can_punch_holes;
+    // Incremented whenever the layout of the cache file is reset
+    unsigned long long generation;
+    struct {
+        bool active; CacheKey key; off_t from, to; size_t sz; unsigned long long generation;
+        // A max-heap of the positions of the entries in the cache file, built
+        // when compaction starts. Entries that are removed or moved are left in
+        // it and skipped when they reach the top.
+        struct { PositionedEntry *items; size_t count, capacity; bool built; } by_pos;
+    } compaction;
+    // The size of the data of all entries and the space they use in the cache file
+    unsigned long long total_size, stored_size;
 } DiskCache;
 
 #define mutex(op) pthread_mutex_##op(&self->lock)
@@ -98,7 +133,9 @@ new_diskcache_object(PyTypeObject *type, PyObject UNUSED *args, PyObject UNUSED
     if (self) {
         self->cache_file_fd = -1;
         self->small_hole_threshold = 512;
+        self->compression_threshold = 64 * 1024;
         self->defrag_factor = 2;
+        self->can_punch_holes = true;
     }
     return (PyObject*) self;
 }
@@ -171,7 +208,36 @@ cleanup_holes(Holes *holes) {
     vt_cleanup(&holes->size_map);
     vt_cleanup(&holes->pos_map);
     vt_cleanup(&holes->end_pos_map);
-    holes->largest_hole_size = 0;
+    for (size_t i = 0; i < arraysz(holes->classes); i++) {
+        free(holes->classes[i].sizes);
+        holes->classes[i] = (SizeClass){0};
+    }
+    holes->nonempty_classes = 0;
+}
+
+static void
+punch_holes(DiskCache *self) {
+    // Release the disk space used by freed ranges, must be called before any
+    // of them is written to or the file is truncated
+#ifdef FALLOC_FL_PUNCH_HOLE
+    for (size_t i = 0; i < self->punch_queue.count && self->can_punch_holes; i++) {
+        const Hole h = self->punch_queue.items[i];
+        if (fallocate(self->cache_file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, h.pos, h.size) != 0) {
+            if (errno == EOPNOTSUPP || errno == ENOSYS) self->can_punch_holes = false;
+        }
+    }
+#endif
+    self->punch_queue.count = 0;
+}
+
+static void
+queue_hole_punch(DiskCache *self, off_t pos, off_t size) {
+    if (!self->can_punch_holes) return;
+    const off_t start = (pos + PUNCH_HOLE_ALIGNMENT - 1) / PUNCH_HOLE_ALIGNMENT * PUNCH_HOLE_ALIGNMENT;
+    const off_t end = (pos + size) / PUNCH_HOLE_ALIGNMENT * PUNCH_HOLE_ALIGNMENT;
+    if (end - start < PUNCH_HOLE_THRESHOLD) return;
+    ensure_space_for(&self->punch_queue, items, Hole, self->punch_queue.count + 1, capacity, 16, false);
+    self->punch_queue.items[self->punch_queue.count++] = (Hole){.pos=start, .size=end - start};
 }
 
 static void
@@ -195,11 +261,11 @@ defrag(DiskCache *self) {
     size_t total_data_size = 0, num_entries_to_defrag = 0;
     cache_map_for_loop(i) {
         CacheValue *s = i.data->val;
-        if (s->pos_in_cache_file > -1 && s->data_sz) {
-            total_data_size += s->data_sz;
+        if (s->pos_in_cache_file > -1 && s->stored_sz) {
+            total_data_size += s->stored_sz;
             DefragEntry *e = defrag_entries + num_entries_to_defrag++;
             e->old_offset = s->pos_in_cache_file;
-            e->data_sz = s->data_sz;
+            e->data_sz = s->stored_sz;
             e->key = keydup(i.data->key);  // have to dup the key as we release the mutex and another thread might free the underlying key.
             if (!e->key.hash_key) { fprintf(stderr, "Failed to allocate space for keydup in defrag\n"); goto cleanup; }
         }
@@ -228,6 +294,8 @@ cleanup:
     if (lock_released) mutex(lock);
     if (ok) {
         cleanup_holes(&self->holes);
+        self->punch_queue.count = 0;
+        self->generation++;
         safe_close(self->cache_file_fd, __FILE__, __LINE__);
         self->cache_file_fd = new_cache_file; new_cache_file = -1;
         for (size_t i = 0; i < num_entries_to_defrag; i++) {
@@ -246,35 +314,42 @@ append_position(PosList *p, off_t pos) {
     p->positions[p->count++] = pos;
 }
 
+static unsigned
+size_class(off_t size) { return size > 0 ? 63 - __builtin_clzll((unsigned long long)size) : 0; }
+
 static void
 add_hole_to_maps(Holes *holes, Hole h) {
     if (vt_is_end(vt_insert(&holes->pos_map, h.pos, h.size))) fatal("Out of memory");
     if (vt_is_end(vt_insert(&holes->end_pos_map, h.pos + h.size, h.size))) fatal("Out of memory");
     hole_size_map_itr i = vt_get_or_insert(&holes->size_map, h.size, (PosList){0});
     if (vt_is_end(i)) fatal("Out of memory");
-    append_position(&(i.data->val), h.pos);
-    holes->largest_hole_size = MAX(h.size, holes->largest_hole_size);
-}
-
-static void
-update_largest_hole_size(Holes *holes) {
-    holes->largest_hole_size = 0;
-    hole_size_map_for_loop(i) {
-        if (i.data->key > holes->largest_hole_size) holes->largest_hole_size = i.data->key;
+    if (!i.data->val.count) {
+        const unsigned c = size_class(h.size);
+        SizeClass *sc = holes->classes + c;
+        ensure_space_for(sc, sizes, off_t, sc->count + 1, capacity, 8, false);
+        sc->sizes[sc->count++] = h.size;
+        holes->nonempty_classes |= 1ull << c;
     }
+    append_position(&(i.data->val), h.pos);
 }
 
 static void
 remove_hole_from_maps_itr(Holes *holes, Hole h, hole_size_map_itr i, size_t pos_in_sizes_array) {
-    vt_erase(&holes->pos_map, h.pos); vt_erase(&holes->end_pos_map, h.pos + h.size);
+    // Removes the hole from all maps except pos_map
+    vt_erase(&holes->end_pos_map, h.pos + h.size);
     if (i.data->val.count <= 1) {
         vt_erase_itr(&holes->size_map, i);
-        if (h.size > holes->largest_hole_size) update_largest_hole_size(holes);
+        const unsigned c = size_class(h.size);
+        SizeClass *sc = holes->classes + c;
+        for (size_t x = 0; x < sc->count; x++) {
+            if (sc->sizes[x] == h.size) { remove_i_from_array(sc->sizes, x, sc->count); break; }
+        }
+        if (!sc->count) holes->nonempty_classes &= ~(1ull << c);
     } else remove_i_from_array(i.data->val.positions, pos_in_sizes_array, i.data->val.count);
 }
 
 static void
-remove_hole_from_maps(Holes *holes, Hole h) {
+remove_hole_from_size_maps(Holes *holes, Hole h) {
     hole_size_map_itr i = vt_get(&holes->size_map, h.size);
     for (size_t x = 0; x < i.data->val.count; x++) {
         if (i.data->val.positions[x] == h.pos) {
@@ -284,19 +359,44 @@ remove_hole_from_maps(Holes *holes, Hole h) {
     }
 }
 
+static void
+remove_hole_from_maps(Holes *holes, Hole h) {
+    vt_erase(&holes->pos_map, h.pos);
+    remove_hole_from_size_maps(holes, h);
+}
+
 static bool
-find_hole_to_use(DiskCache *self, const off_t required_sz) {
-    if (self->holes.largest_hole_size < required_sz) return false;
-    hole_size_map_itr i = vt_get(&self->holes.size_map, required_sz);
-    if (vt_is_end(i)) {
-        for (i = vt_first(&self->holes.size_map); !vt_is_end(i); i = vt_next(i)) {
-            if (i.data->key >= required_sz) break;
+find_hole(const Holes *holes, const off_t required_sz, const off_t before, Hole *ans) {
+    // The smallest hole of at least required_sz in the size class of
+    // required_sz or failing that the smallest one in the next non-empty size
+    // class, which must be large enough. When before > -1 only holes that end
+    // before it are considered.
+    for (uint64_t classes = holes->nonempty_classes & (~0ull << size_class(required_sz)); classes; classes &= classes - 1) {
+        const SizeClass *sc = holes->classes + __builtin_ctzll(classes);
+        bool found = false;
+        for (size_t x = 0; x < sc->count; x++) {
+            const off_t sz = sc->sizes[x];
+            if (sz < required_sz || (found && sz >= ans->size)) continue;
+            const PosList *p = &vt_get((hole_size_map*)&holes->size_map, sz).data->val;
+            for (size_t k = p->count; k-- > 0;) {
+                if (before < 0 || p->positions[k] + required_sz <= before) {
+                    ans->pos = p->positions[k]; ans->size = sz; found = true;
+                    break;
+                }
+            }
         }
+        if (found) return true;
     }
-    if (vt_is_end(i)) return false;
-    Hole h = {.pos=i.data->val.positions[i.data->val.count-1], .size=i.data->key};
-    remove_hole_from_maps_itr(&self->holes, h, i, i.data->val.count-1);
-    self->currently_writing.val.pos_in_cache_file = h.pos;
+    return false;
+}
+
+static bool
+take_hole(DiskCache *self, const off_t required_sz, const off_t before, off_t *pos) {
+    Hole h;
+    if (!find_hole(&self->holes, required_sz, before, &h)) return false;
+    punch_holes(self);
+    remove_hole_from_maps(&self->holes, h);
+    *pos = h.pos;
     if (required_sz < h.size) {
         h.pos += required_sz; h.size -= required_sz;
         if (h.size > self->small_hole_threshold) add_hole_to_maps(&self->holes, h);
@@ -307,12 +407,81 @@ find_hole_to_use(DiskCache *self, const off_t required_sz) {
 static inline bool
 needs_defrag(DiskCache *self) {
     off_t size_on_disk = size_of_cache_file(self);
-    return self->total_size && size_on_disk > 0 && (size_t)size_on_disk > self->total_size * self->defrag_factor;
+    return self->stored_size && size_on_disk > 0 && (size_t)size_on_disk > self->stored_size * self->defrag_factor;
+}
+
+static void
+stop_compaction(DiskCache *self) {
+    self->compaction.active = false;
+    self->compaction.by_pos.count = 0; self->compaction.by_pos.built = false;
+}
+
+#define by_pos_higher(a, b) (self->compaction.by_pos.items[a].pos > self->compaction.by_pos.items[b].pos)
+#define by_pos_swap(a, b) { PositionedEntry t = self->compaction.by_pos.items[a]; self->compaction.by_pos.items[a] = self->compaction.by_pos.items[b]; self->compaction.by_pos.items[b] = t; }
+
+static void
+index_entry_position(DiskCache *self, CacheKey key, off_t pos) {
+    if (!self->compaction.by_pos.built || pos < 0) return;
+    ensure_space_for(&self->compaction.by_pos, items, PositionedEntry, self->compaction.by_pos.count + 1, capacity, 64, false);
+    size_t i = self->compaction.by_pos.count++;
+    PositionedEntry *e = self->compaction.by_pos.items + i;
+    e->pos = pos; e->keylen = MIN(key.hash_keylen, MAX_KEY_SIZE);
+    memcpy(e->key, key.hash_key, e->keylen);
+    for (size_t parent; i && by_pos_higher(i, (parent = (i - 1) / 2)); i = parent) by_pos_swap(i, parent);
+}
+
+static void
+pop_last_entry_position(DiskCache *self) {
+    if (!self->compaction.by_pos.count) return;
+    const size_t count = --self->compaction.by_pos.count;
+    self->compaction.by_pos.items[0] = self->compaction.by_pos.items[count];
+    for (size_t i = 0, largest; ; i = largest) {
+        const size_t l = 2 * i + 1, r = l + 1;
+        largest = i;
+        if (l < count && by_pos_higher(l, largest)) largest = l;
+        if (r < count && by_pos_higher(r, largest)) largest = r;
+        if (largest == i) break;
+        by_pos_swap(i, largest);
+    }
+}
+#undef by_pos_higher
+#undef by_pos_swap
+
+static CacheValue*
+last_entry_in_cache_file(DiskCache *self, CacheKey *key) {
+    // Returns the entry that ends last in the cache file, building the
+    // position index on the first call of a compaction
+    if (!self->compaction.by_pos.built) {
+        self->compaction.by_pos.built = true; self->compaction.by_pos.count = 0;
+        cache_map_for_loop(i) {
+            const CacheValue *s = i.data->val;
+            if (s->written_to_disk && s->stored_sz) index_entry_position(self, i.data->key, s->pos_in_cache_file);
+        }
+    }
+    while (self->compaction.by_pos.count) {
+        PositionedEntry *e = self->compaction.by_pos.items;
+        *key = (CacheKey){.hash_key=e->key, .hash_keylen=e->keylen};
+        cache_map_itr i = vt_get(&self->map, *key);
+        if (!vt_is_end(i)) {
+            CacheValue *s = i.data->val;
+            if (s->written_to_disk && s->stored_sz && s->pos_in_cache_file == e->pos) return s;
+        }
+        pop_last_entry_position(self);
+    }
+    return NULL;
+}
+
+static void
+schedule_compaction(DiskCache *self) {
+    // Marks compaction as active as soon as it is needed, so that waiting for
+    // writes also waits for it
+    if (!self->compaction.active) self->compaction.active = needs_defrag(self);
 }
 
 static void
 add_hole(DiskCache *self, const off_t pos, const off_t size) {
     if (size <= self->small_hole_threshold) return;
+    queue_hole_punch(self, pos, size);
     if (vt_size(&self->holes.pos_map)) {
         // See if we can find a neighboring hole to merge this hole into
         // First look for a hole after us
@@ -335,15 +504,12 @@ add_hole(DiskCache *self, const off_t pos, const off_t size) {
             // there could be a hole before us as well
             i = vt_get(&self->holes.end_pos_map, pos);
             if (!vt_is_end(i)) {
-                self->holes.largest_hole_size = MAX(self->holes.largest_hole_size, new_hole.size);
                 remove_hole_from_maps(&self->holes, original_hole);
                 original_hole.pos = i.data->key - i.data->val; original_hole.size = i.data->val;
                 new_hole.pos = original_hole.pos; new_hole.size += original_hole.size;
             }
         }
         if (found) {
-            // prevent remove_hole_from_maps updating largest hole size
-            self->holes.largest_hole_size = MAX(self->holes.largest_hole_size, new_hole.size);
             remove_hole_from_maps(&self->holes, original_hole);
             add_hole_to_maps(&self->holes, new_hole);
             return;
@@ -357,8 +523,9 @@ static void
 remove_from_disk(DiskCache *self, CacheValue *s) {
     if (s->written_to_disk) {
         s->written_to_disk = false;
-        if (s->data_sz && s->pos_in_cache_file > -1) {
-            add_hole(self, s->pos_in_cache_file, s->data_sz);
+        if (s->stored_sz && s->pos_in_cache_file > -1) {
+            add_hole(self, s->pos_in_cache_file, s->stored_sz);
+            self->stored_size -= MIN(self->stored_size, s->stored_sz);
             s->pos_in_cache_file = -1;
         }
     }
@@ -366,7 +533,6 @@ remove_from_disk(DiskCache *self, CacheValue *s) {
 
 static bool
 find_cache_entry_to_write(DiskCache *self) {
-    if (needs_defrag(self)) defrag(self);
     cache_map_for_loop(i) {
         CacheValue *s = i.data->val;
         if (!s->written_to_disk) {
@@ -376,24 +542,55 @@ find_cache_entry_to_write(DiskCache *self) {
                 s->data = NULL;
                 self->currently_writing.val.data_sz = s->data_sz;
                 self->currently_writing.val.pos_in_cache_file = -1;
-                xor_data64(s->encryption_key, self->currently_writing.val.data, s->data_sz);
+                memcpy(self->currently_writing.val.encryption_key, s->encryption_key, sizeof(s->encryption_key));
                 self->currently_writing.key.hash_keylen = MIN(i.data->key.hash_keylen, MAX_KEY_SIZE);
                 memcpy(self->currently_writing.key.hash_key, i.data->key.hash_key, self->currently_writing.key.hash_keylen);
-                find_hole_to_use(self, self->currently_writing.val.data_sz);
                 return true;
             }
             s->written_to_disk = true;
             s->pos_in_cache_file = 0;
-            s->data_sz = 0;
+            s->data_sz = 0; s->stored_sz = 0;
         }
     }
     return false;
 }
 
+static bool
+is_compressible(const uint8_t *data, size_t sz) {
+    // Compress a few samples from across the data to estimate how well all of it compresses
+    enum { SAMPLE_SIZE = 4096, NUM_SAMPLES = 4 };
+    if (sz < SAMPLE_SIZE * NUM_SAMPLES) return false;
+    uint8_t out[SAMPLE_SIZE + 256];
+    size_t compressed_sz = 0;
+    for (size_t i = 0; i < NUM_SAMPLES; i++) {
+        uLongf n = sizeof(out);
+        if (compress2(out, &n, data + (sz - SAMPLE_SIZE) / (NUM_SAMPLES - 1) * i, SAMPLE_SIZE, Z_BEST_SPEED) != Z_OK) return false;
+        compressed_sz += n;
+    }
+    return compressed_sz * 4 < SAMPLE_SIZE * NUM_SAMPLES * 3;
+}
+
+static void
+compress_currently_writing(DiskCache *self) {
+    // Called without the lock, the data being written can be read by other
+    // threads so it is left unchanged.
+    CacheValue *v = &self->currently_writing.val;
+    v->stored_sz = v->data_sz; v->compressed = false;
+    free(self->currently_writing.compressed); self->currently_writing.compressed = NULL;
+    if (self->compression_threshold < 0 || v->data_sz < (size_t)self->compression_threshold || !is_compressible(v->data, v->data_sz)) return;
+    uLongf n = compressBound(v->data_sz);
+    uint8_t *buf = malloc(n);
+    if (!buf) return;
+    if (compress2(buf, &n, v->data, v->data_sz, Z_BEST_SPEED) == Z_OK && n < v->data_sz - v->data_sz / 8) {
+        self->currently_writing.compressed = buf;
+        v->stored_sz = n; v->compressed = true;
+    } else free(buf);
+}
+
 static bool
 write_dirty_entry(DiskCache *self) {
-    size_t left = self->currently_writing.val.data_sz;
-    uint8_t *p = self->currently_writing.val.data;
+    size_t left = self->currently_writing.val.stored_sz;
+    const uint8_t *p = self->currently_writing.val.compressed ? self->currently_writing.compressed : self->currently_writing.val.data;
     if (self->currently_writing.val.pos_in_cache_file < 0) {
         self->currently_writing.val.pos_in_cache_file = size_of_cache_file(self);
         if (self->currently_writing.val.pos_in_cache_file < 0) {
@@ -402,22 +599,30 @@ write_dirty_entry(DiskCache *self) {
         }
     }
     off_t offset = self->currently_writing.val.pos_in_cache_file;
+    // The data is encrypted a chunk at a time, as it can be read by other threads while it is being written
+    uint8_t buf[64 * 1024];
     while (left > 0) {
-        ssize_t n = pwrite(self->cache_file_fd, p, left, offset);
-        if (n < 0) {
-            if (errno == EINTR || errno == EAGAIN) continue;
-            perror("Failed to write to disk-cache file");
-            self->currently_writing.val.pos_in_cache_file = -1;
-            return false;
-        }
-        if (n == 0) {
-            fprintf(stderr, "Failed to write to disk-cache file with zero return\n");
-            self->currently_writing.val.pos_in_cache_file = -1;
-            return false;
+        const size_t chunk = MIN(left, sizeof(buf));
+        memcpy(buf, p, chunk);
+        xor_data64(self->currently_writing.val.encryption_key, buf, chunk);
+        for (size_t done = 0; done < chunk; ) {
+            ssize_t n = pwrite(self->cache_file_fd, buf + done, chunk - done, offset);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                perror("Failed to write to disk-cache file");
+                self->currently_writing.val.pos_in_cache_file = -1;
+                return false;
+            }
+            if (n == 0) {
+                fprintf(stderr, "Failed to write to disk-cache file with zero return\n");
+                self->currently_writing.val.pos_in_cache_file = -1;
+                return false;
+            }
+            done += n;
+            offset += n;
         }
-        left -= n;
-        p += n;
-        offset += n;
+        left -= chunk;
+        p += chunk;
     }
     return true;
 }
@@ -426,12 +631,105 @@ static void
 retire_currently_writing(DiskCache *self) {
     cache_map_itr i = vt_get(&self->map, self->currently_writing.key);
     if (!vt_is_end(i)) {
-        i.data->val->written_to_disk = true;
-        i.data->val->pos_in_cache_file = self->currently_writing.val.pos_in_cache_file;
+        CacheValue *s = i.data->val;
+        s->written_to_disk = true;
+        s->pos_in_cache_file = self->currently_writing.val.pos_in_cache_file;
+        s->stored_sz = self->currently_writing.val.stored_sz;
+        s->compressed = self->currently_writing.val.compressed;
+        if (s->pos_in_cache_file > -1) self->stored_size += s->stored_sz;
+        index_entry_position(self, i.data->key, s->pos_in_cache_file);
     }
     free(self->currently_writing.val.data);
     self->currently_writing.val.data = NULL;
     self->currently_writing.val.data_sz = 0;
+    free(self->currently_writing.compressed);
+    self->currently_writing.compressed = NULL;
+}
+
+static void
+drop_holes_from(DiskCache *self, off_t pos) {
+    for (hole_pos_map_itr i = vt_first(&self->holes.pos_map); !vt_is_end(i); ) {
+        if (i.data->key >= pos) {
+            remove_hole_from_size_maps(&self->holes, (Hole){.pos=i.data->key, .size=i.data->val});
+            i = vt_erase_itr(&self->holes.pos_map, i);
+        } else i = vt_next(i);
+    }
+}
+
+static bool
+copy_within_cache_file(DiskCache *self, off_t from, off_t to, size_t sz) {
+    uint8_t buf[16 * 1024];
+    while (sz) {
+        ssize_t n = pread(self->cache_file_fd, buf, MIN(sz, sizeof(buf)), from);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            perror("Failed to read from disk-cache file during compaction");
+            return false;
+        }
+        if (n == 0) { fprintf(stderr, "Disk cache file truncated during compaction\n"); return false; }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = pwrite(self->cache_file_fd, buf + done, n - done, to + done);
+            if (w < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                perror("Failed to write to disk-cache file during compaction");
+                return false;
+            }
+            done += w;
+        }
+        sz -= n; from += n; to += n;
+    }
+    return true;
+}
+
+static bool
+start_compaction_step(DiskCache *self) {
+    // Once the cache file has grown too large, it is compacted one entry at a
+    // time by moving the last entry in the file into a hole before it and
+    // truncating free space at the end of the file. Returns true if there is
+    // an entry to move. Falls back to rewriting the whole file when no hole
+    // can hold the last entry.
+    schedule_compaction(self);
+    if (!self->compaction.active) return false;
+    const off_t size_on_disk = size_of_cache_file(self);
+    CacheKey last_key;
+    CacheValue *last = last_entry_in_cache_file(self, &last_key);
+    const off_t end = last ? last->pos_in_cache_file + (off_t)last->stored_sz : 0;
+    if (end < size_on_disk) {
+        punch_holes(self);
+        drop_holes_from(self, end);
+        if (ftruncate(self->cache_file_fd, end) != 0) { perror("Failed to truncate disk cache file"); stop_compaction(self); }
+        return false;
+    }
+    if (!last || (unsigned long long)size_on_disk <= self->stored_size) { stop_compaction(self); return false; }
+    off_t to;
+    if (!take_hole(self, last->stored_sz, last->pos_in_cache_file, &to)) {
+        stop_compaction(self);
+        if (needs_defrag(self)) defrag(self);
+        return false;
+    }
+    // the entry is indexed again at its new position once it has been moved
+    self->compaction.key.hash_keylen = last_key.hash_keylen;
+    memcpy(self->compaction.key.hash_key, last_key.hash_key, self->compaction.key.hash_keylen);
+    pop_last_entry_position(self);
+    self->compaction.from = last->pos_in_cache_file; self->compaction.to = to; self->compaction.sz = last->stored_sz;
+    self->compaction.generation = self->generation;
+    return true;
+}
+
+static void
+finish_compaction_step(DiskCache *self, bool copied) {
+    if (self->compaction.generation != self->generation) return;  // the cache was cleared while copying
+    cache_map_itr i = vt_get(&self->map, self->compaction.key);
+    CacheValue *s = vt_is_end(i) ? NULL : i.data->val;
+    if (copied && s && s->written_to_disk && s->pos_in_cache_file == self->compaction.from && s->stored_sz == self->compaction.sz) {
+        s->pos_in_cache_file = self->compaction.to;
+        index_entry_position(self, self->compaction.key, s->pos_in_cache_file);
+        add_hole(self, self->compaction.from, self->compaction.sz);
+    } else {
+        // the entry was removed or replaced while it was being copied
+        add_hole(self, self->compaction.to, self->compaction.sz);
+        if (!copied) stop_compaction(self);
+    }
 }
 
 static void*
@@ -449,18 +747,37 @@ write_loop(void *data) {
         size_t count = vt_size(&self->map);
         mutex(unlock);
         if (found_dirty_entry) {
+            compress_currently_writing(self);
+            mutex(lock);
+            take_hole(self, self->currently_writing.val.stored_sz, -1, &self->currently_writing.val.pos_in_cache_file);
+            mutex(unlock);
             write_dirty_entry(self);
             mutex(lock);
             retire_currently_writing(self);
+            schedule_compaction(self);
             mutex(unlock);
             continue;
         } else if (!count) {
             mutex(lock);
             count = vt_size(&self->map);
             if (!count && self->cache_file_fd > -1) {
+                punch_holes(self);
                 if (ftruncate(self->cache_file_fd, 0) == 0) lseek(self->cache_file_fd, 0, SEEK_END);
             }
+            stop_compaction(self);
             mutex(unlock);
+        } else {
+            // Compaction is done in steps so that new entries are written without waiting for it to finish
+            mutex(lock);
+            bool move_entry = start_compaction_step(self), active = self->compaction.active;
+            mutex(unlock);
+            if (move_entry) {
+                bool copied = copy_within_cache_file(self, self->compaction.from, self->compaction.to, self->compaction.sz);
+                mutex(lock);
+                finish_compaction_step(self, copied);
+                mutex(unlock);
+            }
+            if (active) continue;
         }
 
         if (poll(fds, 1, -1) > 0 && fds[0].revents & POLLIN) {
@@ -483,6 +800,10 @@ ensure_state(DiskCache *self) {
         self->currently_writing.key.hash_key = malloc(MAX_KEY_SIZE);
         if (!self->currently_writing.key.hash_key) { PyErr_NoMemory(); return false; }
     }
+    if (!self->compaction.key.hash_key) {
+        self->compaction.key.hash_key = malloc(MAX_KEY_SIZE);
+        if (!self->compaction.key.hash_key) { PyErr_NoMemory(); return false; }
+    }
 
     if (!self->lock_inited) {
         if ((ret = pthread_mutex_init(&self->lock, NULL)) != 0) {
@@ -544,6 +865,9 @@ dealloc(DiskCache* self) {
     if (self->currently_writing.key.hash_key) {
         free(self->currently_writing.key.hash_key); self->currently_writing.key.hash_key = NULL;
     }
+    free(self->compaction.key.hash_key); self->compaction.key.hash_key = NULL;
+    free(self->punch_queue.items); self->punch_queue.items = NULL;
+    free(self->compaction.by_pos.items); self->compaction.by_pos.items = NULL;
     if (self->lock_inited) {
         pthread_mutex_destroy(&self->lock);
         self->lock_inited = false;
@@ -558,6 +882,7 @@ dealloc(DiskCache* self) {
         self->cache_file_fd = -1;
     }
     if (self->currently_writing.val.data) free(self->currently_writing.val.data);
+    free(self->currently_writing.compressed);
     free(self->cache_dir); self->cache_dir = NULL;
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
@@ -571,15 +896,11 @@ create_cache_entry(void) {
     return s;
 }
 
-bool
-add_to_disk_cache(PyObject *self_, const void *key, size_t key_sz, const void *data, size_t data_sz) {
-    DiskCache *self = (DiskCache*)self_;
-    if (!ensure_state(self)) return false;
-    if (key_sz > MAX_KEY_SIZE) { PyErr_SetString(PyExc_KeyError, "cache key is too long"); return false; }
-    RAII_ALLOC(uint8_t, copied_data, malloc(data_sz));
-    if (!copied_data) { PyErr_NoMemory(); return false; }
-    memcpy(copied_data, data, data_sz);
+static bool
+add_entry(DiskCache *self, const void *key, size_t key_sz, uint8_t *data, size_t data_sz) {
+    // Takes ownership of data on success
     CacheKey k = {.hash_key=(void*)key, .hash_keylen=key_sz};
+    bool added = false;
 
     mutex(lock);
     cache_map_itr i = vt_get(&self->map, k);
@@ -596,15 +917,40 @@ add_to_disk_cache(PyObject *self_, const void *key, size_t key_sz, const void *d
         self->total_size -= MIN(self->total_size, s->data_sz);
         if (s->data) free(s->data);
     }
-    s->data = copied_data; s->data_sz = data_sz; copied_data = NULL;
+    s->data = data; s->data_sz = data_sz;
     self->total_size += s->data_sz;
+    added = true;
 end:
     mutex(unlock);
-    if (PyErr_Occurred()) return false;
+    if (!added) return false;
     wakeup_write_loop(self);
     return true;
 }
 
+bool
+add_to_disk_cache(PyObject *self_, const void *key, size_t key_sz, const void *data, size_t data_sz) {
+    DiskCache *self = (DiskCache*)self_;
+    if (!ensure_state(self)) return false;
+    if (key_sz > MAX_KEY_SIZE) { PyErr_SetString(PyExc_KeyError, "cache key is too long"); return false; }
+    uint8_t *copied_data = malloc(data_sz);
+    if (!copied_data) { PyErr_NoMemory(); return false; }
+    memcpy(copied_data, data, data_sz);
+    if (add_entry(self, key, key_sz, copied_data, data_sz)) return true;
+    free(copied_data);
+    return false;
+}
+
+bool
+add_buffer_to_disk_cache(PyObject *self_, const void *key, size_t key_sz, void *buf, size_t data_sz) {
+    // Stores the data in buf, which must have been allocated with malloc(),
+    // without copying it. On success the cache owns buf, on failure the
+    // caller retains ownership of it.
+    DiskCache *self = (DiskCache*)self_;
+    if (!ensure_state(self)) return false;
+    if (key_sz > MAX_KEY_SIZE) { PyErr_SetString(PyExc_KeyError, "cache key is too long"); return false; }
+    return add_entry(self, key, key_sz, buf, data_sz);
+}
+
 bool
 remove_from_disk_cache(PyObject *self_, const void *key, size_t key_sz) {
     DiskCache *self = (DiskCache*)self_;
@@ -622,6 +968,7 @@ remove_from_disk_cache(PyObject *self_, const void *key, size_t key_sz) {
         remove_from_disk(self, s);
         self->total_size = (self->total_size > s->data_sz) ? self->total_size - s->data_sz : 0;
         vt_erase_itr(&self->map, i);
+        schedule_compaction(self);
     }
     mutex(unlock);
     wakeup_write_loop(self);
@@ -635,8 +982,12 @@ clear_disk_cache(PyObject *self_) {
     mutex(lock);
     vt_cleanup(&self->map);
     cleanup_holes(&self->holes);
-    self->total_size = 0;
+    self->total_size = 0; self->stored_size = 0;
+    self->generation++;
+    stop_compaction(self);
     if (self->cache_file_fd > -1) add_hole(self, 0, size_of_cache_file(self));
+    // a write may be in progress, so the file is not punched, it is truncated once the cache is empty
+    self->punch_queue.count = 0;
     mutex(unlock);
     wakeup_write_loop(self);
 }
@@ -666,13 +1017,24 @@ read_from_cache_file(const DiskCache *self, off_t pos, size_t sz, void *dest) {
 
 static void
 read_from_cache_entry(const DiskCache *self, const CacheValue *s, void *dest) {
-    size_t sz = s->data_sz;
+    // Reads the decrypted and decompressed data of the entry into dest
     off_t pos = s->pos_in_cache_file;
     if (pos < 0) {
         PyErr_SetString(PyExc_OSError, "Cache entry was not written, could not read from it");
         return;
     }
-    read_from_cache_file(self, pos, sz, dest);
+    if (!s->compressed) {
+        read_from_cache_file(self, pos, s->data_sz, dest);
+        if (!PyErr_Occurred()) xor_data64(s->encryption_key, dest, s->data_sz);
+        return;
+    }
+    RAII_ALLOC(uint8_t, buf, malloc(s->stored_sz));
+    if (!buf) { PyErr_NoMemory(); return; }
+    read_from_cache_file(self, pos, s->stored_sz, buf);
+    if (PyErr_Occurred()) return;
+    xor_data64(s->encryption_key, buf, s->stored_sz);
+    uLongf sz = s->data_sz;
+    if (uncompress(dest, &sz, buf, s->stored_sz) != Z_OK || sz != s->data_sz) PyErr_SetString(PyExc_OSError, "Failed to decompress disk cache entry");
 }
 
 void*
@@ -693,12 +1055,8 @@ read_from_disk_cache(PyObject *self_, const void *key, size_t key_sz, void*(allo
     if (s->data) { memcpy(data, s->data, s->data_sz); }
     else if (self->currently_writing.val.data && self->currently_writing.key.hash_key && keys_are_equal(self->currently_writing.key, k)) {
         memcpy(data, self->currently_writing.val.data, s->data_sz);
-        xor_data64(s->encryption_key, data, s->data_sz);
-    }
-    else {
-        read_from_cache_entry(self, s, data);
-        xor_data64(s->encryption_key, data, s->data_sz);
     }
+    else read_from_cache_entry(self, s, data);
     if (store_in_ram && !s->data && s->data_sz) {
         void *copy = malloc(s->data_sz);
         if (copy) {
@@ -733,8 +1091,8 @@ disk_cache_wait_for_write(PyObject *self_, monotonic_t timeout) {
     if (!ensure_state(self)) return false;
     monotonic_t end_at = monotonic() + timeout;
     while (!timeout || monotonic() <= end_at) {
-        bool pending = false;
         mutex(lock);
+        bool pending = self->compaction.active;
         cache_map_for_loop(i) {
             if (!i.data->val->written_to_disk) {
                 pending = true;
@@ -920,6 +1278,7 @@ static PyMethodDef methods[] = {
 static PyMemberDef members[] = {
     {"total_size", T_ULONGLONG, offsetof(DiskCache, total_size), READONLY, "total_size"},
     {"small_hole_threshold", T_PYSSIZET, offsetof(DiskCache, small_hole_threshold), 0, "small_hole_threshold"},
+    {"compression_threshold", T_PYSSIZET, offsetof(DiskCache, compression_threshold), 0, "compression_threshold"},
     {"defrag_factor", T_UINT, offsetof(DiskCache, defrag_factor), 0, "defrag_factor"},
     {NULL},
 };
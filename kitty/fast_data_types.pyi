@@ -701,6 +701,26 @@ def thread_write(fd: int, data: bytes) -> None:
     pass
 
 
+def stream_paste(window_id: int, fd: int, check_c0: bool = False) -> bool:
+    pass
+
+
+def test_paste_check(chunks: tuple[bytes, ...], check_c0: bool, bracketed: bool) -> bool:
+    pass
+
+
+def test_timed_key(screen: Screen, fd: int, key: bytes, timeout: float) -> bool:
+    pass
+
+
+def test_paste_filter(chunks: tuple[bytes, ...], bracketed: bool) -> bytes:
+    pass
+
+
+def test_native_rc_command(cmd: bytes, major: int, minor: int) -> tuple[int, bytes, bool] | None:
+    pass
+
+
 def set_ignore_os_keyboard_processing(yes: bool) -> None:
     pass
 
@@ -1228,6 +1248,8 @@ class Screen:
     def test_create_write_buffer(self) -> memoryview: ...
     def test_commit_write_buffer(self, inp: memoryview, output: memoryview) -> int: ...
     def test_parse_written_data(self, dump_callback: None = None) -> None: ...
+    def input_latency(self, clear: bool = False) -> tuple[tuple[float, float, float, float], ...]: ...
+    def process_decoded_images(self, wait: bool = False) -> None: ...
     def hyperlink_for_id(self, hyperlink_id: int) -> str: ...
 
     def cursor_at_prompt(self) -> bool:
@@ -1432,6 +1454,8 @@ class ChildMonitor:
 
     def inject_peer(self, fd: int) -> int: ...
 
+    def allow_native_rc_commands(self, major: int, minor: int) -> None: ...
+
 
 class KeyEvent:
 
@@ -1706,11 +1730,17 @@ def wrapped_kitten_names() -> List[str]: ...
 def expand_ansi_c_escapes(test: str) -> str: ...
 def update_tab_bar_edge_colors(os_window_id: int) -> bool: ...
 def mask_kitty_signals_process_wide() -> None: ...
+def benchmark_render_frame(force_redraw: bool = True, capture: bool = False) -> Dict[str, Any]: ...
 def is_modifier_key(key: int) -> bool: ...
 def base64_encode(src: Union[str, ReadableBuffer], add_padding: bool = False) -> bytes: ...
 def base64_encode_into(src: Union[str, ReadableBuffer], output: WriteableBuffer, add_padding: bool = False) -> int: ...
 def base64_decode(src: Union[str, ReadableBuffer]) -> bytes: ...
 def base64_decode_into(src: Union[str, ReadableBuffer], output: WriteableBuffer) -> int: ...
+def base85_decode(src: Union[str, ReadableBuffer]) -> bytes: ...
+def start_tracing() -> None: ...
+def stop_tracing() -> None: ...
+def trace_as_json(clear: bool = False) -> bytes: ...
+def test_trace_event(phase: str, window_id: int = 0) -> None: ...
 def cocoa_recreate_global_menu() -> None: ...
 def cocoa_clear_global_shortcuts() -> None: ...
 def update_pointer_shape(os_window_id: int) -> None: ...
@@ -1773,6 +1803,7 @@ class StreamingBase64Encodeer:
 
 class DiskCache:
     small_hole_threshold: int
+    compression_threshold: int
     defrag_factor: int
     @property
     def total_size(self) -> int: ...
@@ -13,6 +13,8 @@
 #include "char-props.h"
 #include "decorations.h"
 #include "glyph-cache.h"
+#include "simd-string.h"
+#include "trace.h"
 
 #define MISSING_GLYPH 1
 #define MAX_NUM_EXTRA_GLYPHS_PUA 4u
@@ -28,8 +30,18 @@ typedef enum {
 } LigatureType;
 
 
+// Sprites are evicted in least recently used order once the number of
+// sprites reaches max_sprites, see sprite_cache_size. last_used stores the
+// render frame in which each sprite was last used, or one of the two special
+// values below.
+#define SPRITE_SLOT_FREE 0u
+#define SPRITE_SLOT_PINNED UINT32_MAX
+
 typedef struct {
     unsigned x, y, z, xnum, ynum, max_y;
+    size_t max_sprites;
+    struct { uint32_t *frames; size_t capacity; } last_used;
+    struct { sprite_index *slots; size_t count, capacity; } free_slots;
 } GPUSpriteTracker;
 
 typedef struct RunFont {
@@ -45,6 +57,7 @@ static hb_buffer_t *harfbuzz_buffer = NULL;
 static hb_feature_t hb_features[3] = {{0}};
 static struct { char_type *codepoints; size_t capacity; } shape_buffer = {0};
 static size_t max_texture_size = 1024, max_array_len = 1024;
+static uint32_t current_render_frame = 1;
 typedef enum { LIGA_FEATURE, DLIG_FEATURE, CALT_FEATURE } HBFeature;
 
 typedef struct {
@@ -117,7 +130,9 @@ static bool cmpr_decorations_key(DecorationsKey a, DecorationsKey b) { return a.
 
 typedef struct {
     FONTS_DATA_HEAD
-    id_type id;
+    // Used to keep recently used font groups around after no OS window uses
+    // them, zero for font groups never used by an OS window
+    uint64_t last_used_at;
     size_t fonts_capacity, fonts_count, fallback_fonts_count;
     ssize_t medium_font_idx, bold_font_idx, italic_font_idx, bi_font_idx, first_symbol_font_idx, first_fallback_font_idx;
     Font *fonts;
@@ -132,6 +147,10 @@ static FontGroup* font_groups = NULL;
 static size_t font_groups_capacity = 0;
 static size_t num_font_groups = 0;
 static id_type font_group_id_counter = 0;
+static uint64_t font_group_use_counter = 0;
+// Maximum number of font groups not used by any OS window to keep, so that
+// returning to a previous font size or DPI does not need to re-render glyphs
+#define MAX_UNUSED_FONT_GROUPS 8
 static void initialize_font_group(FontGroup *fg);
 
 static void
@@ -236,6 +255,8 @@ del_font(Font *f) {
 static void
 del_font_group(FontGroup *fg) {
     free(fg->canvas.buf); free(fg->canvas.alpha_mask); fg->canvas = (Canvas){0};
+    free(fg->sprite_tracker.last_used.frames); free(fg->sprite_tracker.free_slots.slots);
+    zero_at_ptr(&fg->sprite_tracker.last_used); zero_at_ptr(&fg->sprite_tracker.free_slots);
     free_sprite_data((FONTS_DATA_HANDLE)fg);
     vt_cleanup(&fg->fallback_font_map);
     vt_cleanup(&fg->scaled_font_map);
@@ -244,17 +265,43 @@ del_font_group(FontGroup *fg) {
     free(fg->fonts); fg->fonts = NULL; fg->fonts_count = 0;
 }
 
+static size_t
+font_group_memory_usage(const FontGroup *fg) {
+    const GPUSpriteTracker *st = &fg->sprite_tracker;
+    const size_t texture_size = (size_t)st->xnum * fg->fcm.cell_width * st->ynum * (fg->fcm.cell_height + 1) * (st->z + 1) * sizeof(pixel);
+    return (fg->sprite_map ? texture_size : 0) + fg->canvas.size_in_bytes + fg->canvas.alpha_mask_sz_in_bytes;
+}
+
+static void
+remove_font_group(size_t i) {
+    del_font_group(font_groups + i);
+    size_t num_to_right = (--num_font_groups) - i;
+    if (num_to_right) memmove(font_groups + i, font_groups + 1 + i, num_to_right * sizeof(FontGroup));
+}
+
 static void
 trim_unused_font_groups(void) {
+    // Unused font groups that were previously used by an OS window are kept,
+    // least recently used first, as long as there are at most
+    // MAX_UNUSED_FONT_GROUPS of them and their total memory usage is within
+    // sprite_cache_size
     save_window_font_groups();
-    size_t i = 0;
+    const size_t budget = OPT(sprite_cache_size) ? (size_t)OPT(sprite_cache_size) * 1024u * 1024u : SIZE_MAX;
+    size_t i = 0, num_unused = 0, unused_memory = 0;
     while (i < num_font_groups) {
-        if (font_group_is_unused(font_groups + i)) {
-            del_font_group(font_groups + i);
-            size_t num_to_right = (--num_font_groups) - i;
-            if (!num_to_right) break;
-            memmove(font_groups + i, font_groups + 1 + i, num_to_right * sizeof(FontGroup));
-        } else i++;
+        FontGroup *fg = font_groups + i;
+        if (!font_group_is_unused(fg)) { fg->last_used_at = ++font_group_use_counter; i++; }
+        else if (!fg->last_used_at) remove_font_group(i);
+        else { num_unused++; unused_memory += font_group_memory_usage(fg); i++; }
+    }
+    while (num_unused && (num_unused > MAX_UNUSED_FONT_GROUPS || unused_memory > budget)) {
+        size_t lru = num_font_groups;
+        for (i = 0; i < num_font_groups; i++) {
+            if (font_group_is_unused(font_groups + i) && (lru == num_font_groups || font_groups[i].last_used_at < font_groups[lru].last_used_at)) lru = i;
+        }
+        num_unused--; unused_memory -= MIN(unused_memory, font_group_memory_usage(font_groups + lru));
+        debug("Evicting unused font group at size: %.1f pts and dpi: %.1f x %.1f\n", font_groups[lru].font_sz_in_pts, font_groups[lru].logical_dpi_x, font_groups[lru].logical_dpi_y);
+        remove_font_group(lru);
     }
     restore_window_font_groups();
 }
@@ -318,6 +365,118 @@ current_sprite_index(const GPUSpriteTracker *sprite_tracker) {
     return sprite_tracker->z * (sprite_tracker->xnum * sprite_tracker->ynum) + sprite_tracker->y * sprite_tracker->xnum + sprite_tracker->x;
 }
 
+void
+sprite_tracker_next_frame(void) {
+    if (++current_render_frame == SPRITE_SLOT_PINNED) current_render_frame = SPRITE_SLOT_FREE + 1;
+}
+
+static void
+mark_sprite_as_used(GPUSpriteTracker *st, sprite_index idx) {
+    idx &= 0x7fffffff;
+    if (idx < st->last_used.capacity) {
+        uint32_t *f = st->last_used.frames + idx;
+        if (*f != SPRITE_SLOT_PINNED && *f != SPRITE_SLOT_FREE) *f = current_render_frame;
+    }
+}
+
+static bool
+is_sprite_slot_free(void *data, sprite_index idx) {
+    const GPUSpriteTracker *st = data;
+    idx &= 0x7fffffff;
+    return idx && idx < st->last_used.capacity && st->last_used.frames[idx] == SPRITE_SLOT_FREE;
+}
+
+static bool
+mark_cells_as_used(void *data, const GPUCell *cells, index_type num) {
+    for (index_type i = 0; i < num; i++) mark_sprite_as_used(data, cells[i].sprite_idx);
+    return false;
+}
+
+static bool
+cells_use_free_sprite_slot(void *data, const GPUCell *cells, index_type num) {
+    for (index_type i = 0; i < num; i++) if (is_sprite_slot_free(data, cells[i].sprite_idx)) return true;
+    return false;
+}
+
+typedef struct SpriteAge { sprite_index idx; uint32_t frame; } SpriteAge;
+
+static int
+cmp_sprite_age(const void *a_, const void *b_) {
+    const SpriteAge *a = a_, *b = b_;
+    if (a->frame != b->frame) return a->frame < b->frame ? -1 : 1;
+    // evict higher slots first so that the lowest slots are re-used first
+    return a->idx > b->idx ? -1 : (a->idx < b->idx ? 1 : 0);
+}
+
+#define for_each_screen_using_font_group(fg, only_visible, ...) \
+    for (size_t o = 0; o < global_state.num_os_windows; o++) { \
+        OSWindow *osw = global_state.os_windows + o; \
+        if (osw->fonts_data != (FONTS_DATA_HANDLE)(fg)) continue; \
+        Screen *screen = osw->tab_bar_render_data.screen; \
+        if (screen) { __VA_ARGS__; } \
+        for (size_t t = 0; t < osw->num_tabs; t++) { \
+            Tab *tab = osw->tabs + t; \
+            if (only_visible && t != osw->active_tab) continue; \
+            for (size_t w = 0; w < tab->num_windows; w++) { \
+                if (only_visible && !tab->windows[w].visible) continue; \
+                if ((screen = tab->windows[w].render_data.screen)) { __VA_ARGS__; } \
+            } \
+        } \
+    }
+
+static size_t
+evict_least_recently_used_sprites(FontGroup *fg) {
+    GPUSpriteTracker *st = &fg->sprite_tracker;
+    // Sprites that are currently on screen must never be evicted
+    for_each_screen_using_font_group(fg, true, screen_visit_visible_lines(screen, mark_cells_as_used, st));
+    const size_t limit = MIN((size_t)current_sprite_index(st), st->last_used.capacity);
+    RAII_ALLOC(SpriteAge, candidates, malloc(sizeof(SpriteAge) * (limit + 1)));
+    if (!candidates) return 0;
+    size_t num = 0;
+    for (size_t i = 0; i < limit; i++) {
+        const uint32_t f = st->last_used.frames[i];
+        if (f != SPRITE_SLOT_FREE && f != SPRITE_SLOT_PINNED && f != current_render_frame) candidates[num++] = (SpriteAge){.idx=i, .frame=f};
+    }
+    if (!num) return 0;
+    // Evict a quarter of the cache at a time so that the cost of re-rendering
+    // affected lines is amortized over many new sprites
+    const size_t num_to_evict = MIN(num, MAX(1u, limit / 4));
+    qsort(candidates, num, sizeof(candidates[0]), cmp_sprite_age);
+    ensure_space_for(&st->free_slots, slots, sprite_index, st->free_slots.count + num_to_evict, capacity, 256, false);
+    for (size_t i = 0; i < num_to_evict; i++) {
+        st->last_used.frames[candidates[i].idx] = SPRITE_SLOT_FREE;
+        st->free_slots.slots[st->free_slots.count++] = candidates[i].idx;
+    }
+    for (size_t i = 0; i < fg->fonts_count; i++) {
+        if (fg->fonts[i].sprite_position_hash_table) forget_sprite_positions(fg->fonts[i].sprite_position_hash_table, is_sprite_slot_free, st);
+    }
+    for_each_screen_using_font_group(fg, false, screen_dirty_lines_matching(screen, cells_use_free_sprite_slot, st));
+    debug("Evicted %zu of %zu sprites from the sprite cache of the font group at size: %.1f\n", num_to_evict, limit, fg->font_sz_in_pts);
+    return num_to_evict;
+}
+#undef for_each_screen_using_font_group
+
+static bool
+sprite_tracker_is_full(const GPUSpriteTracker *st) {
+    if (current_sprite_index(st) >= st->max_sprites) return true;
+    // do_increment() will fail after the last slot of the last allowed layer
+    return st->z + 1 >= MIN((size_t)UINT16_MAX, max_array_len) && st->y + 1 >= st->max_y && st->x + 1 >= st->xnum;
+}
+
+static bool
+next_sprite_slot(FontGroup *fg, bool pinned, sprite_index *ans) {
+    GPUSpriteTracker *st = &fg->sprite_tracker;
+    if (!st->free_slots.count && sprite_tracker_is_full(st)) evict_least_recently_used_sprites(fg);
+    if (st->free_slots.count) *ans = st->free_slots.slots[--st->free_slots.count];
+    else {
+        *ans = current_sprite_index(st);
+        if (!do_increment(fg)) return false;
+    }
+    ensure_space_for(&st->last_used, frames, uint32_t, (size_t)*ans + 1, capacity, 256, true);
+    st->last_used.frames[*ans] = pinned ? SPRITE_SLOT_PINNED : current_render_frame;
+    return true;
+}
+
 static SpritePosition*
 sprite_position_for(FontGroup *fg, RunFont rf, glyph_index *glyphs, unsigned glyph_count, uint8_t ligature_index, unsigned cell_count) {
     bool created;
@@ -327,6 +486,7 @@ sprite_position_for(FontGroup *fg, RunFont rf, glyph_index *glyphs, unsigned gly
         font->sprite_position_hash_table, glyphs, glyph_count, ligature_index, cell_count,
         rf.scale, subscale, rf.multicell_y, rf.align.val, &created);
     if (!s) { PyErr_NoMemory(); return NULL; }
+    if (s->rendered) mark_sprite_as_used(&fg->sprite_tracker, s->idx);
     return s;
 }
 
@@ -343,6 +503,15 @@ sprite_tracker_set_layout(GPUSpriteTracker *sprite_tracker, unsigned int cell_wi
     sprite_tracker->max_y = MIN(MAX(1u, max_texture_size / cell_height), (size_t)UINT16_MAX);
     sprite_tracker->ynum = 1;
     sprite_tracker->x = 0; sprite_tracker->y = 0; sprite_tracker->z = 0;
+    sprite_tracker->max_sprites = SIZE_MAX;
+    if (OPT(sprite_cache_size)) {
+        // each sprite has an extra row for underline exclusion data
+        const size_t sprite_size = (size_t)cell_width * (cell_height + 1) * sizeof(pixel);
+        const size_t min_sprites = MAX(1024u, 2u * sprite_tracker->xnum);
+        sprite_tracker->max_sprites = MAX(min_sprites, ((size_t)OPT(sprite_cache_size) * 1024u * 1024u) / sprite_size);
+    }
+    sprite_tracker->free_slots.count = 0;
+    if (sprite_tracker->last_used.frames) memset(sprite_tracker->last_used.frames, 0, sizeof(sprite_tracker->last_used.frames[0]) * sprite_tracker->last_used.capacity);
 }
 
 static void
@@ -383,9 +552,9 @@ calculate_underline_exclusion_zones(pixel *buf, const FontGroup *fg, DecorationG
 }
 
 static sprite_index
-current_send_sprite_to_gpu(FontGroup *fg, pixel *buf, DecorationMetadata dec, FontCellMetrics scaled_metrics) {
-    sprite_index ans = current_sprite_index(&fg->sprite_tracker);
-    if (!do_increment(fg)) return 0;
+send_sprite_to_gpu_with_lifetime(FontGroup *fg, pixel *buf, DecorationMetadata dec, FontCellMetrics scaled_metrics, bool pinned) {
+    sprite_index ans;
+    if (!next_sprite_slot(fg, pinned, &ans)) return 0;
     if (python_send_to_gpu_impl) { python_send_to_gpu(fg, ans, buf); return ans; }
     if (dec.underline_region.height && OPT(underline_exclusion).thickness > 0) calculate_underline_exclusion_zones(
             buf, fg, dec.underline_region, scaled_metrics);
@@ -394,6 +563,15 @@ current_send_sprite_to_gpu(FontGroup *fg, pixel *buf, DecorationMetadata dec, Fo
     return ans;
 }
 
+static sprite_index
+current_send_sprite_to_gpu(FontGroup *fg, pixel *buf, DecorationMetadata dec, FontCellMetrics scaled_metrics) {
+    return send_sprite_to_gpu_with_lifetime(fg, buf, dec, scaled_metrics, false);
+}
+
+// Decorations and the pre-rendered sprites are referenced by index from
+// shaders and the decorations map, so they must never be evicted
+#define send_pinned_sprite_to_gpu(fg, buf, dec, scaled_metrics) send_sprite_to_gpu_with_lifetime(fg, buf, dec, scaled_metrics, true)
+
 
 // }}}
 
@@ -794,14 +972,10 @@ static PyObject *descriptor_for_idx = NULL;
 void
 render_alpha_mask(const uint8_t *alpha_mask, pixel* dest, const Region *src_rect, const Region *dest_rect, size_t src_stride, size_t dest_stride, pixel color_rgb) {
     pixel col = color_rgb << 8;
+    if (src_rect->left >= src_rect->right || dest_rect->left >= dest_rect->right) return;
+    const size_t count = MIN(src_rect->right - src_rect->left, dest_rect->right - dest_rect->left);
     for (size_t sr = src_rect->top, dr = dest_rect->top; sr < src_rect->bottom && dr < dest_rect->bottom; sr++, dr++) {
-        pixel *d = dest + dest_stride * dr;
-        const uint8_t *s = alpha_mask + src_stride * sr;
-        for(size_t sc = src_rect->left, dc = dest_rect->left; sc < src_rect->right && dc < dest_rect->right; sc++, dc++) {
-            uint8_t src_alpha = d[dc] & 0xff;
-            uint8_t alpha = s[sc];
-            d[dc] = col | MAX(alpha, src_alpha);
-        }
+        blend_alpha_mask_into_pixels(alpha_mask + src_stride * sr + src_rect->left, dest + dest_stride * dr + dest_rect->left, count, col);
     }
 }
 
@@ -969,7 +1143,8 @@ render_scaled_decoration(FontCellMetrics unscaled_metrics, FontCellMetrics scale
     for (unsigned srcy = src.top, desty=dest.top; srcy < src_limit && desty < dest_limit; srcy++, desty++) {
         uint8_t *srcp = alpha_mask + cell_width * srcy;
         pixel *destp = output + cell_width * desty;
-        for (unsigned x = 0; x < cell_width; x++) destp[x] = 0xffffff00 | srcp[x];
+        // output is zeroed above so this is destp[x] = 0xffffff00 | srcp[x]
+        blend_alpha_mask_into_pixels(srcp, destp, cell_width, 0xffffff00);
     }
 }
 
@@ -988,7 +1163,7 @@ render_decorations(FontGroup *fg, Region src, Region dest, FontCellMetrics scale
     memset(alpha_mask, 0, sizeof(alpha_mask[0]) * scaled_metrics.cell_width * scaled_metrics.cell_height); \
     DecorationGeometry sdg = call; \
     render_scaled_decoration(unscaled_metrics, scaled_metrics, alpha_mask, buf, src, dest); \
-    sprite_index q = current_send_sprite_to_gpu(fg, buf, (DecorationMetadata){0}, scaled_metrics); \
+    sprite_index q = send_pinned_sprite_to_gpu(fg, buf, (DecorationMetadata){0}, scaled_metrics); \
     if (!ans) ans = q; \
     if (is_underline) { \
         Region r = map_scaled_decoration_geometry(sdg, src, dest); \
@@ -1842,6 +2017,7 @@ render_line(FONTS_DATA_HANDLE fg_, Line *line, index_type lnum, Cursor *cursor,
             multicell_intersects_cursor(line, lnum, cursor)) cursor_offset = cursor->x - first_cell_in_run; \
     render_run(fg, line->cpu_cells + first_cell_in_run, line->gpu_cells + first_cell_in_run, i - first_cell_in_run, run_font, false, center_glyph, cursor_offset, disable_ligature_strategy, line->text_cache, lc); \
 }
+    TRACE_BEGIN("render_line");
     FontGroup *fg = (FontGroup*)fg_;
     RunFont basic_font = {.scale=1, .font_idx = NO_FONT}, run_font = basic_font, cell_font = basic_font;
     bool center_glyph = false;
@@ -1915,6 +2091,7 @@ render_line(FONTS_DATA_HANDLE fg_, Line *line, index_type lnum, Cursor *cursor,
     }
     RENDER
 #undef RENDER
+    TRACE_END("render_line");
 }
 
 StringCanvas
@@ -1972,7 +2149,7 @@ send_prerendered_sprites(FontGroup *fg) {
     // blank cell
     ensure_canvas_can_fit(fg, 1, 1);
     DecorationMetadata dm = {.start_idx=5};
-    current_send_sprite_to_gpu(fg, fg->canvas.buf, dm, fg->fcm);
+    send_pinned_sprite_to_gpu(fg, fg->canvas.buf, dm, fg->fcm);
     const unsigned cell_area = fg->fcm.cell_height * fg->fcm.cell_width;
     RAII_ALLOC(uint8_t, alpha_mask, malloc(cell_area));
     if (!alpha_mask) fatal("Out of memory");
@@ -1982,7 +2159,7 @@ send_prerendered_sprites(FontGroup *fg) {
     call; \
     ensure_canvas_can_fit(fg, 1, 1);  /* clear canvas */ \
     render_alpha_mask(alpha_mask, fg->canvas.buf, &r, &r, fg->fcm.cell_width, fg->fcm.cell_width, 0xffffff); \
-    current_send_sprite_to_gpu(fg, fg->canvas.buf, dm, fg->fcm);
+    send_pinned_sprite_to_gpu(fg, fg->canvas.buf, dm, fg->fcm);
 
     // If you change the mapping of these cells you will need to change
     // BEAM_IDX in shader.c and STRIKE_SPRITE_INDEX in
@@ -2065,6 +2242,7 @@ send_prerendered_sprites_for_window(OSWindow *w) {
 FONTS_DATA_HANDLE
 load_fonts_data(double font_sz_in_pts, double dpi_x, double dpi_y) {
     FontGroup *fg = font_group_for(font_sz_in_pts, dpi_x, dpi_y);
+    fg->last_used_at = ++font_group_use_counter;
     return (FONTS_DATA_HANDLE)fg;
 }
 
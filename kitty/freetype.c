@@ -9,6 +9,7 @@
 #include "colors.h"
 #include "cleanup.h"
 #include "state.h"
+#include "simd-string.h"
 #include <math.h>
 #include <structmember.h>
 #include <ft2build.h>
@@ -643,20 +644,9 @@ downsample_32bit_image(uint8_t *src, unsigned src_width, unsigned src_height, un
     float ratio = MAX((float)src_width / dest_width, (float)src_height / dest_height);
     int factor = (int)ceilf(ratio);
     uint8_t *d = dest;
-    for (unsigned int i = 0, sr = 0; i < dest_height; i++, sr += factor) {
-        for (unsigned int j = 0, sc = 0; j < dest_width; j++, sc += factor, d += 4) {
-            // calculate area average
-            unsigned int r=0, g=0, b=0, a=0, count=0;
-            for (unsigned int y=sr; y < MIN(sr + factor, src_height); y++) {
-                uint8_t *p = src + (y * src_stride) + sc * 4;
-                for (unsigned int x=sc; x < MIN(sc + factor, src_width); x++, count++) {
-                    b += *(p++); g += *(p++); r += *(p++); a += *(p++);
-                }
-            }
-            if (count) {
-                d[0] = b / count; d[1] = g / count; d[2] = r / count; d[3] = a / count;
-            }
-        }
+    for (unsigned int i = 0, sr = 0; i < dest_height; i++, sr += factor, d += 4 * dest_width) {
+        const unsigned num_rows = sr < src_height ? MIN((unsigned)factor, src_height - sr) : 0;
+        downsample_bgra_row(src + (size_t)sr * src_stride, src_stride, num_rows, src_width, factor, d, dest_width);
     }
     return factor;
 }
@@ -889,16 +879,10 @@ render_color_bitmap(Face *self, int glyph_id, ProcessedBitmap *ans, unsigned int
 
 static void
 copy_color_bitmap_bgra(uint8_t *src, pixel* dest, Region *src_rect, Region *dest_rect, size_t src_stride, size_t dest_stride) {
+    if (src_rect->left >= src_rect->right || dest_rect->left >= dest_rect->right) return;
+    const size_t count = MIN(src_rect->right - src_rect->left, dest_rect->right - dest_rect->left);
     for (size_t sr = src_rect->top, dr = dest_rect->top; sr < src_rect->bottom && dr < dest_rect->bottom; sr++, dr++) {
-        pixel *d = dest + dest_stride * dr;
-        uint8_t *s = src + src_stride * sr;
-        for(size_t sc = src_rect->left, dc = dest_rect->left; sc < src_rect->right && dc < dest_rect->right; sc++, dc++) {
-            uint8_t *bgra = s + 4 * sc;
-            const float inv_alpha = 255.f / bgra[3];
-#define C(idx, shift) ( (uint8_t)(bgra[idx] * inv_alpha) << shift)
-            d[dc] = C(2, 24) | C(1, 16) | C(0, 8) | bgra[3];
-#undef C
-        }
+        unpremultiply_bgra_into_pixels(src + src_stride * sr + 4 * src_rect->left, dest + dest_stride * dr + dest_rect->left, count);
     }
 }
 
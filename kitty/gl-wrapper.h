@@ -19,10 +19,10 @@
  *  - ON_DEMAND = False
  *
  * Commandline:
- *    --api='gl:core=3.1' --extensions='GL_ARB_copy_image,GL_ARB_instanced_arrays,GL_ARB_multisample,GL_ARB_robustness,GL_ARB_texture_storage,GL_KHR_debug' c --debug --header-only
+ *    --api='gl:core=3.1' --extensions='GL_ARB_buffer_storage,GL_ARB_copy_image,GL_ARB_instanced_arrays,GL_ARB_multisample,GL_ARB_robustness,GL_ARB_sync,GL_ARB_texture_storage,GL_KHR_debug' c --debug --header-only
  *
  * Online:
- *    http://glad.sh/#api=gl%3Acore%3D3.1&extensions=GL_ARB_copy_image%2CGL_ARB_instanced_arrays%2CGL_ARB_multisample%2CGL_ARB_robustness%2CGL_ARB_texture_storage%2CGL_KHR_debug&generator=c&options=DEBUG%2CHEADER_ONLY
+ *    http://glad.sh/#api=gl%3Acore%3D3.1&extensions=GL_ARB_buffer_storage%2CGL_ARB_copy_image%2CGL_ARB_instanced_arrays%2CGL_ARB_multisample%2CGL_ARB_robustness%2CGL_ARB_sync%2CGL_ARB_texture_storage%2CGL_KHR_debug&generator=c&options=DEBUG%2CHEADER_ONLY
  *
  */
 #ifndef GLAD_GL_H_
@@ -192,6 +192,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_ALPHA_TEST 0x0BC0
 #define GL_ALPHA_TEST_FUNC 0x0BC1
 #define GL_ALPHA_TEST_REF 0x0BC2
+#define GL_ALREADY_SIGNALED 0x911A
 #define GL_ALWAYS 0x0207
 #define GL_AMBIENT 0x1200
 #define GL_AMBIENT_AND_DIFFUSE 0x1602
@@ -240,11 +241,13 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_BUFFER 0x82E0
 #define GL_BUFFER_ACCESS 0x88BB
 #define GL_BUFFER_ACCESS_FLAGS 0x911F
+#define GL_BUFFER_IMMUTABLE_STORAGE 0x821F
 #define GL_BUFFER_MAPPED 0x88BC
 #define GL_BUFFER_MAP_LENGTH 0x9120
 #define GL_BUFFER_MAP_OFFSET 0x9121
 #define GL_BUFFER_MAP_POINTER 0x88BD
 #define GL_BUFFER_SIZE 0x8764
+#define GL_BUFFER_STORAGE_FLAGS 0x8220
 #define GL_BUFFER_USAGE 0x8765
 #define GL_BYTE 0x1400
 #define GL_C3F_V3F 0x2A24
@@ -262,7 +265,9 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_CLIENT_ACTIVE_TEXTURE 0x84E1
 #define GL_CLIENT_ALL_ATTRIB_BITS 0xFFFFFFFF
 #define GL_CLIENT_ATTRIB_STACK_DEPTH 0x0BB1
+#define GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT 0x00004000
 #define GL_CLIENT_PIXEL_STORE_BIT 0x00000001
+#define GL_CLIENT_STORAGE_BIT 0x0200
 #define GL_CLIENT_VERTEX_ARRAY_BIT 0x00000002
 #define GL_CLIP_DISTANCE0 0x3000
 #define GL_CLIP_DISTANCE1 0x3001
@@ -353,6 +358,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_COMPRESSED_SRGB 0x8C48
 #define GL_COMPRESSED_SRGB_ALPHA 0x8C49
 #define GL_COMPRESSED_TEXTURE_FORMATS 0x86A3
+#define GL_CONDITION_SATISFIED 0x911C
 #define GL_CONSTANT 0x8576
 #define GL_CONSTANT_ALPHA 0x8003
 #define GL_CONSTANT_ATTENUATION 0x1207
@@ -472,6 +478,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_DYNAMIC_COPY 0x88EA
 #define GL_DYNAMIC_DRAW 0x88E8
 #define GL_DYNAMIC_READ 0x88E9
+#define GL_DYNAMIC_STORAGE_BIT 0x0100
 #define GL_EDGE_FLAG 0x0B43
 #define GL_EDGE_FLAG_ARRAY 0x8079
 #define GL_EDGE_FLAG_ARRAY_BUFFER_BINDING 0x889B
@@ -707,10 +714,12 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_MAP2_TEXTURE_COORD_4 0x0DB6
 #define GL_MAP2_VERTEX_3 0x0DB7
 #define GL_MAP2_VERTEX_4 0x0DB8
+#define GL_MAP_COHERENT_BIT 0x0080
 #define GL_MAP_COLOR 0x0D10
 #define GL_MAP_FLUSH_EXPLICIT_BIT 0x0010
 #define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
 #define GL_MAP_INVALIDATE_RANGE_BIT 0x0004
+#define GL_MAP_PERSISTENT_BIT 0x0040
 #define GL_MAP_READ_BIT 0x0001
 #define GL_MAP_STENCIL 0x0D11
 #define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
@@ -751,6 +760,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_MAX_RECTANGLE_TEXTURE_SIZE 0x84F8
 #define GL_MAX_RENDERBUFFER_SIZE 0x84E8
 #define GL_MAX_SAMPLES 0x8D57
+#define GL_MAX_SERVER_WAIT_TIMEOUT 0x9111
 #define GL_MAX_TEXTURE_BUFFER_SIZE 0x8C2B
 #define GL_MAX_TEXTURE_COORDS 0x8871
 #define GL_MAX_TEXTURE_IMAGE_UNITS 0x8872
@@ -808,6 +818,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_NUM_EXTENSIONS 0x821D
 #define GL_OBJECT_LINEAR 0x2401
 #define GL_OBJECT_PLANE 0x2501
+#define GL_OBJECT_TYPE 0x9112
 #define GL_ONE 1
 #define GL_ONE_MINUS_CONSTANT_ALPHA 0x8004
 #define GL_ONE_MINUS_CONSTANT_COLOR 0x8002
@@ -1074,6 +1085,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_SHADING_LANGUAGE_VERSION 0x8B8C
 #define GL_SHININESS 0x1601
 #define GL_SHORT 0x1402
+#define GL_SIGNALED 0x9119
 #define GL_SIGNED_NORMALIZED 0x8F9C
 #define GL_SINGLE_COLOR 0x81F9
 #define GL_SLUMINANCE 0x8C46
@@ -1145,6 +1157,12 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_STREAM_READ 0x88E1
 #define GL_SUBPIXEL_BITS 0x0D50
 #define GL_SUBTRACT 0x84E7
+#define GL_SYNC_CONDITION 0x9113
+#define GL_SYNC_FENCE 0x9116
+#define GL_SYNC_FLAGS 0x9115
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_STATUS 0x9114
 #define GL_T 0x2001
 #define GL_T2F_C3F_V3F 0x2A2A
 #define GL_T2F_C4F_N3F_V3F 0x2A2C
@@ -1268,6 +1286,8 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_TEXTURE_WRAP_R 0x8072
 #define GL_TEXTURE_WRAP_S 0x2802
 #define GL_TEXTURE_WRAP_T 0x2803
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_TIMEOUT_IGNORED 0xFFFFFFFFFFFFFFFF
 #define GL_TRANSFORM_BIT 0x00001000
 #define GL_TRANSFORM_FEEDBACK_BUFFER 0x8C8E
 #define GL_TRANSFORM_FEEDBACK_BUFFER_BINDING 0x8C8F
@@ -1315,6 +1335,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_UNPACK_SKIP_PIXELS 0x0CF4
 #define GL_UNPACK_SKIP_ROWS 0x0CF3
 #define GL_UNPACK_SWAP_BYTES 0x0CF0
+#define GL_UNSIGNALED 0x9118
 #define GL_UNSIGNED_BYTE 0x1401
 #define GL_UNSIGNED_BYTE_2_3_3_REV 0x8362
 #define GL_UNSIGNED_BYTE_3_3_2 0x8032
@@ -1372,6 +1393,7 @@ typedef void (*GLADpostcallback)(void *ret, const char *name, GLADapiproc apipro
 #define GL_VERTEX_SHADER 0x8B31
 #define GL_VIEWPORT 0x0BA2
 #define GL_VIEWPORT_BIT 0x00000800
+#define GL_WAIT_FAILED 0x911D
 #define GL_WEIGHT_ARRAY_BUFFER_BINDING 0x889E
 #define GL_WRITE_ONLY 0x88B9
 #define GL_XOR 0x1506
@@ -1742,6 +1764,8 @@ GLAD_API_CALL int GLAD_GL_VERSION_2_1;
 GLAD_API_CALL int GLAD_GL_VERSION_3_0;
 #define GL_VERSION_3_1 1
 GLAD_API_CALL int GLAD_GL_VERSION_3_1;
+#define GL_ARB_buffer_storage 1
+GLAD_API_CALL int GLAD_GL_ARB_buffer_storage;
 #define GL_ARB_copy_image 1
 GLAD_API_CALL int GLAD_GL_ARB_copy_image;
 #define GL_ARB_instanced_arrays 1
@@ -1750,6 +1774,8 @@ GLAD_API_CALL int GLAD_GL_ARB_instanced_arrays;
 GLAD_API_CALL int GLAD_GL_ARB_multisample;
 #define GL_ARB_robustness 1
 GLAD_API_CALL int GLAD_GL_ARB_robustness;
+#define GL_ARB_sync 1
+GLAD_API_CALL int GLAD_GL_ARB_sync;
 #define GL_ARB_texture_storage 1
 GLAD_API_CALL int GLAD_GL_ARB_texture_storage;
 #define GL_KHR_debug 1
@@ -1781,6 +1807,7 @@ typedef void (GLAD_API_PTR *PFNGLBLENDFUNCPROC)(GLenum sfactor, GLenum dfactor);
 typedef void (GLAD_API_PTR *PFNGLBLENDFUNCSEPARATEPROC)(GLenum sfactorRGB, GLenum dfactorRGB, GLenum sfactorAlpha, GLenum dfactorAlpha);
 typedef void (GLAD_API_PTR *PFNGLBLITFRAMEBUFFERPROC)(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter);
 typedef void (GLAD_API_PTR *PFNGLBUFFERDATAPROC)(GLenum target, GLsizeiptr size, const void * data, GLenum usage);
+typedef void (GLAD_API_PTR *PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void * data, GLbitfield flags);
 typedef void (GLAD_API_PTR *PFNGLBUFFERSUBDATAPROC)(GLenum target, GLintptr offset, GLsizeiptr size, const void * data);
 typedef void (GLAD_API_PTR *PFNGLCALLLISTPROC)(GLuint list);
 typedef void (GLAD_API_PTR *PFNGLCALLLISTSPROC)(GLsizei n, GLenum type, const void * lists);
@@ -1797,6 +1824,7 @@ typedef void (GLAD_API_PTR *PFNGLCLEARDEPTHPROC)(GLdouble depth);
 typedef void (GLAD_API_PTR *PFNGLCLEARINDEXPROC)(GLfloat c);
 typedef void (GLAD_API_PTR *PFNGLCLEARSTENCILPROC)(GLint s);
 typedef void (GLAD_API_PTR *PFNGLCLIENTACTIVETEXTUREPROC)(GLenum texture);
+typedef GLenum (GLAD_API_PTR *PFNGLCLIENTWAITSYNCPROC)(GLsync sync, GLbitfield flags, GLuint64 timeout);
 typedef void (GLAD_API_PTR *PFNGLCLIPPLANEPROC)(GLenum plane, const GLdouble * equation);
 typedef void (GLAD_API_PTR *PFNGLCOLOR3BPROC)(GLbyte red, GLbyte green, GLbyte blue);
 typedef void (GLAD_API_PTR *PFNGLCOLOR3BVPROC)(const GLbyte * v);
@@ -1862,6 +1890,7 @@ typedef void (GLAD_API_PTR *PFNGLDELETEPROGRAMPROC)(GLuint program);
 typedef void (GLAD_API_PTR *PFNGLDELETEQUERIESPROC)(GLsizei n, const GLuint * ids);
 typedef void (GLAD_API_PTR *PFNGLDELETERENDERBUFFERSPROC)(GLsizei n, const GLuint * renderbuffers);
 typedef void (GLAD_API_PTR *PFNGLDELETESHADERPROC)(GLuint shader);
+typedef void (GLAD_API_PTR *PFNGLDELETESYNCPROC)(GLsync sync);
 typedef void (GLAD_API_PTR *PFNGLDELETETEXTURESPROC)(GLsizei n, const GLuint * textures);
 typedef void (GLAD_API_PTR *PFNGLDELETEVERTEXARRAYSPROC)(GLsizei n, const GLuint * arrays);
 typedef void (GLAD_API_PTR *PFNGLDEPTHFUNCPROC)(GLenum func);
@@ -1905,6 +1934,7 @@ typedef void (GLAD_API_PTR *PFNGLEVALMESH2PROC)(GLenum mode, GLint i1, GLint i2,
 typedef void (GLAD_API_PTR *PFNGLEVALPOINT1PROC)(GLint i);
 typedef void (GLAD_API_PTR *PFNGLEVALPOINT2PROC)(GLint i, GLint j);
 typedef void (GLAD_API_PTR *PFNGLFEEDBACKBUFFERPROC)(GLsizei size, GLenum type, GLfloat * buffer);
+typedef GLsync (GLAD_API_PTR *PFNGLFENCESYNCPROC)(GLenum condition, GLbitfield flags);
 typedef void (GLAD_API_PTR *PFNGLFINISHPROC)(void);
 typedef void (GLAD_API_PTR *PFNGLFLUSHPROC)(void);
 typedef void (GLAD_API_PTR *PFNGLFLUSHMAPPEDBUFFERRANGEPROC)(GLenum target, GLintptr offset, GLsizeiptr length);
@@ -1954,6 +1984,7 @@ typedef void (GLAD_API_PTR *PFNGLGETFLOATVPROC)(GLenum pname, GLfloat * data);
 typedef GLint (GLAD_API_PTR *PFNGLGETFRAGDATALOCATIONPROC)(GLuint program, const GLchar * name);
 typedef void (GLAD_API_PTR *PFNGLGETFRAMEBUFFERATTACHMENTPARAMETERIVPROC)(GLenum target, GLenum attachment, GLenum pname, GLint * params);
 typedef GLenum (GLAD_API_PTR *PFNGLGETGRAPHICSRESETSTATUSARBPROC)(void);
+typedef void (GLAD_API_PTR *PFNGLGETINTEGER64VPROC)(GLenum pname, GLint64 * data);
 typedef void (GLAD_API_PTR *PFNGLGETINTEGERI_VPROC)(GLenum target, GLuint index, GLint * data);
 typedef void (GLAD_API_PTR *PFNGLGETINTEGERVPROC)(GLenum pname, GLint * data);
 typedef void (GLAD_API_PTR *PFNGLGETLIGHTFVPROC)(GLenum light, GLenum pname, GLfloat * params);
@@ -1981,6 +2012,7 @@ typedef void (GLAD_API_PTR *PFNGLGETSHADERSOURCEPROC)(GLuint shader, GLsizei buf
 typedef void (GLAD_API_PTR *PFNGLGETSHADERIVPROC)(GLuint shader, GLenum pname, GLint * params);
 typedef const GLubyte * (GLAD_API_PTR *PFNGLGETSTRINGPROC)(GLenum name);
 typedef const GLubyte * (GLAD_API_PTR *PFNGLGETSTRINGIPROC)(GLenum name, GLuint index);
+typedef void (GLAD_API_PTR *PFNGLGETSYNCIVPROC)(GLsync sync, GLenum pname, GLsizei count, GLsizei * length, GLint * values);
 typedef void (GLAD_API_PTR *PFNGLGETTEXENVFVPROC)(GLenum target, GLenum pname, GLfloat * params);
 typedef void (GLAD_API_PTR *PFNGLGETTEXENVIVPROC)(GLenum target, GLenum pname, GLint * params);
 typedef void (GLAD_API_PTR *PFNGLGETTEXGENDVPROC)(GLenum coord, GLenum pname, GLdouble * params);
@@ -2036,6 +2068,7 @@ typedef GLboolean (GLAD_API_PTR *PFNGLISPROGRAMPROC)(GLuint program);
 typedef GLboolean (GLAD_API_PTR *PFNGLISQUERYPROC)(GLuint id);
 typedef GLboolean (GLAD_API_PTR *PFNGLISRENDERBUFFERPROC)(GLuint renderbuffer);
 typedef GLboolean (GLAD_API_PTR *PFNGLISSHADERPROC)(GLuint shader);
+typedef GLboolean (GLAD_API_PTR *PFNGLISSYNCPROC)(GLsync sync);
 typedef GLboolean (GLAD_API_PTR *PFNGLISTEXTUREPROC)(GLuint texture);
 typedef GLboolean (GLAD_API_PTR *PFNGLISVERTEXARRAYPROC)(GLuint array);
 typedef void (GLAD_API_PTR *PFNGLLIGHTMODELFPROC)(GLenum pname, GLfloat param);
@@ -2409,6 +2442,7 @@ typedef void (GLAD_API_PTR *PFNGLVERTEXATTRIBIPOINTERPROC)(GLuint index, GLint s
 typedef void (GLAD_API_PTR *PFNGLVERTEXATTRIBPOINTERPROC)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void * pointer);
 typedef void (GLAD_API_PTR *PFNGLVERTEXPOINTERPROC)(GLint size, GLenum type, GLsizei stride, const void * pointer);
 typedef void (GLAD_API_PTR *PFNGLVIEWPORTPROC)(GLint x, GLint y, GLsizei width, GLsizei height);
+typedef void (GLAD_API_PTR *PFNGLWAITSYNCPROC)(GLsync sync, GLbitfield flags, GLuint64 timeout);
 typedef void (GLAD_API_PTR *PFNGLWINDOWPOS2DPROC)(GLdouble x, GLdouble y);
 typedef void (GLAD_API_PTR *PFNGLWINDOWPOS2DVPROC)(const GLdouble * v);
 typedef void (GLAD_API_PTR *PFNGLWINDOWPOS2FPROC)(GLfloat x, GLfloat y);
@@ -2506,6 +2540,9 @@ GLAD_API_CALL PFNGLBLITFRAMEBUFFERPROC glad_debug_glBlitFramebuffer;
 GLAD_API_CALL PFNGLBUFFERDATAPROC glad_glBufferData;
 GLAD_API_CALL PFNGLBUFFERDATAPROC glad_debug_glBufferData;
 #define glBufferData glad_debug_glBufferData
+GLAD_API_CALL PFNGLBUFFERSTORAGEPROC glad_glBufferStorage;
+GLAD_API_CALL PFNGLBUFFERSTORAGEPROC glad_debug_glBufferStorage;
+#define glBufferStorage glad_debug_glBufferStorage
 GLAD_API_CALL PFNGLBUFFERSUBDATAPROC glad_glBufferSubData;
 GLAD_API_CALL PFNGLBUFFERSUBDATAPROC glad_debug_glBufferSubData;
 #define glBufferSubData glad_debug_glBufferSubData
@@ -2554,6 +2591,9 @@ GLAD_API_CALL PFNGLCLEARSTENCILPROC glad_debug_glClearStencil;
 GLAD_API_CALL PFNGLCLIENTACTIVETEXTUREPROC glad_glClientActiveTexture;
 GLAD_API_CALL PFNGLCLIENTACTIVETEXTUREPROC glad_debug_glClientActiveTexture;
 #define glClientActiveTexture glad_debug_glClientActiveTexture
+GLAD_API_CALL PFNGLCLIENTWAITSYNCPROC glad_glClientWaitSync;
+GLAD_API_CALL PFNGLCLIENTWAITSYNCPROC glad_debug_glClientWaitSync;
+#define glClientWaitSync glad_debug_glClientWaitSync
 GLAD_API_CALL PFNGLCLIPPLANEPROC glad_glClipPlane;
 GLAD_API_CALL PFNGLCLIPPLANEPROC glad_debug_glClipPlane;
 #define glClipPlane glad_debug_glClipPlane
@@ -2749,6 +2789,9 @@ GLAD_API_CALL PFNGLDELETERENDERBUFFERSPROC glad_debug_glDeleteRenderbuffers;
 GLAD_API_CALL PFNGLDELETESHADERPROC glad_glDeleteShader;
 GLAD_API_CALL PFNGLDELETESHADERPROC glad_debug_glDeleteShader;
 #define glDeleteShader glad_debug_glDeleteShader
+GLAD_API_CALL PFNGLDELETESYNCPROC glad_glDeleteSync;
+GLAD_API_CALL PFNGLDELETESYNCPROC glad_debug_glDeleteSync;
+#define glDeleteSync glad_debug_glDeleteSync
 GLAD_API_CALL PFNGLDELETETEXTURESPROC glad_glDeleteTextures;
 GLAD_API_CALL PFNGLDELETETEXTURESPROC glad_debug_glDeleteTextures;
 #define glDeleteTextures glad_debug_glDeleteTextures
@@ -2878,6 +2921,9 @@ GLAD_API_CALL PFNGLEVALPOINT2PROC glad_debug_glEvalPoint2;
 GLAD_API_CALL PFNGLFEEDBACKBUFFERPROC glad_glFeedbackBuffer;
 GLAD_API_CALL PFNGLFEEDBACKBUFFERPROC glad_debug_glFeedbackBuffer;
 #define glFeedbackBuffer glad_debug_glFeedbackBuffer
+GLAD_API_CALL PFNGLFENCESYNCPROC glad_glFenceSync;
+GLAD_API_CALL PFNGLFENCESYNCPROC glad_debug_glFenceSync;
+#define glFenceSync glad_debug_glFenceSync
 GLAD_API_CALL PFNGLFINISHPROC glad_glFinish;
 GLAD_API_CALL PFNGLFINISHPROC glad_debug_glFinish;
 #define glFinish glad_debug_glFinish
@@ -3025,6 +3071,9 @@ GLAD_API_CALL PFNGLGETFRAMEBUFFERATTACHMENTPARAMETERIVPROC glad_debug_glGetFrame
 GLAD_API_CALL PFNGLGETGRAPHICSRESETSTATUSARBPROC glad_glGetGraphicsResetStatusARB;
 GLAD_API_CALL PFNGLGETGRAPHICSRESETSTATUSARBPROC glad_debug_glGetGraphicsResetStatusARB;
 #define glGetGraphicsResetStatusARB glad_debug_glGetGraphicsResetStatusARB
+GLAD_API_CALL PFNGLGETINTEGER64VPROC glad_glGetInteger64v;
+GLAD_API_CALL PFNGLGETINTEGER64VPROC glad_debug_glGetInteger64v;
+#define glGetInteger64v glad_debug_glGetInteger64v
 GLAD_API_CALL PFNGLGETINTEGERI_VPROC glad_glGetIntegeri_v;
 GLAD_API_CALL PFNGLGETINTEGERI_VPROC glad_debug_glGetIntegeri_v;
 #define glGetIntegeri_v glad_debug_glGetIntegeri_v
@@ -3106,6 +3155,9 @@ GLAD_API_CALL PFNGLGETSTRINGPROC glad_debug_glGetString;
 GLAD_API_CALL PFNGLGETSTRINGIPROC glad_glGetStringi;
 GLAD_API_CALL PFNGLGETSTRINGIPROC glad_debug_glGetStringi;
 #define glGetStringi glad_debug_glGetStringi
+GLAD_API_CALL PFNGLGETSYNCIVPROC glad_glGetSynciv;
+GLAD_API_CALL PFNGLGETSYNCIVPROC glad_debug_glGetSynciv;
+#define glGetSynciv glad_debug_glGetSynciv
 GLAD_API_CALL PFNGLGETTEXENVFVPROC glad_glGetTexEnvfv;
 GLAD_API_CALL PFNGLGETTEXENVFVPROC glad_debug_glGetTexEnvfv;
 #define glGetTexEnvfv glad_debug_glGetTexEnvfv
@@ -3271,6 +3323,9 @@ GLAD_API_CALL PFNGLISRENDERBUFFERPROC glad_debug_glIsRenderbuffer;
 GLAD_API_CALL PFNGLISSHADERPROC glad_glIsShader;
 GLAD_API_CALL PFNGLISSHADERPROC glad_debug_glIsShader;
 #define glIsShader glad_debug_glIsShader
+GLAD_API_CALL PFNGLISSYNCPROC glad_glIsSync;
+GLAD_API_CALL PFNGLISSYNCPROC glad_debug_glIsSync;
+#define glIsSync glad_debug_glIsSync
 GLAD_API_CALL PFNGLISTEXTUREPROC glad_glIsTexture;
 GLAD_API_CALL PFNGLISTEXTUREPROC glad_debug_glIsTexture;
 #define glIsTexture glad_debug_glIsTexture
@@ -4390,6 +4445,9 @@ GLAD_API_CALL PFNGLVERTEXPOINTERPROC glad_debug_glVertexPointer;
 GLAD_API_CALL PFNGLVIEWPORTPROC glad_glViewport;
 GLAD_API_CALL PFNGLVIEWPORTPROC glad_debug_glViewport;
 #define glViewport glad_debug_glViewport
+GLAD_API_CALL PFNGLWAITSYNCPROC glad_glWaitSync;
+GLAD_API_CALL PFNGLWAITSYNCPROC glad_debug_glWaitSync;
+#define glWaitSync glad_debug_glWaitSync
 GLAD_API_CALL PFNGLWINDOWPOS2DPROC glad_glWindowPos2d;
 GLAD_API_CALL PFNGLWINDOWPOS2DPROC glad_debug_glWindowPos2d;
 #define glWindowPos2d glad_debug_glWindowPos2d
@@ -4477,10 +4535,12 @@ int GLAD_GL_VERSION_2_0 = 0;
 int GLAD_GL_VERSION_2_1 = 0;
 int GLAD_GL_VERSION_3_0 = 0;
 int GLAD_GL_VERSION_3_1 = 0;
+int GLAD_GL_ARB_buffer_storage = 0;
 int GLAD_GL_ARB_copy_image = 0;
 int GLAD_GL_ARB_instanced_arrays = 0;
 int GLAD_GL_ARB_multisample = 0;
 int GLAD_GL_ARB_robustness = 0;
+int GLAD_GL_ARB_sync = 0;
 int GLAD_GL_ARB_texture_storage = 0;
 int GLAD_GL_KHR_debug = 0;
 static void _pre_call_gl_callback_default(const char *name, GLADapiproc apiproc, int len_args, ...) {
@@ -4704,6 +4764,13 @@ static void GLAD_API_PTR glad_debug_impl_glBufferData(GLenum target, GLsizeiptr
     _post_call_gl_callback(NULL, "glBufferData", (GLADapiproc) glad_glBufferData, 4, target, size, data, usage);
 }
 PFNGLBUFFERDATAPROC glad_debug_glBufferData = glad_debug_impl_glBufferData;
+PFNGLBUFFERSTORAGEPROC glad_glBufferStorage = NULL;
+static void GLAD_API_PTR glad_debug_impl_glBufferStorage(GLenum target, GLsizeiptr size, const void * data, GLbitfield flags) {
+    _pre_call_gl_callback("glBufferStorage", (GLADapiproc) glad_glBufferStorage, 4, target, size, data, flags);
+    glad_glBufferStorage(target, size, data, flags);
+    _post_call_gl_callback(NULL, "glBufferStorage", (GLADapiproc) glad_glBufferStorage, 4, target, size, data, flags);
+}
+PFNGLBUFFERSTORAGEPROC glad_debug_glBufferStorage = glad_debug_impl_glBufferStorage;
 PFNGLBUFFERSUBDATAPROC glad_glBufferSubData = NULL;
 static void GLAD_API_PTR glad_debug_impl_glBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void * data) {
     _pre_call_gl_callback("glBufferSubData", (GLADapiproc) glad_glBufferSubData, 4, target, offset, size, data);
@@ -4818,6 +4885,15 @@ static void GLAD_API_PTR glad_debug_impl_glClientActiveTexture(GLenum texture) {
     _post_call_gl_callback(NULL, "glClientActiveTexture", (GLADapiproc) glad_glClientActiveTexture, 1, texture);
 }
 PFNGLCLIENTACTIVETEXTUREPROC glad_debug_glClientActiveTexture = glad_debug_impl_glClientActiveTexture;
+PFNGLCLIENTWAITSYNCPROC glad_glClientWaitSync = NULL;
+static GLenum GLAD_API_PTR glad_debug_impl_glClientWaitSync(GLsync sync, GLbitfield flags, GLuint64 timeout) {
+    GLenum ret;
+    _pre_call_gl_callback("glClientWaitSync", (GLADapiproc) glad_glClientWaitSync, 3, sync, flags, timeout);
+    ret = glad_glClientWaitSync(sync, flags, timeout);
+    _post_call_gl_callback((void*) &ret, "glClientWaitSync", (GLADapiproc) glad_glClientWaitSync, 3, sync, flags, timeout);
+    return ret;
+}
+PFNGLCLIENTWAITSYNCPROC glad_debug_glClientWaitSync = glad_debug_impl_glClientWaitSync;
 PFNGLCLIPPLANEPROC glad_glClipPlane = NULL;
 static void GLAD_API_PTR glad_debug_impl_glClipPlane(GLenum plane, const GLdouble * equation) {
     _pre_call_gl_callback("glClipPlane", (GLADapiproc) glad_glClipPlane, 2, plane, equation);
@@ -5277,6 +5353,13 @@ static void GLAD_API_PTR glad_debug_impl_glDeleteShader(GLuint shader) {
     _post_call_gl_callback(NULL, "glDeleteShader", (GLADapiproc) glad_glDeleteShader, 1, shader);
 }
 PFNGLDELETESHADERPROC glad_debug_glDeleteShader = glad_debug_impl_glDeleteShader;
+PFNGLDELETESYNCPROC glad_glDeleteSync = NULL;
+static void GLAD_API_PTR glad_debug_impl_glDeleteSync(GLsync sync) {
+    _pre_call_gl_callback("glDeleteSync", (GLADapiproc) glad_glDeleteSync, 1, sync);
+    glad_glDeleteSync(sync);
+    _post_call_gl_callback(NULL, "glDeleteSync", (GLADapiproc) glad_glDeleteSync, 1, sync);
+}
+PFNGLDELETESYNCPROC glad_debug_glDeleteSync = glad_debug_impl_glDeleteSync;
 PFNGLDELETETEXTURESPROC glad_glDeleteTextures = NULL;
 static void GLAD_API_PTR glad_debug_impl_glDeleteTextures(GLsizei n, const GLuint * textures) {
     _pre_call_gl_callback("glDeleteTextures", (GLADapiproc) glad_glDeleteTextures, 2, n, textures);
@@ -5578,6 +5661,15 @@ static void GLAD_API_PTR glad_debug_impl_glFeedbackBuffer(GLsizei size, GLenum t
     _post_call_gl_callback(NULL, "glFeedbackBuffer", (GLADapiproc) glad_glFeedbackBuffer, 3, size, type, buffer);
 }
 PFNGLFEEDBACKBUFFERPROC glad_debug_glFeedbackBuffer = glad_debug_impl_glFeedbackBuffer;
+PFNGLFENCESYNCPROC glad_glFenceSync = NULL;
+static GLsync GLAD_API_PTR glad_debug_impl_glFenceSync(GLenum condition, GLbitfield flags) {
+    GLsync ret;
+    _pre_call_gl_callback("glFenceSync", (GLADapiproc) glad_glFenceSync, 2, condition, flags);
+    ret = glad_glFenceSync(condition, flags);
+    _post_call_gl_callback((void*) &ret, "glFenceSync", (GLADapiproc) glad_glFenceSync, 2, condition, flags);
+    return ret;
+}
+PFNGLFENCESYNCPROC glad_debug_glFenceSync = glad_debug_impl_glFenceSync;
 PFNGLFINISHPROC glad_glFinish = NULL;
 static void GLAD_API_PTR glad_debug_impl_glFinish(void) {
     _pre_call_gl_callback("glFinish", (GLADapiproc) glad_glFinish, 0);
@@ -5933,6 +6025,13 @@ static GLenum GLAD_API_PTR glad_debug_impl_glGetGraphicsResetStatusARB(void) {
     return ret;
 }
 PFNGLGETGRAPHICSRESETSTATUSARBPROC glad_debug_glGetGraphicsResetStatusARB = glad_debug_impl_glGetGraphicsResetStatusARB;
+PFNGLGETINTEGER64VPROC glad_glGetInteger64v = NULL;
+static void GLAD_API_PTR glad_debug_impl_glGetInteger64v(GLenum pname, GLint64 * data) {
+    _pre_call_gl_callback("glGetInteger64v", (GLADapiproc) glad_glGetInteger64v, 2, pname, data);
+    glad_glGetInteger64v(pname, data);
+    _post_call_gl_callback(NULL, "glGetInteger64v", (GLADapiproc) glad_glGetInteger64v, 2, pname, data);
+}
+PFNGLGETINTEGER64VPROC glad_debug_glGetInteger64v = glad_debug_impl_glGetInteger64v;
 PFNGLGETINTEGERI_VPROC glad_glGetIntegeri_v = NULL;
 static void GLAD_API_PTR glad_debug_impl_glGetIntegeri_v(GLenum target, GLuint index, GLint * data) {
     _pre_call_gl_callback("glGetIntegeri_v", (GLADapiproc) glad_glGetIntegeri_v, 3, target, index, data);
@@ -6126,6 +6225,13 @@ static const GLubyte * GLAD_API_PTR glad_debug_impl_glGetStringi(GLenum name, GL
     return ret;
 }
 PFNGLGETSTRINGIPROC glad_debug_glGetStringi = glad_debug_impl_glGetStringi;
+PFNGLGETSYNCIVPROC glad_glGetSynciv = NULL;
+static void GLAD_API_PTR glad_debug_impl_glGetSynciv(GLsync sync, GLenum pname, GLsizei count, GLsizei * length, GLint * values) {
+    _pre_call_gl_callback("glGetSynciv", (GLADapiproc) glad_glGetSynciv, 5, sync, pname, count, length, values);
+    glad_glGetSynciv(sync, pname, count, length, values);
+    _post_call_gl_callback(NULL, "glGetSynciv", (GLADapiproc) glad_glGetSynciv, 5, sync, pname, count, length, values);
+}
+PFNGLGETSYNCIVPROC glad_debug_glGetSynciv = glad_debug_impl_glGetSynciv;
 PFNGLGETTEXENVFVPROC glad_glGetTexEnvfv = NULL;
 static void GLAD_API_PTR glad_debug_impl_glGetTexEnvfv(GLenum target, GLenum pname, GLfloat * params) {
     _pre_call_gl_callback("glGetTexEnvfv", (GLADapiproc) glad_glGetTexEnvfv, 3, target, pname, params);
@@ -6533,6 +6639,15 @@ static GLboolean GLAD_API_PTR glad_debug_impl_glIsShader(GLuint shader) {
     return ret;
 }
 PFNGLISSHADERPROC glad_debug_glIsShader = glad_debug_impl_glIsShader;
+PFNGLISSYNCPROC glad_glIsSync = NULL;
+static GLboolean GLAD_API_PTR glad_debug_impl_glIsSync(GLsync sync) {
+    GLboolean ret;
+    _pre_call_gl_callback("glIsSync", (GLADapiproc) glad_glIsSync, 1, sync);
+    ret = glad_glIsSync(sync);
+    _post_call_gl_callback((void*) &ret, "glIsSync", (GLADapiproc) glad_glIsSync, 1, sync);
+    return ret;
+}
+PFNGLISSYNCPROC glad_debug_glIsSync = glad_debug_impl_glIsSync;
 PFNGLISTEXTUREPROC glad_glIsTexture = NULL;
 static GLboolean GLAD_API_PTR glad_debug_impl_glIsTexture(GLuint texture) {
     GLboolean ret;
@@ -9156,6 +9271,13 @@ static void GLAD_API_PTR glad_debug_impl_glViewport(GLint x, GLint y, GLsizei wi
     _post_call_gl_callback(NULL, "glViewport", (GLADapiproc) glad_glViewport, 4, x, y, width, height);
 }
 PFNGLVIEWPORTPROC glad_debug_glViewport = glad_debug_impl_glViewport;
+PFNGLWAITSYNCPROC glad_glWaitSync = NULL;
+static void GLAD_API_PTR glad_debug_impl_glWaitSync(GLsync sync, GLbitfield flags, GLuint64 timeout) {
+    _pre_call_gl_callback("glWaitSync", (GLADapiproc) glad_glWaitSync, 3, sync, flags, timeout);
+    glad_glWaitSync(sync, flags, timeout);
+    _post_call_gl_callback(NULL, "glWaitSync", (GLADapiproc) glad_glWaitSync, 3, sync, flags, timeout);
+}
+PFNGLWAITSYNCPROC glad_debug_glWaitSync = glad_debug_impl_glWaitSync;
 PFNGLWINDOWPOS2DPROC glad_glWindowPos2d = NULL;
 static void GLAD_API_PTR glad_debug_impl_glWindowPos2d(GLdouble x, GLdouble y) {
     _pre_call_gl_callback("glWindowPos2d", (GLADapiproc) glad_glWindowPos2d, 2, x, y);
@@ -9948,6 +10070,10 @@ static void glad_gl_load_GL_VERSION_3_1( GLADuserptrloadfunc load, void* userptr
     glad_glTexBuffer = (PFNGLTEXBUFFERPROC) load(userptr, "glTexBuffer");
     glad_glUniformBlockBinding = (PFNGLUNIFORMBLOCKBINDINGPROC) load(userptr, "glUniformBlockBinding");
 }
+static void glad_gl_load_GL_ARB_buffer_storage( GLADuserptrloadfunc load, void* userptr) {
+    if(!GLAD_GL_ARB_buffer_storage) return;
+    glad_glBufferStorage = (PFNGLBUFFERSTORAGEPROC) load(userptr, "glBufferStorage");
+}
 static void glad_gl_load_GL_ARB_copy_image( GLADuserptrloadfunc load, void* userptr) {
     if(!GLAD_GL_ARB_copy_image) return;
     glad_glCopyImageSubData = (PFNGLCOPYIMAGESUBDATAPROC) load(userptr, "glCopyImageSubData");
@@ -9971,6 +10097,16 @@ static void glad_gl_load_GL_ARB_robustness( GLADuserptrloadfunc load, void* user
     glad_glGetnUniformuivARB = (PFNGLGETNUNIFORMUIVARBPROC) load(userptr, "glGetnUniformuivARB");
     glad_glReadnPixelsARB = (PFNGLREADNPIXELSARBPROC) load(userptr, "glReadnPixelsARB");
 }
+static void glad_gl_load_GL_ARB_sync( GLADuserptrloadfunc load, void* userptr) {
+    if(!GLAD_GL_ARB_sync) return;
+    glad_glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC) load(userptr, "glClientWaitSync");
+    glad_glDeleteSync = (PFNGLDELETESYNCPROC) load(userptr, "glDeleteSync");
+    glad_glFenceSync = (PFNGLFENCESYNCPROC) load(userptr, "glFenceSync");
+    glad_glGetInteger64v = (PFNGLGETINTEGER64VPROC) load(userptr, "glGetInteger64v");
+    glad_glGetSynciv = (PFNGLGETSYNCIVPROC) load(userptr, "glGetSynciv");
+    glad_glIsSync = (PFNGLISSYNCPROC) load(userptr, "glIsSync");
+    glad_glWaitSync = (PFNGLWAITSYNCPROC) load(userptr, "glWaitSync");
+}
 static void glad_gl_load_GL_ARB_texture_storage( GLADuserptrloadfunc load, void* userptr) {
     if(!GLAD_GL_ARB_texture_storage) return;
     glad_glTexStorage1D = (PFNGLTEXSTORAGE1DPROC) load(userptr, "glTexStorage1D");
@@ -10088,10 +10224,12 @@ static int glad_gl_find_extensions_gl( int version) {
     unsigned int num_exts_i = 0;
     char **exts_i = NULL;
     if (!glad_gl_get_extensions(version, &exts, &num_exts_i, &exts_i)) return 0;
+    GLAD_GL_ARB_buffer_storage = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_ARB_buffer_storage");
     GLAD_GL_ARB_copy_image = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_ARB_copy_image");
     GLAD_GL_ARB_instanced_arrays = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_ARB_instanced_arrays");
     GLAD_GL_ARB_multisample = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_ARB_multisample");
     GLAD_GL_ARB_robustness = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_ARB_robustness");
+    GLAD_GL_ARB_sync = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_ARB_sync");
     GLAD_GL_ARB_texture_storage = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_ARB_texture_storage");
     GLAD_GL_KHR_debug = glad_gl_has_extension(version, exts, num_exts_i, exts_i, "GL_KHR_debug");
     glad_gl_free_extensions(exts_i, num_exts_i);
@@ -10148,10 +10286,12 @@ int gladLoadGLUserPtr( GLADuserptrloadfunc load, void *userptr) {
     glad_gl_load_GL_VERSION_3_0(load, userptr);
     glad_gl_load_GL_VERSION_3_1(load, userptr);
     if (!glad_gl_find_extensions_gl(version)) return 0;
+    glad_gl_load_GL_ARB_buffer_storage(load, userptr);
     glad_gl_load_GL_ARB_copy_image(load, userptr);
     glad_gl_load_GL_ARB_instanced_arrays(load, userptr);
     glad_gl_load_GL_ARB_multisample(load, userptr);
     glad_gl_load_GL_ARB_robustness(load, userptr);
+    glad_gl_load_GL_ARB_sync(load, userptr);
     glad_gl_load_GL_ARB_texture_storage(load, userptr);
     glad_gl_load_GL_KHR_debug(load, userptr);
     return version;
@@ -10187,6 +10327,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glBlendFuncSeparate = glad_debug_impl_glBlendFuncSeparate;
     glad_debug_glBlitFramebuffer = glad_debug_impl_glBlitFramebuffer;
     glad_debug_glBufferData = glad_debug_impl_glBufferData;
+    glad_debug_glBufferStorage = glad_debug_impl_glBufferStorage;
     glad_debug_glBufferSubData = glad_debug_impl_glBufferSubData;
     glad_debug_glCallList = glad_debug_impl_glCallList;
     glad_debug_glCallLists = glad_debug_impl_glCallLists;
@@ -10203,6 +10344,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glClearIndex = glad_debug_impl_glClearIndex;
     glad_debug_glClearStencil = glad_debug_impl_glClearStencil;
     glad_debug_glClientActiveTexture = glad_debug_impl_glClientActiveTexture;
+    glad_debug_glClientWaitSync = glad_debug_impl_glClientWaitSync;
     glad_debug_glClipPlane = glad_debug_impl_glClipPlane;
     glad_debug_glColor3b = glad_debug_impl_glColor3b;
     glad_debug_glColor3bv = glad_debug_impl_glColor3bv;
@@ -10268,6 +10410,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glDeleteQueries = glad_debug_impl_glDeleteQueries;
     glad_debug_glDeleteRenderbuffers = glad_debug_impl_glDeleteRenderbuffers;
     glad_debug_glDeleteShader = glad_debug_impl_glDeleteShader;
+    glad_debug_glDeleteSync = glad_debug_impl_glDeleteSync;
     glad_debug_glDeleteTextures = glad_debug_impl_glDeleteTextures;
     glad_debug_glDeleteVertexArrays = glad_debug_impl_glDeleteVertexArrays;
     glad_debug_glDepthFunc = glad_debug_impl_glDepthFunc;
@@ -10311,6 +10454,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glEvalPoint1 = glad_debug_impl_glEvalPoint1;
     glad_debug_glEvalPoint2 = glad_debug_impl_glEvalPoint2;
     glad_debug_glFeedbackBuffer = glad_debug_impl_glFeedbackBuffer;
+    glad_debug_glFenceSync = glad_debug_impl_glFenceSync;
     glad_debug_glFinish = glad_debug_impl_glFinish;
     glad_debug_glFlush = glad_debug_impl_glFlush;
     glad_debug_glFlushMappedBufferRange = glad_debug_impl_glFlushMappedBufferRange;
@@ -10360,6 +10504,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glGetFragDataLocation = glad_debug_impl_glGetFragDataLocation;
     glad_debug_glGetFramebufferAttachmentParameteriv = glad_debug_impl_glGetFramebufferAttachmentParameteriv;
     glad_debug_glGetGraphicsResetStatusARB = glad_debug_impl_glGetGraphicsResetStatusARB;
+    glad_debug_glGetInteger64v = glad_debug_impl_glGetInteger64v;
     glad_debug_glGetIntegeri_v = glad_debug_impl_glGetIntegeri_v;
     glad_debug_glGetIntegerv = glad_debug_impl_glGetIntegerv;
     glad_debug_glGetLightfv = glad_debug_impl_glGetLightfv;
@@ -10387,6 +10532,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glGetShaderiv = glad_debug_impl_glGetShaderiv;
     glad_debug_glGetString = glad_debug_impl_glGetString;
     glad_debug_glGetStringi = glad_debug_impl_glGetStringi;
+    glad_debug_glGetSynciv = glad_debug_impl_glGetSynciv;
     glad_debug_glGetTexEnvfv = glad_debug_impl_glGetTexEnvfv;
     glad_debug_glGetTexEnviv = glad_debug_impl_glGetTexEnviv;
     glad_debug_glGetTexGendv = glad_debug_impl_glGetTexGendv;
@@ -10442,6 +10588,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glIsQuery = glad_debug_impl_glIsQuery;
     glad_debug_glIsRenderbuffer = glad_debug_impl_glIsRenderbuffer;
     glad_debug_glIsShader = glad_debug_impl_glIsShader;
+    glad_debug_glIsSync = glad_debug_impl_glIsSync;
     glad_debug_glIsTexture = glad_debug_impl_glIsTexture;
     glad_debug_glIsVertexArray = glad_debug_impl_glIsVertexArray;
     glad_debug_glLightModelf = glad_debug_impl_glLightModelf;
@@ -10815,6 +10962,7 @@ void gladInstallGLDebug(void) {
     glad_debug_glVertexAttribPointer = glad_debug_impl_glVertexAttribPointer;
     glad_debug_glVertexPointer = glad_debug_impl_glVertexPointer;
     glad_debug_glViewport = glad_debug_impl_glViewport;
+    glad_debug_glWaitSync = glad_debug_impl_glWaitSync;
     glad_debug_glWindowPos2d = glad_debug_impl_glWindowPos2d;
     glad_debug_glWindowPos2dv = glad_debug_impl_glWindowPos2dv;
     glad_debug_glWindowPos2f = glad_debug_impl_glWindowPos2f;
@@ -10860,6 +11008,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glBlendFuncSeparate = glad_glBlendFuncSeparate;
     glad_debug_glBlitFramebuffer = glad_glBlitFramebuffer;
     glad_debug_glBufferData = glad_glBufferData;
+    glad_debug_glBufferStorage = glad_glBufferStorage;
     glad_debug_glBufferSubData = glad_glBufferSubData;
     glad_debug_glCallList = glad_glCallList;
     glad_debug_glCallLists = glad_glCallLists;
@@ -10876,6 +11025,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glClearIndex = glad_glClearIndex;
     glad_debug_glClearStencil = glad_glClearStencil;
     glad_debug_glClientActiveTexture = glad_glClientActiveTexture;
+    glad_debug_glClientWaitSync = glad_glClientWaitSync;
     glad_debug_glClipPlane = glad_glClipPlane;
     glad_debug_glColor3b = glad_glColor3b;
     glad_debug_glColor3bv = glad_glColor3bv;
@@ -10941,6 +11091,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glDeleteQueries = glad_glDeleteQueries;
     glad_debug_glDeleteRenderbuffers = glad_glDeleteRenderbuffers;
     glad_debug_glDeleteShader = glad_glDeleteShader;
+    glad_debug_glDeleteSync = glad_glDeleteSync;
     glad_debug_glDeleteTextures = glad_glDeleteTextures;
     glad_debug_glDeleteVertexArrays = glad_glDeleteVertexArrays;
     glad_debug_glDepthFunc = glad_glDepthFunc;
@@ -10984,6 +11135,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glEvalPoint1 = glad_glEvalPoint1;
     glad_debug_glEvalPoint2 = glad_glEvalPoint2;
     glad_debug_glFeedbackBuffer = glad_glFeedbackBuffer;
+    glad_debug_glFenceSync = glad_glFenceSync;
     glad_debug_glFinish = glad_glFinish;
     glad_debug_glFlush = glad_glFlush;
     glad_debug_glFlushMappedBufferRange = glad_glFlushMappedBufferRange;
@@ -11033,6 +11185,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glGetFragDataLocation = glad_glGetFragDataLocation;
     glad_debug_glGetFramebufferAttachmentParameteriv = glad_glGetFramebufferAttachmentParameteriv;
     glad_debug_glGetGraphicsResetStatusARB = glad_glGetGraphicsResetStatusARB;
+    glad_debug_glGetInteger64v = glad_glGetInteger64v;
     glad_debug_glGetIntegeri_v = glad_glGetIntegeri_v;
     glad_debug_glGetIntegerv = glad_glGetIntegerv;
     glad_debug_glGetLightfv = glad_glGetLightfv;
@@ -11060,6 +11213,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glGetShaderiv = glad_glGetShaderiv;
     glad_debug_glGetString = glad_glGetString;
     glad_debug_glGetStringi = glad_glGetStringi;
+    glad_debug_glGetSynciv = glad_glGetSynciv;
     glad_debug_glGetTexEnvfv = glad_glGetTexEnvfv;
     glad_debug_glGetTexEnviv = glad_glGetTexEnviv;
     glad_debug_glGetTexGendv = glad_glGetTexGendv;
@@ -11115,6 +11269,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glIsQuery = glad_glIsQuery;
     glad_debug_glIsRenderbuffer = glad_glIsRenderbuffer;
     glad_debug_glIsShader = glad_glIsShader;
+    glad_debug_glIsSync = glad_glIsSync;
     glad_debug_glIsTexture = glad_glIsTexture;
     glad_debug_glIsVertexArray = glad_glIsVertexArray;
     glad_debug_glLightModelf = glad_glLightModelf;
@@ -11488,6 +11643,7 @@ void gladUninstallGLDebug(void) {
     glad_debug_glVertexAttribPointer = glad_glVertexAttribPointer;
     glad_debug_glVertexPointer = glad_glVertexPointer;
     glad_debug_glViewport = glad_glViewport;
+    glad_debug_glWaitSync = glad_glWaitSync;
     glad_debug_glWindowPos2d = glad_glWindowPos2d;
     glad_debug_glWindowPos2dv = glad_glWindowPos2dv;
     glad_debug_glWindowPos2f = glad_glWindowPos2f;
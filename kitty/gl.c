@@ -205,10 +205,30 @@ unbind_program(void) {
 
 // Buffers {{{
 
+// Number of frames a persistently mapped buffer is split into, so that the CPU
+// can write the data for the next frame while the GPU is still reading the
+// data of previous ones.
+#define NUM_PERSISTENT_FRAMES 3
+
+typedef struct {
+    GLint location, size;
+    GLenum data_type;
+    GLsizei stride;
+    uintptr_t offset;
+} BufferAttribute;
+
 typedef struct {
     GLuint id;
     GLsizeiptr size;
     GLenum usage;
+    BufferAttribute attributes[4];
+    size_t num_attributes;
+    struct {
+        uint8_t *address;
+        GLsizeiptr frame_size;
+        unsigned current_frame;
+        GLsync fences[NUM_PERSISTENT_FRAMES];
+    } persistent;
 } Buffer;
 
 
@@ -223,6 +243,7 @@ create_buffer(GLenum usage) {
             buffers[i].id = buffer_id;
             buffers[i].size = 0;
             buffers[i].usage = usage;
+            buffers[i].num_attributes = 0;
             return i;
         }
     }
@@ -231,11 +252,22 @@ create_buffer(GLenum usage) {
     return -1;
 }
 
+static void
+free_persistent_storage(Buffer *b) {
+    for (unsigned i = 0; i < NUM_PERSISTENT_FRAMES; i++) {
+        if (b->persistent.fences[i]) { glDeleteSync(b->persistent.fences[i]); b->persistent.fences[i] = NULL; }
+    }
+    // deleting the buffer implicitly unmaps it
+    zero_at_ptr(&b->persistent);
+}
+
 static void
 delete_buffer(ssize_t buf_idx) {
+    free_persistent_storage(buffers + buf_idx);
     glDeleteBuffers(1, &(buffers[buf_idx].id));
     buffers[buf_idx].id = 0;
     buffers[buf_idx].size = 0;
+    buffers[buf_idx].num_attributes = 0;
 }
 
 static GLuint
@@ -309,25 +341,35 @@ add_buffer_to_vao(ssize_t vao_idx, GLenum usage) {
 }
 
 static void
-add_located_attribute_to_vao(ssize_t vao_idx, GLint aloc, GLint size, GLenum data_type, GLsizei stride, void *offset, GLuint divisor) {
-    VAO *vao = vaos + vao_idx;
-    if (!vao->num_buffers) fatal("You must create a buffer for this attribute first");
-    ssize_t buf = vao->buffers[vao->num_buffers - 1];
-    bind_buffer(buf);
-    glEnableVertexAttribArray(aloc);
-    switch(data_type) {
+set_attribute_pointer(const BufferAttribute *a, uintptr_t base) {
+    void *offset = (void*)(base + a->offset);
+    switch(a->data_type) {
         case GL_BYTE:
         case GL_UNSIGNED_BYTE:
         case GL_SHORT:
         case GL_UNSIGNED_SHORT:
         case GL_INT:
         case GL_UNSIGNED_INT:
-            glVertexAttribIPointer(aloc, size, data_type, stride, offset);
+            glVertexAttribIPointer(a->location, a->size, a->data_type, a->stride, offset);
             break;
         default:
-            glVertexAttribPointer(aloc, size, data_type, GL_FALSE, stride, offset);
+            glVertexAttribPointer(a->location, a->size, a->data_type, GL_FALSE, a->stride, offset);
             break;
     }
+}
+
+static void
+add_located_attribute_to_vao(ssize_t vao_idx, GLint aloc, GLint size, GLenum data_type, GLsizei stride, void *offset, GLuint divisor) {
+    VAO *vao = vaos + vao_idx;
+    if (!vao->num_buffers) fatal("You must create a buffer for this attribute first");
+    ssize_t buf = vao->buffers[vao->num_buffers - 1];
+    Buffer *b = buffers + buf;
+    if (b->num_attributes >= arraysz(b->attributes)) fatal("Too many attributes in a single buffer");
+    BufferAttribute *a = b->attributes + b->num_attributes++;
+    a->location = aloc; a->size = size; a->data_type = data_type; a->stride = stride; a->offset = (uintptr_t)offset;
+    bind_buffer(buf);
+    glEnableVertexAttribArray(aloc);
+    set_attribute_pointer(a, 0);
     if (divisor) {
         glVertexAttribDivisorARB(aloc, divisor);
     }
@@ -397,4 +439,91 @@ unmap_vao_buffer(ssize_t vao_idx, size_t bufnum) {
     unbind_buffer(buf_idx);
 }
 
+static bool
+has_persistent_buffers(void) {
+    static int ans = -1;
+    if (ans < 0) ans = GLAD_GL_ARB_buffer_storage && GLAD_GL_ARB_sync && !getenv("KITTY_DISABLE_PERSISTENT_BUFFERS");
+    return ans;
+}
+
+static void
+wait_for_fence(GLsync *fence) {
+    if (!*fence) return;
+    GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    while (true) {
+        GLenum status = glClientWaitSync(*fence, flags, 100 * 1000 * 1000);
+        if (status != GL_TIMEOUT_EXPIRED) break;  // GL_WAIT_FAILED means the context is lost, nothing to wait for
+        flags = 0;
+    }
+    glDeleteSync(*fence); *fence = NULL;
+}
+
+void*
+map_vao_buffer_for_frame(ssize_t vao_idx, GLsizeiptr size, size_t bufnum, GLenum usage, bool *has_previous_frame) {
+    // Return an address to write the complete contents of the buffer for the
+    // next frame to. When the driver supports it, a persistently mapped buffer
+    // holding NUM_PERSISTENT_FRAMES frames is used, with the attributes of the
+    // buffer pointing at the frame that was written last. This avoids the
+    // driver having to allocate or synchronize on every map. Otherwise falls
+    // back to mapping the buffer as usual. The buffer must be unmapped with
+    // unmap_vao_buffer_for_frame(). has_previous_frame is set to true if
+    // parts of the previous frame can be re-used with preserve_vao_buffer_range().
+    ssize_t buf_idx = vaos[vao_idx].buffers[bufnum];
+    Buffer *b = buffers + buf_idx;
+    if (!has_persistent_buffers()) {
+        *has_previous_frame = b->size == size;
+        return alloc_and_map_vao_buffer(vao_idx, size, bufnum, usage, GL_WRITE_ONLY);
+    }
+    *has_previous_frame = b->persistent.address && b->persistent.frame_size == size;
+    if (!*has_previous_frame) {
+        // buffer storage is immutable, so a new buffer is needed
+        free_persistent_storage(b);
+        glDeleteBuffers(1, &b->id);
+        glGenBuffers(1, &b->id);
+        bind_buffer(buf_idx);
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(b->usage, size * NUM_PERSISTENT_FRAMES, NULL, flags);
+        b->persistent.address = glMapBufferRange(b->usage, 0, size * NUM_PERSISTENT_FRAMES, flags);
+        if (!b->persistent.address) fatal("Failed to persistently map OpenGL buffer");
+        b->size = size * NUM_PERSISTENT_FRAMES;
+        b->persistent.frame_size = size;
+        b->persistent.current_frame = 0;
+    } else {
+        // The draw calls reading the current frame have all been issued
+        b->persistent.fences[b->persistent.current_frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        b->persistent.current_frame = (b->persistent.current_frame + 1) % NUM_PERSISTENT_FRAMES;
+        wait_for_fence(b->persistent.fences + b->persistent.current_frame);
+    }
+    return b->persistent.address + b->persistent.current_frame * size;
+}
+
+void
+preserve_vao_buffer_range(ssize_t vao_idx, size_t bufnum, GLintptr offset, GLsizeiptr size) {
+    // Carry over the specified range of the previous frame into the frame
+    // being written, which must not write to that range.
+    if (!has_persistent_buffers()) return;  // mapping the buffer preserves its contents
+    Buffer *b = buffers + vaos[vao_idx].buffers[bufnum];
+    const unsigned prev = (b->persistent.current_frame + NUM_PERSISTENT_FRAMES - 1) % NUM_PERSISTENT_FRAMES;
+    glBindBuffer(GL_COPY_READ_BUFFER, b->id);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, b->id);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+            prev * b->persistent.frame_size + offset, b->persistent.current_frame * b->persistent.frame_size + offset, size);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void
+unmap_vao_buffer_for_frame(ssize_t vao_idx, size_t bufnum) {
+    if (!has_persistent_buffers()) { unmap_vao_buffer(vao_idx, bufnum); return; }
+    ssize_t buf_idx = vaos[vao_idx].buffers[bufnum];
+    Buffer *b = buffers + buf_idx;
+    // The mapping is coherent so no flush is needed, just point the attributes at the new frame
+    glBindVertexArray(vaos[vao_idx].id);
+    bind_buffer(buf_idx);
+    uintptr_t base = (uintptr_t)b->persistent.current_frame * b->persistent.frame_size;
+    for (size_t i = 0; i < b->num_attributes; i++) set_attribute_pointer(b->attributes + i, base);
+    unbind_buffer(buf_idx);
+    glBindVertexArray(0);
+}
+
 // }}}
@@ -50,6 +50,9 @@ void add_attribute_to_vao(int p, ssize_t vao_idx, const char *name, GLint size,
 ssize_t alloc_vao_buffer(ssize_t vao_idx, GLsizeiptr size, size_t bufnum, GLenum usage);
 void* alloc_and_map_vao_buffer(ssize_t vao_idx, GLsizeiptr size, size_t bufnum, GLenum usage, GLenum access);
 void unmap_vao_buffer(ssize_t vao_idx, size_t bufnum);
+void* map_vao_buffer_for_frame(ssize_t vao_idx, GLsizeiptr size, size_t bufnum, GLenum usage, bool *has_previous_frame);
+void preserve_vao_buffer_range(ssize_t vao_idx, size_t bufnum, GLintptr offset, GLsizeiptr size);
+void unmap_vao_buffer_for_frame(ssize_t vao_idx, size_t bufnum);
 void* map_vao_buffer(ssize_t vao_idx, size_t bufnum, GLenum access);
 void bind_program(int program);
 void bind_vertex_array(ssize_t vao_idx);
@@ -92,6 +92,15 @@ find_or_create_sprite_position(
 #undef scratch
 }
 
+void
+forget_sprite_positions(SPRITE_POSITION_MAP_HANDLE map_, bool(*should_forget)(void*, sprite_index), void *data) {
+    HashTable *ht = (HashTable*)map_;
+    for (sprite_pos_map_itr i = vt_first(&ht->table); !vt_is_end(i); i = vt_next(i)) {
+        SpritePosition *sp = i.data->val;
+        if (sp->rendered && should_forget(data, sp->idx)) { sp->rendered = false; sp->idx = 0; }
+    }
+}
+
 void
 free_sprite_position_hash_table(SPRITE_POSITION_MAP_HANDLE *map) {
     HashTable **mapref = (HashTable**)map;
@@ -25,6 +25,8 @@ SPRITE_POSITION_MAP_HANDLE
 create_sprite_position_hash_table(void);
 void
 free_sprite_position_hash_table(SPRITE_POSITION_MAP_HANDLE *handle);
+void
+forget_sprite_positions(SPRITE_POSITION_MAP_HANDLE map, bool(*should_forget)(void*, sprite_index), void *data);
 SpritePosition*
 find_or_create_sprite_position(SPRITE_POSITION_MAP_HANDLE map, glyph_index *glyphs, glyph_index count, glyph_index ligature_index, glyph_index cell_count, uint8_t scale, uint8_t subscale, uint8_t multicell_y, uint8_t vertical_align, bool *created);
 
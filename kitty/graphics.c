@@ -11,6 +11,7 @@
 #include "disk-cache.h"
 #include "iqsort.h"
 #include "safe-wrappers.h"
+#include "threading.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -21,9 +22,12 @@
 #include <zlib.h>
 #include <structmember.h>
 #include "png-reader.h"
+#include "simd-string.h"
 PyTypeObject GraphicsManager_Type;
 
 #define DEFAULT_STORAGE_LIMIT 320u * (1024u * 1024u)
+#define DEFAULT_BACKGROUND_DECODE_THRESHOLD 256u * 1024u
+#define DEFAULT_COALESCED_FRAME_CACHE_LIMIT 64u * (1024u * 1024u)
 #define REPORT_ERROR(...) { log_error(__VA_ARGS__); }
 #define RAII_CoalescedFrameData(name, initializer) __attribute__((cleanup(cfd_free))) CoalescedFrameData name = initializer
 
@@ -45,6 +49,20 @@ add_to_cache(GraphicsManager *self, const ImageAndFrame x, const void *data, con
     return add_to_disk_cache(self->disk_cache, CK(x), data, sz);
 }
 
+static bool
+add_loaded_data_to_cache(GraphicsManager *self, const ImageAndFrame x, LoadData *ld) {
+    // Data in the load buffer, that is directly transmitted, decoded or
+    // snapshotted shared memory data, is handed to the disk cache without
+    // copying it. Mapped files are copied as they can change after transmission.
+    if (ld->buf && ld->data == ld->buf) {
+        char key[CACHE_KEY_BUFFER_SIZE];
+        if (!add_buffer_to_disk_cache(self->disk_cache, CK(x), ld->buf, ld->data_sz)) return false;
+        ld->buf = NULL; ld->buf_capacity = 0; ld->buf_used = 0; ld->data = NULL;
+        return true;
+    }
+    return add_to_cache(self, x, ld->data, ld->data_sz);
+}
+
 static bool
 remove_from_cache(GraphicsManager *self, const ImageAndFrame x) {
     char key[CACHE_KEY_BUFFER_SIZE];
@@ -77,6 +95,9 @@ grman_alloc(bool for_paused_rendering) {
     self->render_data.capacity = 64;
     self->render_data.item = calloc(self->render_data.capacity, sizeof(self->render_data.item[0]));
     self->storage_limit = DEFAULT_STORAGE_LIMIT;
+    self->background_decode_threshold = DEFAULT_BACKGROUND_DECODE_THRESHOLD;
+    self->coalesced_frames.limit = DEFAULT_COALESCED_FRAME_CACHE_LIMIT;
+    vt_init(&self->coalesced_frames.map);
     if (self->render_data.item == NULL) {
         PyErr_NoMemory();
         Py_CLEAR(self); return NULL;
@@ -86,6 +107,7 @@ grman_alloc(bool for_paused_rendering) {
         if (!self->disk_cache) { Py_CLEAR(self); return NULL; }
     }
     vt_init(&self->images_by_internal_id);
+    self->placements.dirty = true;
     return self;
 }
 
@@ -97,8 +119,11 @@ free_refs_data(Image *img) {
     vt_cleanup(&img->refs_by_internal_id);
 }
 
+static void free_stream_decoder(struct StreamDecoder *s);
+
 static void
 free_load_data(LoadData *ld) {
+    if (ld->stream) { free_stream_decoder(ld->stream); ld->stream = NULL; }
     free(ld->buf); ld->buf_used = 0; ld->buf_capacity = 0; ld->buf = NULL;
     if (ld->mapped_file) munmap(ld->mapped_file, ld->mapped_file_sz);
     ld->mapped_file = NULL; ld->mapped_file_sz = 0;
@@ -135,9 +160,19 @@ texture_id_for_img(Image *img) {
     return img->texture ? img->texture->id : 0;
 }
 
+static void forget_coalesced_frames(GraphicsManager *self, id_type image_id);
+
+static void
+placeholders_changed(GraphicsManager *self, uint32_t client_id) {
+    // Lines with unicode placeholders referring to this image have to be rescanned
+    PlaceholderIndex *p = &self->placeholders;
+    p->changed_at[__builtin_ctzll(placeholder_image_id_bit(client_id))] = ++p->generation;
+}
+
 static void
 free_image_resources(GraphicsManager *self, Image *img) {
     clear_texture_ref(&img->texture);
+    forget_coalesced_frames(self, img->internal_id);
     if (self->disk_cache) {
         ImageAndFrame key = { .image_id=img->internal_id, .frame_id = img->root_frame.id };
         if (!remove_from_cache(self, key) && PyErr_Occurred()) PyErr_Print();
@@ -150,6 +185,8 @@ free_image_resources(GraphicsManager *self, Image *img) {
         free(img->extra_frames);
         img->extra_frames = NULL;
     }
+    if (vt_size(&img->refs_by_internal_id)) self->placements.dirty = true;
+    if (img->client_id) placeholders_changed(self, img->client_id);
     free_refs_data(img);
     self->used_storage = img->used_storage <= self->used_storage ? self->used_storage - img->used_storage : 0;
 }
@@ -168,10 +205,16 @@ free_all_images(GraphicsManager *self) {
     vt_cleanup(&self->images_by_internal_id);
 }
 
+static void cancel_decodes(GraphicsManager *self);
+
 static void
 dealloc(GraphicsManager* self) {
+    cancel_decodes(self);
     free_all_images(self);
+    vt_cleanup(&self->coalesced_frames.map);
     free(self->render_data.item);
+    free(self->placements.items);
+    free(self->placeholders.items);
     Py_CLEAR(self->disk_cache);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
@@ -212,6 +255,88 @@ ref_by_client_id(const Image *img, uint32_t id) {
     return NULL;
 }
 
+// Placement index {{{
+// Displayed (non-virtual) refs sorted by start_row, so that scrolling,
+// deleting by row and building layers only look at refs in the relevant rows.
+// Adding or removing refs or moving them relative to each other marks the
+// index dirty and it is rebuilt when next used. Scrolling moves refs
+// uniformly, and the scroll and delete by row code drop the refs they remove
+// from the index themselves, so those keep it valid.
+
+static size_t
+first_placement_from_row(const PlacementIndex *p, int32_t row) {
+    // The position of the first ref with start_row >= row
+    size_t lo = 0, hi = p->count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (p->items[mid].ref->start_row < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void
+insert_into_placement_index(PlacementIndex *p, size_t pos, ImageRef *ref, Image *img) {
+    ensure_space_for(p, items, IndexedRef, p->count + 1, capacity, 64, false);
+    memmove(p->items + pos + 1, p->items + pos, (p->count - pos) * sizeof(p->items[0]));
+    p->items[pos] = (IndexedRef){.ref = ref, .img = img};
+    p->count++;
+    p->max_rows = MAX(p->max_rows, ref->effective_num_rows);
+    if (ref->parent.img) p->num_with_parent++;
+}
+
+static void
+add_to_placement_index(GraphicsManager *self, Image *img, ImageRef *ref) {
+    PlacementIndex *p = &self->placements;
+    if (p->dirty || ref->is_virtual_ref) return;
+    insert_into_placement_index(p, first_placement_from_row(p, ref->start_row + 1), ref, img);
+}
+
+static void
+sort_placements(IndexedRef *items, size_t count) {
+#define lt(a, b) ((a)->ref->start_row < (b)->ref->start_row)
+    QSORT(IndexedRef, items, count, lt);
+#undef lt
+}
+
+static PlacementIndex*
+placement_index(GraphicsManager *self) {
+    PlacementIndex *p = &self->placements;
+    if (!p->dirty) return p;
+    p->dirty = false; p->count = 0; p->max_rows = 0; p->num_with_parent = 0;
+    for (image_map_itr ii = vt_first(&self->images_by_internal_id); !vt_is_end(ii); ii = vt_next(ii)) { Image *img = ii.data->val;
+        for (ref_map_itr ri = vt_first(&img->refs_by_internal_id); !vt_is_end(ri); ri = vt_next(ri)) { ImageRef *ref = ri.data->val;
+            if (!ref->is_virtual_ref) insert_into_placement_index(p, p->count, ref, img);
+        }
+    }
+    sort_placements(p->items, p->count);
+    return p;
+}
+
+static void
+drop_from_placement_index(PlacementIndex *p, size_t keep_end, size_t drop_end) {
+    // Remove the entries [keep_end, drop_end) whose refs the caller has removed
+    if (keep_end >= drop_end) return;
+    memmove(p->items + keep_end, p->items + drop_end, (p->count - drop_end) * sizeof(p->items[0]));
+    p->count -= drop_end - keep_end;
+}
+
+static void remove_image(GraphicsManager *self, Image *img);
+
+static void
+remove_indexed_ref(GraphicsManager *self, const IndexedRef *x, bool remove_unreferenced_image) {
+    // The caller must drop x from the index with drop_from_placement_index()
+    if (x->ref->parent.img && self->placements.num_with_parent) self->placements.num_with_parent--;
+    ref_map_itr i = vt_get(&x->img->refs_by_internal_id, x->ref->internal_id);
+    if (!vt_is_end(i)) {
+        free(i.data->val);
+        vt_erase_itr(&x->img->refs_by_internal_id, i);
+    }
+    self->layers_dirty = true;
+    if (remove_unreferenced_image && !vt_size(&x->img->refs_by_internal_id)) remove_image(self, x->img);
+}
+// }}}
+
 static image_map_itr
 remove_image_itr(GraphicsManager *self, image_map_itr i) {
     free_image(self, i.data->val);
@@ -261,6 +386,7 @@ grman_pause_rendering(GraphicsManager *self, GraphicsManager *dest) {
         clone->texture = incref_texture_ref(img->texture);
         vt_insert(&dest->images_by_internal_id, clone->internal_id, clone);
     }
+    dest->placements.dirty = true;
 }
 
 // Loading image data {{{
@@ -288,7 +414,8 @@ apply_storage_quota(GraphicsManager *self, size_t storage_limit, id_type current
     if (!num_images || !vt_size(&self->images_by_internal_id)) self->used_storage = 0;  // sanity check
 }
 
-static char command_response[512] = {0};
+// thread local as images can be decoded on worker threads
+static _Thread_local char command_response[512] = {0};
 
 static void
 set_command_failed_response(const char *code, const char *fmt, ...) {
@@ -304,7 +431,11 @@ set_command_failed_response(const char *code, const char *fmt, ...) {
 #define ABRT(code, ...) { set_command_failed_response(#code, __VA_ARGS__); goto err; }
 
 static bool
-mmap_img_file(GraphicsManager *self, int fd, size_t sz, off_t offset) {
+mmap_img_file(GraphicsManager *self, int fd, size_t sz, off_t offset, bool snapshot) {
+    // When snapshot is true the data is copied into the load buffer, so that
+    // the client cannot modify it after transmission. Note that a MAP_PRIVATE
+    // mapping would not do, as changes made to the file are visible in pages
+    // that have not been written to.
     if (!sz) {
         struct stat s;
         if (fstat(fd, &s) != 0) ABRT(EBADF, "Failed to fstat() the fd: %d file with error: [%d] %s", fd, errno, strerror(errno));
@@ -312,6 +443,15 @@ mmap_img_file(GraphicsManager *self, int fd, size_t sz, off_t offset) {
     }
     void *addr = mmap(0, sz, PROT_READ, MAP_SHARED, fd, offset);
     if (addr == MAP_FAILED) ABRT(EBADF, "Failed to map image file fd: %d at offset: %zd with size: %zu with error: [%d] %s", fd, offset, sz, errno, strerror(errno));
+    if (snapshot) {
+        uint8_t *copy = malloc(sz);
+        if (!copy) { munmap(addr, sz); ABRT(ENOMEM, "Out of memory copying image data of size: %zu", sz); }
+        memcpy(copy, addr, sz);
+        munmap(addr, sz);
+        self->currently_loading.buf = copy;
+        self->currently_loading.buf_capacity = sz; self->currently_loading.buf_used = sz;
+        return true;
+    }
     self->currently_loading.mapped_file = addr;
     self->currently_loading.mapped_file_sz = sz;
     return true;
@@ -323,7 +463,7 @@ err:
 static const char*
 zlib_strerror(int ret) {
 #define Z(x) case x: return #x;
-    static char buf[128];
+    static _Thread_local char buf[128];
     switch(ret) {
         case Z_ERRNO:
             return strerror(errno);
@@ -389,6 +529,79 @@ inflate_png(LoadData *load_data, uint8_t *buf, size_t bufsz) {
     return d.ok;
 }
 #undef ABRT
+
+// Chunked direct transmissions are decoded as the chunks arrive, so that
+// decoding overlaps transmission and the compressed data is never held in
+// full. Errors are reported once the last chunk arrives.
+struct StreamDecoder {
+    bool has_zlib, zlib_done, failed;
+    z_stream z;
+    png_read_data png;
+    png_stream *png_stream;
+    char error[sizeof(command_response)];
+};
+
+static void
+free_stream_decoder(struct StreamDecoder *s) {
+    if (s->has_zlib) inflateEnd(&s->z);
+    if (s->png_stream) free_png_stream(s->png_stream);
+    free(s->png.decompressed); free(s->png.row_pointers);
+    free(s);
+}
+
+
+static bool
+stream_decode_chunk(LoadData *ld, const uint8_t *payload, size_t sz) {
+    struct StreamDecoder *s = ld->stream;
+    if (!s->has_zlib) return png_stream_feed(s->png_stream, payload, sz);
+    uint8_t inflated[16 * 1024];
+    s->z.next_in = (Bytef*)payload; s->z.avail_in = sz;
+    while (s->z.avail_in && !s->zlib_done) {
+        // Once the image data is complete the end of the stream can still
+        // arrive in later chunks, so inflate continues into the scratch
+        // buffer, any output in it is more data than expected
+        const bool is_complete = !s->png_stream && ld->buf_used >= ld->data_sz;
+        if (s->png_stream || is_complete) { s->z.next_out = inflated; s->z.avail_out = sizeof(inflated); }
+        else { s->z.next_out = ld->buf + ld->buf_used; s->z.avail_out = ld->data_sz - ld->buf_used; }
+        const uint8_t *out = s->z.next_out;
+        int ret = inflate(&s->z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            set_command_failed_response("EINVAL", "Failed to inflate image data with error: %s", zlib_strerror(ret));
+            return false;
+        }
+        const size_t produced = s->z.next_out - out;
+        if (s->png_stream) { if (produced && !png_stream_feed(s->png_stream, out, produced)) return false; }
+        else if (is_complete) {
+            if (produced) {
+                set_command_failed_response("EINVAL", "Image data size post inflation does not match expected size");
+                return false;
+            }
+        } else ld->buf_used += produced;
+        s->zlib_done = ret == Z_STREAM_END;
+    }
+    return true;
+}
+
+static bool
+finish_stream_decode(LoadData *ld) {
+    struct StreamDecoder *s = ld->stream;
+    bool ok = false;
+    if (s->failed) memcpy(command_response, s->error, sizeof(command_response));
+    else if (s->has_zlib && !s->zlib_done) set_command_failed_response("EINVAL", "Failed to inflate image data with error: %s", "incomplete data");
+    else if (s->png_stream) {
+        if (png_stream_finish(s->png_stream)) {
+            free(ld->buf);
+            ld->buf = s->png.decompressed; s->png.decompressed = NULL;
+            ld->buf_capacity = s->png.sz; ld->buf_used = s->png.sz; ld->data_sz = s->png.sz;
+            ld->width = s->png.width; ld->height = s->png.height;
+            ok = true;
+        }
+    } else if (ld->buf_used != ld->data_sz) set_command_failed_response("EINVAL", "Image data size post inflation does not match expected size");
+    else ok = true;
+    free_stream_decoder(s); ld->stream = NULL;
+    ld->is_decoded = ok;
+    return ok;
+}
 // }}}
 
 static bool
@@ -538,6 +751,23 @@ get_free_client_id(const GraphicsManager *self) {
 #define MAX_DATA_SZ (4u * 100000000u)
 enum FORMATS { RGB=24, RGBA=32, PNG=100 };
 
+static void
+start_stream_decode(LoadData *ld, const GraphicsCommand *g, const uint32_t data_fmt) {
+    struct StreamDecoder *s = calloc(1, sizeof(struct StreamDecoder));
+    if (!s) return;  // the data will be decoded once all of it has arrived
+    if (g->compressed == 'z') {
+        if (inflateInit(&s->z) != Z_OK) { free(s); return; }
+        s->has_zlib = true;
+    }
+    if (data_fmt == PNG) {
+        s->png.err_handler = png_error_handler;
+        if (!(s->png_stream = new_png_stream(&s->png))) { free_stream_decoder(s); return; }
+        // the decoded pixels are held by the decoder until the last chunk arrives
+        free(ld->buf); ld->buf = NULL; ld->buf_capacity = 0;
+    }
+    ld->stream = s;
+}
+
 static Image*
 load_image_data(GraphicsManager *self, Image *img, const GraphicsCommand *g, const unsigned char transmission_type, const uint32_t data_fmt, const uint8_t *payload) {
     int fd;
@@ -546,6 +776,21 @@ load_image_data(GraphicsManager *self, Image *img, const GraphicsCommand *g, con
 
     switch(transmission_type) {
         case 'd':  // direct
+            if (load_data->stream) {
+                struct StreamDecoder *s = load_data->stream;
+                if (!s->failed && !stream_decode_chunk(load_data, payload, g->payload_sz)) {
+                    s->failed = true;
+                    memcpy(s->error, command_response, sizeof(s->error));
+                    command_response[0] = 0;
+                }
+                if (!g->more) {
+                    if (!finish_stream_decode(load_data)) {
+                        load_data->loading_completed_successfully = false; free_load_data(load_data); return NULL;
+                    }
+                    load_data->loading_completed_successfully = true; load_data->loading_for = (const ImageAndFrame){0};
+                }
+                break;
+            }
             if (load_data->buf_capacity - load_data->buf_used < g->payload_sz) {
                 if (load_data->buf_used + g->payload_sz > MAX_DATA_SZ || data_fmt != PNG) ABRT("EFBIG", "Too much data");
                 load_data->buf_capacity = MIN(2 * load_data->buf_capacity, MAX_DATA_SZ);
@@ -578,7 +823,9 @@ load_image_data(GraphicsManager *self, Image *img, const GraphicsCommand *g, con
                     ABRT("EPERM", "Permission denied to read image file");
                 }
             }
-            load_data->loading_completed_successfully = mmap_img_file(self, fd, g->data_sz, g->data_offset);
+            // only uncompressed shared memory data is snapshotted, compressed data is decoded into a new buffer anyway
+            load_data->loading_completed_successfully = mmap_img_file(
+                self, fd, g->data_sz, g->data_offset, transmission_type == 's' && g->action != 'q' && !g->compressed && data_fmt != PNG);
             safe_close(fd, __FILE__, __LINE__);
             if (transmission_type == 't' && strstr(fname, "tty-graphics-protocol") != NULL) {
                 if (global_state.boss) { call_boss(safe_delete_temp_file, "s", fname); }
@@ -593,55 +840,64 @@ load_image_data(GraphicsManager *self, Image *img, const GraphicsCommand *g, con
     return img;
 }
 
-static Image*
-process_image_data(GraphicsManager *self, Image* img, const GraphicsCommand *g, const unsigned char transmission_type, const uint32_t data_fmt) {
-    bool needs_processing = g->compressed || data_fmt == PNG;
+#define DABRT(code, ...) { set_command_failed_response(code, __VA_ARGS__); ld->loading_completed_successfully = false; free_load_data(ld); return false; }
+
+static bool
+decode_load_data(LoadData *ld, const GraphicsCommand *g, const unsigned char transmission_type, const uint32_t data_fmt) {
+    bool needs_processing = (g->compressed || data_fmt == PNG) && !ld->is_decoded;
     if (needs_processing) {
         uint8_t *buf; size_t bufsz;
-#define IB { if (self->currently_loading.buf) { buf = self->currently_loading.buf; bufsz = self->currently_loading.buf_used; } else { buf = self->currently_loading.mapped_file; bufsz = self->currently_loading.mapped_file_sz; } }
+#define IB { if (ld->buf) { buf = ld->buf; bufsz = ld->buf_used; } else { buf = ld->mapped_file; bufsz = ld->mapped_file_sz; } }
         switch(g->compressed) {
             case 'z':
                 IB;
-                if (!inflate_zlib(&self->currently_loading, buf, bufsz)) {
-                    self->currently_loading.loading_completed_successfully = false; return NULL;
+                if (!inflate_zlib(ld, buf, bufsz)) {
+                    ld->loading_completed_successfully = false; return false;
                 }
                 break;
             case 0:
                 break;
             default:
-                ABRT("EINVAL", "Unknown image compression: %c", g->compressed);
+                DABRT("EINVAL", "Unknown image compression: %c", g->compressed);
         }
         switch(data_fmt) {
             case PNG:
                 IB;
-                if (!inflate_png(&self->currently_loading, buf, bufsz)) {
-                    self->currently_loading.loading_completed_successfully = false; return NULL;
+                if (!inflate_png(ld, buf, bufsz)) {
+                    ld->loading_completed_successfully = false; return false;
                 }
                 break;
             default: break;
         }
 #undef IB
-        self->currently_loading.data = self->currently_loading.buf;
-        if (self->currently_loading.buf_used < self->currently_loading.data_sz) {
-            ABRT("ENODATA", "Insufficient image data: %zu < %zu", self->currently_loading.buf_used, self->currently_loading.data_sz);
+        ld->data = ld->buf;
+        if (ld->buf_used < ld->data_sz) {
+            DABRT("ENODATA", "Insufficient image data: %zu < %zu", ld->buf_used, ld->data_sz);
         }
-        if (self->currently_loading.mapped_file) {
-            munmap(self->currently_loading.mapped_file, self->currently_loading.mapped_file_sz);
-            self->currently_loading.mapped_file = NULL; self->currently_loading.mapped_file_sz = 0;
+        if (ld->mapped_file) {
+            munmap(ld->mapped_file, ld->mapped_file_sz);
+            ld->mapped_file = NULL; ld->mapped_file_sz = 0;
         }
     } else {
-        if (transmission_type == 'd') {
-            if (self->currently_loading.buf_used < self->currently_loading.data_sz) {
-                ABRT("ENODATA", "Insufficient image data: %zu < %zu",  self->currently_loading.buf_used, self->currently_loading.data_sz);
-            } else self->currently_loading.data = self->currently_loading.buf;
+        // shared memory data is in buf when it was snapshotted
+        if (transmission_type == 'd' || ld->buf) {
+            if (ld->buf_used < ld->data_sz) {
+                DABRT("ENODATA", "Insufficient image data: %zu < %zu",  ld->buf_used, ld->data_sz);
+            } else ld->data = ld->buf;
         } else {
-            if (self->currently_loading.mapped_file_sz < self->currently_loading.data_sz) {
-                ABRT("ENODATA", "Insufficient image data: %zu < %zu",  self->currently_loading.mapped_file_sz, self->currently_loading.data_sz);
-            } else self->currently_loading.data = self->currently_loading.mapped_file;
+            if (ld->mapped_file_sz < ld->data_sz) {
+                DABRT("ENODATA", "Insufficient image data: %zu < %zu",  ld->mapped_file_sz, ld->data_sz);
+            } else ld->data = ld->mapped_file;
         }
-        self->currently_loading.loading_completed_successfully = true;
+        ld->loading_completed_successfully = true;
     }
-    return img;
+    return true;
+#undef DABRT
+}
+
+static Image*
+process_image_data(GraphicsManager *self, Image* img, const GraphicsCommand *g, const unsigned char transmission_type, const uint32_t data_fmt) {
+    return decode_load_data(&self->currently_loading, g, transmission_type, data_fmt) ? img : NULL;
 }
 
 static Image*
@@ -677,6 +933,7 @@ initialize_load_data(GraphicsManager *self, const GraphicsCommand *g, Image *img
             self->currently_loading.buf_capacity = 0; self->currently_loading.buf_used = 0;
             ABRT("ENOMEM", "Out of memory");
         }
+        if (g->more && (g->compressed == 'z' || (!g->compressed && data_fmt == PNG))) start_stream_decode(&self->currently_loading, g, data_fmt);
     }
     return img;
 }
@@ -690,16 +947,326 @@ initialize_load_data(GraphicsManager *self, const GraphicsCommand *g, Image *img
 }
 #define MAX_IMAGE_DIMENSION 10000u
 
+#define MAX_TEXTURE_DOWNSCALE_FACTOR 256u
+
+// Downscaled pixel data of a frame, kept so that it can be uploaded again
+// without downscaling, for example when an animation loops
+typedef struct ScaledFrame {
+    uint8_t *buf;
+    uint32_t width, height;
+    unsigned factor;
+} ScaledFrame;
+
+static void update_dest_rect(ImageRef *ref, uint32_t num_cols, uint32_t num_rows, CellPixelSize cell);
+
 static void
-upload_to_gpu(GraphicsManager *self, Image *img, const bool is_opaque, const bool is_4byte_aligned, const uint8_t *data) {
-    if (!self->context_made_current_for_this_command) {
-        if (!self->window_id) return;
+set_ref_src_size(ImageRef *ref, const Image *img, uint32_t width, uint32_t height) {
+    ref->src_width = width ? width : img->width; ref->src_height = height ? height : img->height;
+    ref->src_width = MIN(ref->src_width, img->width - ((float)img->width > ref->src_x ? ref->src_x : (float)img->width));
+    ref->src_height = MIN(ref->src_height, img->height - ((float)img->height > ref->src_y ? ref->src_y : (float)img->height));
+}
+
+static double
+placement_scale(const ImageRef *ref, CellPixelSize cell) {
+    // The size a placement is displayed at relative to the part of the image it shows
+    if (ref->src_width < 1 || ref->src_height < 1) return 0;
+    return MAX((double)ref->effective_num_cols * cell.width / ref->src_width, (double)ref->effective_num_rows * cell.height / ref->src_height);
+}
+
+static unsigned
+texture_downscale_factor(Image *img, CellPixelSize cell, const GraphicsCommand *pending_put) {
+    // The largest factor the image can be downscaled by without becoming
+    // smaller than any of its placements. pending_put is a put command that
+    // creates a placement right after the image is loaded, as for a=T.
+    if (!cell.width || !cell.height) return 1;
+    double scale = 0;
+    if (pending_put) {
+        // placeholder images are displayed a cell at a time, at arbitrary sizes
+        if (pending_put->unicode_placement) return 1;
+        ImageRef ref = {
+            .src_x = pending_put->x_offset, .src_y = pending_put->y_offset,
+            .cell_x_offset = MIN(pending_put->cell_x_offset, cell.width - 1), .cell_y_offset = MIN(pending_put->cell_y_offset, cell.height - 1)};
+        set_ref_src_size(&ref, img, pending_put->width, pending_put->height);
+        update_dest_rect(&ref, pending_put->num_cells, pending_put->num_lines, cell);
+        scale = placement_scale(&ref, cell);
+    }
+    iter_refs(img) {
+        const ImageRef *ref = i.data->val;
+        if (ref->is_virtual_ref || ref->virtual_ref_id) return 1;
+        scale = MAX(scale, placement_scale(ref, cell));
+    }
+    if (scale <= 0 || scale >= 0.5) return 1;
+    return MIN((unsigned)(1. / scale), MIN(MAX(img->width, img->height), MAX_TEXTURE_DOWNSCALE_FACTOR));
+}
+
+static uint8_t*
+downscale_image(const uint8_t *src, uint32_t width, uint32_t height, unsigned bytes_per_pixel, unsigned factor, uint32_t *dest_width, uint32_t *dest_height) {
+    // Average factor x factor blocks of pixels
+    const uint32_t dw = (width + factor - 1) / factor, dh = (height + factor - 1) / factor;
+    uint8_t *ans = malloc((size_t)dw * dh * bytes_per_pixel);
+    if (!ans) return NULL;
+    const size_t stride = (size_t)width * bytes_per_pixel;
+    uint8_t *d = ans;
+    for (uint32_t y = 0, sy = 0; y < dh; y++, sy += factor) {
+        const unsigned num_rows = MIN(factor, height - sy);
+        const uint8_t *row = src + sy * stride;
+        if (bytes_per_pixel == 4) {
+            downsample_bgra_row(row, stride, num_rows, width, factor, d, dw);
+            d += 4 * (size_t)dw;
+            continue;
+        }
+        for (uint32_t x = 0, sx = 0; x < dw; x++, sx += factor, d += 3) {
+            const unsigned num_cols = MIN(factor, width - sx);
+            unsigned r = 0, g = 0, b = 0;
+            for (unsigned j = 0; j < num_rows; j++) {
+                for (const uint8_t *p = row + j * stride + 3 * sx, *limit = p + 3 * num_cols; p < limit; p += 3) {
+                    r += p[0]; g += p[1]; b += p[2];
+                }
+            }
+            const unsigned count = num_rows * num_cols;
+            d[0] = r / count; d[1] = g / count; d[2] = b / count;
+        }
+    }
+    *dest_width = dw; *dest_height = dh;
+    return ans;
+}
+
+static void
+upload_to_gpu(GraphicsManager *self, Image *img, const bool is_opaque, const bool is_4byte_aligned, const uint8_t *data, const GraphicsCommand *pending_put, ScaledFrame *scaled_cache) {
+    // Images are uploaded at the smallest size that does not lose detail in
+    // any of their placements, see update_texture_size(). When scaled_cache
+    // is not NULL, the downscaled data is taken from and stored in it.
+    if (!img->texture) return;
+    unsigned factor = texture_downscale_factor(img, self->cell, pending_put);
+    uint32_t width = img->width, height = img->height;
+    bool aligned = is_4byte_aligned;
+    RAII_ALLOC(uint8_t, scaled, NULL);
+    if (factor > 1) {
+        if (scaled_cache && scaled_cache->buf && scaled_cache->factor == factor) {
+            data = scaled_cache->buf; width = scaled_cache->width; height = scaled_cache->height;
+        } else if ((scaled = downscale_image(data, img->width, img->height, is_opaque ? 3 : 4, factor, &width, &height))) {
+            data = scaled;
+            if (scaled_cache) {
+                free(scaled_cache->buf);
+                *scaled_cache = (ScaledFrame){.buf=scaled, .width=width, .height=height, .factor=factor};
+                scaled = NULL;
+            }
+        } else factor = 1;
+        if (factor > 1) aligned = !is_opaque || width % 4 == 0;
+    }
+    if (!self->context_made_current_for_this_command && self->window_id) {
         if (!make_window_context_current(self->window_id)) return;
         self->context_made_current_for_this_command = true;
     }
-    if (img->texture) send_image_to_gpu(&img->texture->id, data, img->width, img->height, is_opaque, is_4byte_aligned, true, REPEAT_CLAMP);
+    img->texture->downscale_factor = factor;
+    // there is no OpenGL context when testing
+    if (self->window_id) send_image_to_gpu(&img->texture->id, data, width, height, is_opaque, aligned, true, REPEAT_CLAMP);
+}
+
+// Background decoding {{{
+// Large compressed images are decoded on a pool of worker threads. The image
+// is created immediately with its final dimensions so that it can be placed,
+// but it is not drawn until its data is uploaded on the main thread. Command
+// responses are queued in order behind pending decodes.
+
+typedef enum { DECODE_QUEUED, DECODE_RUNNING, DECODE_DONE } DecodeState;
+
+struct DecodeJob {
+    DecodeJob *next, *next_in_queue;
+    DecodeState state;
+    bool ok, applied, orphaned;
+    LoadData load_data;
+    GraphicsCommand g, response_command;
+    unsigned char transmission_type;
+    uint32_t data_fmt, width, height;
+    id_type image_id;
+    uint32_t frame_id;
+    char error[sizeof(command_response)];
+    char *response;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t job_available, job_done;
+    DecodeJob *head, *tail;
+    unsigned num_threads;
+    bool has_finished;
+} decoder = {.lock = PTHREAD_MUTEX_INITIALIZER, .job_available = PTHREAD_COND_INITIALIZER, .job_done = PTHREAD_COND_INITIALIZER};
+
+static void
+free_decode_job(DecodeJob *job) {
+    free_load_data(&job->load_data);
+    free(job->response);
+    free(job);
 }
 
+static void
+run_decode_job(DecodeJob *job) {
+    command_response[0] = 0;
+    LoadData *ld = &job->load_data;
+    job->ok = decode_load_data(ld, &job->g, job->transmission_type, job->data_fmt);
+    if (job->ok && (ld->width != job->width || ld->height != job->height)) {
+        set_command_failed_response("EINVAL", "Decoded image dimensions: %ux%u do not match expected dimensions: %ux%u", ld->width, ld->height, job->width, job->height);
+        job->ok = false;
+    }
+    if (job->ok) {
+        size_t required_sz = (size_t)(ld->is_opaque ? 3 : 4) * ld->width * ld->height;
+        if (ld->data_sz != required_sz) {
+            set_command_failed_response("EINVAL", "Image dimensions: %ux%u do not match data size: %zu, expected size: %zu", ld->width, ld->height, ld->data_sz, required_sz);
+            job->ok = false;
+        }
+    }
+    memcpy(job->error, command_response, sizeof(job->error));
+}
+
+static void*
+decode_worker(void *x UNUSED) {
+    set_thread_name("KittyImgDecode");
+    pthread_mutex_lock(&decoder.lock);
+    while (true) {
+        while (!decoder.head) pthread_cond_wait(&decoder.job_available, &decoder.lock);
+        DecodeJob *job = decoder.head;
+        decoder.head = job->next_in_queue;
+        if (!decoder.head) decoder.tail = NULL;
+        job->state = DECODE_RUNNING;
+        pthread_mutex_unlock(&decoder.lock);
+        run_decode_job(job);
+        pthread_mutex_lock(&decoder.lock);
+        job->state = DECODE_DONE;
+        const bool orphaned = job->orphaned;
+        if (!orphaned) decoder.has_finished = true;
+        pthread_cond_broadcast(&decoder.job_done);
+        if (orphaned) free_decode_job(job);
+        else if (global_state.boss) wakeup_main_loop();
+    }
+    return NULL;
+}
+
+static bool
+start_decode_workers(void) {
+    if (decoder.num_threads) return true;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned count = num_cpus > 2 ? MIN(4u, (unsigned)num_cpus - 1) : 1;
+    for (unsigned i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, decode_worker, NULL) != 0) break;
+        pthread_detach(thread);
+        decoder.num_threads++;
+    }
+    return decoder.num_threads > 0;
+}
+
+static bool
+png_dimensions(const uint8_t *data, size_t sz, uint32_t *width, uint32_t *height) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (sz < 24 || memcmp(data, signature, sizeof(signature)) != 0 || memcmp(data + 12, "IHDR", 4) != 0) return false;
+#define be32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+    *width = be32(data + 16); *height = be32(data + 20);
+#undef be32
+    return true;
+}
+
+static bool
+start_background_decode(GraphicsManager *self, Image *img, const GraphicsCommand *g, const unsigned char transmission_type, const uint32_t data_fmt) {
+    LoadData *ld = &self->currently_loading;
+    if (ld->is_decoded || (!g->compressed && data_fmt != PNG)) return false;
+    const uint8_t *data = ld->buf ? ld->buf : ld->mapped_file;
+    const size_t sz = ld->buf ? ld->buf_used : ld->mapped_file_sz;
+    if (!data || sz < self->background_decode_threshold) return false;
+    uint32_t width = ld->width, height = ld->height;
+    // The dimensions of compressed PNG data are not known without decompressing it
+    if (data_fmt == PNG && (g->compressed || !png_dimensions(data, sz, &width, &height))) return false;
+    if (!width || !height || width > MAX_IMAGE_DIMENSION || height > MAX_IMAGE_DIMENSION) return false;
+    if (!start_decode_workers()) return false;
+    DecodeJob *job = calloc(1, sizeof(DecodeJob));
+    if (!job) return false;
+    // the transmitted data now belongs to the job
+    job->load_data = *ld;
+    ld->buf = NULL; ld->buf_capacity = 0; ld->buf_used = 0; ld->data = NULL;
+    ld->mapped_file = NULL; ld->mapped_file_sz = 0;
+    job->g = *g; job->transmission_type = transmission_type; job->data_fmt = data_fmt;
+    job->width = width; job->height = height;
+    img->width = width; img->height = height;
+    if (img->root_frame.id) remove_from_cache(self, (const ImageAndFrame){.image_id=img->internal_id, .frame_id=img->root_frame.id});
+    img->root_frame = (const Frame){
+        .id = ++img->frame_id_counter,
+        .is_opaque = job->load_data.is_opaque,
+        .is_4byte_aligned = job->load_data.is_4byte_aligned,
+        .width = width, .height = height,
+    };
+    img->root_frame_data_loaded = true;
+    img->is_decoding = true;
+    job->image_id = img->internal_id; job->frame_id = img->root_frame.id;
+    self->decodes.just_started = job;
+    return true;
+}
+
+static void
+append_decode_job(GraphicsManager *self, DecodeJob *job) {
+    if (self->decodes.tail) self->decodes.tail->next = job;
+    else self->decodes.head = job;
+    self->decodes.tail = job;
+}
+
+static void
+submit_decode_job(GraphicsManager *self, DecodeJob *job) {
+    append_decode_job(self, job);
+    pthread_mutex_lock(&decoder.lock);
+    job->state = DECODE_QUEUED;
+    if (decoder.tail) decoder.tail->next_in_queue = job;
+    else decoder.head = job;
+    decoder.tail = job;
+    pthread_cond_signal(&decoder.job_available);
+    pthread_mutex_unlock(&decoder.lock);
+}
+
+static void
+queue_response(GraphicsManager *self, const char *response) {
+    DecodeJob *job = calloc(1, sizeof(DecodeJob));
+    if (!job || !(job->response = strdup(response))) fatal("Out of memory");
+    job->state = DECODE_DONE; job->applied = true;
+    append_decode_job(self, job);
+}
+
+static void
+cancel_decodes(GraphicsManager *self) {
+    DecodeJob *next;
+    for (DecodeJob *job = self->decodes.head; job; job = next) {
+        next = job->next;
+        bool can_free = true;
+        pthread_mutex_lock(&decoder.lock);
+        switch (job->state) {
+            case DECODE_QUEUED:
+                for (DecodeJob **q = &decoder.head, *prev = NULL; *q; prev = *q, q = &(*q)->next_in_queue) {
+                    if (*q == job) {
+                        *q = job->next_in_queue;
+                        if (decoder.tail == job) decoder.tail = prev;
+                        break;
+                    }
+                }
+                break;
+            case DECODE_RUNNING:
+                job->orphaned = true; can_free = false; break;
+            case DECODE_DONE:
+                break;
+        }
+        pthread_mutex_unlock(&decoder.lock);
+        if (can_free) free_decode_job(job);
+    }
+    self->decodes.head = NULL; self->decodes.tail = NULL; self->decodes.just_started = NULL;
+}
+
+bool
+grman_has_finished_decodes(void) {
+    if (!decoder.num_threads) return false;
+    pthread_mutex_lock(&decoder.lock);
+    bool ans = decoder.has_finished;
+    decoder.has_finished = false;
+    pthread_mutex_unlock(&decoder.lock);
+    return ans;
+}
+// }}}
+
 static Image*
 handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_t *payload, bool *is_dirty, uint32_t iid, bool is_query) {
     bool existing, init_img = true;
@@ -717,6 +1284,7 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
             img->texture = new_texture_ref();
             img->root_frame_data_loaded = false;
             img->is_drawn = false;
+            img->is_decoding = false;
             img->current_frame_shown_at = 0;
             img->extra_framecnt = 0;
             *is_dirty = true;
@@ -743,6 +1311,7 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
     img = load_image_data(self, img, g, tt, fmt, payload);
     if (!img || !self->currently_loading.loading_completed_successfully) return NULL;
         self->currently_loading.loading_for = (const ImageAndFrame){0};
+    if (!is_query && start_background_decode(self, img, g, tt, fmt)) return img;
     img = process_image_data(self, img, g, tt, fmt);
     if (!img) return NULL;
     size_t required_sz = (size_t)(self->currently_loading.is_opaque ? 3 : 4) * self->currently_loading.width * self->currently_loading.height;
@@ -758,11 +1327,12 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
             .width = img->width, .height = img->height,
         };
         if (!is_query) {
-            if (!add_to_cache(self, (const ImageAndFrame){.image_id = img->internal_id, .frame_id=img->root_frame.id}, self->currently_loading.data, self->currently_loading.data_sz)) {
+            // uploaded first as the data no longer belongs to us once it is added to the cache
+            upload_to_gpu(self, img, img->root_frame.is_opaque, img->root_frame.is_4byte_aligned, self->currently_loading.data, g->action == 'T' ? g : NULL, NULL);
+            if (!add_loaded_data_to_cache(self, (const ImageAndFrame){.image_id = img->internal_id, .frame_id=img->root_frame.id}, &self->currently_loading)) {
                 if (PyErr_Occurred()) PyErr_Print();
                 ABRT("ENOSPC", "Failed to store image data in disk cache");
             }
-            upload_to_gpu(self, img, img->root_frame.is_opaque, img->root_frame.is_4byte_aligned, self->currently_loading.data);
             self->used_storage += required_sz;
             img->used_storage = required_sz;
         }
@@ -798,10 +1368,105 @@ finish_command_response(const GraphicsCommand *g, bool data_loaded) {
     return NULL;
 }
 
+static void
+apply_decoded_image(GraphicsManager *self, DecodeJob *job, bool *is_dirty) {
+    job->applied = true;
+    Image *img = img_by_internal_id(self, job->image_id);
+    // the image was deleted or re-transmitted while it was being decoded
+    if (img && (!img->is_decoding || img->root_frame.id != job->frame_id)) img = NULL;
+    LoadData *ld = &job->load_data;
+    command_response[0] = 0;
+    if (!job->ok) memcpy(command_response, job->error, sizeof(command_response));
+    else if (img) {
+        // uploaded first as the data no longer belongs to us once it is added to the cache
+        self->context_made_current_for_this_command = false;
+        upload_to_gpu(self, img, img->root_frame.is_opaque, img->root_frame.is_4byte_aligned, ld->data, NULL, NULL);
+        if (!add_loaded_data_to_cache(self, (const ImageAndFrame){.image_id = img->internal_id, .frame_id=img->root_frame.id}, ld)) {
+            if (PyErr_Occurred()) PyErr_Print();
+            set_command_failed_response("ENOSPC", "Failed to store image data in disk cache");
+            job->ok = false;
+        } else {
+            self->used_storage += ld->data_sz;
+            img->used_storage = ld->data_sz;
+        }
+    }
+    free_load_data(ld);
+    if (img) {
+        img->is_decoding = false;
+        id_type added_image_id = img->internal_id;
+        if (!job->ok) remove_image(self, img);
+        else if (self->used_storage > self->storage_limit) apply_storage_quota(self, self->storage_limit, added_image_id);
+        self->layers_dirty = true;
+        *is_dirty = true;
+    }
+    const char *response = finish_command_response(&job->response_command, job->ok);
+    if (response && !(job->response = strdup(response))) fatal("Out of memory");
+}
+
+static void
+wait_for_decode_job(DecodeJob *job) {
+    pthread_mutex_lock(&decoder.lock);
+    while (job->state != DECODE_DONE) pthread_cond_wait(&decoder.job_done, &decoder.lock);
+    pthread_mutex_unlock(&decoder.lock);
+}
+
+static Image*
+finish_decoding(GraphicsManager *self, Image *img, bool *is_dirty) {
+    // Blocks until img is decoded, returns NULL if decoding it failed
+    if (!img || !img->is_decoding) return img;
+    id_type internal_id = img->internal_id;
+    for (DecodeJob *job = self->decodes.head; job; job = job->next) {
+        if (!job->applied && job->image_id == internal_id && job->frame_id == img->root_frame.id) {
+            wait_for_decode_job(job);
+            apply_decoded_image(self, job, is_dirty);
+            break;
+        }
+    }
+    return img_by_internal_id(self, internal_id);
+}
+
+bool
+grman_process_decoded_images(GraphicsManager *self, bool wait, bool *is_dirty, const char **response) {
+    static char rbuf[sizeof(command_response)/sizeof(command_response[0]) + 128];
+    DecodeJob *job = self->decodes.head;
+    if (!job) return false;
+    if (!job->applied) {
+        if (wait) wait_for_decode_job(job);
+        else {
+            pthread_mutex_lock(&decoder.lock);
+            bool done = job->state == DECODE_DONE;
+            pthread_mutex_unlock(&decoder.lock);
+            if (!done) return false;
+        }
+        apply_decoded_image(self, job, is_dirty);
+    }
+    self->decodes.head = job->next;
+    if (!self->decodes.head) self->decodes.tail = NULL;
+    *response = NULL;
+    if (job->response) {
+        snprintf(rbuf, arraysz(rbuf), "%s", job->response);
+        *response = rbuf;
+    }
+    free_decode_job(job);
+    return true;
+}
+
 // }}}
 
 // Displaying images {{{
 
+static bool upload_current_frame(GraphicsManager *self, Image *img);
+
+static void
+update_texture_size(GraphicsManager *self, Image *img) {
+    // Upload the texture again if it is the wrong size for the current
+    // placements and cell size. Called when placements or the cell size
+    // change, never while rendering, as the full resolution data may have to
+    // be read from the disk cache.
+    if (!img->texture || !img->root_frame_data_loaded || img->is_decoding || !self->disk_cache) return;
+    if (texture_downscale_factor(img, self->cell, NULL) != img->texture->downscale_factor) upload_current_frame(self, img);
+}
+
 static void
 update_src_rect(ImageRef *ref, Image *img) {
     // The src rect in OpenGL co-ords [0, 1] with origin at top-left corner of image
@@ -1014,10 +1679,11 @@ void grman_put_cell_image(GraphicsManager *self, uint32_t screen_row,
 
     update_src_rect(real_ref, img);
     update_dest_rect(real_ref, ref.num_cols, ref.num_rows, cell);
+    add_to_placement_index(self, img, real_ref);
 }
 
-static void remove_ref(Image *img, ImageRef *ref);
-static ref_map_itr remove_ref_itr(Image *img, ref_map_itr x);
+static void remove_ref(GraphicsManager *self, Image *img, ImageRef *ref);
+static ref_map_itr remove_ref_itr(GraphicsManager *self, Image *img, ref_map_itr x);
 
 static bool
 has_good_ancestry(GraphicsManager *self, ImageRef *ref) {
@@ -1101,13 +1767,14 @@ handle_put_command(GraphicsManager *self, const GraphicsCommand *g, Cursor *c, b
         }
     }
     if (ref == NULL) ref = create_ref(img, NULL);
+    const bool was_virtual = ref->is_virtual_ref;
 
     *is_dirty = true;
     self->layers_dirty = true;
+    self->placements.dirty = true;
     img->atime = monotonic();
-    ref->src_x = g->x_offset; ref->src_y = g->y_offset; ref->src_width = g->width ? g->width : img->width; ref->src_height = g->height ? g->height : img->height;
-    ref->src_width = MIN(ref->src_width, img->width - ((float)img->width > ref->src_x ? ref->src_x : (float)img->width));
-    ref->src_height = MIN(ref->src_height, img->height - ((float)img->height > ref->src_y ? ref->src_y : (float)img->height));
+    ref->src_x = g->x_offset; ref->src_y = g->y_offset;
+    set_ref_src_size(ref, img, g->width, g->height);
     ref->z_index = g->z_index;
     ref->start_row = c->y; ref->start_column = c->x;
     ref->cell_x_offset = MIN(g->cell_x_offset, cell.width - 1);
@@ -1125,9 +1792,10 @@ handle_put_command(GraphicsManager *self, const GraphicsCommand *g, Cursor *c, b
         ref->is_virtual_ref = true;
         ref->start_row = ref->start_column = 0;
     }
+    if (was_virtual || ref->is_virtual_ref) placeholders_changed(self, img->client_id);
     if (ref->parent.img) {
         if (!has_good_ancestry(self, ref)) {
-            remove_ref(img, ref);
+            remove_ref(self, img, ref);
             return g->id;
         }
     } else {
@@ -1137,6 +1805,7 @@ handle_put_command(GraphicsManager *self, const GraphicsCommand *g, Cursor *c, b
             if (ref->effective_num_rows) c->y += ref->effective_num_rows - 1;
         }
     }
+    update_texture_size(self, img);
     return img->client_id;
 }
 
@@ -1207,6 +1876,7 @@ grman_update_layers(GraphicsManager *self, unsigned int scrolled_by, float scree
     self->last_scrolled_by = scrolled_by;
     if (!self->layers_dirty) return false;
     self->layers_dirty = false;
+    self->cell = cell;
     size_t i;
     self->num_of_below_refs = 0;
     self->num_of_negative_refs = 0;
@@ -1221,72 +1891,74 @@ grman_update_layers(GraphicsManager *self, unsigned int scrolled_by, float scree
     // Iterate over all visible refs and create render data
     self->render_data.count = 0;
 
-    for (image_map_itr imgitr = vt_first(&self->images_by_internal_id); !vt_is_end(imgitr); ) {
-        Image *img = imgitr.data->val;
-        bool was_drawn = img->is_drawn, ref_removed = false;
-        img->is_drawn = false;
-
-        for (ref_map_itr refitr = vt_first(&img->refs_by_internal_id); !vt_is_end(refitr); ) {
-            ImageRef *ref = refitr.data->val;
-            if (ref->is_virtual_ref) { refitr = vt_next(refitr); continue; }
-            int32_t start_row = ref->start_row, start_column = ref->start_column;
-            if (ref->parent.img) {
-                bool has_virtual_ancestor;
-                if (!resolve_parent_offset(self, ref, &start_row, &start_column, &has_virtual_ancestor)) {
-                    if (!has_virtual_ancestor) {
-                        refitr = remove_ref_itr(img, refitr);
-                        ref_removed = true;
-                    } else refitr = vt_next(refitr);
-                    continue;
+    iter_images(self) { Image *img = i.data->val; img->was_drawn = img->is_drawn; img->is_drawn = false; }
+    PlacementIndex *p = placement_index(self);
+    // Refs placed relative to a parent can be anywhere, otherwise only refs
+    // starting in or a few rows above the visible rows need to be looked at
+    size_t start = 0, end = p->count;
+    if (!p->num_with_parent) {
+        start = first_placement_from_row(p, -(int32_t)scrolled_by - (int32_t)p->max_rows - 1);
+        end = first_placement_from_row(p, (int32_t)num_rows - (int32_t)scrolled_by);
+    }
+
+    // Removing refs below marks the index dirty, but the entries after the
+    // removed ones remain valid until this loop is finished
+    for (size_t pos = start; pos < end; pos++) {
+        ImageRef *ref = p->items[pos].ref; Image *img = p->items[pos].img;
+        int32_t start_row = ref->start_row, start_column = ref->start_column;
+        if (ref->parent.img) {
+            bool has_virtual_ancestor;
+            if (!resolve_parent_offset(self, ref, &start_row, &start_column, &has_virtual_ancestor)) {
+                if (!has_virtual_ancestor) {
+                    remove_ref(self, img, ref);
+                    if (!vt_size(&img->refs_by_internal_id)) remove_image(self, img);
                 }
+                continue;
             }
-            r.top = y0 - start_row * dy - dy * (float)ref->cell_y_offset / (float)cell.height;
-            r.left = screen_left + start_column * dx + dx * (float)ref->cell_x_offset / (float) cell.width;
-
-            int32_t nr = ref->num_rows, nc = ref->num_cols;
-            if (nr) {
-                r.bottom = y0 - (start_row + nr) * dy;
-                if (nc) r.right = screen_left + (start_column + nc) * dx;
-                else {
-                    double height_px = (((double)r.top - r.bottom) / screen_height) * screen_height_px;
-                    double width_px = height_px * ref->src_width / (double) ref->src_height;
-                    r.right = r.left + (float)((width_px / screen_width_px) * screen_width);
-                }
-            } else {
-                if (nc) r.right = screen_left + (start_column + nc) * dx;
-                else r.right = r.left + screen_width * (float)ref->src_width / screen_width_px;
-                double width_px = (((double)r.right - r.left) / screen_width) * screen_width_px;
-                double height_px = width_px * ref->src_height / (double)ref->src_width;
-                r.bottom = r.top - (float)((height_px / screen_height_px) * screen_height);
+        }
+        r.top = y0 - start_row * dy - dy * (float)ref->cell_y_offset / (float)cell.height;
+        r.left = screen_left + start_column * dx + dx * (float)ref->cell_x_offset / (float) cell.width;
+
+        int32_t nr = ref->num_rows, nc = ref->num_cols;
+        if (nr) {
+            r.bottom = y0 - (start_row + nr) * dy;
+            if (nc) r.right = screen_left + (start_column + nc) * dx;
+            else {
+                double height_px = (((double)r.top - r.bottom) / screen_height) * screen_height_px;
+                double width_px = height_px * ref->src_width / (double) ref->src_height;
+                r.right = r.left + (float)((width_px / screen_width_px) * screen_width);
             }
+        } else {
+            if (nc) r.right = screen_left + (start_column + nc) * dx;
+            else r.right = r.left + screen_width * (float)ref->src_width / screen_width_px;
+            double width_px = (((double)r.right - r.left) / screen_width) * screen_width_px;
+            double height_px = width_px * ref->src_height / (double)ref->src_width;
+            r.bottom = r.top - (float)((height_px / screen_height_px) * screen_height);
+        }
 
-            if (r.top <= screen_bottom || r.bottom >= screen_top) { refitr = vt_next(refitr); continue; }  // not visible
-
-            if (ref->z_index < ((int32_t)INT32_MIN/2))
-                self->num_of_below_refs++;
-            else if (ref->z_index < 0)
-                self->num_of_negative_refs++;
-            else
-                self->num_of_positive_refs++;
-            ensure_space_for(&(self->render_data), item, ImageRenderData, self->render_data.count + 1, capacity, 64, true);
-            ImageRenderData *rd = self->render_data.item + self->render_data.count;
-            zero_at_ptr(rd);
-            rd->dest_rect = r; rd->src_rect = ref->src_rect;
-            self->render_data.count++;
-            rd->z_index = ref->z_index; rd->image_id = img->internal_id; rd->ref_id = ref->internal_id;
-            rd->texture_id = texture_id_for_img(img);
+        if (r.top <= screen_bottom || r.bottom >= screen_top) continue;  // not visible
+        if (img->is_decoding) continue;  // drawn once its data is uploaded
+
+        if (ref->z_index < ((int32_t)INT32_MIN/2))
+            self->num_of_below_refs++;
+        else if (ref->z_index < 0)
+            self->num_of_negative_refs++;
+        else
+            self->num_of_positive_refs++;
+        ensure_space_for(&(self->render_data), item, ImageRenderData, self->render_data.count + 1, capacity, 64, true);
+        ImageRenderData *rd = self->render_data.item + self->render_data.count;
+        zero_at_ptr(rd);
+        rd->dest_rect = r; rd->src_rect = ref->src_rect;
+        self->render_data.count++;
+        rd->z_index = ref->z_index; rd->image_id = img->internal_id; rd->ref_id = ref->internal_id;
+        if (!img->is_drawn) {
             img->is_drawn = true;
-            refitr = vt_next(refitr);
-        }
-        if (ref_removed && !vt_size(&img->refs_by_internal_id)) {
-            imgitr = remove_image_itr(self, imgitr);
-            continue;
-        }
-        if (img->is_drawn && !was_drawn && img->animation_state != ANIMATION_STOPPED && img->extra_framecnt && img->animation_duration) {
-            self->has_images_needing_animation = true;
-            global_state.check_for_active_animated_images = true;
+            if (!img->was_drawn && img->animation_state != ANIMATION_STOPPED && img->extra_framecnt && img->animation_duration) {
+                self->has_images_needing_animation = true;
+                global_state.check_for_active_animated_images = true;
+            }
         }
-        imgitr = vt_next(imgitr);
+        rd->texture_id = texture_id_for_img(img);
     }
     if (!self->render_data.count) return false;
     // Sort visible refs in draw order (z-index, img, ref)
@@ -1355,24 +2027,79 @@ typedef struct {
     bool is_4byte_aligned, is_opaque;
 } CoalescedFrameData;
 
+// Coalesced frame cache {{{
+struct CachedFrame {
+    ImageAndFrame key;
+    CoalescedFrameData data;
+    // The frame as last uploaded to the GPU, if it was downscaled
+    ScaledFrame scaled;
+    size_t sz, scaled_sz;
+    CachedFrame *newer, *older;
+};
+
 static void
-blend_on_opaque(uint8_t *under_px, const uint8_t *over_px) {
-    const float alpha = (float)over_px[3] / 255.f;
-    const float alpha_op = 1.f - alpha;
-    for (unsigned i = 0; i < 3; i++) under_px[i] = (uint8_t)(over_px[i] * alpha + under_px[i] * alpha_op);
+unlink_cached_frame(GraphicsManager *self, CachedFrame *c) {
+    if (c->newer) c->newer->older = c->older; else self->coalesced_frames.newest = c->older;
+    if (c->older) c->older->newer = c->newer; else self->coalesced_frames.oldest = c->newer;
+    c->newer = NULL; c->older = NULL;
 }
 
 static void
-alpha_blend(uint8_t *dest_px, const uint8_t *src_px) {
-    if (src_px[3]) {
-        const float dest_a = (float)dest_px[3] / 255.f, src_a = (float)src_px[3] / 255.f;
-        const float alpha = src_a + dest_a * (1.f - src_a);
-        dest_px[3] = (uint8_t)(255 * alpha);
-        if (!dest_px[3]) { dest_px[0] = 0; dest_px[1] = 0; dest_px[2] = 0; return; }
-        for (unsigned i = 0; i < 3; i++) dest_px[i] = (uint8_t)((src_px[i] * src_a + dest_px[i] * dest_a * (1.f - src_a))/alpha);
-    }
+link_cached_frame(GraphicsManager *self, CachedFrame *c) {
+    c->older = self->coalesced_frames.newest; c->newer = NULL;
+    if (c->older) c->older->newer = c; else self->coalesced_frames.oldest = c;
+    self->coalesced_frames.newest = c;
 }
 
+static void
+free_cached_frame(GraphicsManager *self, CachedFrame *c) {
+    unlink_cached_frame(self, c);
+    vt_erase(&self->coalesced_frames.map, c->key);
+    self->coalesced_frames.size -= c->sz + c->scaled_sz;
+    free(c->data.buf); free(c->scaled.buf); free(c);
+}
+
+static void
+forget_coalesced_frames(GraphicsManager *self, id_type image_id) {
+    CachedFrame *older;
+    for (CachedFrame *c = self->coalesced_frames.newest; c; c = older) {
+        older = c->older;
+        if (c->key.image_id == image_id) free_cached_frame(self, c);
+    }
+}
+
+static CachedFrame*
+lookup_coalesced_frame(GraphicsManager *self, const ImageAndFrame key) {
+    frame_map_itr i = vt_get(&self->coalesced_frames.map, key);
+    if (vt_is_end(i)) return NULL;
+    CachedFrame *c = i.data->val;
+    unlink_cached_frame(self, c); link_cached_frame(self, c);
+    return c;
+}
+
+static CachedFrame*
+cache_coalesced_frame(GraphicsManager *self, const ImageAndFrame key, const CoalescedFrameData data, size_t sz) {
+    // Takes ownership of data.buf on success. Frames of other images are
+    // evicted least recently used first, but frames of the same image never
+    // evict each other: an animation loop that does not fit would otherwise
+    // evict every frame just before it is needed again. This way at least
+    // part of the loop is always served from the cache.
+    if (sz > self->coalesced_frames.limit) return NULL;
+    for (CachedFrame *c = self->coalesced_frames.oldest, *newer; c && self->coalesced_frames.size + sz > self->coalesced_frames.limit; c = newer) {
+        newer = c->newer;
+        if (c->key.image_id != key.image_id) free_cached_frame(self, c);
+    }
+    if (self->coalesced_frames.size + sz > self->coalesced_frames.limit) return NULL;
+    CachedFrame *c = calloc(1, sizeof(CachedFrame));
+    if (!c) return NULL;
+    if (vt_is_end(vt_insert(&self->coalesced_frames.map, key, c))) { free(c); return NULL; }
+    c->key = key; c->data = data; c->sz = sz;
+    link_cached_frame(self, c);
+    self->coalesced_frames.size += sz;
+    return c;
+}
+// }}}
+
 typedef struct {
     bool needs_blending;
     uint32_t over_px_sz, under_px_sz;
@@ -1381,12 +2108,14 @@ typedef struct {
 } ComposeData;
 
 #define COPY_RGB under_px[0] = over_px[0]; under_px[1] = over_px[1]; under_px[2] = over_px[2];
+// blending is only needed when the over image has an alpha channel, the
+// blending kernels work a row at a time and are SIMD accelerated
 #define COPY_PIXELS \
     if (d.needs_blending) { \
         if (d.under_px_sz == 3) { \
-            ROW_ITER PIX_ITER blend_on_opaque(under_px, over_px); }} \
+            ROW_ITER blend_rgba_on_rgb(under_row, over_row, ROW_WIDTH); } \
         } else { \
-            ROW_ITER PIX_ITER alpha_blend(under_px, over_px); }} \
+            ROW_ITER alpha_blend_rgba(under_row, over_row, ROW_WIDTH); } \
         } \
     } else { \
         if (d.under_px_sz == 4) { \
@@ -1417,7 +2146,9 @@ compose_rectangles(const ComposeData d, uint8_t *under_data, const uint8_t *over
 #define PIX_ITER for (unsigned x = 0; x < min_width; x++) { \
         uint8_t *under_px = under_row + (d.under_px_sz * x); \
         const uint8_t *over_px = over_row + (d.over_px_sz * x);
+#define ROW_WIDTH min_width
     COPY_PIXELS
+#undef ROW_WIDTH
 #undef PIX_ITER
 #undef ROW_ITER
 }
@@ -1438,7 +2169,9 @@ compose(const ComposeData d, uint8_t *under_data, const uint8_t *over_data) {
 #define PIX_ITER for (unsigned x = 0; x < min_row_sz; x++) { \
         uint8_t *under_px = under_row + (d.under_px_sz * x); \
         const uint8_t *over_px = over_row + (d.over_px_sz * x);
+#define ROW_WIDTH min_row_sz
     COPY_PIXELS
+#undef ROW_WIDTH
 #undef COPY_RGB
 #undef PIX_ITER
 #undef ROW_ITER
@@ -1496,6 +2229,14 @@ get_coalesced_frame_data_impl(GraphicsManager *self, Image *img, const Frame *f,
     if (count > 32) return ans;  // prevent stack overflows, infinite recursion
     size_t frame_data_sz; void *frame_data;
     ImageAndFrame key = {.image_id = img->internal_id, .frame_id = f->id};
+    CachedFrame *cached = lookup_coalesced_frame(self, key);
+    if (cached) {
+        if ((ans.buf = malloc(cached->sz))) {
+            memcpy(ans.buf, cached->data.buf, cached->sz);
+            ans.is_4byte_aligned = cached->data.is_4byte_aligned; ans.is_opaque = cached->data.is_opaque;
+        }
+        return ans;
+    }
     if (!read_from_cache(self, key, &frame_data, &frame_data_sz)) return ans;
     if (!f->base_frame_id) return get_coalesced_frame_data_standalone(img, f, frame_data);
     Frame *base = frame_for_id(img, f->base_frame_id);
@@ -1519,22 +2260,41 @@ get_coalesced_frame_data(GraphicsManager *self, Image *img, const Frame *f) {
     return get_coalesced_frame_data_impl(self, img, f, 0);
 }
 
-static void
-update_current_frame(GraphicsManager *self, Image *img, const CoalescedFrameData *data) {
-    bool needs_load = data == NULL;
-    CoalescedFrameData cfd;
-    if (needs_load) {
-        Frame *f = current_frame(img);
-        if (f == NULL) return;
+static bool
+upload_current_frame(GraphicsManager *self, Image *img) {
+    CoalescedFrameData cfd = {0};
+    const CoalescedFrameData *data;
+    Frame *f = current_frame(img);
+    if (f == NULL) return false;
+    const ImageAndFrame key = {.image_id = img->internal_id, .frame_id = f->id};
+    CachedFrame *cached = lookup_coalesced_frame(self, key);
+    if (cached) data = &cached->data;
+    else {
         cfd = get_coalesced_frame_data(self, img, f);
         if (!cfd.buf) {
             if (PyErr_Occurred()) PyErr_Print();
-            return;
+            return false;
         }
         data = &cfd;
+        if ((cached = cache_coalesced_frame(self, key, cfd, (size_t)(cfd.is_opaque ? 3 : 4) * img->width * img->height))) {
+            data = &cached->data; cfd.buf = NULL;
+        }
     }
-    upload_to_gpu(self, img, data->is_opaque, data->is_4byte_aligned, data->buf);
-    if (needs_load) free(data->buf);
+    if (cached) {
+        // keep the downscaled frame so that showing it again does not need to downscale it
+        upload_to_gpu(self, img, data->is_opaque, data->is_4byte_aligned, data->buf, NULL, &cached->scaled);
+        self->coalesced_frames.size -= cached->scaled_sz;
+        cached->scaled_sz = cached->scaled.buf ? (size_t)(data->is_opaque ? 3 : 4) * cached->scaled.width * cached->scaled.height : 0;
+        self->coalesced_frames.size += cached->scaled_sz;
+    } else upload_to_gpu(self, img, data->is_opaque, data->is_4byte_aligned, data->buf, NULL, NULL);
+    free(cfd.buf);
+    return true;
+}
+
+static void
+update_current_frame(GraphicsManager *self, Image *img, const CoalescedFrameData *data) {
+    if (data) upload_to_gpu(self, img, data->is_opaque, data->is_4byte_aligned, data->buf, NULL, NULL);
+    else if (!upload_current_frame(self, img)) return;
     img->current_frame_shown_at = monotonic();
 }
 
@@ -1623,7 +2383,9 @@ handle_animation_frame_load_command(GraphicsManager *self, GraphicsCommand *g, I
                 };
                 compose(d, cfd.buf, load_data->data);
                 free_load_data(load_data);
-                load_data->data = cfd.buf; load_data->data_sz = (size_t)img->width * img->height * d.under_px_sz;
+                load_data->data_sz = (size_t)img->width * img->height * d.under_px_sz;
+                load_data->buf = cfd.buf; load_data->buf_capacity = load_data->data_sz; load_data->buf_used = load_data->data_sz;
+                load_data->data = load_data->buf;
                 transmitted_frame.width = img->width; transmitted_frame.height = img->height;
                 transmitted_frame.x = 0; transmitted_frame.y = 0;
                 transmitted_frame.is_4byte_aligned = cfd.is_4byte_aligned;
@@ -1633,7 +2395,7 @@ handle_animation_frame_load_command(GraphicsManager *self, GraphicsCommand *g, I
             }
         }
         *frame = transmitted_frame;
-        if (!add_to_cache(self, key, load_data->data, load_data->data_sz)) {
+        if (!add_loaded_data_to_cache(self, key, load_data)) {
             img->extra_framecnt--;
             if (PyErr_Occurred()) PyErr_Print();
             ABRT("ENOSPC", "Failed to cache data for image frame");
@@ -1661,6 +2423,8 @@ handle_animation_frame_load_command(GraphicsManager *self, GraphicsCommand *g, I
             .needs_blending = transmitted_frame.alpha_blend && !transmitted_frame.is_opaque
         };
         compose(d, cfd.buf, load_data->data);
+        // frames based on this frame change as well
+        forget_coalesced_frames(self, img->internal_id);
         const ImageAndFrame key = { .image_id = img->internal_id, .frame_id = frame->id };
         bool added = add_to_cache(self, key, cfd.buf, (size_t)bytes_per_pixel * frame->width * frame->height);
         if (added && frame == current_frame(img)) {
@@ -1693,6 +2457,7 @@ handle_delete_frame_command(GraphicsManager *self, const GraphicsCommand *g, boo
     if (!frame_number) frame_number = 1;
     if (!img->extra_framecnt) return g->delete_action == 'F' ? img : NULL;
     *is_dirty = true;
+    forget_coalesced_frames(self, img->internal_id);
     ImageAndFrame key = {.image_id=img->internal_id};
     bool remove_root = frame_number == 1;
     uint32_t removed_gap = 0;
@@ -1864,6 +2629,7 @@ handle_compose_command(GraphicsManager *self, bool *is_dirty, const GraphicsComm
         .stride = img->width
     };
     compose_rectangles(d, dest_data.buf, src_data.buf);
+    forget_coalesced_frames(self, img->internal_id);
     const ImageAndFrame key = { .image_id = img->internal_id, .frame_id = dest_frame->id };
     if (!add_to_cache(self, key, dest_data.buf, ((size_t)(dest_data.is_opaque ? 3 : 4)) * img->width * img->height)) {
         if (PyErr_Occurred()) PyErr_Print();
@@ -1880,17 +2646,19 @@ handle_compose_command(GraphicsManager *self, bool *is_dirty, const GraphicsComm
 // Image lifetime/scrolling {{{
 
 static ref_map_itr
-remove_ref_itr(Image *img, ref_map_itr x) {
+remove_ref_itr(GraphicsManager *self, Image *img, ref_map_itr x) {
+    if (!x.data->val->is_virtual_ref) self->placements.dirty = true;
+    else placeholders_changed(self, img->client_id);
     free(x.data->val);
     return vt_erase_itr(&img->refs_by_internal_id, x);
 }
 
 
 static void
-remove_ref(Image *img, ImageRef *ref) {
+remove_ref(GraphicsManager *self, Image *img, ImageRef *ref) {
     ref_map_itr i = vt_get(&img->refs_by_internal_id, ref->internal_id);
     if (vt_is_end(i)) return;
-    remove_ref_itr(img, i);
+    remove_ref_itr(self, img, i);
 }
 
 static void
@@ -1899,7 +2667,7 @@ filter_refs(GraphicsManager *self, const void* data, bool free_images, bool (*fi
         bool matched = false;
         for (ref_map_itr ri = vt_first(&img->refs_by_internal_id); !vt_is_end(ri); ) { ImageRef *ref = ri.data->val;
             if (filter_func(ref, img, data, cell)) {
-                ri = remove_ref_itr(img, ri);
+                ri = remove_ref_itr(self, img, ri);
                 self->layers_dirty = true;
                 matched = true;
             } else ri = vt_next(ri);
@@ -1912,27 +2680,38 @@ filter_refs(GraphicsManager *self, const void* data, bool free_images, bool (*fi
 
 
 static void
-modify_refs(GraphicsManager *self, const void* data, bool (*filter_func)(ImageRef*, Image*, const void*, CellPixelSize), CellPixelSize cell) {
-    for (image_map_itr ii = vt_first(&self->images_by_internal_id); !vt_is_end(ii); ) { Image *img = ii.data->val;
-        for (ref_map_itr ri = vt_first(&img->refs_by_internal_id); !vt_is_end(ri); ) { ImageRef *ref = ri.data->val;
-            if (filter_func(ref, img, data, cell)) ri = remove_ref_itr(img, ri);
-            else ri = vt_next(ri);
-        }
-        if (!vt_size(&img->refs_by_internal_id) && img->client_id == 0 && img->client_number == 0) {
-            // references have all scrolled off the history buffer and the image has no way to reference it
-            // to create new references so remove it.
-            ii = remove_image_itr(self, ii);
-        } else ii = vt_next(ii);
+filter_refs_in_rows(GraphicsManager *self, int32_t top, int32_t bottom, const void* data, bool free_images, bool (*filter_func)(const ImageRef*, Image*, const void*, CellPixelSize), CellPixelSize cell) {
+    // Same as filter_refs() with free_only_matched for filters that only
+    // match displayed refs that intersect the rows from top to bottom
+    PlacementIndex *p = placement_index(self);
+    size_t keep = first_placement_from_row(p, top - (int32_t)p->max_rows), pos = keep;
+    for (; pos < p->count && p->items[pos].ref->start_row <= bottom; pos++) {
+        const IndexedRef x = p->items[pos];
+        if (filter_func(x.ref, x.img, data, cell)) remove_indexed_ref(self, &x, free_images || x.img->client_id == 0);
+        else p->items[keep++] = x;
     }
+    drop_from_placement_index(p, keep, pos);
 }
 
-
 static bool
-scroll_filter_func(ImageRef *ref, Image UNUSED *img, const void *data, CellPixelSize cell UNUSED) {
-    if (ref->is_virtual_ref) return false;
-    ScrollData *d = (ScrollData*)data;
-    ref->start_row += d->amt;
-    return ref->start_row + (int32_t)ref->effective_num_rows <= d->limit;
+scrolled_off_image(const Image *img) {
+    // references have all scrolled off the history buffer and the image has no way to reference it
+    // to create new references so remove it.
+    return img->client_id == 0 && img->client_number == 0;
+}
+
+static void
+scroll_placements(GraphicsManager *self, const ScrollData *d) {
+    PlacementIndex *p = placement_index(self);
+    for (size_t i = 0; i < p->count; i++) p->items[i].ref->start_row += d->amt;
+    // refs that have scrolled off the history buffer are at the start of the index
+    size_t keep = 0, pos = 0;
+    for (; pos < p->count && p->items[pos].ref->start_row <= d->limit; pos++) {
+        const IndexedRef x = p->items[pos];
+        if (x.ref->start_row + (int32_t)x.ref->effective_num_rows <= d->limit) remove_indexed_ref(self, &x, scrolled_off_image(x.img));
+        else p->items[keep++] = x;
+    }
+    drop_from_placement_index(p, keep, pos);
 }
 
 static bool
@@ -1977,12 +2756,97 @@ scroll_filter_margins_func(ImageRef* ref, Image* img, const void* data, CellPixe
     return false;
 }
 
+static void
+scroll_placements_in_region(GraphicsManager *self, const ScrollData *d, CellPixelSize cell) {
+    // Only refs that start in the scroll region can be within it, and they
+    // stay in it, so the index only needs to be re-sorted for those refs
+    PlacementIndex *p = placement_index(self);
+    const size_t start = first_placement_from_row(p, d->margin_top);
+    size_t keep = start, pos = start;
+    for (; pos < p->count && p->items[pos].ref->start_row <= (int32_t)d->margin_bottom; pos++) {
+        const IndexedRef x = p->items[pos];
+        if (scroll_filter_margins_func(x.ref, x.img, d, cell)) remove_indexed_ref(self, &x, scrolled_off_image(x.img));
+        else p->items[keep++] = x;
+    }
+    drop_from_placement_index(p, keep, pos);
+    sort_placements(p->items + start, keep - start);
+}
+
+// Placeholder index {{{
+
+static size_t
+first_placeholder_line_from_row(const PlaceholderIndex *p, int32_t row) {
+    // The position of the first line with row >= row
+    size_t lo = 0, hi = p->count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (p->items[mid].row < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void
+drop_placeholder_lines(PlaceholderIndex *p, int32_t top, int32_t bottom) {
+    const size_t start = first_placeholder_line_from_row(p, top);
+    const size_t end = bottom < INT32_MAX ? first_placeholder_line_from_row(p, bottom + 1) : p->count;
+    memmove(p->items + start, p->items + end, (p->count - end) * sizeof(p->items[0]));
+    p->count -= end - start;
+}
+
+static void
+scroll_placeholder_lines(PlaceholderIndex *p, const ScrollData *d) {
+    // Lines move exactly like the single row cell images created for them
+    size_t start = 0, end = p->count;
+    if (d->has_margins) {
+        start = first_placeholder_line_from_row(p, d->margin_top);
+        end = first_placeholder_line_from_row(p, d->margin_bottom + 1);
+    }
+    size_t keep = start;
+    for (size_t i = start; i < end; i++) {
+        PlaceholderLine x = p->items[i];
+        x.row += d->amt;
+        if (d->has_margins ? x.row >= (int32_t)d->margin_top && x.row <= (int32_t)d->margin_bottom : x.row >= d->limit) p->items[keep++] = x;
+    }
+    memmove(p->items + keep, p->items + end, (p->count - end) * sizeof(p->items[0]));
+    p->count -= end - keep;
+}
+
+bool
+grman_placeholder_line_is_current(GraphicsManager *self, int32_t row) {
+    // Whether the cell images for the line at row are up to date, that is the
+    // line has been scanned since the images it refers to last changed
+    const PlaceholderIndex *p = &self->placeholders;
+    const size_t pos = first_placeholder_line_from_row(p, row);
+    if (pos >= p->count || p->items[pos].row != row) return false;
+    const PlaceholderLine *l = p->items + pos;
+    for (uint64_t ids = l->image_ids; ids; ids &= ids - 1) {
+        if (p->changed_at[__builtin_ctzll(ids)] > l->scanned_at) return false;
+    }
+    return true;
+}
+
+void
+grman_placeholder_line_scanned(GraphicsManager *self, int32_t row, uint64_t image_ids) {
+    PlaceholderIndex *p = &self->placeholders;
+    const size_t pos = first_placeholder_line_from_row(p, row);
+    if (pos >= p->count || p->items[pos].row != row) {
+        ensure_space_for(p, items, PlaceholderLine, p->count + 1, capacity, 64, false);
+        memmove(p->items + pos + 1, p->items + pos, (p->count - pos) * sizeof(p->items[0]));
+        p->count++;
+    }
+    p->items[pos] = (PlaceholderLine){.row=row, .image_ids=image_ids, .scanned_at=p->generation};
+}
+// }}}
+
 void
 grman_scroll_images(GraphicsManager *self, const ScrollData *data, CellPixelSize cell) {
     if (vt_size(&self->images_by_internal_id)) {
         self->layers_dirty = true;
-        modify_refs(self, data, data->has_margins ? scroll_filter_margins_func : scroll_filter_func, cell);
+        if (data->has_margins) scroll_placements_in_region(self, data, cell);
+        else scroll_placements(self, data);
     }
+    scroll_placeholder_lines(&self->placeholders, data);
 }
 
 static bool
@@ -2004,13 +2868,15 @@ void
 grman_remove_cell_images(GraphicsManager *self, int32_t top, int32_t bottom) {
     CellPixelSize dummy = {0};
     int32_t data[] = {top, bottom};
-    filter_refs(self, data, false, cell_image_row_filter_func, dummy, false, true);
+    filter_refs_in_rows(self, top, bottom, data, false, cell_image_row_filter_func, dummy);
+    drop_placeholder_lines(&self->placeholders, top, bottom);
 }
 
 void
 grman_remove_all_cell_images(GraphicsManager *self) {
     CellPixelSize dummy = {0};
     filter_refs(self, NULL, false, cell_image_filter_func, dummy, false, true);
+    self->placeholders.count = 0;
 }
 
 
@@ -2035,6 +2901,7 @@ clear_all_filter_func(const ImageRef *ref UNUSED, Image UNUSED *img, const void
 void
 grman_clear(GraphicsManager *self, bool all, CellPixelSize cell) {
     filter_refs(self, NULL, true, all ? clear_all_filter_func : clear_filter_func, cell, false, false);
+    drop_placeholder_lines(&self->placeholders, all ? INT32_MIN : 0, INT32_MAX);
 }
 
 static bool
@@ -2111,26 +2978,28 @@ handle_delete_command(GraphicsManager *self, const GraphicsCommand *g, Cursor *c
 #define I(u, data, func) filter_refs(self, data, g->delete_action == u, func, cell, false, true); *is_dirty = true; break
 #define D(l, u, data, func) case l: case u: I(u, data, func)
 #define G(l, u, func) D(l, u, g, func)
+#define ROW(u, data, func) { const int32_t row = (int32_t)(data)->y_offset - 1; filter_refs_in_rows(self, row, row, data, g->delete_action == u, func, cell); *is_dirty = true; } break
+#define R(l, u, func) case l: case u: ROW(u, g, func)
         case 0:
         D('a', 'A', NULL, clear_filter_func_noncell);
         G('i', 'I', id_filter_func);
         G('r', 'R', id_range_filter_func);
-        G('p', 'P', point_filter_func);
-        G('q', 'Q', point3d_filter_func);
+        R('p', 'P', point_filter_func);
+        R('q', 'Q', point3d_filter_func);
         G('x', 'X', x_filter_func);
-        G('y', 'Y', y_filter_func);
+        R('y', 'Y', y_filter_func);
         G('z', 'Z', z_filter_func);
         case 'c':
         case 'C':
             d.x_offset = c->x + 1; d.y_offset = c->y + 1;
-            I('C', &d, point_filter_func);
+            ROW('C', &d, point_filter_func);
         case 'n':
         case 'N': {
             Image *img = img_by_client_number(self, g->image_number);
             if (img) {
                 for (ref_map_itr ri = vt_first(&img->refs_by_internal_id); !vt_is_end(ri); ) { ImageRef *ref = ri.data->val;
                     if (!g->placement_id || g->placement_id == ref->client_id) {
-                        ri = remove_ref_itr(img, ri);
+                        ri = remove_ref_itr(self, img, ri);
                         self->layers_dirty = true;
                     } else ri = vt_next(ri);
                 }
@@ -2149,6 +3018,8 @@ handle_delete_command(GraphicsManager *self, const GraphicsCommand *g, Cursor *c
         default:
             REPORT_ERROR("Unknown graphics command delete action: %c", g->delete_action);
             break;
+#undef R
+#undef ROW
 #undef G
 #undef D
 #undef I
@@ -2165,6 +3036,7 @@ grman_resize(GraphicsManager *self, index_type old_lines UNUSED, index_type line
     self->layers_dirty = true;
     if (columns == old_columns && num_content_lines_before > num_content_lines_after) {
         const unsigned int vertical_shrink_size = num_content_lines_before - num_content_lines_after;
+        self->placements.dirty = true;  // cell images are not moved
         iter_images(self) { img = i.data->val;
             iter_refs(img) { ref = i.data->val;
                 if (ref->is_virtual_ref || is_cell_image(ref)) continue;
@@ -2178,6 +3050,9 @@ void
 grman_rescale(GraphicsManager *self, CellPixelSize cell) {
     ImageRef *ref; Image *img;
     self->layers_dirty = true;
+    self->placements.dirty = true;
+    self->cell = cell;
+    self->context_made_current_for_this_command = false;
     iter_images(self) { img = i.data->val;
         iter_refs(img) { ref = i.data->val;
             if (ref->is_virtual_ref || is_cell_image(ref)) continue;
@@ -2185,18 +3060,28 @@ grman_rescale(GraphicsManager *self, CellPixelSize cell) {
             ref->cell_y_offset = MIN(ref->cell_y_offset, cell.height - 1);
             update_dest_rect(ref, ref->num_cols, ref->num_rows, cell);
         }
+        update_texture_size(self, img);
     }
 }
 
+static const char*
+respond_in_order(GraphicsManager *self, const char *response) {
+    // responses must not overtake those of commands still being decoded
+    if (!response || !self->decodes.head) return response;
+    queue_response(self, response);
+    return NULL;
+}
+
 const char*
 grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_t *payload, Cursor *c, bool *is_dirty, CellPixelSize cell) {
     const char *ret = NULL;
     command_response[0] = 0;
     self->context_made_current_for_this_command = false;
+    self->cell = cell;
 
     if (g->id && g->image_number) {
         set_command_failed_response("EINVAL", "Must not specify both image id and image number");
-        return finish_command_response(g, false);
+        return respond_in_order(self, finish_command_response(g, false));
     }
 
     switch(g->action) {
@@ -2212,7 +3097,12 @@ grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint
             GraphicsCommand *lg = &self->currently_loading.start_command;
             if (g->quiet) lg->quiet = g->quiet;
             if (is_query) ret = finish_command_response(&(const GraphicsCommand){.id=q_iid, .quiet=g->quiet}, image != NULL);
-            else ret = finish_command_response(lg, image != NULL);
+            else if (self->decodes.just_started) {
+                // the response is sent once decoding finishes
+                self->decodes.just_started->response_command = *lg;
+                submit_decode_job(self, self->decodes.just_started);
+                self->decodes.just_started = NULL;
+            } else ret = finish_command_response(lg, image != NULL);
             if (lg->action == 'T' && image && image->root_frame_data_loaded) handle_put_command(self, lg, c, is_dirty, image, cell);
             id_type added_image_id = image ? image->internal_id : 0;
             if (g->action == 'q') remove_images(self, add_trim_predicate, 0);
@@ -2228,6 +3118,8 @@ grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint
             Image *img;
             if (self->currently_loading.loading_for.image_id) img = img_by_internal_id(self, self->currently_loading.loading_for.image_id);
             else img = g->id ? img_by_client_id(self, g->id) : img_by_client_number(self, g->image_number);
+            img = finish_decoding(self, img, is_dirty);
+            command_response[0] = 0;
             if (!img) {
                 set_command_failed_response("ENOENT", "Animation command refers to non-existent image with id: %u and number: %u", g->id, g->image_number);
                 ret = finish_command_response(g, false);
@@ -2264,6 +3156,8 @@ grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint
                 break;
             }
             Image *img = g->id ? img_by_client_id(self, g->id) : img_by_client_number(self, g->image_number);
+            img = finish_decoding(self, img, is_dirty);
+            command_response[0] = 0;
             if (!img) {
                 set_command_failed_response("ENOENT", "Animation command refers to non-existent image with id: %u and number: %u", g->id, g->image_number);
                 ret = finish_command_response(g, false);
@@ -2276,7 +3170,7 @@ grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint
             REPORT_ERROR("Unknown graphics command action: %c", g->action);
             break;
     }
-    return ret;
+    return respond_in_order(self, ret);
 }
 
 
@@ -2308,7 +3202,7 @@ image_as_dict(GraphicsManager *self, Image *img) {
     }
     CoalescedFrameData cfd = get_coalesced_frame_data(self, img, &img->root_frame);
     if (!cfd.buf) { PyErr_SetString(PyExc_RuntimeError, "Failed to get data for root frame"); return NULL; }
-    PyObject *ans = Py_BuildValue("{sI sI sI sI sI sI sI " "sO sI sO " "sI sI sI " "sI sy# sN}",
+    PyObject *ans = Py_BuildValue("{sI sI sI sI sI sI sI " "sO sI sO " "sI sI sI " "sI sI sy# sN}",
         "texture_id", texture_id_for_img(img), U(client_id), U(width), U(height), U(internal_id),
         "refs.count", (unsigned int)vt_size(&img->refs_by_internal_id), U(client_number),
 
@@ -2316,7 +3210,7 @@ image_as_dict(GraphicsManager *self, Image *img) {
 
         U(current_frame_index), "root_frame_gap", img->root_frame.gap, U(current_frame_index),
 
-        U(animation_duration), "data", cfd.buf, (Py_ssize_t)((cfd.is_opaque ? 3 : 4) * img->width * img->height), "extra_frames", frames
+        U(animation_duration), "texture_downscale_factor", img->texture ? img->texture->downscale_factor : 0, "data", cfd.buf, (Py_ssize_t)((cfd.is_opaque ? 3 : 4) * img->width * img->height), "extra_frames", frames
     );
     free(cfd.buf);
     return ans;
@@ -2332,13 +3226,16 @@ W(image_for_client_id) {
     bool existing = false;
     Image *img = find_or_create_image(self, id, &existing);
     if (!existing) { Py_RETURN_NONE; }
+    bool is_dirty;
+    if (!(img = finish_decoding(self, img, &is_dirty))) Py_RETURN_NONE;
     return image_as_dict(self, img);
 }
 
 W(image_for_client_number) {
     unsigned long num = PyLong_AsUnsignedLong(args);
     Image *img = img_by_client_number(self, num);
-    if (!img) Py_RETURN_NONE;
+    bool is_dirty;
+    if (!(img = finish_decoding(self, img, &is_dirty))) Py_RETURN_NONE;
     return image_as_dict(self, img);
 }
 
@@ -2404,6 +3301,9 @@ static PyGetSetDef getsets[] = {
 
 static PyMemberDef members[] = {
     {"storage_limit", T_PYSSIZET, offsetof(GraphicsManager, storage_limit), 0, "storage_limit"},
+    {"background_decode_threshold", T_PYSSIZET, offsetof(GraphicsManager, background_decode_threshold), 0, "background_decode_threshold"},
+    {"coalesced_frame_cache_limit", T_PYSSIZET, offsetof(GraphicsManager, coalesced_frames.limit), 0, "coalesced_frame_cache_limit"},
+    {"coalesced_frame_cache_size", T_PYSSIZET, offsetof(GraphicsManager, coalesced_frames.size), READONLY, "coalesced_frame_cache_size"},
     {"disk_cache", T_OBJECT_EX, offsetof(GraphicsManager, disk_cache), READONLY, "disk_cache"},
     {NULL},
 };
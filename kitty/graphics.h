@@ -78,6 +78,8 @@ typedef enum { ANIMATION_STOPPED = 0, ANIMATION_LOADING = 1, ANIMATION_RUNNING =
 
 typedef struct TextureRef {
     uint32_t id, refcnt;
+    // The factor the uploaded texture was downscaled by, zero if the upload is pending
+    uint32_t downscale_factor;
 } TextureRef;
 
 #define NAME ref_map
@@ -98,7 +100,7 @@ typedef struct {
     size_t extra_framecnt;
     monotonic_t atime;
     size_t used_storage;
-    bool is_drawn;
+    bool is_drawn, was_drawn, is_decoding;
     AnimationState animation_state;
     uint32_t max_loops, current_loop;
     monotonic_t current_frame_shown_at;
@@ -124,6 +126,9 @@ typedef struct {
     uint32_t width, height;
     GraphicsCommand start_command;
     ImageAndFrame loading_for;
+    // Decodes chunked direct transmissions as they arrive, is_decoded is set once it is done
+    struct StreamDecoder *stream;
+    bool is_decoded;
 } LoadData;
 
 #define NAME image_map
@@ -131,6 +136,48 @@ typedef struct {
 #define VAL_TY Image*
 #include "kitty-verstable.h"
 
+typedef struct DecodeJob DecodeJob;
+
+typedef struct {
+    ImageRef *ref;
+    Image *img;
+} IndexedRef;
+
+typedef struct {
+    IndexedRef *items;
+    size_t count, capacity, num_with_parent;
+    // An upper bound on effective_num_rows of the indexed refs
+    uint32_t max_rows;
+    bool dirty;
+} PlacementIndex;
+
+typedef struct {
+    int32_t row;
+    // The images the placeholders in the line refer to, see placeholder_image_id_bit()
+    uint64_t image_ids;
+    // The value of PlaceholderIndex.generation when the line was last scanned
+    uint64_t scanned_at;
+} PlaceholderLine;
+
+typedef struct {
+    // Lines that have been scanned for unicode placeholders, sorted by row
+    PlaceholderLine *items;
+    size_t count, capacity;
+    // changed_at records the generation at which the virtual placements of the images in each bit of image_ids last changed
+    uint64_t generation, changed_at[64];
+} PlaceholderIndex;
+
+typedef struct CachedFrame CachedFrame;
+static inline uint64_t image_and_frame_hash(ImageAndFrame k);
+static inline bool image_and_frame_eq(ImageAndFrame a, ImageAndFrame b) { return a.image_id == b.image_id && a.frame_id == b.frame_id; }
+#define NAME frame_map
+#define KEY_TY ImageAndFrame
+#define VAL_TY CachedFrame*
+#define HASH_FN image_and_frame_hash
+#define CMPR_FN image_and_frame_eq
+#include "kitty-verstable.h"
+static inline uint64_t image_and_frame_hash(ImageAndFrame k) { return vt_hash_integer(k.image_id ^ ((uint64_t)k.frame_id << 40)); }
+
 typedef struct {
     PyObject_HEAD
 
@@ -149,7 +196,19 @@ typedef struct {
     PyObject *disk_cache;
     bool has_images_needing_animation, context_made_current_for_this_command;
     id_type window_id;
+    // The most recent cell size, textures are sized to fit their placements at this size
+    CellPixelSize cell;
     image_map images_by_internal_id;
+    // Displayed refs sorted by start_row
+    PlacementIndex placements;
+    // Lines with unicode placeholders, so that they are only rescanned when the images they refer to change
+    PlaceholderIndex placeholders;
+    // Images with at least this much compressed data are decoded on a worker thread
+    size_t background_decode_threshold;
+    // Responses to commands in the order they were received, waiting for background decodes to finish
+    struct { DecodeJob *head, *tail, *just_started; } decodes;
+    // Fully composed animation frames, so that looping animations do not re-compose them from the disk cache
+    struct { frame_map map; CachedFrame *newest, *oldest; size_t size, limit; } coalesced_frames;
 } GraphicsManager;
 #else
 typedef struct {int x;} *GraphicsManager;
@@ -190,6 +249,10 @@ gl_pos_y(const unsigned int px_from_top_margin, const unsigned int viewport_size
     return 1.f - px_from_top_margin * px;
 }
 
+// Lines with unicode placeholders record the ids of the images they refer to as a bitmask
+static inline uint64_t
+placeholder_image_id_bit(uint32_t image_id) { return 1ull << (image_id & 63); }
+
 typedef struct GraphicsRenderData {
     size_t count, capacity, num_of_below_refs, num_of_negative_refs, num_of_positive_refs;
     ImageRenderData *images;
@@ -205,6 +268,8 @@ void grman_resize(GraphicsManager*, index_type, index_type, index_type, index_ty
 void grman_rescale(GraphicsManager *self, CellPixelSize fg);
 void grman_remove_cell_images(GraphicsManager *self, int32_t top, int32_t bottom);
 void grman_remove_all_cell_images(GraphicsManager *self);
+bool grman_placeholder_line_is_current(GraphicsManager *self, int32_t row);
+void grman_placeholder_line_scanned(GraphicsManager *self, int32_t row, uint64_t image_ids);
 void gpu_data_for_image(ImageRenderData *ans, float left, float top, float right, float bottom);
 bool png_from_file_pointer(FILE* fp, const char *path, uint8_t** data, unsigned int* width, unsigned int* height, size_t* sz);
 bool png_path_to_bitmap(const char *path, uint8_t** data, unsigned int* width, unsigned int* height, size_t* sz);
@@ -216,3 +281,5 @@ void grman_pause_rendering(GraphicsManager *self, GraphicsManager *dest);
 void grman_mark_layers_dirty(GraphicsManager *self);
 void grman_set_window_id(GraphicsManager *self, id_type id);
 GraphicsRenderData grman_render_data(GraphicsManager *self);
+bool grman_has_finished_decodes(void);
+bool grman_process_decoded_images(GraphicsManager *self, bool wait, bool *is_dirty, const char **response);
@@ -226,6 +226,11 @@ historybuf_set_line_has_image_placeholders(HistoryBuf *self, index_type y, bool
     attrptr(self, index_of(self, y))->has_image_placeholders = val;
 }
 
+bool
+historybuf_line_has_image_placeholders(HistoryBuf *self, index_type y) {
+    return attrptr(self, index_of(self, y))->has_image_placeholders;
+}
+
 void
 historybuf_clear(HistoryBuf *self) {
     pagerhist_clear(self);
@@ -168,7 +168,8 @@ format_mods(unsigned mods) {
 }
 
 static void
-send_key_to_child(id_type window_id, Screen *screen, const GLFWkeyevent *ev) {
+send_key_to_child(id_type window_id, Screen *screen, const GLFWkeyevent *ev, monotonic_t received_at) {
+    // received_at is zero for keys that should not be timed for latency measurement
     const int action = ev->action;
     const uint32_t key = ev->key, native_key = ev->native_key;
     const char *text = ev->text ? ev->text : "";
@@ -182,14 +183,18 @@ send_key_to_child(id_type window_id, Screen *screen, const GLFWkeyevent *ev) {
     }
     char encoded_key[KEY_BUFFER_SIZE] = {0};
     int size = encode_glfw_key_event(ev, screen->modes.mDECCKM, screen_current_key_encoding_flags(screen), encoded_key);
+    // only presses are timed, since releases are usually not echoed
+    const bool timed = received_at && action != GLFW_RELEASE;
     if (size == SEND_TEXT_TO_CHILD) {
-        schedule_write_to_child(window_id, 1, text, strlen(text));
+        if (timed && latency_key_sent_to_child(screen, received_at)) schedule_timed_key_write_to_child(window_id, text, strlen(text), received_at);
+        else schedule_write_to_child(window_id, 1, text, strlen(text));
         debug("sent key as text to child (window_id: %llu): %s\n", window_id, text);
     } else if (size > 0) {
         if (size == 1 && screen->modes.mHANDLE_TERMIOS_SIGNALS) {
             if (screen_send_signal_for_key(screen, *encoded_key)) return;
         }
-        schedule_write_to_child(window_id, 1, encoded_key, size);
+        if (timed && latency_key_sent_to_child(screen, received_at)) schedule_timed_key_write_to_child(window_id, encoded_key, size, received_at);
+        else schedule_write_to_child(window_id, 1, encoded_key, size);
         if (OPT(debug_keyboard)) {
             debug("sent encoded key to child (window_id: %llu): ", window_id);
             for (int ki = 0; ki < size; ki++) {
@@ -211,7 +216,7 @@ dispatch_buffered_keys(Window *w) {
     GLFWkeyevent *keys = w->buffered_keys.key_data;
     for (size_t i = 0; i < w->buffered_keys.count; i++) {
         debug("Sending previously buffered key ");
-        send_key_to_child(w->id, w->render_data.screen, keys + i);
+        send_key_to_child(w->id, w->render_data.screen, keys + i, 0);
     }
     free(w->buffered_keys.key_data); zero_at_ptr(&w->buffered_keys);
 }
@@ -222,6 +227,7 @@ on_key_input(const GLFWkeyevent *ev) {
     const int action = ev->action, mods = ev->mods;
     const uint32_t key = ev->key, native_key = ev->native_key;
     const char *text = ev->text ? ev->text : "";
+    const monotonic_t received_at = monotonic();
 
     if (OPT(debug_keyboard)) {
         if (!key && !native_key && text[0]) {
@@ -306,7 +312,7 @@ on_key_input(const GLFWkeyevent *ev) {
         GLFWkeyevent *k = w->buffered_keys.key_data;
         k[w->buffered_keys.count++] = *ev;
         debug("bufferring key until child is ready\n");
-    } else send_key_to_child(w->id, screen, ev);
+    } else send_key_to_child(w->id, screen, ev, received_at);
 #undef dispatch_key_event
 }
 
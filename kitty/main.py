@@ -96,8 +96,14 @@ def init_glfw_module(glfw_module: str = 'wayland', debug_keyboard: bool = False,
     supports_window_occlusion(swo)
 
 
-def init_glfw(opts: Options, debug_keyboard: bool = False, debug_rendering: bool = False) -> str:
-    glfw_module = 'cocoa' if is_macos else ('wayland' if is_wayland(opts) else 'x11')
+def init_glfw(opts: Options, debug_keyboard: bool = False, debug_rendering: bool = False, headless: bool = False) -> str:
+    if headless:
+        if is_macos:
+            raise SystemExit('Headless mode is not supported on macOS')
+        setattr(is_wayland, 'ans', False)
+        glfw_module = 'osmesa'
+    else:
+        glfw_module = 'cocoa' if is_macos else ('wayland' if is_wayland(opts) else 'x11')
     init_glfw_module(glfw_module, debug_keyboard, debug_rendering, wayland_enable_ime=opts.wayland_enable_ime)
     return glfw_module
 
@@ -239,6 +245,9 @@ def _run_app(opts: Options, args: CLIOptions, bad_lines: Sequence[BadLine] = (),
         boss.start(window_id, startup_sessions)
         if args.debug_font_fallback:
             dump_font_debug()
+        if args.benchmark_rendering:
+            from .render_benchmark import start_render_benchmark
+            start_render_benchmark(boss, args.benchmark_rendering)
         if bad_lines or boss.misc_config_errors:
             boss.show_bad_config_lines(bad_lines, boss.misc_config_errors)
             boss.misc_config_errors = []
@@ -525,7 +534,7 @@ def _main() -> None:
     # threads. These threads must not handle the masked signals, to ensure
     # kitty can handle them. See https://github.com/kovidgoyal/kitty/issues/4636
     mask_kitty_signals_process_wide()
-    init_glfw(opts, cli_opts.debug_keyboard, cli_opts.debug_rendering)
+    init_glfw(opts, cli_opts.debug_keyboard, cli_opts.debug_rendering, cli_opts.headless)
     try:
         with setup_profiling():
             # Avoid needing to launch threads to reap zombies
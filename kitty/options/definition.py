@@ -957,6 +957,21 @@
 scrolling. However, it limits the rendering speed to the refresh rate of your
 monitor. With a very high speed mouse/high keyboard repeat rate, you may notice
 some slight input latency. If so, set this to :code:`no`.
+'''
+    )
+
+opt('sprite_cache_size', '256',
+    option_type='positive_int', ctype='uint',
+    long_text='''
+The maximum amount of GPU memory (in MB) used to cache rendered glyphs, per
+font size. When this limit is reached, the glyphs that have gone unused for the
+longest time are evicted and their space is re-used for new glyphs. Glyphs that
+are currently visible on screen are never evicted. A value of zero means glyphs
+are only evicted when the texture size limits of the GPU are reached. Glyphs
+rendered at font sizes and DPIs that are no longer in use, for example after
+changing the font size or moving a window to a different monitor, are kept as
+long as their total memory usage is within this limit, so that returning to
+them is instant.
 '''
     )
 egr()  # }}}
@@ -1229,6 +1229,9 @@ def single_window_margin_width(self, val: str, ans: dict[str, typing.Any]) -> No
     def single_window_padding_width(self, val: str, ans: dict[str, typing.Any]) -> None:
         ans['single_window_padding_width'] = optional_edge_width(val)
 
+    def sprite_cache_size(self, val: str, ans: dict[str, typing.Any]) -> None:
+        ans['sprite_cache_size'] = positive_int(val)
+
     def startup_session(self, val: str, ans: dict[str, typing.Any]) -> None:
         ans['startup_session'] = config_or_absolute_path(val)
 
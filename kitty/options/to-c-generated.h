@@ -551,6 +551,19 @@ convert_from_opts_sync_to_monitor(PyObject *py_opts, Options *opts) {
     Py_DECREF(ret);
 }
 
+static void
+convert_from_python_sprite_cache_size(PyObject *val, Options *opts) {
+    opts->sprite_cache_size = PyLong_AsUnsignedLong(val);
+}
+
+static void
+convert_from_opts_sprite_cache_size(PyObject *py_opts, Options *opts) {
+    PyObject *ret = PyObject_GetAttrString(py_opts, "sprite_cache_size");
+    if (ret == NULL) return;
+    convert_from_python_sprite_cache_size(ret, opts);
+    Py_DECREF(ret);
+}
+
 static void
 convert_from_python_enable_audio_bell(PyObject *val, Options *opts) {
     opts->enable_audio_bell = PyObject_IsTrue(val);
@@ -1261,6 +1274,8 @@ convert_opts_from_python_opts(PyObject *py_opts, Options *opts) {
     if (PyErr_Occurred()) return false;
     convert_from_opts_sync_to_monitor(py_opts, opts);
     if (PyErr_Occurred()) return false;
+    convert_from_opts_sprite_cache_size(py_opts, opts);
+    if (PyErr_Occurred()) return false;
     convert_from_opts_enable_audio_bell(py_opts, opts);
     if (PyErr_Occurred()) return false;
     convert_from_opts_visual_bell_duration(py_opts, opts);
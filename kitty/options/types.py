@@ -422,6 +422,7 @@
     'show_hyperlink_targets',
     'single_window_margin_width',
     'single_window_padding_width',
+    'sprite_cache_size',
     'startup_session',
     'strip_trailing_spaces',
     'symbol_map',
@@ -593,6 +594,7 @@ class Options:
     show_hyperlink_targets: bool = False
     single_window_margin_width: FloatEdges = FloatEdges(left=-1.0, top=-1.0, right=-1.0, bottom=-1.0)
     single_window_padding_width: FloatEdges = FloatEdges(left=-1.0, top=-1.0, right=-1.0, bottom=-1.0)
+    sprite_cache_size: int = 256
     startup_session: str | None = None
     strip_trailing_spaces: choices_for_strip_trailing_spaces = 'never'
     sync_to_monitor: bool = True
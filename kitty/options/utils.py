@@ -434,6 +434,11 @@ def mouse_selection(func: str, rest: str) -> FuncArgsType:
 @func_with_args('load_config_file')
 def load_config_file(func: str, rest: str) -> FuncArgsType:
     return func, list(shlex_split(rest))
+
+
+@func_with_args('toggle_tracing')
+def toggle_tracing(func: str, rest: str) -> FuncArgsType:
+    return func, [rest.strip()]
 # }}}
 
 
@@ -10,9 +10,11 @@
 #include "cleanup.h"
 #include "state.h"
 #include <lcms2.h>
+#include <pthread.h>
 
 
 static cmsHPROFILE srgb_profile = NULL;
+static pthread_mutex_t srgb_profile_lock = PTHREAD_MUTEX_INITIALIZER;  // images are also decoded on worker threads
 struct fake_file { const uint8_t *buf; size_t sz, cur; };
 
 static void
@@ -46,21 +48,13 @@ read_png_warn_handler(png_structp UNUSED png_ptr, png_const_charp msg) {
 
 #define ABRT(code, msg) { if(d->err_handler) d->err_handler(d, #code, msg); goto err; }
 
-void
-inflate_png_inner(png_read_data *d, const uint8_t *buf, size_t bufsz) {
-    struct fake_file f = {.buf = buf, .sz = bufsz};
-    png_structp png = NULL;
-    png_infop info = NULL;
-    struct custom_error_handler eh = {.d = d};
-    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &eh, read_png_error_handler, read_png_warn_handler);
-    if (!png) ABRT(ENOMEM, "Failed to create PNG read structure");
-    info = png_create_info_struct(png);
-    if (!info) ABRT(ENOMEM, "Failed to create PNG info structure");
-
-    if (setjmp(eh.jb)) goto err;
+typedef struct {
+    cmsHPROFILE input_profile;
+    cmsHTRANSFORM colorspace_transform;
+} color_management;
 
-    png_set_read_fn(png, &f, read_png_from_buffer);
-    png_read_info(png, info);
+static bool
+setup_read_transforms(png_structp png, png_infop info, png_read_data *d, color_management *cm) {
     png_byte color_type, bit_depth;
     d->width      = png_get_image_width(png, info);
     d->height     = png_get_image_height(png, info);
@@ -68,8 +62,6 @@ inflate_png_inner(png_read_data *d, const uint8_t *buf, size_t bufsz) {
     bit_depth  = png_get_bit_depth(png, info);
     double image_gamma;
     int intent;
-    cmsHPROFILE input_profile = NULL;
-    cmsHTRANSFORM colorspace_transform = NULL;
     if (png_get_sRGB(png, info, &intent)) {
         // do nothing since we output sRGB
     } else if (png_get_gAMA(png, info, &image_gamma)) {
@@ -81,14 +73,14 @@ inflate_png_inner(png_read_data *d, const uint8_t *buf, size_t bufsz) {
         png_bytep profdata;
         png_uint_32 proflen;
         if (png_get_iCCP(png, info, &name, &compression_type, &profdata, &proflen) & PNG_INFO_iCCP) {
-            input_profile = cmsOpenProfileFromMem(profdata, proflen);
-            if (input_profile) {
-                if (!srgb_profile) {
-                    srgb_profile = cmsCreate_sRGBProfile();
-                    if (!srgb_profile) ABRT(ENOMEM, "Out of memory allocating sRGB colorspace profile");
-                }
-                colorspace_transform = cmsCreateTransform(
-                    input_profile, TYPE_RGBA_8, srgb_profile, TYPE_RGBA_8, INTENT_PERCEPTUAL, 0);
+            cm->input_profile = cmsOpenProfileFromMem(profdata, proflen);
+            if (cm->input_profile) {
+                pthread_mutex_lock(&srgb_profile_lock);
+                if (!srgb_profile) srgb_profile = cmsCreate_sRGBProfile();
+                pthread_mutex_unlock(&srgb_profile_lock);
+                if (!srgb_profile) ABRT(ENOMEM, "Out of memory allocating sRGB colorspace profile");
+                cm->colorspace_transform = cmsCreateTransform(
+                    cm->input_profile, TYPE_RGBA_8, srgb_profile, TYPE_RGBA_8, INTENT_PERCEPTUAL, 0);
 
             }
         }
@@ -106,6 +98,7 @@ inflate_png_inner(png_read_data *d, const uint8_t *buf, size_t bufsz) {
     if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_PALETTE) png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
 
     if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) png_set_gray_to_rgb(png);
+    png_set_interlace_handling(png);
     png_read_update_info(png, info);
 
     png_uint_32 rowbytes = png_get_rowbytes(png, info);
@@ -115,22 +108,122 @@ inflate_png_inner(png_read_data *d, const uint8_t *buf, size_t bufsz) {
     d->row_pointers = malloc(d->height * sizeof(png_bytep));
     if (d->row_pointers == NULL) ABRT(ENOMEM, "Out of memory allocating row_pointers buffer for PNG");
     for (size_t i = 0; i < (size_t)d->height; i++) d->row_pointers[i] = d->decompressed + i * rowbytes * sizeof(png_byte);
-    png_read_image(png, d->row_pointers);
+    return true;
+err:
+    return false;
+}
 
-    if (colorspace_transform) {
+static void
+release_color_management(color_management *cm) {
+    if (cm->colorspace_transform) { cmsDeleteTransform(cm->colorspace_transform); cm->colorspace_transform = NULL; }
+    if (cm->input_profile) { cmsCloseProfile(cm->input_profile); cm->input_profile = NULL; }
+}
+
+static void
+apply_color_management(png_read_data *d, color_management *cm) {
+    if (cm->colorspace_transform) {
         for (int i = 0; i < d->height; i++) {
-            cmsDoTransform(colorspace_transform, d->row_pointers[i], d->row_pointers[i], d->width);
+            cmsDoTransform(cm->colorspace_transform, d->row_pointers[i], d->row_pointers[i], d->width);
         }
-        cmsDeleteTransform(colorspace_transform);
     }
-    if (input_profile) cmsCloseProfile(input_profile);
+    release_color_management(cm);
+}
+
+void
+inflate_png_inner(png_read_data *d, const uint8_t *buf, size_t bufsz) {
+    struct fake_file f = {.buf = buf, .sz = bufsz};
+    png_structp png = NULL;
+    png_infop info = NULL;
+    struct custom_error_handler eh = {.d = d};
+    color_management cm = {0};
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &eh, read_png_error_handler, read_png_warn_handler);
+    if (!png) ABRT(ENOMEM, "Failed to create PNG read structure");
+    info = png_create_info_struct(png);
+    if (!info) ABRT(ENOMEM, "Failed to create PNG info structure");
+
+    if (setjmp(eh.jb)) goto err;
+
+    png_set_read_fn(png, &f, read_png_from_buffer);
+    png_read_info(png, info);
+    if (!setup_read_transforms(png, info, d, &cm)) goto err;
+    png_read_image(png, d->row_pointers);
+    apply_color_management(d, &cm);
 
     d->ok = true;
 err:
+    release_color_management(&cm);
     if (png) png_destroy_read_struct(&png, info ? &info : NULL, NULL);
     return;
 }
 
+// Progressive reading {{{
+// Decodes PNG data as it arrives, without needing to hold all of it in memory
+
+struct png_stream {
+    png_structp png;
+    png_infop info;
+    struct custom_error_handler eh;
+    color_management cm;
+    bool finished;
+};
+
+static void
+stream_info_callback(png_structp png, png_infop info) {
+    png_stream *s = png_get_progressive_ptr(png);
+    if (!setup_read_transforms(png, info, s->eh.d, &s->cm)) longjmp(s->eh.jb, 1);
+}
+
+static void
+stream_row_callback(png_structp png, png_bytep new_row, png_uint_32 row_num, int pass UNUSED) {
+    png_stream *s = png_get_progressive_ptr(png);
+    if (new_row && row_num < (png_uint_32)s->eh.d->height) png_progressive_combine_row(png, s->eh.d->row_pointers[row_num], new_row);
+}
+
+static void
+stream_end_callback(png_structp png, png_infop info UNUSED) {
+    png_stream *s = png_get_progressive_ptr(png);
+    s->finished = true;
+}
+
+png_stream*
+new_png_stream(png_read_data *d) {
+    png_stream *s = calloc(1, sizeof(png_stream));
+    if (!s) return NULL;
+    s->eh.d = d;
+    s->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &s->eh, read_png_error_handler, read_png_warn_handler);
+    if (s->png) s->info = png_create_info_struct(s->png);
+    if (!s->png || !s->info) { free_png_stream(s); return NULL; }
+    png_set_progressive_read_fn(s->png, s, stream_info_callback, stream_row_callback, stream_end_callback);
+    return s;
+}
+
+bool
+png_stream_feed(png_stream *s, const uint8_t *buf, size_t bufsz) {
+    if (setjmp(s->eh.jb)) return false;
+    png_process_data(s->png, s->info, (png_bytep)buf, bufsz);
+    return true;
+}
+
+bool
+png_stream_finish(png_stream *s) {
+    png_read_data *d = s->eh.d;
+    if (!s->finished) {
+        if (d->err_handler) d->err_handler(d, "EBADPNG", "PNG data is incomplete");
+        return false;
+    }
+    apply_color_management(d, &s->cm);
+    d->ok = true;
+    return true;
+}
+
+void
+free_png_stream(png_stream *s) {
+    if (s->png) png_destroy_read_struct(&s->png, s->info ? &s->info : NULL, NULL);
+    release_color_management(&s->cm);
+    free(s);
+}
+// }}}
+
 static void
 png_error_handler(png_read_data *d UNUSED, const char *code, const char *msg) {
     if (!PyErr_Occurred()) PyErr_Format(PyExc_ValueError, "[%s] %s", code, msg);
@@ -28,3 +28,9 @@ typedef struct png_read_data {
 } png_read_data;
 
 void inflate_png_inner(png_read_data *d, const uint8_t *buf, size_t bufsz);
+
+typedef struct png_stream png_stream;
+png_stream* new_png_stream(png_read_data *d);
+bool png_stream_feed(png_stream *s, const uint8_t *buf, size_t bufsz);
+bool png_stream_finish(png_stream *s);
+void free_png_stream(png_stream *s);
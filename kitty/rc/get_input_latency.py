@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+# License: GPLv3 Copyright: 2026, Kovid Goyal <kovid at kovidgoyal.net>
+
+import json
+from collections.abc import Sequence
+from typing import TYPE_CHECKING, Any
+
+from .base import MATCH_WINDOW_OPTION, ArgsType, Boss, PayloadGetType, PayloadType, RCOptions, RemoteCommand, ResponseType, Window
+
+if TYPE_CHECKING:
+    from kitty.cli_stub import GetInputLatencyRCOptions as CLIOptions
+
+
+STAGES = 'write', 'echo', 'parse', 'present'
+# Upper bounds of the histogram buckets in milliseconds, the last bucket is unbounded
+BUCKETS = 0.25, 0.5, 1, 2, 4, 8, 16, 32, 64, 128, 256
+
+
+def summarize(durations: Sequence[float]) -> dict[str, Any]:
+    ms = sorted(d * 1000 for d in durations)
+    if not ms:
+        return {}
+
+    def percentile(p: float) -> float:
+        return round(ms[min(len(ms) - 1, int(p * len(ms)))], 3)
+
+    counts = [0] * (len(BUCKETS) + 1)
+    b = 0
+    for x in ms:
+        while b < len(BUCKETS) and x > BUCKETS[b]:
+            b += 1
+        counts[b] += 1
+    return {
+        'median': percentile(0.5), 'p90': percentile(0.9), 'p99': percentile(0.99), 'max': round(ms[-1], 3),
+        'histogram': [[BUCKETS[i] if i < len(BUCKETS) else None, c] for i, c in enumerate(counts) if c],
+    }
+
+
+def input_latency_report(samples: Sequence[tuple[float, float, float, float]]) -> dict[str, Any]:
+    ans: dict[str, Any] = {'samples': len(samples), 'stages': {}}
+    for i, stage in enumerate(STAGES):
+        ans['stages'][stage] = summarize([s[i] for s in samples])
+    ans['stages']['total'] = summarize([sum(s) for s in samples])
+    return ans
+
+
+class GetInputLatency(RemoteCommand):
+
+    protocol_spec = __doc__ = '''
+    match/str: The window to get the input latency of
+    all/bool: Boolean, if True get the input latency of all windows
+    clear/bool: Boolean, if True discard the recorded samples after reporting them
+    self/bool: Boolean, if True use window the command was run in
+    '''
+
+    short_desc = 'Get the input latency of windows'
+    desc = (
+        'Get statistics about the time taken from a key being pressed to the response of the program running in the'
+        ' window being displayed, for the most recent key presses in each window. The result is a JSON object mapping'
+        ' window ids to the number of :italic:`samples` and statistics for each of the :italic:`stages`. The stages are:'
+        ' :code:`write` until the key is written to the program, :code:`echo` until the first output from the program'
+        ' is read, :code:`parse` until that output is parsed, :code:`present` until the frame showing it is swapped'
+        ' to the screen and the :code:`total` of all of them. For each stage the :italic:`median`, :italic:`p90`,'
+        ' :italic:`p99` and :italic:`max` times are reported in milliseconds, along with a :italic:`histogram` of'
+        ' :code:`[upper bound in ms, count]` pairs, where the last bucket has no upper bound.\n\n'
+        'Only one key press at a time is timed in each window and any output from the program is taken to be'
+        ' its response, so use a program that echoes input and produces no other output, such as :program:`cat`,'
+        ' for accurate measurements.'
+    )
+    options_spec = MATCH_WINDOW_OPTION + '''\n
+--all -a
+type=bool-set
+Get the input latency of all windows.
+
+
+--clear
+type=bool-set
+Discard the recorded samples after reporting them, so that the next report only
+contains key presses from after this one.
+
+
+--self
+type=bool-set
+Get the input latency of the window this command is run in, rather than the active window.
+'''
+
+    def message_to_kitty(self, global_opts: RCOptions, opts: 'CLIOptions', args: ArgsType) -> PayloadType:
+        return {'match': opts.match, 'all': opts.all, 'clear': opts.clear, 'self': opts.self}
+
+    def response_from_kitty(self, boss: Boss, window: Window | None, payload_get: PayloadGetType) -> ResponseType:
+        ans = {}
+        for w in self.windows_for_match_payload(boss, window, payload_get):
+            ans[str(w.id)] = input_latency_report(w.screen.input_latency(bool(payload_get('clear'))))
+        return json.dumps(ans, indent=2, sort_keys=True)
+
+
+get_input_latency = GetInputLatency()
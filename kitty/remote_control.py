@@ -25,6 +25,8 @@
     AES256GCMDecrypt,
     AES256GCMEncrypt,
     EllipticCurveKey,
+    Secret,
+    base85_decode,
     get_boss,
     get_options,
     monotonic,
@@ -46,7 +48,39 @@ def encode_response_for_peer(response: Any) -> bytes:
     return b'\x1bP@kitty-cmd' + json.dumps(response).encode('utf-8') + b'\x1b\\'
 
 
-def parse_cmd(serialized_cmd: memoryview, encryption_key: EllipticCurveKey) -> dict[str, Any]:
+class SessionSecrets:
+    # Clients that send many commands use the same public key for all of them,
+    # so the shared secrets are cached to avoid a key agreement per command.
+    # They are cached per session, that is per socket peer or window, and
+    # forgotten when the session ends, see end_session().
+
+    max_per_session = 4
+
+    def __init__(self) -> None:
+        self.sessions: dict[tuple[str, int], dict[bytes, Secret]] = {}
+        self.misses = 0
+
+    def derive_secret_for_peer(self, session: tuple[str, int] | None, encryption_key: EllipticCurveKey, pubkey: bytes) -> Secret:
+        if session is None:
+            self.misses += 1
+            return encryption_key.derive_secret(pubkey)
+        secrets = self.sessions.setdefault(session, {})
+        ans = secrets.get(pubkey)
+        if ans is None:
+            self.misses += 1
+            ans = secrets[pubkey] = encryption_key.derive_secret(pubkey)
+            while len(secrets) > self.max_per_session:
+                del secrets[next(iter(secrets))]
+        return ans
+
+    def end_session(self, session: tuple[str, int]) -> None:
+        self.sessions.pop(session, None)
+
+
+def parse_cmd(
+    serialized_cmd: memoryview, encryption_key: EllipticCurveKey,
+    secrets: SessionSecrets | None = None, session: tuple[str, int] | None = None,
+) -> dict[str, Any]:
     # See https://github.com/python/cpython/issues/74379 for why we cant use
     # memoryview directly :((
     try:
@@ -65,8 +99,10 @@ def parse_cmd(serialized_cmd: memoryview, encryption_key: EllipticCurveKey) -> d
         pubkey = pcmd.get('pubkey', '')
         if not pubkey:
             log_error('Ignoring encrypted rc command without a public key')
-        d = AES256GCMDecrypt(encryption_key.derive_secret(base64.b85decode(pubkey)), base64.b85decode(pcmd['iv']), base64.b85decode(pcmd['tag']))
-        data = d.add_data_to_be_decrypted(base64.b85decode(pcmd['encrypted']), True)
+        pk = base85_decode(pubkey)
+        secret = encryption_key.derive_secret(pk) if secrets is None else secrets.derive_secret_for_peer(session, encryption_key, pk)
+        d = AES256GCMDecrypt(secret, base85_decode(pcmd['iv']), base85_decode(pcmd['tag']))
+        data = d.add_data_to_be_decrypted(base85_decode(pcmd['encrypted']), True)
         pcmd = json.loads(data)
         if not isinstance(pcmd, dict) or 'version' not in pcmd:
             return {}
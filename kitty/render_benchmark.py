@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+# License: GPLv3 Copyright: 2026, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Drive rendering from a script, for benchmarking and regression testing the
+# render path, typically with kitty --headless --benchmark-rendering script.py
+# The script must define a function render_benchmark(bench: RenderBenchmark)
+
+import os
+import runpy
+import struct
+import zlib
+from typing import TYPE_CHECKING, Any, NamedTuple
+
+from .fast_data_types import IMPERATIVE_CLOSE_REQUESTED, add_timer, benchmark_render_frame, set_application_quit_request
+from .utils import log_error
+
+if TYPE_CHECKING:
+    from .boss import Boss
+    from .window import Window
+
+PHASES = 'prepare', 'borders', 'cells', 'overlays', 'swap'
+
+
+class Frame(NamedTuple):
+    label: str
+    rendered: int
+    wall: float
+    cpu: float
+    phases: dict[str, float]
+
+
+def png_from_rgba(width: int, height: int, pixels: bytes) -> bytes:
+    # OpenGL returns rows bottom to top
+    stride = width * 4
+    raw = b''.join(b'\0' + pixels[y * stride:(y + 1) * stride] for y in range(height - 1, -1, -1))
+
+    def chunk(kind: bytes, data: bytes) -> bytes:
+        return struct.pack('>I', len(data)) + kind + data + struct.pack('>I', zlib.crc32(kind + data))
+
+    return b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 6, 0, 0, 0)) + chunk(
+        b'IDAT', zlib.compress(raw)) + chunk(b'IEND', b'')
+
+
+class RenderBenchmark:
+
+    def __init__(self, boss: 'Boss') -> None:
+        self.boss = boss
+        self.frames: list[Frame] = []
+
+    @property
+    def window(self) -> 'Window':
+        w = self.boss.active_window
+        if w is None:
+            raise RuntimeError('No active window to render into')
+        return w
+
+    def feed(self, data: bytes | str, window: 'Window | None' = None) -> None:
+        ' Parse data as though it was written by the program running in the window '
+        screen = (window or self.window).screen
+        mv = memoryview(data.encode() if isinstance(data, str) else data)
+        while mv:
+            n = screen.test_commit_write_buffer(mv, screen.test_create_write_buffer())
+            mv = mv[n:]
+            screen.test_parse_written_data()
+
+    def render_frame(self, label: str = '', force_redraw: bool = True, dump_to: str = '') -> Frame:
+        '''
+        Render a single frame of all OS windows. With force_redraw=False only
+        OS windows that have changed are drawn. When dump_to is specified the
+        rendered OS windows are saved to it as PNG files, if more than one OS
+        window is rendered the OS window id is appended to the file name.
+        '''
+        ans = benchmark_render_frame(force_redraw, bool(dump_to))
+        frame = Frame(label, ans['rendered'], ans['wall'], ans['cpu'], {p: ans[p] for p in PHASES})
+        self.frames.append(frame)
+        captured = ans['captured']
+        for os_window_id, width, height, pixels in captured:
+            path = dump_to
+            if len(captured) > 1:
+                base, ext = os.path.splitext(dump_to)
+                path = f'{base}-{os_window_id}{ext}'
+            with open(path, 'wb') as f:
+                f.write(png_from_rgba(width, height, pixels))
+        return frame
+
+    def report(self) -> str:
+        cols = ('wall', 'cpu') + PHASES
+        lines = ['Times are in milliseconds, phase times are CPU times of the rendering thread',
+                 f'{"frame":>5} {"label":16}' + ''.join(f'{c:>9}' for c in cols)]
+
+        def values(f: Frame) -> list[float]:
+            return [f.wall, f.cpu] + [f.phases[p] for p in PHASES]
+
+        for i, f in enumerate(self.frames):
+            lines.append(f'{i:5d} {f.label[:16]:16}' + ''.join(f'{v * 1000:9.3f}' for v in values(f)))
+        rendered = [values(f) for f in self.frames if f.rendered]
+        if rendered:
+            lines.append('')
+            for name, pos in (('median', 0.5), ('p95', 0.95), ('max', 1.0)):
+                row = []
+                for c in range(len(cols)):
+                    vals = sorted(r[c] for r in rendered)
+                    row.append(vals[min(len(vals) - 1, int(pos * len(vals)))])
+                lines.append(f'{"":5} {name:16}' + ''.join(f'{v * 1000:9.3f}' for v in row))
+        return '\n'.join(lines)
+
+
+def run_render_benchmark(boss: 'Boss', path: str) -> None:
+    try:
+        script: dict[str, Any] = runpy.run_path(path)
+        bench = RenderBenchmark(boss)
+        script['render_benchmark'](bench)
+        print(bench.report(), flush=True)
+    except Exception:
+        import traceback
+        log_error(f'Running the render benchmark from {path} failed with error:\n{traceback.format_exc()}')
+    finally:
+        set_application_quit_request(IMPERATIVE_CLOSE_REQUESTED)
+
+
+def start_render_benchmark(boss: 'Boss', path: str) -> None:
+    # wait for the first window to be created and its child to be started
+    add_timer(lambda timer_id: run_render_benchmark(boss, path), 0.1, False)
@@ -31,6 +31,7 @@
 #include "char-props.h"
 #include "wcswidth.h"
 #include <stdalign.h>
+#include <xxhash.h>
 #include "keys.h"
 #include "vt-parser.h"
 #include "resize.h"
@@ -120,9 +121,6 @@ new_screen_object(PyTypeObject *type, PyObject *args, PyObject UNUSED *kwds) {
         self->reload_all_gpu_data = true;
         self->cell_size.width = cell_width; self->cell_size.height = cell_height;
         self->columns = columns; self->lines = lines;
-        self->write_buf_sz = BUFSIZ;
-        self->write_buf = PyMem_RawMalloc(self->write_buf_sz);
-        if (self->write_buf == NULL) { Py_CLEAR(self); return PyErr_NoMemory(); }
         self->window_id = window_id;
         self->modes = empty_modes;
         self->saved_modes = empty_modes;
@@ -223,6 +221,63 @@ screen_dirty_sprite_positions(Screen *self) {
     for (index_type i = 0; i < self->historybuf->count; i++) historybuf_mark_line_dirty(self->historybuf, i);
 }
 
+void
+screen_visit_visible_lines(Screen *self, gpu_cells_visitor visitor, void *data) {
+    if (self->paused_rendering.expires_at && self->paused_rendering.linebuf) {
+        LineBuf *linebuf = self->paused_rendering.linebuf;
+        for (index_type y = 0; y < linebuf->ynum; y++) {
+            linebuf_init_line(linebuf, y);
+            visitor(data, linebuf->line->gpu_cells, linebuf->line->xnum);
+        }
+        return;
+    }
+    for (index_type y = 0; y < MIN(self->lines, self->scrolled_by); y++) {
+        historybuf_init_line(self->historybuf, self->scrolled_by - 1 - y, self->historybuf->line);
+        visitor(data, self->historybuf->line->gpu_cells, self->historybuf->line->xnum);
+    }
+    for (index_type y = self->scrolled_by; y < self->lines; y++) {
+        linebuf_init_line(self->linebuf, y - self->scrolled_by);
+        visitor(data, self->linebuf->line->gpu_cells, self->linebuf->line->xnum);
+    }
+    if (self->overlay_line.is_active && self->overlay_line.gpu_cells) visitor(data, self->overlay_line.gpu_cells, self->columns);
+}
+
+static bool
+dirty_linebuf_lines_matching(LineBuf *linebuf, gpu_cells_visitor predicate, void *data) {
+    bool found = false;
+    for (index_type y = 0; y < linebuf->ynum; y++) {
+        linebuf_init_line(linebuf, y);
+        if (predicate(data, linebuf->line->gpu_cells, linebuf->line->xnum)) {
+            linebuf_mark_line_dirty(linebuf, y); found = true;
+        }
+    }
+    return found;
+}
+
+void
+screen_dirty_lines_matching(Screen *self, gpu_cells_visitor predicate, void *data) {
+    // Marks every line, visible or not, for which predicate returns true as
+    // dirty so that it is re-rendered when it is next displayed, even if its
+    // contents are unchanged. The predicate is not run on the sprites of
+    // cached rendered lines, so they are all forgotten.
+    if (self->rendered_lines.fingerprints) zero_at_ptr_count(self->rendered_lines.fingerprints, self->rendered_lines.num_entries);
+    bool found = dirty_linebuf_lines_matching(self->main_linebuf, predicate, data);
+    if (dirty_linebuf_lines_matching(self->alt_linebuf, predicate, data)) found = true;
+    if (self->paused_rendering.linebuf && dirty_linebuf_lines_matching(self->paused_rendering.linebuf, predicate, data)) {
+        self->paused_rendering.cell_data_updated = false; found = true;
+    }
+    for (index_type y = 0; y < self->historybuf->count; y++) {
+        historybuf_init_line(self->historybuf, y, self->historybuf->line);
+        if (predicate(data, self->historybuf->line->gpu_cells, self->historybuf->line->xnum)) {
+            historybuf_mark_line_dirty(self->historybuf, y); found = true;
+        }
+    }
+    if (self->overlay_line.is_active && self->overlay_line.gpu_cells && predicate(data, self->overlay_line.gpu_cells, self->columns)) {
+        self->overlay_line.is_dirty = true; found = true;
+    }
+    if (found) self->is_dirty = true;
+}
+
 typedef struct CursorTrack {
     index_type num_content_lines;
     bool is_beyond_content;
@@ -641,6 +696,12 @@ reset_callbacks(Screen *self, PyObject *a UNUSED) {
     Py_RETURN_NONE;
 }
 
+static void
+free_rendered_lines(Screen *self) {
+    free(self->rendered_lines.fingerprints); free(self->rendered_lines.sprites); free(self->rendered_lines.scratch);
+    zero_at_ptr(&self->rendered_lines);
+}
+
 static void
 dealloc(Screen* self) {
     pthread_mutex_destroy(&self->write_buf_lock);
@@ -649,7 +710,18 @@ dealloc(Screen* self) {
     Py_CLEAR(self->main_grman);
     Py_CLEAR(self->alt_grman);
     Py_CLEAR(self->last_reported_cwd);
-    PyMem_RawFree(self->write_buf);
+    while (self->write_queue.head) {
+        WriteChunk *c = self->write_queue.head;
+        self->write_queue.head = c->next;
+        free(c);
+    }
+    while (self->held_writes.head) {
+        WriteChunk *c = self->held_writes.head;
+        self->held_writes.head = c->next;
+        free(c);
+    }
+    free(self->latency.history);
+    free_rendered_lines(self);
     Py_CLEAR(self->callbacks);
     Py_CLEAR(self->test_child);
     Py_CLEAR(self->cursor);
@@ -1498,9 +1570,20 @@ screen_handle_graphics_command(Screen *self, const GraphicsCommand *cmd, const u
         if (self->cursor->y > self->margin_bottom) screen_scroll(self, self->cursor->y - self->margin_bottom);
         screen_ensure_bounds(self, false, in_margins);
     }
-    if (cmd->unicode_placement) {
-        // Make sure the placeholders are redrawn if we add or change a virtual placement.
-        screen_dirty_line_graphics(self, 0, self->lines, self->linebuf == self->main_linebuf);
+    // Lines with placeholders referring to an image whose virtual placements
+    // have changed are rescanned by screen_update_cell_data() as the graphics
+    // manager tracks which images they refer to.
+    if (cmd->unicode_placement) self->is_dirty = true;
+}
+
+void
+screen_process_decoded_images(Screen *self, bool wait) {
+    GraphicsManager *managers[] = {self->main_grman, self->alt_grman};
+    for (size_t i = 0; i < arraysz(managers); i++) {
+        const char *response;
+        while (grman_process_decoded_images(managers[i], wait, &self->is_dirty, &response)) {
+            if (response != NULL) write_escape_code_to_child(self, ESC_APC, response);
+        }
     }
 }
 // }}}
@@ -3143,7 +3226,8 @@ static uint32_t color_to_id(color_type c) {
 }
 
 // Scan the line and create cell images in place of unicode placeholders
-// reserved for image placement.
+// reserved for image placement. The images referred to are recorded in the
+// graphics manager so that the line is rescanned only when they change.
 static void
 screen_render_line_graphics(Screen *self, Line *line, int32_t row) {
     // If there are no image placeholders now, no need to rescan the line.
@@ -3153,6 +3237,7 @@ screen_render_line_graphics(Screen *self, Line *line, int32_t row) {
     grman_remove_cell_images(self->grman, row, row);
     // The placeholders might be erased. We will update the attribute.
     line->attrs.has_image_placeholders = false;
+    uint64_t image_ids = 0;
     index_type i;
     uint32_t run_length = 0;
     uint32_t prev_img_id_lower24bits = 0;
@@ -3205,6 +3290,7 @@ screen_render_line_graphics(Screen *self, Line *line, int32_t row) {
             // has a non-zero length.
             if (run_length > 0) {
                 uint32_t img_id = prev_img_id_lower24bits | (prev_img_id_higher8bits - 1) << 24;
+                image_ids |= placeholder_image_id_bit(img_id);
                 grman_put_cell_image(
                     self->grman, row, i - run_length, img_id,
                     prev_placement_id, prev_img_col - run_length,
@@ -3227,10 +3313,19 @@ screen_render_line_graphics(Screen *self, Line *line, int32_t row) {
     if (run_length > 0) {
         // Render the last run.
         uint32_t img_id = prev_img_id_lower24bits | (prev_img_id_higher8bits - 1) << 24;
+        image_ids |= placeholder_image_id_bit(img_id);
         grman_put_cell_image(self->grman, row, i - run_length, img_id,
                              prev_placement_id, prev_img_col - run_length,
                              prev_img_row - 1, run_length, 1, self->cell_size);
     }
+    grman_placeholder_line_scanned(self->grman, row, image_ids);
+}
+
+static bool
+line_graphics_need_update(Screen *self, const Line *line, int32_t row) {
+    // Graphics commands received after the unicode placeholders in a line were
+    // scanned can change the images displayed by it
+    return line->attrs.has_image_placeholders && (line->attrs.has_dirty_text || !grman_placeholder_line_is_current(self->grman, row));
 }
 
 // This functions is similar to screen_update_cell_data, but it only updates
@@ -3246,7 +3341,7 @@ screen_update_only_line_graphics_data(Screen *self) {
     for (index_type y = 0; y < MIN(self->lines, self->scrolled_by); y++) {
         lnum = self->scrolled_by - 1 - y;
         historybuf_init_line(self->historybuf, lnum, self->historybuf->line);
-        screen_render_line_graphics(self, self->historybuf->line, y - self->scrolled_by);
+        if (line_graphics_need_update(self, self->historybuf->line, y - self->scrolled_by)) screen_render_line_graphics(self, self->historybuf->line, y - self->scrolled_by);
         if (self->historybuf->line->attrs.has_dirty_text) {
             historybuf_mark_line_clean(self->historybuf, lnum);
         }
@@ -3254,15 +3349,136 @@ screen_update_only_line_graphics_data(Screen *self) {
     for (index_type y = self->scrolled_by; y < self->lines; y++) {
         lnum = y - self->scrolled_by;
         linebuf_init_line(self->linebuf, lnum);
-        if (self->linebuf->line->attrs.has_dirty_text) {
-            screen_render_line_graphics(self, self->linebuf->line, y - self->scrolled_by);
-            linebuf_mark_line_clean(self->linebuf, lnum);
+        if (line_graphics_need_update(self, self->linebuf->line, y - self->scrolled_by)) screen_render_line_graphics(self, self->linebuf->line, y - self->scrolled_by);
+        if (self->linebuf->line->attrs.has_dirty_text) linebuf_mark_line_clean(self->linebuf, lnum);
+    }
+}
+
+static bool
+ensure_rendered_lines(Screen *self, FONTS_DATA_HANDLE fonts_data) {
+    // Sprite indices are only valid for the font group they were rendered
+    // with, so the cache is dropped when the font group changes
+    const index_type num_entries = 2 * self->lines;
+    if (self->rendered_lines.font_group_id == fonts_data->id && self->rendered_lines.num_entries == num_entries && self->rendered_lines.columns == self->columns) return true;
+    free_rendered_lines(self);
+    self->rendered_lines.fingerprints = calloc(num_entries, sizeof(self->rendered_lines.fingerprints[0]));
+    self->rendered_lines.sprites = malloc((size_t)num_entries * self->columns * sizeof(self->rendered_lines.sprites[0]));
+    self->rendered_lines.scratch = malloc(self->columns * sizeof(self->rendered_lines.scratch[0]));
+    if (!self->rendered_lines.fingerprints || !self->rendered_lines.sprites || !self->rendered_lines.scratch) { free_rendered_lines(self); return false; }
+    self->rendered_lines.num_entries = num_entries; self->rendered_lines.columns = self->columns;
+    self->rendered_lines.font_group_id = fonts_data->id;
+    return true;
+}
+
+static uint64_t
+line_render_fingerprint(Screen *self, const Line *line, index_type lnum, const Cursor *cursor) {
+    // The sprites assigned by render_line() depend only on the text of the
+    // line, the bold and italic attributes of its cells, the ligature
+    // strategy and, when ligatures are disabled at the cursor, the position
+    // of a cursor close enough to intersect multicell characters in the
+    // line. Colors, hyperlinks, marks and the existing sprite indices, which
+    // are reset when text is drawn, are left out.
+    struct { uint32_t disable_ligatures, cursor_x, cursor_y; } key = {
+        .disable_ligatures = self->disable_ligatures, .cursor_x = UINT32_MAX, .cursor_y = UINT32_MAX};
+    if (self->disable_ligatures == DISABLE_LIGATURES_CURSOR && cursor && cursor->y < lnum + (1u << SCALE_BITS) && lnum < cursor->y + (1u << SCALE_BITS)) {
+        key.cursor_x = cursor->x; key.cursor_y = cursor->y;
+    }
+    RenderedLineKey *k = self->rendered_lines.scratch;
+    for (index_type i = 0; i < line->xnum; i++) {
+        k[i].text = line->cpu_cells[i]; k[i].text.hyperlink_id = 0; k[i].text.temp_flag = 0;
+        k[i].font_style = line->gpu_cells[i].attrs.bold | (line->gpu_cells[i].attrs.italic << 1);
+    }
+    const uint64_t ans = XXH3_64bits_withSeed(k, sizeof(k[0]) * line->xnum, XXH3_64bits(&key, sizeof(key)));
+    return ans ? ans : 1;
+}
+
+static void
+render_line_if_changed(Screen *self, FONTS_DATA_HANDLE fonts_data, Line *line, index_type lnum, Cursor *cursor) {
+    // Calls render_line() unless a line with the same text was rendered
+    // recently, for example when a program redraws the screen with identical
+    // contents or a cursor move does not affect the line, in which case the
+    // sprite indices from that render are re-used.
+    if (!ensure_rendered_lines(self, fonts_data) || line->xnum != self->rendered_lines.columns) {
+        render_line(fonts_data, line, lnum, cursor, self->disable_ligatures, self->lc);
+        return;
+    }
+    const uint64_t fingerprint = line_render_fingerprint(self, line, lnum, cursor);
+    const index_type slot = fingerprint % self->rendered_lines.num_entries;
+    sprite_index *sprites = self->rendered_lines.sprites + (size_t)slot * self->rendered_lines.columns;
+    if (self->rendered_lines.fingerprints[slot] == fingerprint) {
+        for (index_type i = 0; i < line->xnum; i++) line->gpu_cells[i].sprite_idx = sprites[i];
+        return;
+    }
+    render_line(fonts_data, line, lnum, cursor, self->disable_ligatures, self->lc);
+    self->rendered_lines.fingerprints[slot] = fingerprint;
+    for (index_type i = 0; i < line->xnum; i++) sprites[i] = line->gpu_cells[i].sprite_idx;
+}
+
+static void
+update_cell_data_for_rows(Screen *self, void *address, FONTS_DATA_HANDLE fonts_data, bool cursor_has_moved, bool is_overlay_active, index_type y_start, index_type y_limit) {
+    // Updates the lines on screen in [y_start, y_limit) writing them to the
+    // rows of the GPU cell buffer they map to
+    index_type lnum;
+#define gpu_row(y) (((y) + self->gpu_cells.first_row) % self->lines)
+    for (index_type y = 0; y < MIN(self->lines, self->scrolled_by); y++) {
+        lnum = self->scrolled_by - 1 - y;
+        const bool in_range = y_start <= y && y < y_limit;
+        // Lines outside the range only need to be looked at when they contain
+        // unicode placeholders whose images may have changed
+        if (!in_range && !historybuf_line_has_image_placeholders(self->historybuf, lnum)) continue;
+        historybuf_init_line(self->historybuf, lnum, self->historybuf->line);
+        if (line_graphics_need_update(self, self->historybuf->line, y - self->scrolled_by)) screen_render_line_graphics(self, self->historybuf->line, y - self->scrolled_by);
+        if (!in_range) continue;
+        if (self->historybuf->line->attrs.has_dirty_text) {
+            render_line_if_changed(self, fonts_data, self->historybuf->line, lnum, self->cursor);
+            if (screen_has_marker(self)) mark_text_in_line(self->marker, self->historybuf->line, &self->as_ansi_buf);
+            historybuf_mark_line_clean(self->historybuf, lnum);
         }
+        update_line_data(self->historybuf->line, gpu_row(y), address);
     }
+    for (index_type y = MAX(self->scrolled_by, y_start); y < y_limit; y++) {
+        lnum = y - self->scrolled_by;
+        linebuf_init_line(self->linebuf, lnum);
+        if (self->linebuf->line->attrs.has_dirty_text ||
+            (cursor_has_moved && (self->cursor->y == lnum || self->last_rendered.cursor_y == lnum))) {
+            render_line_if_changed(self, fonts_data, self->linebuf->line, lnum, self->cursor);
+            if (line_graphics_need_update(self, self->linebuf->line, y - self->scrolled_by)) screen_render_line_graphics(self, self->linebuf->line, y - self->scrolled_by);
+            if (self->linebuf->line->attrs.has_dirty_text && screen_has_marker(self)) mark_text_in_line(
+                    self->marker, self->linebuf->line, &self->as_ansi_buf);
+            if (is_overlay_active && lnum == self->overlay_line.ynum) render_overlay_line(self, self->linebuf->line, fonts_data);
+            linebuf_mark_line_clean(self->linebuf, lnum);
+        } else if (line_graphics_need_update(self, self->linebuf->line, y - self->scrolled_by)) screen_render_line_graphics(self, self->linebuf->line, y - self->scrolled_by);
+        update_line_data(self->linebuf->line, gpu_row(y), address);
+    }
+#undef gpu_row
 }
 
-void
-screen_update_cell_data(Screen *self, void *address, FONTS_DATA_HANDLE fonts_data, bool cursor_has_moved) {
+static bool
+scroll_cell_data(Screen *self, void *address, FONTS_DATA_HANDLE fonts_data, GPURowRange *kept) {
+    // When only the scroll position has changed since the GPU cell buffer was
+    // last written, rotate the ring of lines and write only the newly exposed
+    // lines, leaving the rows in kept unchanged.
+    if (!self->gpu_cells.is_scrollable || self->is_dirty || self->history_line_added_count || screen_is_overlay_active(self)) return false;
+    const index_type n = self->scrolled_by > self->gpu_cells.scrolled_by ? self->scrolled_by - self->gpu_cells.scrolled_by : self->gpu_cells.scrolled_by - self->scrolled_by;
+    if (!n || n >= self->lines) return false;
+    const bool scrolled_up = self->scrolled_by > self->gpu_cells.scrolled_by;
+    // when scrolling up into the history, existing lines move down the screen
+    self->gpu_cells.first_row = (self->gpu_cells.first_row + (scrolled_up ? self->lines - n : n)) % self->lines;
+    self->gpu_cells.scrolled_by = self->scrolled_by;
+    self->scroll_changed = false;
+    kept->start = (self->gpu_cells.first_row + (scrolled_up ? n : 0)) % self->lines;
+    kept->count = self->lines - n;
+    if (scrolled_up) update_cell_data_for_rows(self, address, fonts_data, false, false, 0, n);
+    else update_cell_data_for_rows(self, address, fonts_data, false, false, self->lines - n, self->lines);
+    return true;
+}
+
+GPURowRange
+screen_update_cell_data(Screen *self, void *address, FONTS_DATA_HANDLE fonts_data, bool cursor_has_moved, bool can_scroll) {
+    // Writes the cell data for the lines on screen to address. When can_scroll
+    // is true, address holds the data from the previous call and only rows not
+    // in the returned range are written.
+    GPURowRange kept = {0};
     if (self->paused_rendering.expires_at) {
         if (!self->paused_rendering.cell_data_updated) {
             LineBuf *linebuf = self->paused_rendering.linebuf;
@@ -3278,42 +3494,18 @@ screen_update_cell_data(Screen *self, void *address, FONTS_DATA_HANDLE fonts_dat
                 update_line_data(linebuf->line, y, address);
             }
         }
-        return;
+        self->gpu_cells.first_row = 0; self->gpu_cells.is_scrollable = false;
+        return kept;
     }
+    if (can_scroll && !cursor_has_moved && scroll_cell_data(self, address, fonts_data, &kept)) return kept;
     const bool is_overlay_active = screen_is_overlay_active(self);
     unsigned int history_line_added_count = self->history_line_added_count;
-    index_type lnum;
     screen_reset_dirty(self);
     update_overlay_position(self);
     if (self->scrolled_by) self->scrolled_by = MIN(self->scrolled_by + history_line_added_count, self->historybuf->count);
     self->scroll_changed = false;
-    for (index_type y = 0; y < MIN(self->lines, self->scrolled_by); y++) {
-        lnum = self->scrolled_by - 1 - y;
-        historybuf_init_line(self->historybuf, lnum, self->historybuf->line);
-        // we render line graphics even if the line is not dirty as graphics commands received after
-        // the unicode placeholder was first scanned can alter it.
-        screen_render_line_graphics(self, self->historybuf->line, y - self->scrolled_by);
-        if (self->historybuf->line->attrs.has_dirty_text) {
-            render_line(fonts_data, self->historybuf->line, lnum, self->cursor, self->disable_ligatures, self->lc);
-            if (screen_has_marker(self)) mark_text_in_line(self->marker, self->historybuf->line, &self->as_ansi_buf);
-            historybuf_mark_line_clean(self->historybuf, lnum);
-        }
-        update_line_data(self->historybuf->line, y, address);
-    }
-    for (index_type y = self->scrolled_by; y < self->lines; y++) {
-        lnum = y - self->scrolled_by;
-        linebuf_init_line(self->linebuf, lnum);
-        if (self->linebuf->line->attrs.has_dirty_text ||
-            (cursor_has_moved && (self->cursor->y == lnum || self->last_rendered.cursor_y == lnum))) {
-            render_line(fonts_data, self->linebuf->line, lnum, self->cursor, self->disable_ligatures, self->lc);
-            screen_render_line_graphics(self, self->linebuf->line, y - self->scrolled_by);
-            if (self->linebuf->line->attrs.has_dirty_text && screen_has_marker(self)) mark_text_in_line(
-                    self->marker, self->linebuf->line, &self->as_ansi_buf);
-            if (is_overlay_active && lnum == self->overlay_line.ynum) render_overlay_line(self, self->linebuf->line, fonts_data);
-            linebuf_mark_line_clean(self->linebuf, lnum);
-        }
-        update_line_data(self->linebuf->line, y, address);
-    }
+    self->gpu_cells.first_row = 0; self->gpu_cells.scrolled_by = self->scrolled_by; self->gpu_cells.is_scrollable = true;
+    update_cell_data_for_rows(self, address, fonts_data, cursor_has_moved, is_overlay_active, 0, self->lines);
     if (is_overlay_active && self->overlay_line.ynum + self->scrolled_by < self->lines) {
         if (self->overlay_line.is_dirty) {
             linebuf_init_line(self->linebuf, self->overlay_line.ynum);
@@ -3321,6 +3513,7 @@ screen_update_cell_data(Screen *self, void *address, FONTS_DATA_HANDLE fonts_dat
         }
         update_overlay_line_data(self, address);
     }
+    return kept;
 }
 
 static bool
@@ -3469,7 +3662,8 @@ iteration_data_is_empty(const Screen *self, const IterationData *idata) {
 }
 
 static void
-apply_selection(Screen *self, uint8_t *data, Selection *s, uint8_t set_mask) {
+apply_selection(Screen *self, uint8_t *data, Selection *s, uint8_t set_mask, index_type first_row) {
+#define row(y) (self->columns * (((y) + first_row) % self->lines))
     iteration_data(s, &s->last_rendered, self->columns, -self->historybuf->count, self->scrolled_by);
     Line *line;
     const int y_min = MAX(0, s->last_rendered.y), y_limit = MIN(s->last_rendered.y_limit, (int)self->lines);
@@ -3478,18 +3672,19 @@ apply_selection(Screen *self, uint8_t *data, Selection *s, uint8_t set_mask) {
             linebuf_init_line(self->paused_rendering.linebuf, y);
             line = self->paused_rendering.linebuf->line;
         } else line = visual_line_(self, y);
-        uint8_t *line_start = data + self->columns * y;
+        uint8_t *line_start = data + row(y);
         XRange xr = xrange_for_iteration_with_multicells(&s->last_rendered, y, line);
         for (index_type x = xr.x; x < xr.x_limit; x++) {
             line_start[x] |= set_mask;
             CPUCell *c = &line->cpu_cells[x];
             if (c->is_multicell && c->scale > 1) {
-                for (int ym = MAX(0, y - c->y); ym < y; ym++) data[self->columns * ym + x] |= set_mask;
-                for (int ym = y + 1; ym < MIN((int)self->lines, y + c->scale - c->y); ym++) data[self->columns * ym + x] |= set_mask;
+                for (int ym = MAX(0, y - c->y); ym < y; ym++) data[row(ym) + x] |= set_mask;
+                for (int ym = y + 1; ym < MIN((int)self->lines, y + c->scale - c->y); ym++) data[row(ym) + x] |= set_mask;
             }
         }
     }
     s->last_rendered.y = MAX(0, s->last_rendered.y);
+#undef row
 }
 
 bool
@@ -3506,16 +3701,16 @@ screen_has_selection(Screen *self) {
 }
 
 void
-screen_apply_selection(Screen *self, void *address, size_t size) {
+screen_apply_selection(Screen *self, void *address, size_t size, index_type first_row) {
     memset(address, 0, size);
     Selections *sel = self->paused_rendering.expires_at ? &self->paused_rendering.selections : &self->selections;
-    for (size_t i = 0; i < sel->count; i++) apply_selection(self, address, sel->items + i, 1);
+    for (size_t i = 0; i < sel->count; i++) apply_selection(self, address, sel->items + i, 1, first_row);
     sel->last_rendered_count = sel->count;
     sel = self->paused_rendering.expires_at ? &self->paused_rendering.url_ranges : &self->url_ranges;
     for (size_t i = 0; i < sel->count; i++) {
         Selection *s = sel->items + i;
         if (OPT(underline_hyperlinks) == UNDERLINE_NEVER && s->is_hyperlink) continue;
-        apply_selection(self, address, s, 2);
+        apply_selection(self, address, s, 2, first_row);
     }
     sel->last_rendered_count = sel->count;
 }
@@ -5402,10 +5597,29 @@ static PyObject*
 current_selections(Screen *self, PyObject *a UNUSED) {
     PyObject *ans = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)self->lines * self->columns);
     if (!ans) return NULL;
-    screen_apply_selection(self, PyBytes_AS_STRING(ans), PyBytes_GET_SIZE(ans));
+    screen_apply_selection(self, PyBytes_AS_STRING(ans), PyBytes_GET_SIZE(ans), 0);
     return ans;
 }
 
+static PyObject*
+input_latency(Screen *self, PyObject *args) {
+    int clear = 0;
+    if (!PyArg_ParseTuple(args, "|p", &clear)) return NULL;
+    const LatencyHistory *h = self->latency.history;
+    RAII_PyObject(ans, PyTuple_New(h ? h->count : 0));
+    if (!ans) return NULL;
+    for (size_t i = 0; h && i < h->count; i++) {
+        const LatencySample *s = h->samples + (h->next + LATENCY_HISTORY_SIZE - h->count + i) % LATENCY_HISTORY_SIZE;
+#define D(a, b) monotonic_t_to_s_double(s->b - s->a)
+        PyObject *t = Py_BuildValue("dddd", D(key, written), D(written, echoed), D(echoed, parsed), D(parsed, presented));
+#undef D
+        if (!t) return NULL;
+        PyTuple_SET_ITEM(ans, i, t);
+    }
+    if (clear && self->latency.history) { free(self->latency.history); self->latency.history = NULL; }
+    return Py_NewRef(ans);
+}
+
 WRAP0(update_only_line_graphics_data)
 WRAP0(bell)
 
@@ -5438,6 +5652,14 @@ test_parse_written_data(Screen *screen, PyObject *args) {
     Py_RETURN_NONE;
 }
 
+static PyObject*
+process_decoded_images(Screen *self, PyObject *args) {
+    int wait = 0;
+    if (!PyArg_ParseTuple(args, "|p", &wait)) return NULL;
+    screen_process_decoded_images(self, wait);
+    Py_RETURN_NONE;
+}
+
 static PyObject*
 multicell_data_as_dict(CPUCell mcd) {
     return Py_BuildValue("{sI sI sI sI sO sI sI}",
@@ -5506,7 +5728,9 @@ static PyMethodDef methods[] = {
     METHODB(test_create_write_buffer, METH_NOARGS),
     METHODB(test_commit_write_buffer, METH_VARARGS),
     METHODB(test_parse_written_data, METH_VARARGS),
+    MND(process_decoded_images, METH_VARARGS)
     MND(line_edge_colors, METH_NOARGS)
+    MND(input_latency, METH_VARARGS)
     MND(line, METH_O)
     MND(dump_lines_with_attrs, METH_VARARGS)
     MND(cpu_cells, METH_VARARGS)
@@ -26,6 +26,15 @@ typedef struct {
     bool in_left_half_of_cell;
 } SelectionBoundary;
 
+typedef struct {
+    index_type start, count;
+} GPURowRange;
+
+typedef struct {
+    CPUCell text;
+    uint32_t font_style;
+} RenderedLineKey;
+
 typedef enum SelectionExtendModes { EXTEND_CELL, EXTEND_WORD, EXTEND_LINE, EXTEND_LINE_FROM_POINT, EXTEND_WORD_AND_LINE_FROM_POINT } SelectionExtendMode;
 
 typedef struct {
@@ -87,6 +96,25 @@ typedef struct {
     } last_ime_pos;
 } OverlayLine;
 
+typedef struct WriteChunk {
+    struct WriteChunk *next;
+    // The bytes in [start, end) are waiting to be written
+    size_t start, end, capacity;
+    uint8_t data[];
+} WriteChunk;
+
+// The times at which a key press was received, written to the child, the
+// first byte of the response from the child was read, parsed and presented
+typedef struct {
+    monotonic_t key, written, echoed, parsed, presented;
+} LatencySample;
+
+#define LATENCY_HISTORY_SIZE 256u
+typedef struct {
+    LatencySample samples[LATENCY_HISTORY_SIZE];
+    size_t count, next;
+} LatencyHistory;
+
 typedef struct {
     PyObject_HEAD
 
@@ -101,6 +129,24 @@ typedef struct {
         index_type lines, columns;
         color_type cursor_bg;
     } last_rendered;
+    struct {
+        // The GPU cell buffer is a ring of lines, first_row is the row of it
+        // holding the top line of the screen and scrolled_by the value of
+        // scrolled_by when it was last written to. is_scrollable is false when
+        // it holds something other than the lines for scrolled_by.
+        index_type first_row;
+        unsigned int scrolled_by;
+        bool is_scrollable;
+    } gpu_cells;
+    // The sprite indices of recently rendered lines, keyed by a hash of what
+    // render_line() depends on, see render_line_if_changed()
+    struct {
+        uint64_t *fingerprints;
+        sprite_index *sprites;
+        RenderedLineKey *scratch;
+        index_type num_entries, columns;
+        id_type font_group_id;
+    } rendered_lines;
     bool is_dirty, scroll_changed, reload_all_gpu_data;
     Cursor *cursor;
     Savepoint main_savepoint, alt_savepoint;
@@ -115,9 +161,27 @@ typedef struct {
     ColorProfile *color_profile;
     monotonic_t start_visual_bell_at;
 
-    uint8_t *write_buf;
-    size_t write_buf_sz, write_buf_used;
+    // Data waiting to be written to the child, appended to by the main thread
+    // and drained by the I/O thread. write_buf_used is the total size of it.
+    struct { WriteChunk *head, *tail; } write_queue;
+    size_t write_buf_used;
     pthread_mutex_t write_buf_lock;
+    // While a paste is being streamed to the child, other data for the child is held here
+    struct { WriteChunk *head, *tail; size_t used; } held_writes;
+    bool streaming_paste;
+    // Input latency is measured for one key press at a time as it moves
+    // through the threads, see the Input latency section in child-monitor.c
+    struct {
+        // Main thread only
+        monotonic_t sent_at;
+        LatencySample parsed;
+        LatencyHistory *history;
+        // Protected by the write lock
+        monotonic_t queued_at;
+        LatencySample echoed;
+        // I/O thread only
+        LatencySample in_flight;
+    } latency;
 
     CursorRenderInfo cursor_render_info;
 
@@ -245,11 +309,11 @@ void report_device_attributes(Screen *self, unsigned int UNUSED mode, char start
 void select_graphic_rendition(Screen *self, int *params, unsigned int count, bool is_group, Region *r);
 void report_device_status(Screen *self, unsigned int which, bool UNUSED);
 void report_mode_status(Screen *self, unsigned int which, bool);
-void screen_apply_selection(Screen *self, void *address, size_t size);
+void screen_apply_selection(Screen *self, void *address, size_t size, index_type first_row);
 bool screen_is_selection_dirty(Screen *self);
 bool screen_has_selection(Screen*);
 bool screen_invert_colors(Screen *self);
-void screen_update_cell_data(Screen *self, void *address, FONTS_DATA_HANDLE, bool cursor_has_moved);
+GPURowRange screen_update_cell_data(Screen *self, void *address, FONTS_DATA_HANDLE, bool cursor_has_moved, bool can_scroll);
 bool screen_is_cursor_visible(const Screen *self);
 bool screen_selection_range_for_line(Screen *self, index_type y, index_type *start, index_type *end);
 bool screen_selection_range_for_word(Screen *self, const index_type x, const index_type y, index_type *, index_type *, index_type *start, index_type *end, bool);
@@ -265,11 +329,15 @@ void screen_mark_url(Screen *self, index_type start_x, index_type start_y, index
 void set_active_hyperlink(Screen*, char*, char*);
 hyperlink_id_type screen_mark_hyperlink(Screen*, index_type, index_type);
 void screen_handle_graphics_command(Screen *self, const GraphicsCommand *cmd, const uint8_t *payload);
+void screen_process_decoded_images(Screen *self, bool wait);
 void screen_handle_multicell_command(Screen *self, const MultiCellCommand *cmd, const uint8_t *payload);
 bool screen_open_url(Screen*);
 bool screen_set_last_visited_prompt(Screen*, index_type);
 bool screen_select_cmd_output(Screen*, index_type);
 void screen_dirty_sprite_positions(Screen *self);
+typedef bool(*gpu_cells_visitor)(void *data, const GPUCell *cells, index_type num);
+void screen_visit_visible_lines(Screen *self, gpu_cells_visitor visitor, void *data);
+void screen_dirty_lines_matching(Screen *self, gpu_cells_visitor predicate, void *data);
 void screen_rescale_images(Screen *self);
 void screen_report_size(Screen *, unsigned int which);
 void screen_manipulate_title_stack(Screen *, unsigned int op, unsigned int which);
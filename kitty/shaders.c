@@ -13,6 +13,7 @@
 #include "window_logo.h"
 #include "srgb_gamma.h"
 #include "uniforms_generated.h"
+#include "trace.h"
 
 #define BLEND_ONTO_OPAQUE  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);  // blending onto opaque colors
 #define BLEND_ONTO_OPAQUE_WITH_OPAQUE_OUTPUT  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);  // blending onto opaque colors with final color having alpha 1
@@ -202,6 +203,7 @@ ensure_sprite_map(FONTS_DATA_HANDLE fg) {
 
 void
 send_sprite_to_gpu(FONTS_DATA_HANDLE fg, sprite_index idx, pixel *buf, sprite_index decoration_idx) {
+    TRACE_BEGIN("send_sprite_to_gpu");
     SpriteMap *sprite_map = (SpriteMap*)fg->sprite_map;
     unsigned int xnum, ynum, znum, x, y, z;
 #define dm (sprite_map->decorations_map)
@@ -225,6 +227,7 @@ send_sprite_to_gpu(FONTS_DATA_HANDLE fg, sprite_index idx, pixel *buf, sprite_in
     sprite_index_to_pos(idx, xnum, ynum, &x, &y, &z);
     x *= fg->fcm.cell_width; y *= (fg->fcm.cell_height + 1);
     glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, z, fg->fcm.cell_width, fg->fcm.cell_height + 1, 1, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, buf);
+    TRACE_END("send_sprite_to_gpu");
 }
 
 void
@@ -368,7 +371,7 @@ cell_update_uniform_block(ssize_t vao_idx, Screen *screen, int uniform_buffer, c
 
         GLuint default_fg, highlight_fg, highlight_bg, cursor_fg, cursor_bg, url_color, url_style, inverted;
 
-        GLuint xnum, ynum, sprites_xnum, sprites_ynum, cursor_fg_sprite_idx, cell_height;
+        GLuint xnum, ynum, first_row, sprites_xnum, sprites_ynum, cursor_fg_sprite_idx, cell_height;
         GLuint cursor_x1, cursor_x2, cursor_y1, cursor_y2;
         GLfloat cursor_opacity;
 
@@ -467,7 +470,7 @@ cell_update_uniform_block(ssize_t vao_idx, Screen *screen, int uniform_buffer, c
         rd->cursor_y1 = screen->lines + 1; rd->cursor_y2 = screen->lines;
     }
 
-    rd->xnum = screen->columns; rd->ynum = screen->lines;
+    rd->xnum = screen->columns; rd->ynum = screen->lines; rd->first_row = screen->gpu_cells.first_row;
 
     rd->xstart = crd->gl.xstart; rd->ystart = crd->gl.ystart; rd->dx = crd->gl.dx; rd->dy = crd->gl.dy;
     unsigned int x, y, z;
@@ -482,6 +485,16 @@ cell_update_uniform_block(ssize_t vao_idx, Screen *screen, int uniform_buffer, c
     unmap_vao_buffer(vao_idx, uniform_buffer); rd = NULL;
 }
 
+static void
+preserve_cell_data_rows(ssize_t vao_idx, Screen *screen, GPURowRange kept) {
+    CELL_BUFFERS;
+    const size_t row_size = sizeof(GPUCell) * screen->columns;
+    // kept is a range of rows in the ring, it can wrap around
+    const index_type first = MIN(kept.count, screen->lines - kept.start);
+    if (first) preserve_vao_buffer_range(vao_idx, cell_data_buffer, row_size * kept.start, row_size * first);
+    if (kept.count > first) preserve_vao_buffer_range(vao_idx, cell_data_buffer, 0, row_size * (kept.count - first));
+}
+
 static bool
 cell_prepare_to_render(ssize_t vao_idx, Screen *screen, GLfloat xstart, GLfloat ystart, GLfloat dx, GLfloat dy, FONTS_DATA_HANDLE fonts_data) {
     size_t sz;
@@ -496,12 +509,18 @@ cell_prepare_to_render(ssize_t vao_idx, Screen *screen, GLfloat xstart, GLfloat
                            || cursor->y != screen->last_rendered.cursor_y;
     bool disable_ligatures = screen->disable_ligatures == DISABLE_LIGATURES_CURSOR;
     bool screen_resized = screen->last_rendered.columns != screen->columns || screen->last_rendered.lines != screen->lines;
+    const index_type first_row = screen->gpu_cells.first_row;
 
 #define update_cell_data { \
         sz = sizeof(GPUCell) * screen->lines * screen->columns; \
-        address = alloc_and_map_vao_buffer(vao_idx, sz, cell_data_buffer, GL_STREAM_DRAW, GL_WRITE_ONLY); \
-        screen_update_cell_data(screen, address, fonts_data, disable_ligatures && cursor_pos_changed); \
-        unmap_vao_buffer(vao_idx, cell_data_buffer); address = NULL; \
+        bool has_previous_frame; \
+        address = map_vao_buffer_for_frame(vao_idx, sz, cell_data_buffer, GL_STREAM_DRAW, &has_previous_frame); \
+        TRACE_BEGIN_FOR_WINDOW("update_cell_data", screen->window_id); \
+        GPURowRange kept = screen_update_cell_data(screen, address, fonts_data, disable_ligatures && cursor_pos_changed, \
+                has_previous_frame && !screen->reload_all_gpu_data && !screen_resized); \
+        TRACE_END_FOR_WINDOW("update_cell_data", screen->window_id); \
+        preserve_cell_data_rows(vao_idx, screen, kept); \
+        unmap_vao_buffer_for_frame(vao_idx, cell_data_buffer); address = NULL; \
         changed = true; \
 }
 
@@ -517,7 +536,7 @@ cell_prepare_to_render(ssize_t vao_idx, Screen *screen, GLfloat xstart, GLfloat
 #define update_selection_data { \
     sz = (size_t)screen->lines * screen->columns; \
     address = alloc_and_map_vao_buffer(vao_idx, sz, selection_buffer, GL_STREAM_DRAW, GL_WRITE_ONLY); \
-    screen_apply_selection(screen, address, sz); \
+    screen_apply_selection(screen, address, sz, screen->gpu_cells.first_row); \
     unmap_vao_buffer(vao_idx, selection_buffer); address = NULL; \
     changed = true; \
 }
@@ -532,7 +551,7 @@ cell_prepare_to_render(ssize_t vao_idx, Screen *screen, GLfloat xstart, GLfloat
         screen->paused_rendering.cell_data_updated = true;
         screen->last_rendered.scrolled_by = screen->paused_rendering.scrolled_by;
     } else {
-        if (screen->reload_all_gpu_data || screen_resized || screen_is_selection_dirty(screen)) update_selection_data;
+        if (screen->reload_all_gpu_data || screen_resized || first_row != screen->gpu_cells.first_row || screen_is_selection_dirty(screen)) update_selection_data;
         if (update_graphics_data(screen->grman)) changed = true;
         screen->last_rendered.scrolled_by = screen->scrolled_by;
     }
@@ -1057,6 +1076,18 @@ blank_canvas(float background_opacity, color_type color) {
     glClear(GL_COLOR_BUFFER_BIT);
 }
 
+void
+finish_rendering(void) {
+    glFinish();
+}
+
+void
+read_framebuffer_pixels(uint32_t width, uint32_t height, uint8_t *rgba) {
+    // rows are returned bottom to top
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+}
+
 bool
 send_cell_data_to_gpu(ssize_t vao_idx, GLfloat xstart, GLfloat ystart, GLfloat dx, GLfloat dy, Screen *screen, OSWindow *os_window) {
     bool changed = false;
@@ -1096,6 +1127,7 @@ draw_cells(ssize_t vao_idx, const WindowRenderData *srd, OSWindow *os_window, bo
         y_ratio = (float) os_window->viewport_height / (float) os_window->live_resize.height;
     }
     Screen *screen = srd->screen;
+    TRACE_BEGIN_FOR_WINDOW("draw_cells", screen->window_id);
     CELL_BUFFERS;
     CellRenderData crd = {
         .gl={.xstart = srd->xstart, .ystart = srd->ystart, .dx = srd->dx * x_ratio, .dy = srd->dy * y_ratio},
@@ -1151,6 +1183,7 @@ draw_cells(ssize_t vao_idx, const WindowRenderData *srd, OSWindow *os_window, bo
     if (window && screen->display_window_char) draw_window_number(os_window, screen, &crd, window);
     if (OPT(show_hyperlink_targets) && window && screen->current_hyperlink_under_mouse.id && !is_mouse_hidden(os_window)) draw_hyperlink_target(os_window, screen, &crd, window);
     free(scaled_render_data);
+    TRACE_END_FOR_WINDOW("draw_cells", screen->window_id);
 }
 // }}}
 
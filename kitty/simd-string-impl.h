@@ -21,6 +21,11 @@
 bool FUNC(utf8_decode_to_esc)(UTF8Decoder *d UNUSED, const uint8_t *src UNUSED, size_t src_sz UNUSED) NOSIMD
 const uint8_t* FUNC(find_either_of_two_bytes)(const uint8_t *haystack UNUSED, const size_t sz UNUSED, const uint8_t a UNUSED, const uint8_t b UNUSED) NOSIMD
 void FUNC(xor_data64)(const uint8_t key[64] UNUSED, uint8_t* data UNUSED, const size_t data_sz UNUSED) NOSIMD
+void FUNC(blend_alpha_mask_into_pixels)(const uint8_t *alpha UNUSED, pixel *dest UNUSED, size_t count UNUSED, pixel color UNUSED) NOSIMD
+void FUNC(unpremultiply_bgra_into_pixels)(const uint8_t *bgra UNUSED, pixel *dest UNUSED, size_t count UNUSED) NOSIMD
+void FUNC(downsample_bgra_row)(const uint8_t *src UNUSED, size_t src_stride UNUSED, unsigned num_rows UNUSED, unsigned src_width UNUSED, unsigned factor UNUSED, uint8_t *dest UNUSED, unsigned dest_width UNUSED) NOSIMD
+void FUNC(alpha_blend_rgba)(uint8_t *dest UNUSED, const uint8_t *src UNUSED, size_t count UNUSED) NOSIMD
+void FUNC(blend_rgba_on_rgb)(uint8_t *dest UNUSED, const uint8_t *src UNUSED, size_t count UNUSED) NOSIMD
 #undef NOSIMD
 #else
 
@@ -46,6 +51,7 @@ END_IGNORE_DIAGNOSTIC
 #define _MM_SHUFFLE(z, y, x, w) (((z) << 6) | ((y) << 4) | ((x) << 2) | (w))
 #endif
 #define integer_t CONCAT_EXPAND(CONCAT_EXPAND(simde__m, KITTY_SIMD_LEVEL), i)
+static inline int32_t load_u32(const uint8_t *p) { int32_t ans; memcpy(&ans, p, sizeof(ans)); return ans; }
 #define shift_right_by_bytes128 simde_mm_srli_si128
 #define is_zero FUNC(is_zero)
 
@@ -69,6 +75,23 @@ END_IGNORE_DIAGNOSTIC
 #define blendv_epi8 simde_mm_blendv_epi8
 #define shift_left_by_bits16 simde_mm_slli_epi16
 #define shift_right_by_bits32 simde_mm_srli_epi32
+#define shift_left_by_bits32 simde_mm_slli_epi32
+#define set1_epi32 simde_mm_set1_epi32
+#define add_epi32 simde_mm_add_epi32
+#define max_epu8 simde_mm_max_epu8
+#define max_epi32 simde_mm_max_epi32
+#define cmpeq_epi32 simde_mm_cmpeq_epi32
+#define float_vec_t simde__m128
+#define set1_ps simde_mm_set1_ps
+#define add_ps simde_mm_add_ps
+#define sub_ps simde_mm_sub_ps
+#define mul_ps simde_mm_mul_ps
+#define div_ps simde_mm_div_ps
+#define min_ps simde_mm_min_ps
+#define cvtepi32_ps simde_mm_cvtepi32_ps
+#define cvttps_epi32 simde_mm_cvttps_epi32
+// zero extend sizeof(integer_t)/4 bytes into 32 bit lanes
+#define load_bytes_as_epi32(p) simde_mm_cvtepu8_epi32(simde_mm_cvtsi32_si128(load_u32(p)))
 #define shuffle_epi8 simde_mm_shuffle_epi8
 #define numbered_bytes() set_epi8(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0)
 #define reverse_numbered_bytes() simde_mm_setr_epi8(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0)
@@ -139,6 +162,23 @@ w(left, sixteen_bytes, 16)
 #define subtract_epi8 simde_mm256_sub_epi8
 #define shift_left_by_bits16 simde_mm256_slli_epi16
 #define shift_right_by_bits32 simde_mm256_srli_epi32
+#define shift_left_by_bits32 simde_mm256_slli_epi32
+#define set1_epi32 simde_mm256_set1_epi32
+#define add_epi32 simde_mm256_add_epi32
+#define max_epu8 simde_mm256_max_epu8
+#define max_epi32 simde_mm256_max_epi32
+#define cmpeq_epi32 simde_mm256_cmpeq_epi32
+#define float_vec_t simde__m256
+#define set1_ps simde_mm256_set1_ps
+#define add_ps simde_mm256_add_ps
+#define sub_ps simde_mm256_sub_ps
+#define mul_ps simde_mm256_mul_ps
+#define div_ps simde_mm256_div_ps
+#define min_ps simde_mm256_min_ps
+#define cvtepi32_ps simde_mm256_cvtepi32_ps
+#define cvttps_epi32 simde_mm256_cvttps_epi32
+// zero extend sizeof(integer_t)/4 bytes into 32 bit lanes
+#define load_bytes_as_epi32(p) simde_mm256_cvtepu8_epi32(simde_mm_loadl_epi64((const simde__m128i*)(p)))
 #define create_zero_integer simde_mm256_setzero_si256
 #define create_all_ones_integer() simde_mm256_set1_epi64x(-1)
 #define numbered_bytes() set_epi8(31,30,29,28,27,26,25,24,23,22,21,20,19,18,17,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0)
@@ -352,6 +392,149 @@ FUNC(xor_data64)(const uint8_t key[KEY_SIZE], uint8_t* data, const size_t data_s
 }
 #undef KEY_SIZE
 
+// Glyph compositing {{{
+#define PIXELS_PER_VEC (sizeof(integer_t) / sizeof(pixel))
+
+void
+FUNC(blend_alpha_mask_into_pixels)(const uint8_t *alpha, pixel *dest, size_t count, pixel color) {
+    // Since both the alpha and the low byte of dest are zero extended to 32 bits, a byte wise max is the same as MAX()
+    const integer_t col = set1_epi32(color), low_byte = set1_epi32(0xff);
+    size_t i = 0;
+    for (; i + PIXELS_PER_VEC <= count; i += PIXELS_PER_VEC) {
+        const integer_t a = load_bytes_as_epi32(alpha + i);
+        const integer_t d = and_si(load_unaligned((const integer_t*)(dest + i)), low_byte);
+        store_unaligned((integer_t*)(dest + i), or_si(col, max_epu8(a, d)));
+    }
+    for (; i < count; i++) dest[i] = color | MAX(alpha[i], dest[i] & 0xff);
+    zero_upper();
+}
+
+void
+FUNC(unpremultiply_bgra_into_pixels)(const uint8_t *bgra, pixel *dest, size_t count) {
+    // Uses the same float operations as unpremultiply_bgra_pixel() so that the results are bit identical.
+    // Fully transparent pixels are divided by one instead of zero and then masked out.
+    const integer_t low_byte = set1_epi32(0xff), one = set1_epi32(1), zero = create_zero_integer();
+    const float_vec_t max_val = set1_ps(255.f);
+    size_t i = 0;
+    for (; i + PIXELS_PER_VEC <= count; i += PIXELS_PER_VEC) {
+        const integer_t v = load_unaligned((const integer_t*)(bgra + 4 * i));
+        const integer_t a = shift_right_by_bits32(v, 24);
+        const float_vec_t inv_alpha = div_ps(max_val, cvtepi32_ps(max_epi32(a, one)));
+#define C(shift) cvttps_epi32(min_ps(mul_ps(cvtepi32_ps(and_si(shift_right_by_bits32(v, shift), low_byte)), inv_alpha), max_val))
+        const integer_t rg = or_si(shift_left_by_bits32(C(16), 24), shift_left_by_bits32(C(8), 16));
+        const integer_t ans = or_si(rg, or_si(shift_left_by_bits32(C(0), 8), a));
+        store_unaligned((integer_t*)(dest + i), andnot_si(cmpeq_epi32(a, zero), ans));
+#undef C
+    }
+    for (; i < count; i++) dest[i] = unpremultiply_bgra_pixel(bgra + 4 * i);
+    zero_upper();
+}
+
+void
+FUNC(downsample_bgra_row)(const uint8_t *src, size_t src_stride, unsigned num_rows, unsigned src_width, unsigned factor, uint8_t *d, unsigned dest_width) {
+    // Sum all four channels of a pixel at a time in 32 bit lanes, two pixels at a time with 256 bit registers
+    alignas(sizeof(integer_t)) uint32_t sums[sizeof(integer_t) / sizeof(uint32_t)];
+    for (unsigned j = 0, sc = 0; j < dest_width; j++, sc += factor, d += 4) {
+        const unsigned limit = MIN(sc + factor, src_width);
+        if (limit <= sc || !num_rows) continue;
+        integer_t sum = create_zero_integer();
+        for (unsigned y = 0; y < num_rows; y++) {
+            const uint8_t *p = src + y * src_stride + sc * 4;
+            unsigned x = sc;
+            for (; x + PIXELS_PER_VEC / 4 <= limit; x += PIXELS_PER_VEC / 4, p += PIXELS_PER_VEC) sum = add_epi32(sum, load_bytes_as_epi32(p));
+#if KITTY_SIMD_LEVEL != 128
+            if (x < limit) sum = add_epi32(sum, simde_mm256_cvtepu8_epi32(simde_mm_cvtsi32_si128(load_u32(p))));
+#endif
+        }
+        store_aligned(sums, sum);
+        const unsigned count = num_rows * (limit - sc);
+#if KITTY_SIMD_LEVEL == 128
+        d[0] = sums[0] / count; d[1] = sums[1] / count; d[2] = sums[2] / count; d[3] = sums[3] / count;
+#else
+        d[0] = (sums[0] + sums[4]) / count; d[1] = (sums[1] + sums[5]) / count; d[2] = (sums[2] + sums[6]) / count; d[3] = (sums[3] + sums[7]) / count;
+#endif
+    }
+    zero_upper();
+}
+
+// Image compositing, these use the same float operations as alpha_blend_pixel()
+// and blend_pixel_on_opaque() so that the results are bit identical
+
+static inline simde__m128i
+load_four_rgb_as_epi32(const uint8_t *p) {
+    simde__m128i v = simde_mm_setzero_si128();
+    memcpy(&v, p, 12);
+    return simde_mm_shuffle_epi8(v, simde_mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+}
+
+static inline void
+store_epi32_as_four_rgb(uint8_t *p, simde__m128i v) {
+    v = simde_mm_shuffle_epi8(v, simde_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+    memcpy(p, &v, 12);
+}
+
+#if KITTY_SIMD_LEVEL == 128
+#define load_rgb_as_epi32 load_four_rgb_as_epi32
+#define store_epi32_as_rgb store_epi32_as_four_rgb
+#else
+static inline integer_t
+load_rgb_as_epi32(const uint8_t *p) { return simde_mm256_set_m128i(load_four_rgb_as_epi32(p + 12), load_four_rgb_as_epi32(p)); }
+
+static inline void
+store_epi32_as_rgb(uint8_t *p, integer_t v) {
+    store_epi32_as_four_rgb(p, simde_mm256_extracti128_si256(v, 0));
+    store_epi32_as_four_rgb(p + 12, simde_mm256_extracti128_si256(v, 1));
+}
+#endif
+
+#define channel_as_float(v, shift) cvtepi32_ps(and_si(shift_right_by_bits32(v, shift), low_byte))
+#define float_as_channel(f, shift) shift_left_by_bits32(and_si(cvttps_epi32(f), low_byte), shift)
+
+void
+FUNC(alpha_blend_rgba)(uint8_t *dest, const uint8_t *src, size_t count) {
+    const integer_t low_byte = set1_epi32(0xff), zero = create_zero_integer();
+    const float_vec_t max_val = set1_ps(255.f), one = set1_ps(1.f);
+    size_t i = 0;
+    for (; i + PIXELS_PER_VEC <= count; i += PIXELS_PER_VEC) {
+        const integer_t s = load_unaligned((const integer_t*)(src + 4 * i)), d = load_unaligned((const integer_t*)(dest + 4 * i));
+        const integer_t src_alpha = shift_right_by_bits32(s, 24);
+        const float_vec_t src_a = div_ps(cvtepi32_ps(src_alpha), max_val), dest_a = div_ps(cvtepi32_ps(shift_right_by_bits32(d, 24)), max_val);
+        const float_vec_t src_a_op = sub_ps(one, src_a);
+        const float_vec_t alpha = add_ps(src_a, mul_ps(dest_a, src_a_op));
+        const integer_t a = and_si(cvttps_epi32(mul_ps(max_val, alpha)), low_byte);
+#define C(shift) float_as_channel(div_ps(add_ps(mul_ps(channel_as_float(s, shift), src_a), mul_ps(mul_ps(channel_as_float(d, shift), dest_a), src_a_op)), alpha), shift)
+        integer_t ans = or_si(or_si(C(0), C(8)), or_si(C(16), shift_left_by_bits32(a, 24)));
+#undef C
+        // fully transparent results are transparent black and pixels with zero source alpha are left unchanged
+        ans = andnot_si(cmpeq_epi32(a, zero), ans);
+        ans = blendv_epi8(ans, d, cmpeq_epi32(src_alpha, zero));
+        store_unaligned((integer_t*)(dest + 4 * i), ans);
+    }
+    for (; i < count; i++) alpha_blend_pixel(dest + 4 * i, src + 4 * i);
+    zero_upper();
+}
+
+void
+FUNC(blend_rgba_on_rgb)(uint8_t *dest, const uint8_t *src, size_t count) {
+    const integer_t low_byte = set1_epi32(0xff);
+    const float_vec_t max_val = set1_ps(255.f), one = set1_ps(1.f);
+    size_t i = 0;
+    for (; i + PIXELS_PER_VEC <= count; i += PIXELS_PER_VEC) {
+        const integer_t s = load_unaligned((const integer_t*)(src + 4 * i)), d = load_rgb_as_epi32(dest + 3 * i);
+        const float_vec_t alpha = div_ps(cvtepi32_ps(shift_right_by_bits32(s, 24)), max_val);
+        const float_vec_t alpha_op = sub_ps(one, alpha);
+#define C(shift) float_as_channel(add_ps(mul_ps(channel_as_float(s, shift), alpha), mul_ps(channel_as_float(d, shift), alpha_op)), shift)
+        store_epi32_as_rgb(dest + 3 * i, or_si(or_si(C(0), C(8)), C(16)));
+#undef C
+    }
+    for (; i < count; i++) blend_pixel_on_opaque(dest + 3 * i, src + 4 * i);
+    zero_upper();
+}
+#undef channel_as_float
+#undef float_as_channel
+#undef PIXELS_PER_VEC
+// }}}
+
 #define check_chunk() if (n > -1) { \
     const uint8_t *ans = haystack + n; \
     zero_upper(); \
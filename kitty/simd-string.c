@@ -16,6 +16,60 @@ static void (*xor_data64_impl)(const uint8_t key[64], uint8_t* data, const size_
 void xor_data64(const uint8_t key[64], uint8_t* data, const size_t data_sz) { xor_data64_impl(key, data, data_sz); }
 // }}}
 
+// glyph compositing {{{
+static void
+blend_alpha_mask_into_pixels_scalar(const uint8_t *alpha, pixel *dest, size_t count, pixel color) {
+    for (size_t i = 0; i < count; i++) dest[i] = color | MAX(alpha[i], dest[i] & 0xff);
+}
+
+static void
+unpremultiply_bgra_into_pixels_scalar(const uint8_t *bgra, pixel *dest, size_t count) {
+    for (size_t i = 0; i < count; i++, bgra += 4) dest[i] = unpremultiply_bgra_pixel(bgra);
+}
+
+static void
+downsample_bgra_row_scalar(const uint8_t *src, size_t src_stride, unsigned num_rows, unsigned src_width, unsigned factor, uint8_t *d, unsigned dest_width) {
+    for (unsigned int j = 0, sc = 0; j < dest_width; j++, sc += factor, d += 4) {
+        unsigned int r=0, g=0, b=0, a=0, count=0;
+        for (unsigned int y = 0; y < num_rows; y++) {
+            const uint8_t *p = src + (y * src_stride) + sc * 4;
+            for (unsigned int x=sc; x < MIN(sc + factor, src_width); x++, count++) {
+                b += *(p++); g += *(p++); r += *(p++); a += *(p++);
+            }
+        }
+        if (count) {
+            d[0] = b / count; d[1] = g / count; d[2] = r / count; d[3] = a / count;
+        }
+    }
+}
+
+static void (*blend_alpha_mask_into_pixels_impl)(const uint8_t*, pixel*, size_t, pixel) = blend_alpha_mask_into_pixels_scalar;
+static void (*unpremultiply_bgra_into_pixels_impl)(const uint8_t*, pixel*, size_t) = unpremultiply_bgra_into_pixels_scalar;
+static void (*downsample_bgra_row_impl)(const uint8_t*, size_t, unsigned, unsigned, unsigned, uint8_t*, unsigned) = downsample_bgra_row_scalar;
+
+void blend_alpha_mask_into_pixels(const uint8_t *alpha, pixel *dest, size_t count, pixel color) { blend_alpha_mask_into_pixels_impl(alpha, dest, count, color); }
+void unpremultiply_bgra_into_pixels(const uint8_t *bgra, pixel *dest, size_t count) { unpremultiply_bgra_into_pixels_impl(bgra, dest, count); }
+void downsample_bgra_row(const uint8_t *src, size_t src_stride, unsigned num_rows, unsigned src_width, unsigned factor, uint8_t *dest, unsigned dest_width) { downsample_bgra_row_impl(src, src_stride, num_rows, src_width, factor, dest, dest_width); }
+// }}}
+
+// image compositing {{{
+static void
+alpha_blend_rgba_scalar(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; i++) alpha_blend_pixel(dest + 4 * i, src + 4 * i);
+}
+
+static void
+blend_rgba_on_rgb_scalar(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; i++) blend_pixel_on_opaque(dest + 3 * i, src + 4 * i);
+}
+
+static void (*alpha_blend_rgba_impl)(uint8_t*, const uint8_t*, size_t) = alpha_blend_rgba_scalar;
+static void (*blend_rgba_on_rgb_impl)(uint8_t*, const uint8_t*, size_t) = blend_rgba_on_rgb_scalar;
+
+void alpha_blend_rgba(uint8_t *dest, const uint8_t *src, size_t count) { alpha_blend_rgba_impl(dest, src, count); }
+void blend_rgba_on_rgb(uint8_t *dest, const uint8_t *src, size_t count) { blend_rgba_on_rgb_impl(dest, src, count); }
+// }}}
+
 // find_either_of_two_bytes {{{
 static const uint8_t*
 find_either_of_two_bytes_scalar(const uint8_t *haystack, const size_t sz, const uint8_t x, const uint8_t y) {
@@ -180,6 +234,44 @@ test_xor64(PyObject *self UNUSED, PyObject *args) {
     return ans;
 }
 
+static PyObject*
+test_glyph_compositing(PyObject *self UNUSED, PyObject *args) {
+    RAII_PY_BUFFER(src);
+    const char *kernel; int which_function = 0; unsigned long color = 0; unsigned width = 0, height = 0, factor = 1, repeat = 1;
+    PyObject *dest_bytes;
+    if (!PyArg_ParseTuple(args, "siy*O!|kIIII", &kernel, &which_function, &src, &PyBytes_Type, &dest_bytes, &color, &width, &height, &factor, &repeat)) return NULL;
+    if (which_function < 0 || which_function > 3) { PyErr_SetString(PyExc_ValueError, "Unknown which_function"); return NULL; }
+#define choose(name) (which_function == 1 ? name##_scalar : which_function == 2 ? name##_128 : which_function == 3 ? name##_256 : name)
+    PyObject *ans = PyBytes_FromStringAndSize(PyBytes_AS_STRING(dest_bytes), PyBytes_GET_SIZE(dest_bytes));
+    if (!ans) return NULL;
+    uint8_t *dest = (uint8_t*)PyBytes_AS_STRING(ans); const size_t dest_sz = PyBytes_GET_SIZE(ans);
+    const uint8_t *s = src.buf;
+    if (strcmp(kernel, "blend_alpha_mask") == 0) {
+        if (dest_sz < (size_t)src.len * sizeof(pixel)) { Py_DECREF(ans); PyErr_SetString(PyExc_ValueError, "dest too small"); return NULL; }
+        void (*func)(const uint8_t*, pixel*, size_t, pixel) = choose(blend_alpha_mask_into_pixels);
+        for (unsigned i = 0; i < repeat; i++) func(s, (pixel*)dest, src.len, color);
+    } else if (strcmp(kernel, "unpremultiply_bgra") == 0) {
+        if (dest_sz < (size_t)src.len || src.len % 4) { Py_DECREF(ans); PyErr_SetString(PyExc_ValueError, "dest too small"); return NULL; }
+        void (*func)(const uint8_t*, pixel*, size_t) = choose(unpremultiply_bgra_into_pixels);
+        for (unsigned i = 0; i < repeat; i++) func(s, (pixel*)dest, src.len / 4);
+    } else if (strcmp(kernel, "downsample_bgra") == 0) {
+        const unsigned dest_width = factor ? (width + factor - 1) / factor : 0, dest_height = factor ? (height + factor - 1) / factor : 0;
+        if (!factor || (size_t)src.len < 4u * width * height || dest_sz < 4u * dest_width * dest_height) { Py_DECREF(ans); PyErr_SetString(PyExc_ValueError, "invalid sizes"); return NULL; }
+        void (*func)(const uint8_t*, size_t, unsigned, unsigned, unsigned, uint8_t*, unsigned) = choose(downsample_bgra_row);
+        for (unsigned i = 0; i < repeat; i++) {
+            for (unsigned r = 0, sr = 0; r < dest_height; r++, sr += factor) func(s + sr * 4 * width, 4 * width, MIN(factor, height - sr), width, factor, dest + 4 * dest_width * r, dest_width);
+        }
+    } else if (strcmp(kernel, "alpha_blend_rgba") == 0 || strcmp(kernel, "blend_rgba_on_rgb") == 0) {
+        const bool on_rgb = kernel[0] == 'b';
+        const size_t count = src.len / 4;
+        if (src.len % 4 || dest_sz < count * (on_rgb ? 3 : 4)) { Py_DECREF(ans); PyErr_SetString(PyExc_ValueError, "invalid sizes"); return NULL; }
+        void (*func)(uint8_t*, const uint8_t*, size_t) = on_rgb ? choose(blend_rgba_on_rgb) : choose(alpha_blend_rgba);
+        for (unsigned i = 0; i < repeat; i++) func(dest, s, count);
+    } else { Py_DECREF(ans); PyErr_Format(PyExc_KeyError, "Unknown kernel: %s", kernel); return NULL; }
+#undef choose
+    return ans;
+}
+
 
 // }}}
 
@@ -187,6 +279,7 @@ static PyMethodDef module_methods[] = {
     METHODB(test_utf8_decode_to_sentinel, METH_VARARGS),
     METHODB(test_find_either_of_two_bytes, METH_VARARGS),
     METHODB(test_xor64, METH_VARARGS),
+    METHODB(test_glyph_compositing, METH_VARARGS),
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -233,6 +326,11 @@ init_simd(void *x) {
         find_either_of_two_bytes_impl = find_either_of_two_bytes_256;
         utf8_decode_to_esc_impl = utf8_decode_to_esc_256;
         xor_data64_impl = xor_data64_256;
+        blend_alpha_mask_into_pixels_impl = blend_alpha_mask_into_pixels_256;
+        unpremultiply_bgra_into_pixels_impl = unpremultiply_bgra_into_pixels_256;
+        downsample_bgra_row_impl = downsample_bgra_row_256;
+        alpha_blend_rgba_impl = alpha_blend_rgba_256;
+        blend_rgba_on_rgb_impl = blend_rgba_on_rgb_256;
     } else {
         A(has_avx2, False);
     }
@@ -241,6 +339,11 @@ init_simd(void *x) {
         if (find_either_of_two_bytes_impl == find_either_of_two_bytes_scalar) find_either_of_two_bytes_impl = find_either_of_two_bytes_128;
         if (utf8_decode_to_esc_impl == utf8_decode_to_esc_scalar) utf8_decode_to_esc_impl = utf8_decode_to_esc_128;
         if (xor_data64_impl == xor_data64_scalar) xor_data64_impl = xor_data64_128;
+        if (blend_alpha_mask_into_pixels_impl == blend_alpha_mask_into_pixels_scalar) blend_alpha_mask_into_pixels_impl = blend_alpha_mask_into_pixels_128;
+        if (unpremultiply_bgra_into_pixels_impl == unpremultiply_bgra_into_pixels_scalar) unpremultiply_bgra_into_pixels_impl = unpremultiply_bgra_into_pixels_128;
+        if (downsample_bgra_row_impl == downsample_bgra_row_scalar) downsample_bgra_row_impl = downsample_bgra_row_128;
+        if (alpha_blend_rgba_impl == alpha_blend_rgba_scalar) alpha_blend_rgba_impl = alpha_blend_rgba_128;
+        if (blend_rgba_on_rgb_impl == blend_rgba_on_rgb_scalar) blend_rgba_on_rgb_impl = blend_rgba_on_rgb_128;
     } else {
         A(has_sse4_2, False);
     }
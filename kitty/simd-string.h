@@ -49,6 +49,51 @@ const uint8_t* find_either_of_two_bytes(const uint8_t *haystack, const size_t sz
 // XOR data with the 64 byte key
 void xor_data64(const uint8_t key[64], uint8_t* data, const size_t data_sz);
 
+// Glyph compositing kernels, used when rendering glyphs and decorations into sprites
+
+// dest[i] = color | MAX(alpha[i], dest[i] & 0xff) where color is an RGB value shifted left by 8 bits
+void blend_alpha_mask_into_pixels(const uint8_t *alpha, pixel *dest, size_t count, pixel color);
+// Convert premultiplied BGRA pixels to the straight RGBA pixels used in sprites
+void unpremultiply_bgra_into_pixels(const uint8_t *bgra, pixel *dest, size_t count);
+// Area average num_rows rows of src (BGRA) in blocks of factor columns into a single row of dest_width pixels.
+// Destination pixels with no source pixels are left untouched.
+void downsample_bgra_row(const uint8_t *src, size_t src_stride, unsigned num_rows, unsigned src_width, unsigned factor, uint8_t *dest, unsigned dest_width);
+
+// Image compositing kernels, used when composing animation frames
+
+// Alpha blend count RGBA pixels from src over the RGBA pixels in dest
+void alpha_blend_rgba(uint8_t *dest, const uint8_t *src, size_t count);
+// Blend count RGBA pixels from src onto the opaque RGB pixels in dest
+void blend_rgba_on_rgb(uint8_t *dest, const uint8_t *src, size_t count);
+
+static inline void
+alpha_blend_pixel(uint8_t *dest_px, const uint8_t *src_px) {
+    if (src_px[3]) {
+        const float dest_a = (float)dest_px[3] / 255.f, src_a = (float)src_px[3] / 255.f;
+        const float alpha = src_a + dest_a * (1.f - src_a);
+        dest_px[3] = (uint8_t)(255 * alpha);
+        if (!dest_px[3]) { dest_px[0] = 0; dest_px[1] = 0; dest_px[2] = 0; return; }
+        for (unsigned i = 0; i < 3; i++) dest_px[i] = (uint8_t)((src_px[i] * src_a + dest_px[i] * dest_a * (1.f - src_a))/alpha);
+    }
+}
+
+static inline void
+blend_pixel_on_opaque(uint8_t *under_px, const uint8_t *over_px) {
+    const float alpha = (float)over_px[3] / 255.f;
+    const float alpha_op = 1.f - alpha;
+    for (unsigned i = 0; i < 3; i++) under_px[i] = (uint8_t)(over_px[i] * alpha + under_px[i] * alpha_op);
+}
+
+static inline pixel
+unpremultiply_bgra_pixel(const uint8_t *bgra) {
+    if (!bgra[3]) return 0;
+    const float inv_alpha = 255.f / bgra[3];
+    // clamp as channels larger than alpha are invalid but not impossible in font data
+#define C(idx, shift) ( (pixel)(uint8_t)MIN(bgra[idx] * inv_alpha, 255.f) << shift)
+    return C(2, 24) | C(1, 16) | C(0, 8) | bgra[3];
+#undef C
+}
+
 // SIMD implementations, internal use
 bool utf8_decode_to_esc_128(UTF8Decoder *d, const uint8_t *src, size_t src_sz);
 bool utf8_decode_to_esc_256(UTF8Decoder *d, const uint8_t *src, size_t src_sz);
@@ -56,3 +101,13 @@ const uint8_t* find_either_of_two_bytes_128(const uint8_t *haystack, const size_
 const uint8_t* find_either_of_two_bytes_256(const uint8_t *haystack, const size_t sz, const uint8_t a, const uint8_t b);
 void xor_data64_128(const uint8_t key[64], uint8_t* data, const size_t data_sz);
 void xor_data64_256(const uint8_t key[64], uint8_t* data, const size_t data_sz);
+void blend_alpha_mask_into_pixels_128(const uint8_t *alpha, pixel *dest, size_t count, pixel color);
+void blend_alpha_mask_into_pixels_256(const uint8_t *alpha, pixel *dest, size_t count, pixel color);
+void unpremultiply_bgra_into_pixels_128(const uint8_t *bgra, pixel *dest, size_t count);
+void unpremultiply_bgra_into_pixels_256(const uint8_t *bgra, pixel *dest, size_t count);
+void downsample_bgra_row_128(const uint8_t *src, size_t src_stride, unsigned num_rows, unsigned src_width, unsigned factor, uint8_t *dest, unsigned dest_width);
+void downsample_bgra_row_256(const uint8_t *src, size_t src_stride, unsigned num_rows, unsigned src_width, unsigned factor, uint8_t *dest, unsigned dest_width);
+void alpha_blend_rgba_128(uint8_t *dest, const uint8_t *src, size_t count);
+void alpha_blend_rgba_256(uint8_t *dest, const uint8_t *src, size_t count);
+void blend_rgba_on_rgb_128(uint8_t *dest, const uint8_t *src, size_t count);
+void blend_rgba_on_rgb_256(uint8_t *dest, const uint8_t *src, size_t count);
@@ -9,6 +9,7 @@
 #include "animation.h"
 #include "screen.h"
 #include "monotonic.h"
+#include "trace.h"
 #include "window_logo.h"
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
@@ -56,7 +57,7 @@ typedef struct {
     float cursor_trail_decay_slow;
     float cursor_trail_start_threshold;
     unsigned int url_style;
-    unsigned int scrollback_pager_history_size;
+    unsigned int scrollback_pager_history_size, sprite_cache_size;
     bool scrollback_fill_enlarged_window;
     char_type *select_by_word_characters;
     char_type *select_by_word_characters_forward;
@@ -342,9 +343,11 @@ typedef struct {
 extern GlobalState global_state;
 
 #define call_boss(name, ...) if (global_state.boss) { \
+    TRACE_BEGIN(#name); \
     PyObject *cret_ = PyObject_CallMethod(global_state.boss, #name, __VA_ARGS__); \
     if (cret_ == NULL) { PyErr_Print(); } \
     else Py_DECREF(cret_); \
+    TRACE_END(#name); \
 }
 
 static inline void
@@ -397,6 +400,8 @@ void free_framebuffer(uint32_t*);
 void send_image_to_gpu(uint32_t*, const void*, int32_t, int32_t, bool, bool, bool, RepeatStrategy);
 void send_sprite_to_gpu(FONTS_DATA_HANDLE fg, sprite_index, pixel*, sprite_index);
 void blank_canvas(float, color_type);
+void finish_rendering(void);
+void read_framebuffer_pixels(uint32_t width, uint32_t height, uint8_t *rgba);
 void blank_os_window(OSWindow *);
 void set_os_window_chrome(OSWindow *w);
 FONTS_DATA_HANDLE load_fonts_data(double, double, double);
@@ -437,6 +442,8 @@ void set_ignore_os_keyboard_processing(bool enabled);
 void update_menu_bar_title(PyObject *title UNUSED);
 void change_live_resize_state(OSWindow*, bool);
 bool render_os_window(OSWindow *w, monotonic_t now, bool ignore_render_frames, bool scan_for_animated_images);
+bool latency_key_sent_to_child(Screen *screen, monotonic_t received_at);
+bool schedule_timed_key_write_to_child(unsigned long id, const char *key, size_t key_sz, monotonic_t received_at);
 void update_mouse_pointer_shape(void);
 void adjust_window_size_for_csd(OSWindow *w, int width, int height, int *adjusted_width, int *adjusted_height);
 void dispatch_buffered_keys(Window *w);
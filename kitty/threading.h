@@ -14,12 +14,15 @@
 #if defined(__APPLE__)
 // I can't figure out how to get pthread.h to include this definition on macOS. MACOSX_DEPLOYMENT_TARGET does not work.
 extern int pthread_setname_np(const char *name);
+extern int pthread_getname_np(pthread_t, char *name, size_t len);
 #elif defined(FREEBSD_SET_NAME)
 // Function has a different name on FreeBSD
 void pthread_set_name_np(pthread_t tid, const char *name);
+void pthread_get_name_np(pthread_t tid, char *name, size_t len);
 #else
 // Need _GNU_SOURCE for pthread_setname_np on linux and that causes other issues on systems with old glibc
 extern int pthread_setname_np(pthread_t, const char *name);
+extern int pthread_getname_np(pthread_t, char *name, size_t len);
 #endif
 
 static inline void
@@ -35,3 +38,13 @@ set_thread_name(const char *name) {
 #endif
     if (ret != 0) perror("Failed to set thread name");
 }
+
+static inline void
+get_thread_name(char *name, size_t len) {
+    name[0] = 0;
+#if defined(FREEBSD_SET_NAME)
+    pthread_get_name_np(pthread_self(), name, len);
+#else
+    if (pthread_getname_np(pthread_self(), name, len) != 0) name[0] = 0;
+#endif
+}
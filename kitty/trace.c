@@ -0,0 +1,322 @@
+/*
+ * trace.c
+ * Copyright (C) 2026 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#include "trace.h"
+#include "threading.h"
+#include <stdarg.h>
+#include <unistd.h>
+#include <sched.h>
+
+// Each thread appends to its own buffer, publishing every event with a
+// release store of used, so that the buffers can be read while tracing
+// continues. Events are stored in chunks allocated as they are needed. A
+// buffer is only ever reset by its own thread, when it notices that a new
+// tracing session has started. When tracing stops, the recorded events are
+// moved out of the buffers into stopped_trace, so that they can be freed
+// once exported, and the buffers of exited threads are freed.
+
+#define EVENTS_PER_THREAD (256u * 1024u)
+#define EVENTS_PER_CHUNK 4096u
+
+typedef struct {
+    const char *name;
+    monotonic_t ts;
+    id_type window_id;
+    char phase;
+} TraceEvent;
+
+typedef struct TraceChunk {
+    struct TraceChunk *_Atomic next;
+    TraceEvent events[EVENTS_PER_CHUNK];
+} TraceChunk;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    unsigned tid;
+    char thread_name[32];
+    atomic_uint session;
+    atomic_size_t used;
+    atomic_bool owner_exited;
+    // true while the owner is recording an event, see stop_tracing()
+    atomic_bool writing;
+    atomic_size_t dropped;
+    TraceChunk *_Atomic first;
+    TraceChunk *last;
+} TraceBuffer;
+
+typedef struct StoppedThread {
+    unsigned tid;
+    char thread_name[32];
+    TraceChunk *first;
+    size_t used, dropped;
+} StoppedThread;
+
+atomic_bool tracing_active = false;
+static atomic_uint current_session = 0;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *buffers = NULL;
+// The events of the last tracing session, once it has stopped. Protected by buffers_lock.
+static struct { StoppedThread *items; size_t count, capacity; } stopped_trace = {0};
+static unsigned tid_counter = 0;
+static pthread_key_t buffer_key;
+static _Thread_local TraceBuffer *thread_buffer = NULL;
+
+static void
+free_chunks(TraceChunk *c) {
+    while (c) { TraceChunk *next = atomic_load_explicit(&c->next, memory_order_relaxed); free(c); c = next; }
+}
+
+static void
+free_stopped_trace(void) {
+    // Must be called with buffers_lock held
+    for (size_t i = 0; i < stopped_trace.count; i++) free_chunks(stopped_trace.items[i].first);
+    free(stopped_trace.items);
+    zero_at_ptr(&stopped_trace);
+}
+
+static void
+on_thread_exit(void *b) {
+    TraceBuffer *buf = b;
+    atomic_store(&buf->owner_exited, true);
+}
+
+static TraceBuffer*
+buffer_for_thread(unsigned session) {
+    // Must be called with buffers_lock held
+    for (TraceBuffer *b = buffers; b; b = b->next) {
+        if (atomic_load(&b->owner_exited) && atomic_load(&b->session) != session) {
+            atomic_store(&b->owner_exited, false);
+            b->tid = ++tid_counter;
+            return b;
+        }
+    }
+    TraceBuffer *b = calloc(1, sizeof(TraceBuffer));
+    if (b) {
+        b->tid = ++tid_counter;
+        b->next = buffers; buffers = b;
+    }
+    return b;
+}
+
+static bool
+record_event(TraceBuffer *b, unsigned session, TraceEvent e) {
+    if (UNLIKELY(atomic_load_explicit(&b->session, memory_order_relaxed) != session)) {
+        atomic_store_explicit(&b->used, 0, memory_order_relaxed);
+        atomic_store_explicit(&b->dropped, 0, memory_order_relaxed);
+        free_chunks(atomic_exchange_explicit(&b->first, NULL, memory_order_relaxed)); b->last = NULL;
+        atomic_store_explicit(&b->session, session, memory_order_release);
+    }
+    const size_t used = atomic_load_explicit(&b->used, memory_order_relaxed);
+    if (used >= EVENTS_PER_THREAD) return false;
+    if (used % EVENTS_PER_CHUNK == 0) {
+        TraceChunk *c = malloc(sizeof(TraceChunk));
+        if (!c) return false;
+        atomic_init(&c->next, NULL);
+        if (b->last) atomic_store_explicit(&b->last->next, c, memory_order_release);
+        else atomic_store_explicit(&b->first, c, memory_order_release);
+        b->last = c;
+    }
+    b->last->events[used % EVENTS_PER_CHUNK] = e;
+    atomic_store_explicit(&b->used, used + 1, memory_order_release);
+    return true;
+}
+
+void
+trace_event(const char *name, char phase, id_type window_id) {
+    const unsigned session = atomic_load_explicit(&current_session, memory_order_acquire);
+    TraceBuffer *b = thread_buffer;
+    if (UNLIKELY(!b)) {
+        pthread_mutex_lock(&buffers_lock);
+        b = buffer_for_thread(session);
+        pthread_mutex_unlock(&buffers_lock);
+        if (!b) return;
+        get_thread_name(b->thread_name, sizeof(b->thread_name));
+        atomic_store(&b->session, session - 1);
+        pthread_setspecific(buffer_key, b);
+        thread_buffer = b;
+    }
+    // stop_tracing() waits for writing to be false after clearing
+    // tracing_active, so it is checked again once writing is set
+    atomic_store(&b->writing, true);
+    if (atomic_load(&tracing_active)) {
+        if (!record_event(b, session, (TraceEvent){.name=name, .phase=phase, .window_id=window_id, .ts=monotonic()})) {
+            atomic_fetch_add_explicit(&b->dropped, 1, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&b->writing, false, memory_order_release);
+}
+
+// Python API {{{
+
+typedef struct { char *buf; size_t used, capacity; bool oom; } Output;
+
+static void
+output(Output *o, const char *fmt, ...) {
+    if (o->oom) return;
+    va_list ar;
+    while (true) {
+        va_start(ar, fmt);
+        int n = vsnprintf(o->buf + o->used, o->capacity - o->used, fmt, ar);
+        va_end(ar);
+        if (n < 0) { o->oom = true; return; }
+        if ((size_t)n < o->capacity - o->used) { o->used += n; return; }
+        size_t capacity = MAX(2 * o->capacity, o->used + n + 4096);
+        char *buf = realloc(o->buf, capacity);
+        if (!buf) { o->oom = true; return; }
+        o->buf = buf; o->capacity = capacity;
+    }
+}
+
+static PyObject*
+start_tracing(PyObject *self UNUSED, PyObject *args UNUSED) {
+    pthread_mutex_lock(&buffers_lock);
+    free_stopped_trace();
+    pthread_mutex_unlock(&buffers_lock);
+    atomic_fetch_add(&current_session, 1);
+    atomic_store(&tracing_active, true);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+stop_tracing(PyObject *self UNUSED, PyObject *args UNUSED) {
+    if (!atomic_exchange(&tracing_active, false)) Py_RETURN_NONE;
+    const unsigned session = atomic_load(&current_session);
+    pthread_mutex_lock(&buffers_lock);
+    for (TraceBuffer **prev = &buffers, *b; (b = *prev); ) {
+        // wait for an event that was being recorded when tracing stopped
+        while (atomic_load(&b->writing)) sched_yield();
+        const size_t used = atomic_load_explicit(&b->used, memory_order_acquire);
+        if (used && atomic_load_explicit(&b->session, memory_order_acquire) == session) {
+            ensure_space_for(&stopped_trace, items, StoppedThread, stopped_trace.count + 1, capacity, 16, false);
+            StoppedThread *t = stopped_trace.items + stopped_trace.count++;
+            t->tid = b->tid; memcpy(t->thread_name, b->thread_name, sizeof(t->thread_name));
+            t->used = used; t->dropped = atomic_load_explicit(&b->dropped, memory_order_relaxed);
+            t->first = atomic_exchange_explicit(&b->first, NULL, memory_order_relaxed); b->last = NULL;
+            atomic_store_explicit(&b->used, 0, memory_order_relaxed);
+        }
+        if (atomic_load(&b->owner_exited)) {
+            *prev = b->next;
+            free_chunks(atomic_load_explicit(&b->first, memory_order_relaxed)); free(b);
+        } else prev = &b->next;
+    }
+    pthread_mutex_unlock(&buffers_lock);
+    Py_RETURN_NONE;
+}
+
+static void
+output_thread(Output *o, const char **sep, long pid, unsigned tid, const char *thread_name, const TraceChunk *first, size_t used) {
+    // Slices whose begin or end was not recorded, because tracing started or
+    // stopped in the middle of them or events were dropped, are left out, as
+    // viewers show them as broken
+    RAII_ALLOC(bool, keep, calloc(used, sizeof(bool)));
+    RAII_ALLOC(size_t, open_slices, malloc(used * sizeof(size_t)));
+    RAII_ALLOC(const TraceEvent*, events, malloc(used * sizeof(TraceEvent*)));
+    if (!keep || !open_slices || !events) { o->oom = true; return; }
+    size_t num_open = 0, num_kept = 0;
+    const TraceChunk *c = first;
+    for (size_t i = 0; i < used; i++) {
+        if (i && i % EVENTS_PER_CHUNK == 0) c = atomic_load_explicit(&((TraceChunk*)c)->next, memory_order_acquire);
+        const TraceEvent *e = events[i] = c->events + i % EVENTS_PER_CHUNK;
+        switch (e->phase) {
+            case 'B': open_slices[num_open++] = i; break;
+            case 'E':
+                for (size_t n = num_open; n-- > 0;) {
+                    if (events[open_slices[n]]->name == e->name) {
+                        keep[open_slices[n]] = keep[i] = true; num_kept += 2;
+                        num_open = n;
+                        break;
+                    }
+                }
+                break;
+            default: keep[i] = true; num_kept++; break;
+        }
+    }
+    if (!num_kept) return;
+    char name[32];
+    size_t n = 0;
+    for (const char *p = thread_name; *p && n < sizeof(name) - 1; p++) {
+        if (*p > 32 && *p < 127 && *p != '"' && *p != '\\') name[n++] = *p;
+    }
+    name[n] = 0;
+    if (!n) snprintf(name, sizeof(name), "thread-%u", tid);
+    output(o, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %ld, \"tid\": %u, \"args\": {\"name\": \"%s\"}}", *sep, pid, tid, name);
+    *sep = ",\n";
+    for (size_t i = 0; i < used; i++) {
+        if (!keep[i]) continue;
+        const TraceEvent *e = events[i];
+        output(o, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %ld, \"tid\": %u", e->name, e->phase, e->ts / 1e3, pid, tid);
+        if (e->phase == 'i') output(o, ", \"s\": \"t\"");
+        if (e->window_id) output(o, ", \"args\": {\"window_id\": %llu}", e->window_id);
+        output(o, "}");
+    }
+}
+
+static PyObject*
+trace_as_json(PyObject *self UNUSED, PyObject *args) {
+    // The events of the current tracing session, or of the last one if
+    // tracing has stopped. If clear is true, the events of a stopped session
+    // are freed afterwards.
+    int clear = 0;
+    if (!PyArg_ParseTuple(args, "|p", &clear)) return NULL;
+    const unsigned session = atomic_load(&current_session);
+    const long pid = (long)getpid();
+    Output o = {.capacity = 64 * 1024};
+    if (!(o.buf = malloc(o.capacity))) return PyErr_NoMemory();
+    size_t dropped = 0;
+    output(&o, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    const char *sep = "";
+    pthread_mutex_lock(&buffers_lock);
+    if (atomic_load(&tracing_active)) {
+        for (TraceBuffer *b = buffers; b; b = b->next) {
+            if (atomic_load_explicit(&b->session, memory_order_acquire) != session) continue;
+            const size_t used = atomic_load_explicit(&b->used, memory_order_acquire);
+            if (used) output_thread(&o, &sep, pid, b->tid, b->thread_name, atomic_load_explicit(&b->first, memory_order_acquire), used);
+            dropped += atomic_load_explicit(&b->dropped, memory_order_relaxed);
+        }
+    } else {
+        for (size_t i = 0; i < stopped_trace.count; i++) {
+            const StoppedThread *t = stopped_trace.items + i;
+            output_thread(&o, &sep, pid, t->tid, t->thread_name, t->first, t->used);
+            dropped += t->dropped;
+        }
+        if (clear) free_stopped_trace();
+    }
+    pthread_mutex_unlock(&buffers_lock);
+    output(&o, "\n], \"otherData\": {\"dropped_events\": %zu}}\n", dropped);
+    if (o.oom) { free(o.buf); return PyErr_NoMemory(); }
+    PyObject *ans = PyBytes_FromStringAndSize(o.buf, o.used);
+    free(o.buf);
+    return ans;
+}
+
+static PyObject*
+test_trace_event(PyObject *self UNUSED, PyObject *args) {
+    const char *phase; unsigned long long window_id = 0;
+    if (!PyArg_ParseTuple(args, "s|K", &phase, &window_id)) return NULL;
+    if (TRACE_ACTIVE) trace_event("test", phase[0], window_id);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    METHODB(start_tracing, METH_NOARGS),
+    METHODB(stop_tracing, METH_NOARGS),
+    METHODB(trace_as_json, METH_VARARGS),
+    METHODB(test_trace_event, METH_VARARGS),
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+bool
+init_trace(PyObject *module) {
+    int ret;
+    if ((ret = pthread_key_create(&buffer_key, on_thread_exit)) != 0) {
+        PyErr_Format(PyExc_RuntimeError, "Failed to create thread local key for tracing: %s", strerror(ret));
+        return false;
+    }
+    if (PyModule_AddFunctions(module, module_methods) != 0) return false;
+    return true;
+}
+// }}}
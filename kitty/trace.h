@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2026 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#pragma once
+
+#include "data-types.h"
+#include <stdatomic.h>
+
+// Records begin and end events for the phases of the main loop and the I/O
+// threads, to be viewed in Perfetto or chrome://tracing. Each thread records
+// into its own buffer without locking. Names must be string literals, as
+// only pointers to them are stored. Events with a non-zero window_id are
+// annotated with it.
+
+extern atomic_bool tracing_active;
+void trace_event(const char *name, char phase, id_type window_id);
+
+#define TRACE_ACTIVE UNLIKELY(atomic_load_explicit(&tracing_active, memory_order_relaxed))
+#define TRACE_BEGIN(name) if (TRACE_ACTIVE) trace_event(name, 'B', 0)
+#define TRACE_END(name) if (TRACE_ACTIVE) trace_event(name, 'E', 0)
+#define TRACE_BEGIN_FOR_WINDOW(name, window_id) if (TRACE_ACTIVE) trace_event(name, 'B', window_id)
+#define TRACE_END_FOR_WINDOW(name, window_id) if (TRACE_ACTIVE) trace_event(name, 'E', window_id)
+#define TRACE_INSTANT(name) if (TRACE_ACTIVE) trace_event(name, 'i', 0)
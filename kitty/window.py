@@ -16,6 +16,7 @@
 from re import Pattern
 from time import time_ns
 from typing import (
+    IO,
     TYPE_CHECKING,
     Any,
     Deque,
@@ -33,6 +34,7 @@
     clear_handled_signals,
     config_dir,
     kitten_exe,
+    supports_primary_selection,
     wakeup_io_loop,
 )
 from .fast_data_types import (
@@ -81,6 +83,7 @@
     set_window_logo,
     set_window_padding,
     set_window_render_data,
+    stream_paste,
     update_ime_position_for_window,
     update_pointer_shape,
     update_window_title,
@@ -117,6 +120,7 @@
 if TYPE_CHECKING:
     from kittens.tui.handler import OpenUrlHandler
 
+    from .clipboard import Clipboard
     from .fast_data_types import MousePosition
     from .file_transmission import FileTransmission
     from .notifications import OnlyWhen
@@ -1663,15 +1667,13 @@ def mouse_selection(self, code: int) -> None:
 
     @ac('mouse', 'Paste the current primary selection')
     def paste_selection(self) -> None:
-        txt = get_boss().current_primary_selection()
-        if txt:
-            self.paste_with_actions(txt)
+        if supports_primary_selection:
+            self.paste_from_clipboard(get_boss().primary_selection)
 
     @ac('mouse', 'Paste the current primary selection or the clipboard if no selection is present')
     def paste_selection_or_clipboard(self) -> None:
-        txt = get_boss().current_primary_selection_or_clipboard()
-        if txt:
-            self.paste_with_actions(txt)
+        boss = get_boss()
+        self.paste_from_clipboard(boss.primary_selection if supports_primary_selection else boss.clipboard)
 
     @ac('mouse', '''
         Select clicked command output
@@ -1792,7 +1794,7 @@ def set_logo(self, path: str, position: str = '', alpha: float = -1, png_data: b
         path = resolve_custom_file(path) if path else ''
         set_window_logo(self.os_window_id, self.tab_id, self.id, path, position or '', alpha, png_data)
 
-    def paste_with_actions(self, text: str) -> None:
+    def paste_with_actions(self, text: str, large_paste_confirmed: bool = False) -> None:
         if self.destroyed or not text:
             return
         opts = get_options()
@@ -1837,7 +1839,7 @@ def paste_with_actions(self, text: str) -> None:
                     window=self, default='s', title=_('Allow paste?'),
                 )
                 return
-        if 'confirm-if-large' in opts.paste_actions:
+        if 'confirm-if-large' in opts.paste_actions and not large_paste_confirmed:
             msg = ''
             if len(btext) > 16 * 1024:
                 msg = _('Pasting very large amounts of text ({} bytes) can be slow.').format(len(btext))
@@ -1846,6 +1848,70 @@ def paste_with_actions(self, text: str) -> None:
                 return
         self.paste_text(btext)
 
+    def paste_from_clipboard(self, cb: 'Clipboard') -> None:
+        text = cb.get_text_for_paste()
+        if isinstance(text, str):
+            self.paste_with_actions(text)
+        else:
+            self.paste_file_with_actions(text)
+
+    def paste_file_with_actions(self, f: IO[bytes]) -> None:
+        # Large pastes are streamed to the child from f rather than being
+        # read into memory, unless the paste actions need to see all the text
+        if self.destroyed:
+            f.close()
+            return
+        opts = get_options()
+        if not self.can_stream_paste(f):
+            with f:
+                self.paste_with_actions(f.read().decode('utf-8', 'replace'))
+            return
+        if 'confirm-if-large' in opts.paste_actions:
+            msg = _('Pasting very large amounts of text ({} bytes) can be slow.').format(os.fstat(f.fileno()).st_size)
+            get_boss().confirm(msg + _(' Are you sure?'), partial(self.handle_large_streamed_paste_confirmation, f), window=self, title=_(
+            'Allow large paste?'))
+            return
+        self.stream_paste(f)
+
+    def can_stream_paste(self, f: IO[bytes]) -> bool:
+        # Checks whether paste_with_actions() could paste the contents of f
+        # unchanged and without asking for confirmation, looking only at the
+        # start of f. The rest of the checks need all of the data and are
+        # done by the paste thread, see on_rejected_paste(). Leaves f
+        # positioned at its start.
+        opts = get_options()
+        if opts.paste_actions & {'filter', 'replace-dangerous-control-codes', 'replace-newline'}:
+            return False
+        if 'quote-urls-at-prompt' in opts.paste_actions and self.at_prompt:
+            prefixes = re.compile('({}):'.format('|'.join(opts.url_prefixes)))
+            try:
+                if prefixes.match(f.read(4096).decode('utf-8', 'replace')) is not None:
+                    return False
+            finally:
+                f.seek(0)
+        return True
+
+    def stream_paste(self, f: IO[bytes]) -> None:
+        with f:
+            check_c0 = 'confirm' in get_options().paste_actions
+            if not self.destroyed and not stream_paste(self.id, os.dup(f.fileno()), check_c0):
+                # the child is gone or is already being pasted into
+                f.seek(0)
+                self.paste_with_actions(f.read().decode('utf-8', 'replace'), large_paste_confirmed=True)
+
+    def on_rejected_paste(self, fd: int) -> None:
+        # The streamed paste contains data that paste_with_actions() has to
+        # change or confirm, so paste it that way instead
+        with open(fd, 'rb') as f:
+            if not self.destroyed:
+                self.paste_with_actions(f.read().decode('utf-8', 'replace'), large_paste_confirmed=True)
+
+    def handle_large_streamed_paste_confirmation(self, f: IO[bytes], confirmed: bool) -> None:
+        if confirmed:
+            self.stream_paste(f)
+        else:
+            f.close()
+
     def handle_dangerous_paste_confirmation(self, unsanitized: bytes, sanitized: bytes, choice: str) -> None:
         if choice == 's':
             self.paste_text(sanitized)
@@ -61,3 +61,52 @@ def corrupt_data(data):
         d = AES256GCMDecrypt(bob_secret, e.iv, e.tag)
         d.add_data_to_be_authenticated_but_not_decrypted(auth_data)
         self.assertRaises(CryptoError, d.add_data_to_be_decrypted, corrupt_data(ciphertext), True)
+
+    def test_encrypted_remote_control_session(self):
+        if is_rlimit_memlock_too_low():
+            self.skipTest('RLIMIT_MEMLOCK is too low')
+        import base64
+        import json
+
+        from kitty.constants import RC_ENCRYPTION_PROTOCOL_VERSION
+        from kitty.fast_data_types import EllipticCurveKey, base85_decode
+        from kitty.remote_control import CommandEncrypter, SessionSecrets, create_basic_command, parse_cmd
+
+        for n in range(12):
+            data = os.urandom(n)
+            self.ae(base85_decode(base64.b85encode(data)), data)
+        self.ae(base85_decode('|NsC0'), b'\xff' * 4)
+        for bad in ('|NsC1', 'ab"de', 'abcd\x80'):
+            self.assertRaises(ValueError, base85_decode, bad)
+
+        server_key = EllipticCurveKey()
+        secrets = SessionSecrets()
+        session = ('peer', 1)
+
+        def parse(encrypter, cmd, session=session):
+            return parse_cmd(memoryview(json.dumps(encrypter(cmd)).encode()), server_key, secrets, session)
+
+        encrypter = CommandEncrypter(server_key.public, RC_ENCRYPTION_PROTOCOL_VERSION, 'pw')
+        for i in range(3):
+            pcmd = parse(encrypter, create_basic_command('ls', {'i': i}))
+            self.ae(pcmd['payload'], {'i': i})
+            self.ae(pcmd['password'], 'pw')
+        # one key agreement for the whole session
+        self.ae(secrets.misses, 1)
+        # a new client uses a new key
+        encrypter = CommandEncrypter(server_key.public, RC_ENCRYPTION_PROTOCOL_VERSION, 'pw')
+        self.ae(parse(encrypter, create_basic_command('ls'))['cmd'], 'ls')
+        self.ae(secrets.misses, 2)
+        # secrets are forgotten when the session ends
+        secrets.end_session(session)
+        self.assertNotIn(session, secrets.sessions)
+        self.ae(parse(encrypter, create_basic_command('ls'))['cmd'], 'ls')
+        self.ae(secrets.misses, 3)
+        # and are not cached without a session
+        self.ae(parse(encrypter, create_basic_command('ls'), None)['cmd'], 'ls')
+        self.ae(parse(encrypter, create_basic_command('ls'), None)['cmd'], 'ls')
+        self.ae(secrets.misses, 5)
+        # the number of secrets per session is bounded
+        for i in range(2 * secrets.max_per_session):
+            parse(CommandEncrypter(server_key.public, RC_ENCRYPTION_PROTOCOL_VERSION, 'pw'), create_basic_command('ls'))
+        self.ae(len(secrets.sessions[session]), secrets.max_per_session)
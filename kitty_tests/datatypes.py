@@ -579,6 +579,113 @@ def test_bracketed_paste_sanitizer(self):
             self.assertNotIn('\x9b201~'.encode(), q)
             self.assertIn(b'ab', q)
 
+    def test_streamed_paste_filter(self):
+        from kitty.fast_data_types import test_paste_filter
+        from kitty.utils import sanitize_for_bracketed_paste
+
+        def t(x, bracketed=True):
+            x = x.encode('latin-1')
+            expected = sanitize_for_bracketed_paste(x) if bracketed else x.replace(b'\r\n', b'\n').replace(b'\n', b'\r')
+            for step in range(1, len(x) + 1):
+                chunks = tuple(x[i:i+step] for i in range(0, len(x), step))
+                self.ae(test_paste_filter(chunks, bracketed), expected, f'{x!r} in chunks of {step}')
+
+        for x in ('abc', '\x1b[201~ab\x9b201~cd', '\x1b[201\x1b[201~~ab', '\x1b[20\x1b[\x9b201~201~1~x\x1b[2', 'a\x1b[201', '\x1b\x1b[201~['):
+            t(x)
+        for x in ('a\r\nb\nc\r', '\r\r\n\n', '\n'):
+            t(x, False)
+        # long runs of partial markers are not held back indefinitely
+        q = test_paste_filter((b'\x1b[20' * 4096, b'1~' * 4096), True)
+        self.assertNotIn(b'\x1b[201~', q)
+
+    def test_streamed_paste_check(self):
+        from kitty.fast_data_types import test_paste_check
+
+        def t(x, expected, check_c0=True, bracketed=True):
+            for step in range(1, len(x) + 1):
+                chunks = tuple(x[i:i+step] for i in range(0, len(x), step))
+                self.ae(test_paste_check(chunks, check_c0, bracketed), expected, f'{x!r} in chunks of {step}')
+
+        t('ab\tc d\n\u00e9\U0001f600'.encode(), True)
+        t(b'a\nb', False, bracketed=False)
+        t(b'a\nb', True, check_c0=False, bracketed=False)
+        t(b'a\x1bb', False)
+        t(b'a\x7f', False)
+        t(b'a\x1bb', True, check_c0=False)
+        t(b'a\xffb', False, check_c0=False)
+        t('\u00e9'.encode()[:1], False, check_c0=False)  # truncated UTF-8
+
+    def test_native_rc_command(self):
+        import base64
+        import json
+
+        from kitty.fast_data_types import test_native_rc_command
+
+        def t(expected=None, data='base64:' + base64.standard_b64encode(b'hello').decode(), version=(0, 41, 1), **kw):
+            cmd = {'cmd': 'send-text', 'version': version, 'no_response': True, 'payload': {'data': data}}
+            for k, v in kw.items():
+                if k.startswith('p_'):
+                    cmd['payload'][k[2:]] = v
+                else:
+                    cmd[k] = v
+            for s in (json.dumps(cmd), json.dumps(cmd, indent=2, separators=(',', ':'))):
+                self.ae(test_native_rc_command(s.encode(), 0, 41), expected, s)
+
+        t((3, b'hello', True), kitty_window_id=3)
+        t((7, b'hello', False), p_match='id:7', kitty_window_id=3, no_response=False)
+        t((3, 'a\n\x1b\U0001f600'.encode(), True), data='text:a\n\x1b\U0001f600', kitty_window_id=3)
+        t((3, b'hello', True), kitty_window_id=3, version=(0, 40, 5), p_match=None, p_match_tab=None, p_all=False, p_bracketed_paste='disable')
+        # these need the main thread
+        t()  # active window
+        t(kitty_window_id=3, version=(0, 42, 0))
+        t(kitty_window_id=3, p_match='title:x')
+        t(kitty_window_id=3, p_match='id:07')
+        t(kitty_window_id=3, p_bracketed_paste='auto')
+        t(kitty_window_id=3, p_exclude_active=True)
+        t(kitty_window_id=3, p_session_id='s')
+        t(kitty_window_id=3, stream_id='s')
+        t(kitty_window_id=3, cmd='ls')
+        t(kitty_window_id=3, data='base64:aGVsbG8')
+        t(kitty_window_id=3, data='kitty-key:YQ==')
+        t(kitty_window_id=3, data='text:\ud800')
+
+    def test_tracing(self):
+        import json
+        from threading import Thread
+
+        from kitty.fast_data_types import start_tracing, stop_tracing, test_trace_event, trace_as_json
+
+        def events(clear=False):
+            ans = json.loads(trace_as_json(clear))
+            self.ae(ans['otherData'], {'dropped_events': 0})
+            threads = {}
+            for e in ans['traceEvents']:
+                if e['ph'] != 'M':
+                    threads.setdefault(e['tid'], []).append(e)
+            return sorted(threads.values(), key=len)
+
+        test_trace_event('B')
+        start_tracing()
+        test_trace_event('E')  # a slice that began before tracing started
+        test_trace_event('B', 7)
+        test_trace_event('i')
+        test_trace_event('E', 7)
+        t = Thread(target=test_trace_event, args=('i',))
+        t.start(), t.join()
+        test_trace_event('B')  # a slice that ends after tracing stopped
+        stop_tracing()
+        test_trace_event('E')
+        threads = events()
+        self.ae([[(e['ph'], e.get('args', {}).get('window_id')) for e in evs] for evs in threads], [[('i', None)], [('B', 7), ('i', None), ('E', 7)]])
+        ts = [e['ts'] for e in threads[1]]
+        self.ae(ts, sorted(ts))
+        # the events of a stopped session are kept until cleared
+        self.ae(events(True), threads)
+        self.ae(events(), [])
+        start_tracing()
+        stop_tracing()
+        self.ae(events(), [])
+
     def test_expand_ansi_c_escapes(self):
         for src, expected in {
             'abc': 'abc',
@@ -15,10 +15,13 @@
     DECAWM,
     ParsedFontFeature,
     get_fallback_font,
+    has_avx2,
+    has_sse4_2,
     set_allow_use_of_box_fonts,
     sprite_idx_to_pos,
     sprite_map_set_layout,
     sprite_map_set_limits,
+    test_glyph_compositing,
     test_render_line,
     test_sprite_position_increment,
     wcwidth,
@@ -296,6 +299,49 @@ def test_sprite_map(self):
         self.ae(test_sprite_position_increment(), (0, 0, 2))
         self.ae(test_sprite_position_increment(), (1, 0, 2))
 
+    def test_glyph_compositing_kernels(self):
+        which_functions = [0]
+        if has_sse4_2:
+            which_functions.append(2)
+        if has_avx2:
+            which_functions.append(3)
+
+        def t(kernel, src, dest, *a):
+            expected = test_glyph_compositing(kernel, 1, src, dest, *a)
+            for which in which_functions:
+                self.ae(expected, test_glyph_compositing(kernel, which, src, dest, *a), f'{kernel=} {which=} {len(src)=} {a=}')
+            return expected
+
+        self.ae(t('blend_alpha_mask', b'\x10\xf0', b'\x20\0\0\0\x20\0\0\0', 0x11223300), b'\x20\x33\x22\x11\xf0\x33\x22\x11')
+        self.ae(t('unpremultiply_bgra', bytes((0x40, 0x20, 0x10, 0x80)), b'\0' * 4), bytes((0x80, 0x7f, 0x3f, 0x1f)))
+        self.ae(t('unpremultiply_bgra', bytes((0x40, 0x20, 0x10, 0)) * 9, b'\1' * 36), b'\0' * 36)
+        self.ae(t('unpremultiply_bgra', bytes((0x40, 0x20, 0x10, 0xff)) * 9, b'\0' * 36), bytes((0xff, 0x40, 0x20, 0x10)) * 9)
+        self.ae(t('unpremultiply_bgra', bytes((0xff, 0x90, 0x81, 0x80)) * 9, b'\0' * 36), bytes((0x80, 0xff, 0xff, 0xff)) * 9)
+
+        def premultiplied(n):
+            ans = bytearray(os.urandom(4 * n))
+            for i in range(0, len(ans), 4):
+                a = ans[i + 3]
+                ans[i:i+3] = bytes(x % (a + 1) for x in ans[i:i+3])
+            ans[3::20], ans[7::28] = b'\0' * len(ans[3::20]), b'\xff' * len(ans[7::28])
+            return bytes(ans)
+        for n in range(67):
+            t('blend_alpha_mask', os.urandom(n), os.urandom(4 * n), 0xabcdef00)
+            t('unpremultiply_bgra', premultiplied(n), b'\0' * (4 * n))
+            # image compositing, with fully transparent and fully opaque pixels mixed in
+            over = bytearray(os.urandom(4 * n))
+            under = bytearray(os.urandom(4 * n))
+            over[3::12], under[7::20], over[11::16] = b'\0' * len(over[3::12]), b'\0' * len(under[7::20]), b'\xff' * len(over[11::16])
+            t('alpha_blend_rgba', bytes(over), bytes(under), 0)
+            t('blend_rgba_on_rgb', bytes(over), os.urandom(3 * n), 0)
+        self.ae(t('alpha_blend_rgba', b'\x10\x20\x30\xff\x10\x20\x30\0', b'\x40\x50\x60\x80' * 2, 0), b'\x10\x20\x30\xff\x40\x50\x60\x80')
+        self.ae(t('blend_rgba_on_rgb', b'\x10\x20\x30\xff\x10\x20\x30\0', b'\x40\x50\x60' * 2, 0), b'\x10\x20\x30\x40\x50\x60')
+        for width in range(1, 37):
+            for factor in range(1, 6):
+                height = 1 + width % 7
+                dest_sz = 4 * ((width + factor - 1) // factor) * ((height + factor - 1) // factor)
+                t('downsample_bgra', os.urandom(4 * width * height), b'\0' * dest_sz, 0, width, height, factor)
+
     def test_box_drawing(self):
         s = self.create_screen(cols=len(box_chars) + 1, lines=1, scrollback=0)
         prerendered = len(self.sprites)
@@ -358,6 +358,49 @@ def clear_predicate(key):
         remove(3)
         self.assertEqual(dc.holes(), {(1, 9)})
 
+        # test that the smallest hole that fits is used
+        reset(defrag_factor=20)
+        for i, sz in enumerate((100, 10, 3000, 10, 1500, 10)):
+            self.assertIsNone(add(i, str(i) * sz))
+            dc.wait_for_write()
+        remove(0), remove(2), remove(4)
+        self.assertIsNone(add(6, '6' * 1200))
+        dc.wait_for_write()
+        self.assertEqual(dc.holes(), {(0, 100), (110, 3000), (4320, 300)})
+        check_data()
+
+        # test incremental compaction, entries at the end of the file are moved
+        # into holes before them and free space at the end is truncated
+        reset()
+        for i in range(8):
+            self.assertIsNone(add(i, str(i) * 1024))
+            dc.wait_for_write()
+        for i in range(6):
+            remove(i)
+        dc.wait_for_write()
+        self.ae(dc.size_on_disk(), 2048)
+        self.assertFalse(dc.holes())
+        check_data()
+
+        # test compression of large entries
+        reset()
+        self.ae(dc.compression_threshold, 64 * 1024)
+        self.assertIsNone(add('small', b'\0' * 1024))
+        self.assertIsNone(add('compressible', bytes(range(256)) * 1024))
+        dc.wait_for_write()
+        self.assertLess(dc.size_on_disk(), 64 * 1024)
+        check_data()
+        self.assertIsNone(add('random', os.urandom(128 * 1024)))
+        dc.wait_for_write()
+        self.assertGreater(dc.size_on_disk(), 128 * 1024)
+        check_data()
+        reset()
+        dc.compression_threshold = -1
+        self.assertIsNone(add('compressible', bytes(range(256)) * 1024))
+        dc.wait_for_write()
+        self.ae(dc.size_on_disk(), 256 * 1024)
+        check_data()
+
     def test_suppressing_gr_command_responses(self):
         s, g, pl, sl = load_helpers(self)
         self.ae(pl('abcd', s=10, v=10, q=1), 'ENODATA:Insufficient image data: 4 < 400')
@@ -472,6 +515,67 @@ def load_temp(prefix='tty-graphics-protocol-'):
         self.assertRaises(
             FileNotFoundError, shm_unlink, name
         )  # check that file was deleted
+        # the snapshot of the data is handed to the disk cache and released once written
+        self.assertTrue(g.disk_cache.wait_for_write())
+        self.ae(g.disk_cache.num_cached_in_ram(), 0)
+        self.ae(g.image_for_client_id(1)['data'], random_data)
+        frame_data = bytes(reversed(random_data))
+        shm_write(name, frame_data)
+        self.ae(pl(name, a='f', s=1024, v=8, t='s'), 'OK')
+        self.assertRaises(FileNotFoundError, shm_unlink, name)
+        self.assertTrue(g.disk_cache.wait_for_write())
+        self.ae(g.image_for_client_id(1)['extra_frames'][0]['data'], frame_data)
+        # compressed data is decoded straight from the shared memory
+        shm_write(name, compressed_random_data)
+        sl(name, s=1024, v=8, t='s', o='z', i=2, expecting_data=random_data)
+        self.assertRaises(FileNotFoundError, shm_unlink, name)
+        s.reset()
+        self.assertEqual(g.disk_cache.total_size, 0)
+
+    def test_chunked_stream_decode(self):
+        from kitty.render_benchmark import png_from_rgba
+        s, g, pl, sl = load_helpers(self)
+        w, h = 64, 16
+        pixels = byte_block(w * h * 4)
+        png = png_from_rgba(w, h, pixels)
+        flipped = b''.join(reversed([pixels[y * w * 4:(y + 1) * w * 4] for y in range(h)]))
+
+        def chunked(data, chunk_size=99, **kw):
+            chunks = [data[i:i+chunk_size] for i in range(0, len(data), chunk_size)]
+            for c in chunks[:-1]:
+                self.assertIsNone(pl(c, m=1, **kw))
+                kw = {}
+            return pl(chunks[-1], m=0)
+
+        def split(data, *sizes, **kw):
+            chunks = []
+            for size in sizes:
+                chunks.append(data[:size])
+                data = data[size:]
+            for c in chunks:
+                self.assertIsNone(pl(c, m=1, **kw))
+                kw = {}
+            return pl(data, m=0)
+
+        for kw, data, expected in (
+            ({'s': w, 'v': h, 'o': 'z'}, zlib.compress(pixels), pixels),
+            ({'f': 100}, png, flipped),
+            ({'f': 100, 'o': 'z'}, zlib.compress(png), flipped),
+        ):
+            self.ae(chunked(data, **kw), 'OK')
+            img = g.image_for_client_id(1)
+            self.ae((img['width'], img['height'], img['data']), (w, h, expected))
+        # the end of the stream can arrive after all the image data
+        compressed = zlib.compress(pixels)
+        for sizes in ((len(compressed) - 4,), (len(compressed) - 6, 2), (len(compressed) - 4, 1, 1, 1)):
+            self.ae(split(compressed, *sizes, s=w, v=h, o='z'), 'OK')
+            self.ae(g.image_for_client_id(1)['data'], pixels)
+        self.ae(split(zlib.compress(pixels + b'extra'), len(compressed) - 4, s=w, v=h, o='z').partition(':')[0], 'EINVAL')
+        # errors are reported once the last chunk has arrived
+        self.ae(chunked(b'x' * 1000, s=w, v=h, o='z').partition(':')[0], 'EINVAL')
+        self.ae(chunked(zlib.compress(pixels)[:-100], s=w, v=h, o='z').partition(':')[0], 'EINVAL')
+        self.ae(chunked(b'x' * 1000, f=100).partition(':')[0], 'EBADPNG')
+        self.ae(chunked(png[:-100], f=100).partition(':')[0], 'EBADPNG')
         s.reset()
         self.assertEqual(g.disk_cache.total_size, 0)
 
@@ -515,6 +619,48 @@ def test_load_png_simple(self):
         sl(png_data, f=100, expecting_data=expected)
         # test error handling for loading bad png data
         self.assertRaisesRegex(ValueError, '[EBADPNG]', load_png_data, b'dsfsdfsfsfd')
+        # PNG files written by the render benchmark from bottom to top OpenGL pixel rows
+        from kitty.render_benchmark import png_from_rgba
+        w, h = 3, 2
+        rows = [bytes(range(y * w * 4, (y + 1) * w * 4)) for y in range(h)]
+        self.ae(load_png_data(png_from_rgba(w, h, b''.join(rows))), (b''.join(reversed(rows)), w, h))
+
+    def test_background_decode(self):
+        from kitty.render_benchmark import png_from_rgba
+        s, g, pl, sl = load_helpers(self)
+        g.background_decode_threshold = 0
+
+        def responses(wait=True):
+            s.callbacks.clear()
+            s.process_decoded_images(wait)
+            return [parse_response_with_ids(b'\033_G' + x) for x in s.callbacks.wtcbuf.split(b'\033_G') if x]
+
+        # responses are sent in command order once decoding finishes
+        data = byte_block(64 * 32 * 3)
+        self.assertIsNone(pl(zlib.compress(data), s=64, v=32, f=24, o='z', a='T'))
+        self.assertIsNone(pl('abc', s=1, v=1, f=24, i=2))
+        self.ae(responses(), [('OK', 'i=1'), ('OK', 'i=2')])
+        self.ae(responses(), [])
+        self.ae(g.image_for_client_id(1)['data'], data)
+        # querying an image waits for it to be decoded
+        self.assertIsNone(pl(zlib.compress(data), s=64, v=32, f=24, o='z'))
+        self.ae(g.image_for_client_id(1)['data'], data)
+        self.ae(responses(), [('OK', 'i=1')])
+        # PNG data
+        w, h = 4, 3
+        pixels = byte_block(w * h * 4)
+        rows = [pixels[y * w * 4:(y + 1) * w * 4] for y in range(h)]
+        self.assertIsNone(pl(png_from_rgba(w, h, pixels), f=100, i=3))
+        self.ae(responses(), [('OK', 'i=3')])
+        img = g.image_for_client_id(3)
+        self.ae((img['width'], img['height'], img['data']), (w, h, b''.join(reversed(rows))))
+        # quiet and failed decodes
+        self.assertIsNone(pl(zlib.compress(data), s=64, v=32, f=24, o='z', i=4, q=1))
+        self.assertIsNone(pl(b'not zlib data', s=64, v=32, f=24, o='z', i=5))
+        self.ae(responses(), [('EINVAL', 'i=5')])
+        self.ae(g.image_count, 4)
+        s.reset()
+        self.ae(g.image_count, 0)
 
     def test_gr_operations_with_numbers(self):
         s = self.create_screen()
@@ -628,6 +774,29 @@ def test_image_put(self):
         self.ae((s.cursor.x, s.cursor.y), (3, 2))
         rect_eq(layers(s)[0]['dest_rect'], -1, 1, -1 + 3 * dx, 1 - 3*dy)
 
+    def test_texture_downscaling(self):
+        cw, ch = 10, 20
+        s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
+
+        def factor(iid):
+            return s.grman.image_for_client_id(iid)['texture_downscale_factor']
+
+        iid, code = put_image(s, 400, 200, a='t')
+        self.ae(code, 'OK')
+        self.ae(factor(iid), 1)  # no placements, uploaded at full size
+        put_ref(s, id=iid, num_cols=4, placement_id=1)
+        self.ae(factor(iid), 10)
+        put_ref(s, id=iid, num_cols=10, placement_id=2)
+        self.ae(factor(iid), 3)
+        put_ref(s, id=iid, num_cols=4, placement_id=2)
+        self.ae(factor(iid), 10)
+        put_ref(s, id=iid, placement_id=3)  # displayed at full size
+        self.ae(factor(iid), 1)
+        iid, code = put_image(s, 400, 200, num_cols=2)
+        self.ae(factor(iid), 10)  # uploaded downscaled at transmit time
+        put_ref(s, id=iid, unicode_placeholder=1, placement_id=5, num_cols=2, num_lines=1)
+        self.ae(factor(iid), 1)  # placeholders can be displayed at any size
+
     def test_image_layer_grouping(self):
         cw, ch = 10, 20
         s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
@@ -973,6 +1142,46 @@ def test_unicode_placeholders_scroll(self):
         self.ae(refs[4]['src_rect'], {'left': 0.0, 'top': 0.125*7, 'right': 1.0, 'bottom': 0.125*8})
         self.ae(refs[4]['dest_rect']['top'], 1.0 - 0.25*7)
 
+    def test_unicode_placeholders_rescan(self):
+        # Lines with placeholders are rescanned when the images they refer to change,
+        # even if the lines themselves are unchanged
+        cw, ch = 10, 20
+        s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
+        s.apply_sgr("38;5;42")
+        s.draw("\U0010EEEE\u0305\u0305\U0010EEEE\u0305\u030D")
+        s.update_only_line_graphics_data()
+        self.ae(len(layers(s)), 0)  # the image does not exist yet
+        put_image(s, 20, 20, num_cols=4, num_lines=2, placement_id=1, unicode_placeholder=1, id=42)
+        s.update_only_line_graphics_data()
+        refs = layers(s)
+        self.ae(len(refs), 1)
+        self.ae(refs[0]['src_rect'], {'left': 0.0, 'top': 0.0, 'right': 0.5, 'bottom': 0.5})
+        # Move the line into the scrollback and scroll back to it
+        s.cursor_position(s.lines, 1)
+        s.index(), s.index()
+        s.update_only_line_graphics_data()
+        self.ae(len(layers(s)), 0)
+        s.scroll(2, True)
+        s.update_only_line_graphics_data()
+        refs = layers(s, scrolled_by=2)
+        self.ae(len(refs), 1)
+        self.ae(refs[0]['src_rect'], {'left': 0.0, 'top': 0.0, 'right': 0.5, 'bottom': 0.5})
+        # Changing the virtual placement changes the cell image in the scrollback
+        put_ref(s, id=42, num_cols=2, num_lines=1, placement_id=1, unicode_placeholder=1)
+        s.update_only_line_graphics_data()
+        refs = layers(s, scrolled_by=2)
+        self.ae(len(refs), 1)
+        self.ae(refs[0]['src_rect'], {'left': 0.0, 'top': 0.0, 'right': 1.0, 'bottom': 1.0})
+        # Deleting the image removes the cell image and transmitting it again brings it back
+        send_command(s, 'a=d,d=I,i=42')
+        s.update_only_line_graphics_data()
+        self.ae(len(layers(s, scrolled_by=2)), 0)
+        put_image(s, 20, 20, num_cols=4, num_lines=2, placement_id=1, unicode_placeholder=1, id=42)
+        s.update_only_line_graphics_data()
+        refs = layers(s, scrolled_by=2)
+        self.ae(len(refs), 1)
+        self.ae(refs[0]['src_rect'], {'left': 0.0, 'top': 0.0, 'right': 0.5, 'bottom': 0.5})
+
     def test_gr_scroll(self):
         cw, ch = 10, 20
         s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
@@ -1040,6 +1249,38 @@ def test_gr_reset(self):
         s.reset()
         self.ae(s.grman.image_count, 1)
 
+    def test_gr_many_placements(self):
+        cw, ch = 10, 20
+        s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
+        for y in range(s.lines):
+            for x in range(s.columns):
+                s.cursor_position(y + 1, x + 1)
+                put_image(s, cw, ch, no_id=True, cursor_movement=1)
+        self.ae(len(layers(s)), s.lines * s.columns)
+        send_command(s, 'a=d,d=Y,y=3')
+        self.ae(s.grman.image_count, (s.lines - 1) * s.columns)
+        self.ae(len(layers(s)), (s.lines - 1) * s.columns)
+        s.cursor_position(s.lines, 1)
+        s.index()
+        self.ae(len(layers(s)), (s.lines - 2) * s.columns)
+        self.ae(len(layers(s, scrolled_by=1)), (s.lines - 1) * s.columns)
+        send_command(s, 'a=d,d=P,x=1,y=1')
+        self.ae(s.grman.image_count, (s.lines - 1) * s.columns - 1)
+        s.set_margins(2, 4)
+        s.cursor_position(4, 1)
+        s.index()  # rows 1 to 3 scroll up by one, row 1 is empty
+        self.ae(s.grman.image_count, (s.lines - 1) * s.columns - 1)
+        self.ae(len(layers(s)), (s.lines - 2) * s.columns - 1)
+        s.index()  # the images in row 1 are scrolled out of the region
+        self.ae(s.grman.image_count, (s.lines - 2) * s.columns - 1)
+        for i in range(s.lines + s.historybuf.ynum):
+            s.index()
+        # images above the region are untouched
+        self.ae(s.grman.image_count, (s.lines - 3) * s.columns - 1)
+        self.ae(len(layers(s)), s.columns - 1)
+        s.reset()
+        self.ae(s.grman.image_count, 0)
+
     def test_gr_delete(self):
         cw, ch = 10, 20
         s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
@@ -1267,6 +1508,43 @@ def expand(*rows):
             {'gap': 40, 'id': 3, 'data': b'3' * 12 + (b'333abc' + b'3' * 6) * 2},
         ))
 
+    def test_coalesced_frame_cache(self):
+        s = self.create_screen()
+        g = s.grman
+        li = make_send_command(s)
+        root = b'abcdefghijkl'
+        self.assertEqual(li(a='t').code, 'OK')
+        self.assertEqual(li(payload='2' * 12, s=2, v=2, c=1).code, 'OK')
+        self.assertEqual(li(payload='3' * 12, s=2, v=2, x=2, c=2).code, 'OK')
+        self.assertEqual(g.coalesced_frame_cache_size, 0)
+
+        def frames():
+            return tuple(f['data'] for f in g.image_for_client_id(1)['extra_frames'])
+
+        # showing a frame caches its composed data
+        for c in (2, 3, 1):
+            self.assertIsNone(li(a='a', i=1, c=c))
+        self.assertEqual(g.coalesced_frame_cache_size, 3 * 36)
+        self.assertEqual(frames(), (b'222222ghijkl' * 2 + root, b'222222333333' * 2 + root))
+        # editing a frame invalidates the frames based on it
+        self.assertEqual(li(payload='4' * 36, r=2).code, 'OK')
+        self.assertEqual(g.coalesced_frame_cache_size, 0)
+        self.assertEqual(frames(), (b'4' * 36, b'444444333333' * 2 + b'4' * 12))
+        # frames of a looping animation do not evict each other
+        g.coalesced_frame_cache_limit = 2 * 36
+        for c in (2, 3, 1, 2, 3, 1):
+            self.assertIsNone(li(a='a', i=1, c=c))
+        self.assertEqual(g.coalesced_frame_cache_size, 2 * 36)
+        self.assertEqual(frames(), (b'4' * 36, b'444444333333' * 2 + b'4' * 12))
+        # but are evicted by frames of other images
+        self.assertEqual(li(a='t', i=2).code, 'OK')
+        self.assertEqual(li(payload='5' * 36, i=2).code, 'OK')
+        self.assertIsNone(li(a='a', i=2, c=2))
+        self.assertEqual(g.coalesced_frame_cache_size, 2 * 36)
+        self.assertEqual(g.image_for_client_id(2)['extra_frames'][0]['data'], b'5' * 36)
+        s.reset()
+        self.assertEqual(g.coalesced_frame_cache_size, 0)
+
     def test_graphics_quota_enforcement(self):
         s = self.create_screen()
         g = s.grman
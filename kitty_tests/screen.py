@@ -1466,6 +1466,31 @@ def q(send, expected=None):
         q({'transparent_background_color2': '#ffffff@-1'})
         q({'transparent_background_color2': '?'}, {'transparent_background_color2': (Color(255, 255, 255), 255)})
 
+    def test_input_latency(self):
+        from kitty.rc.get_input_latency import input_latency_report
+        s = self.create_screen()
+        self.ae(s.input_latency(), ())
+        self.ae(input_latency_report(()), {'samples': 0, 'stages': {k: {} for k in ('write', 'echo', 'parse', 'present', 'total')}})
+        samples = [(0.0001, 0.001 * i, 0.0002, 0.005) for i in range(1, 11)] + [(0.0001, 0.5, 0.0002, 0.005)]
+        r = input_latency_report(samples)
+        self.ae(r['samples'], 11)
+        self.ae(r['stages']['write'], {'median': 0.1, 'p90': 0.1, 'p99': 0.1, 'max': 0.1, 'histogram': [[0.25, 11]]})
+        e = r['stages']['echo']
+        self.ae((e['median'], e['p90'], e['max']), (6, 10, 500))
+        self.ae(e['histogram'], [[1, 1], [2, 1], [4, 2], [8, 4], [16, 2], [None, 1]])
+        self.ae(r['stages']['total']['median'], 11.3)
+        # a key echoed by the tty of the child
+        from kitty.fast_data_types import test_timed_key
+        pty = self.create_pty()
+        self.assertTrue(pty.is_echo_on())
+        self.assertTrue(test_timed_key(pty.screen, pty.master_fd, b'a', 10))
+        samples = pty.screen.input_latency()
+        self.ae(len(samples), 1)
+        for stage in samples[0]:
+            self.assertGreaterEqual(stage, 0)
+        self.ae(pty.screen.input_latency(True), samples)
+        self.ae(pty.screen.input_latency(), ())
+
 
 def detect_url(self, scale=1):
     s = self.create_screen(cols=30 * scale)
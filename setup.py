@@ -752,6 +752,9 @@ def get_source_specific_defines(env: Env, src: str) -> Tuple[str, List[str], Opt
 
 def get_source_specific_cflags(env: Env, src: str) -> List[str]:
     ans = list(env.cflags)
+    if src in ('kitty/simd-string.c', 'kitty/simd-string-128.c', 'kitty/simd-string-256.c'):
+        # The scalar and SIMD image compositing kernels must give bit identical results
+        ans.append('-ffp-contract=off')
     # SIMD specific flags
     if src in ('kitty/simd-string-128.c', 'kitty/simd-string-256.c'):
         # simde recommends these are used for best performance
@@ -976,7 +979,7 @@ def find_c_files() -> Tuple[List[str], List[str]]:
 
 
 def compile_glfw(compilation_database: CompilationDatabase, build_dsym: bool = False) -> None:
-    modules = 'cocoa' if is_macos else 'x11 wayland'
+    modules = 'cocoa' if is_macos else 'x11 wayland osmesa'
     for module in modules.split():
         try:
             genv = glfw.init_env(env, pkg_config, pkg_version, at_least_version, test_compile, module)
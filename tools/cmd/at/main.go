@@ -141,6 +141,11 @@ func simple_serializer(rc *utils.RemoteControlCmd) (ans []byte, err error) {
 
 type serializer_func func(rc *utils.RemoteControlCmd) ([]byte, error)
 
+// Encryption sessions keyed by the public key of the kitty instance, so that
+// all commands sent by this process, for instance from the shell, share a
+// single key agreement
+var encryption_sessions = map[string]*crypto.Session{}
+
 func create_serializer(password password, encoded_pubkey string, io_data *rc_io_data) (err error) {
 	io_data.serializer = simple_serializer
 	if password.is_set {
@@ -148,8 +153,16 @@ func create_serializer(password password, encoded_pubkey string, io_data *rc_io_
 		if err != nil {
 			return err
 		}
+		session_key := encryption_version + ":" + string(pubkey)
+		session := encryption_sessions[session_key]
+		if session == nil {
+			if session, err = crypto.NewSession(pubkey, encryption_version); err != nil {
+				return err
+			}
+			encryption_sessions[session_key] = session
+		}
 		io_data.serializer = func(rc *utils.RemoteControlCmd) (ans []byte, err error) {
-			ec, err := crypto.Encrypt_cmd(rc, global_options.password.val, pubkey, encryption_version)
+			ec, err := session.Encrypt_cmd(rc, global_options.password.val, encryption_version)
 			if err != nil {
 				return
 			}
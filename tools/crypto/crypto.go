@@ -54,7 +54,17 @@ func b85_decode(data string) (decoded []byte, err error) {
 	return
 }
 
-func encrypt(plaintext []byte, alice_public_key []byte, encryption_protocol string) (iv []byte, tag []byte, ciphertext []byte, bob_public_key []byte, err error) {
+// A Session performs the key agreement with the remote once and then encrypts
+// any number of messages with the resulting key, each with a random nonce.
+// kitty caches the secret it derives for the public key of a session, so
+// sending many messages in one session avoids a key agreement per message
+// on both ends.
+type Session struct {
+	pubkey []byte
+	aesgcm cipher.AEAD
+}
+
+func NewSession(alice_public_key []byte, encryption_protocol string) (ans *Session, err error) {
 	bob_private_key, bob_public_key, err := KeyPair(encryption_protocol)
 	if err != nil {
 		return
@@ -73,17 +83,30 @@ func encrypt(plaintext []byte, alice_public_key []byte, encryption_protocol stri
 	if err != nil {
 		return
 	}
-	iv = make([]byte, aesgcm.NonceSize())
+	return &Session{pubkey: bob_public_key, aesgcm: aesgcm}, nil
+}
+
+func (self *Session) encrypt(plaintext []byte) (iv []byte, tag []byte, ciphertext []byte, err error) {
+	iv = make([]byte, self.aesgcm.NonceSize())
 	_, err = rand.Read(iv)
 	if err != nil {
 		return
 	}
-	output := aesgcm.Seal(nil, iv, plaintext, nil)
+	output := self.aesgcm.Seal(nil, iv, plaintext, nil)
 	ciphertext = output[0 : len(output)-16]
 	tag = output[len(output)-16:]
 	return
 }
 
+func encrypt(plaintext []byte, alice_public_key []byte, encryption_protocol string) (iv []byte, tag []byte, ciphertext []byte, bob_public_key []byte, err error) {
+	s, err := NewSession(alice_public_key, encryption_protocol)
+	if err != nil {
+		return
+	}
+	iv, tag, ciphertext, err = s.encrypt(plaintext)
+	return iv, tag, ciphertext, s.pubkey, err
+}
+
 func KeyPair(encryption_protocol string) (private_key []byte, public_key []byte, err error) {
 	switch encryption_protocol {
 	case "1":
@@ -115,15 +138,26 @@ func DecodePublicKey(raw string) (encryption_protocol string, pubkey []byte, err
 }
 
 func Encrypt_cmd(cmd *utils.RemoteControlCmd, password string, other_pubkey []byte, encryption_protocol string) (encrypted_cmd utils.EncryptedRemoteControlCmd, err error) {
+	s, err := NewSession(other_pubkey, encryption_protocol)
+	if err != nil {
+		return
+	}
+	return s.Encrypt_cmd(cmd, password, encryption_protocol)
+}
+
+func (self *Session) Encrypt_cmd(cmd *utils.RemoteControlCmd, password string, encryption_protocol string) (encrypted_cmd utils.EncryptedRemoteControlCmd, err error) {
 	cmd.Password = password
 	cmd.Timestamp = time.Now().UnixNano()
 	plaintext, err := json.Marshal(cmd)
 	if err != nil {
 		return
 	}
-	iv, tag, ciphertext, pubkey, err := encrypt(plaintext, other_pubkey, encryption_protocol)
+	iv, tag, ciphertext, err := self.encrypt(plaintext)
+	if err != nil {
+		return
+	}
 	encrypted_cmd = utils.EncryptedRemoteControlCmd{
-		Version: cmd.Version, IV: b85_encode(iv), Tag: b85_encode(tag), Pubkey: b85_encode(pubkey), Encrypted: b85_encode(ciphertext)}
+		Version: cmd.Version, IV: b85_encode(iv), Tag: b85_encode(tag), Pubkey: b85_encode(self.pubkey), Encrypted: b85_encode(ciphertext)}
 	if encryption_protocol != "1" {
 		encrypted_cmd.EncProto = encryption_protocol
 	}